@@ -1,4 +1,4 @@
 from diskhash._diskhash import DiskHash
-from diskhash.client import DiskHashClient
+from diskhash.client import DiskHashBinaryClient, DiskHashClient
 
-__all__ = ["DiskHash", "DiskHashClient"]
+__all__ = ["DiskHash", "DiskHashBinaryClient", "DiskHashClient"]
@@ -1,11 +1,36 @@
 """HTTP client for diskhash server."""
 
 import base64
-from typing import Iterator
+import socket
+import struct
+from typing import Iterable, Iterator
 
 import requests
 
 
+_NOT_FOUND_SIZE = 0xFFFFFFFF
+
+
+def _length_prefixed(data: bytes) -> bytes:
+    """Prefix data with its 4-byte little-endian length."""
+    return struct.pack("<I", len(data)) + data
+
+
+def _parse_values(data: bytes) -> list[bytes | None]:
+    """Split length-prefixed values, None where the length marks a missing key."""
+    result = []
+    offset = 0
+    while offset < len(data):
+        (size,) = struct.unpack_from("<I", data, offset)
+        offset += 4
+        if size == _NOT_FOUND_SIZE:
+            result.append(None)
+        else:
+            result.append(data[offset:offset + size])
+            offset += size
+    return result
+
+
 class DiskHashClient:
     """Client for the diskhash HTTP server.
 
@@ -44,6 +69,19 @@ class DiskHashClient:
             encoded += "=" * padding
         return base64.urlsafe_b64decode(encoded)
 
+    def _counters(self, path: str) -> dict[str, float]:
+        """Fetch a text endpoint of "name value" lines."""
+        url = f"{self.base_url}{path}"
+        resp = self._session.get(url, timeout=self.timeout)
+        resp.raise_for_status()
+
+        result = {}
+        for line in resp.text.strip().split("\n"):
+            if line:
+                name, value = line.split(" ", 1)
+                result[name] = float(value) if "." in value else int(value)
+        return result
+
     def get(self, key: bytes) -> bytes | None:
         """Get value for key.
 
@@ -112,20 +150,179 @@ class DiskHashClient:
             resp.raise_for_status()
             return False
 
+    def get_many(self, keys: Iterable[bytes]) -> list[bytes | None]:
+        """Get the values of many keys in one request.
+
+        Args:
+            keys: The keys to look up.
+
+        Returns:
+            The values in the order of keys, None for keys not found.
+        """
+        body = b"".join(_length_prefixed(k) for k in keys)
+        resp = self._session.post(
+            f"{self.base_url}/mget", data=body,
+            headers={"Content-Type": "application/octet-stream"},
+            timeout=self.timeout
+        )
+        resp.raise_for_status()
+        return _parse_values(resp.content)
+
+    def set_many(self, items) -> list[bool]:
+        """Set many keys in one request.
+
+        Args:
+            items: A mapping or an iterable of (key, value) pairs.
+
+        Returns:
+            For each pair in order, True if it was set, False if the key
+            already existed.
+        """
+        if hasattr(items, "items"):
+            items = items.items()
+        body = b"".join(_length_prefixed(k) + _length_prefixed(v) for k, v in items)
+        resp = self._session.post(
+            f"{self.base_url}/mset", data=body,
+            headers={"Content-Type": "application/octet-stream"},
+            timeout=self.timeout
+        )
+        resp.raise_for_status()
+        return [b == 1 for b in resp.content]
+
     def keys(self) -> list[bytes]:
         """Return all keys in the database.
 
+        The server streams them, so this only holds the keys themselves in
+        memory; iterate over the client to hold one page at a time instead.
+
         Returns:
             List of all keys.
         """
         url = f"{self.base_url}/keys"
+        with self._session.get(url, timeout=self.timeout, stream=True) as resp:
+            resp.raise_for_status()
+            return [self._decode_key(line.decode()) for line in resp.iter_lines() if line]
+
+    def scan(self, cursor: str = "0", count: int = 1000) -> tuple[str, list[bytes]]:
+        """Return one page of keys and the cursor of the next one.
+
+        Start with cursor "0" and pass each returned cursor to the next call
+        until "0" comes back. Keys present for the whole scan are returned
+        exactly once, keys added or removed meanwhile may or may not be.
+
+        Args:
+            cursor: Where to continue, "0" to start.
+            count: Keys per page. Pages end with whole bucket chains, so they
+                may hold more or fewer keys.
+
+        Returns:
+            The next cursor, "0" at the end, and the keys of the page.
+        """
+        resp = self._session.get(
+            f"{self.base_url}/keys", params={"cursor": cursor, "count": count},
+            timeout=self.timeout
+        )
+        resp.raise_for_status()
+        keys = [self._decode_key(line) for line in resp.text.split("\n") if line]
+        return resp.headers["X-Cursor"], keys
+
+    def iter_keys(self, count: int = 1000) -> Iterator[bytes]:
+        """Iterate over all keys, fetching a page with scan() at a time.
+
+        Args:
+            count: Keys per page.
+
+        Returns:
+            Iterator over keys.
+        """
+        cursor = "0"
+        while True:
+            cursor, keys = self.scan(cursor, count)
+            yield from keys
+            if cursor == "0":
+                return
+
+    def stats(self) -> dict[str, float]:
+        """Return server statistics.
+
+        Returns:
+            Counters by name, e.g. "records", "key_bytes" and "value_bytes",
+            plus filter and cache counters when those are enabled.
+        """
+        return self._counters("/stats")
+
+    def structure(self) -> dict[str, float]:
+        """Return the shape of the database: chain lengths, bucket fill and splits.
+
+        The server walks every bucket with writers of each shard waiting, so
+        this is slow on large databases.
+
+        Returns:
+            Statistics by name, e.g. "buckets", "chains", "chain_length_1"
+            and "global_depth".
+        """
+        return self._counters("/structure")
+
+    def reshard(self, shards: int) -> bool:
+        """Start moving the records to a new number of shards.
+
+        The server keeps serving while records move in the background,
+        see reshard_status().
+
+        Args:
+            shards: Number of shards to move to.
+
+        Returns:
+            True if resharding started, False if one is already under way.
+        """
+        url = f"{self.base_url}/reshard"
+        resp = self._session.post(url, params={"shards": shards}, timeout=self.timeout)
+        if resp.status_code == 409:
+            return False
+        resp.raise_for_status()
+        return True
+
+    def reshard_status(self) -> dict[str, int]:
+        """Return the progress of resharding.
+
+        Returns:
+            "shards" holding records, "target" being moved to (0 when done),
+            "running" and "keys_moved" by the current or last move.
+        """
+        url = f"{self.base_url}/reshard"
         resp = self._session.get(url, timeout=self.timeout)
         resp.raise_for_status()
 
-        result = []
+        result = {}
+        for line in resp.text.strip().split("\n"):
+            if line:
+                name, value = line.split(" ", 1)
+                result[name] = int(value)
+        return result
+
+    def snapshot(self, name: str | None = None) -> dict[str, str | int]:
+        """Copy the database into the server's --snapshot-dir.
+
+        Writers wait while each shard is copied, readers do not. The copy
+        is served by starting a server with --db set to the returned path.
+
+        Args:
+            name: Directory of the copy, the current time if not given.
+
+        Returns:
+            "path" of the copy, its "shards", "bytes" and "milliseconds"
+            taken.
+        """
+        url = f"{self.base_url}/snapshot"
+        params = {"name": name} if name is not None else {}
+        resp = self._session.post(url, params=params, timeout=self.timeout)
+        resp.raise_for_status()
+
+        result = {}
         for line in resp.text.strip().split("\n"):
             if line:
-                result.append(self._decode_key(line))
+                field, value = line.split(" ", 1)
+                result[field] = value if field == "path" else int(value)
         return result
 
     def health(self) -> bool:
@@ -203,7 +400,7 @@ class DiskHashClient:
         Returns:
             Iterator over keys.
         """
-        return iter(self.keys())
+        return self.iter_keys()
 
     def __len__(self) -> int:
         """Return number of keys: len(client).
@@ -211,7 +408,7 @@ class DiskHashClient:
         Returns:
             Number of keys in database.
         """
-        return len(self.keys())
+        return self.stats()["records"]
 
     def close(self) -> None:
         """Close the HTTP session."""
@@ -224,3 +421,115 @@ class DiskHashClient:
     def __exit__(self, exc_type, exc_val, exc_tb) -> None:
         """Context manager exit."""
         self.close()
+
+
+class DiskHashBinaryClient:
+    """Client for the binary protocol listener of the diskhash server.
+
+    Frames are a 4-byte little-endian body length, a 1-byte code and the
+    body, and keys are sent as raw bytes, so requests cost the server far
+    less than HTTP ones. The server must run with --binary-port.
+
+    Example:
+        client = DiskHashBinaryClient("localhost", 8081)
+        client[b"foo"] = b"bar"
+        print(client.get_many([b"foo", b"baz"]))  # [b"bar", None]
+    """
+
+    OP_GET = 1
+    OP_SET = 2
+    OP_DELETE = 3
+    OP_MGET = 4
+
+    STATUS_OK = 0
+    STATUS_NOT_FOUND = 1
+    STATUS_EXISTS = 2
+    STATUS_ERROR = 3
+
+    def __init__(self, host: str = "localhost", port: int = 8081,
+                 timeout: float = 30.0):
+        """Connect to the server.
+
+        Args:
+            host: Server hostname or IP address.
+            port: Binary protocol port of the server.
+            timeout: Socket timeout in seconds.
+        """
+        self._sock = socket.create_connection((host, port), timeout=timeout)
+        self._sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        self._buffer = b""
+
+    def _request(self, opcode: int, body: bytes) -> tuple[int, bytes]:
+        """Send one frame and return the status and body of the response."""
+        self._sock.sendall(struct.pack("<IB", len(body), opcode) + body)
+        status, response = self._read_frame()
+        if status == self.STATUS_ERROR:
+            raise RuntimeError(response.decode("utf-8", "replace"))
+        return status, response
+
+    def _read_exactly(self, size: int) -> bytes:
+        while len(self._buffer) < size:
+            chunk = self._sock.recv(max(65536, size - len(self._buffer)))
+            if not chunk:
+                raise ConnectionError("connection closed by server")
+            self._buffer += chunk
+        data, self._buffer = self._buffer[:size], self._buffer[size:]
+        return data
+
+    def _read_frame(self) -> tuple[int, bytes]:
+        size, status = struct.unpack("<IB", self._read_exactly(5))
+        return status, self._read_exactly(size)
+
+    def get(self, key: bytes) -> bytes | None:
+        """Get value for key, None if not found."""
+        status, value = self._request(self.OP_GET, key)
+        return value if status == self.STATUS_OK else None
+
+    def set(self, key: bytes, value: bytes) -> bool:
+        """Set key to value, False if the key already exists."""
+        status, _ = self._request(self.OP_SET, struct.pack("<I", len(key)) + key + value)
+        return status == self.STATUS_OK
+
+    def delete(self, key: bytes) -> bool:
+        """Delete key, False if not found."""
+        status, _ = self._request(self.OP_DELETE, key)
+        return status == self.STATUS_OK
+
+    def get_many(self, keys: Iterable[bytes]) -> list[bytes | None]:
+        """Get the values of keys in one request, None for missing keys."""
+        body = b"".join(_length_prefixed(k) for k in keys)
+        _, response = self._request(self.OP_MGET, body)
+        return _parse_values(response)
+
+    def __getitem__(self, key: bytes) -> bytes:
+        """Dict-like access, raises KeyError if not found."""
+        result = self.get(key)
+        if result is None:
+            raise KeyError(key)
+        return result
+
+    def __setitem__(self, key: bytes, value: bytes) -> None:
+        """Dict-like assignment, raises ValueError if the key exists."""
+        if not self.set(key, value):
+            raise ValueError(f"Key already exists: {key!r}")
+
+    def __delitem__(self, key: bytes) -> None:
+        """Dict-like deletion, raises KeyError if not found."""
+        if not self.delete(key):
+            raise KeyError(key)
+
+    def __contains__(self, key: bytes) -> bool:
+        """Check if key exists: key in client."""
+        return self.get(key) is not None
+
+    def close(self) -> None:
+        """Close the connection."""
+        self._sock.close()
+
+    def __enter__(self) -> "DiskHashBinaryClient":
+        """Context manager entry."""
+        return self
+
+    def __exit__(self, exc_type, exc_val, exc_tb) -> None:
+        """Context manager exit."""
+        self.close()
@@ -4,14 +4,16 @@ import os
 import shutil
 import signal
 import socket
+import struct
 import subprocess
 import tempfile
 import time
 import uuid
 
 import pytest
+import requests
 
-from diskhash import DiskHashClient
+from diskhash import DiskHashBinaryClient, DiskHashClient
 
 
 def find_free_port():
@@ -41,14 +43,19 @@ def get_server_path():
     pytest.skip("diskhash_server binary not found. Install with: pip install .")
 
 
-# Module-scoped: one server for all tests in this file
 @pytest.fixture(scope="module")
-def server():
-    """Start a test server and yield the client, then clean up."""
+def binary_port():
+    """Port of the test server's binary protocol listener."""
+    return find_free_port()
+
+
+def run_server(binary_port, *args, db_path=None):
+    """Start a test server, on a new database unless db_path is given, and yield its
+    client, then stop it."""
     server_path = get_server_path()
     port = find_free_port()
-    tmpdir = tempfile.mkdtemp()
-    db_path = os.path.join(tmpdir, "testdb")
+    if db_path is None:
+        db_path = os.path.join(tempfile.mkdtemp(), "testdb")
 
     proc = subprocess.Popen(
         [
@@ -58,6 +65,8 @@ def server():
             "--shards", "2",
             "--threads", "2",
             "--address", "127.0.0.1",
+            "--binary-port", str(binary_port),
+            *args,
         ],
         stdout=subprocess.PIPE,
         stderr=subprocess.PIPE,
@@ -85,6 +94,73 @@ def server():
         client.close()
 
 
+# Module-scoped: one server for all tests in this file
+@pytest.fixture(scope="module")
+def server(binary_port):
+    """Start a test server and yield the client, then clean up."""
+    yield from run_server(binary_port)
+
+
+@pytest.fixture(scope="module")
+def uring_binary_port():
+    """Port of the binary listener of the io_uring test server."""
+    return find_free_port()
+
+
+@pytest.fixture(scope="module")
+def uring_server(uring_binary_port):
+    """A second test server whose binary listener uses io_uring where available."""
+    yield from run_server(uring_binary_port, "--io-uring")
+
+
+@pytest.fixture(scope="module")
+def per_core_binary_port():
+    """Port of the binary listener of the thread-per-core test server."""
+    return find_free_port()
+
+
+@pytest.fixture(scope="module")
+def per_core_server(per_core_binary_port):
+    """A third test server with an event loop per thread, each owning some of the shards."""
+    yield from run_server(per_core_binary_port, "--thread-per-core")
+
+
+@pytest.fixture(scope="module")
+def reshard_server():
+    """A test server of its own, whose shard count the tests change."""
+    yield from run_server(find_free_port())
+
+
+@pytest.fixture(scope="module")
+def replicated():
+    """A primary and a replica that follows it, as two processes."""
+    primary_server = run_server(find_free_port())
+    primary = next(primary_server)
+    replica_server = run_server(find_free_port(), "--replica-of",
+                                primary.base_url[len("http://"):])
+    try:
+        yield primary, next(replica_server)
+    finally:
+        replica_server.close()
+        primary_server.close()
+
+
+@pytest.fixture(scope="module")
+def snapshot_server():
+    """A test server that writes snapshots into a directory of its own."""
+    yield from run_server(find_free_port(), "--snapshot-dir", tempfile.mkdtemp())
+
+
+@pytest.fixture
+def binary_client(server, binary_port):
+    """A binary protocol client of the test server."""
+    client = DiskHashBinaryClient("127.0.0.1", binary_port, timeout=5.0)
+    try:
+        yield client
+    finally:
+        client.close()
+
+
 def unique_key(prefix: str = "k") -> bytes:
     """Generate a unique key to avoid cross-test conflicts."""
     return f"{prefix}_{uuid.uuid4().hex[:8]}".encode()
@@ -119,6 +195,25 @@ class TestDiskHashClient:
     def test_delete_missing(self, server):
         assert server.delete(unique_key("miss")) is False
 
+    def test_get_many(self, server):
+        keys = [unique_key("many") for _ in range(3)]
+        server.set(keys[0], b"a")
+        server.set(keys[2], b"")
+        assert server.get_many(keys) == [b"a", None, b""]
+        assert server.get_many([]) == []
+
+    def test_set_many(self, server):
+        keys = [unique_key("many") for _ in range(200)]
+        server.set(keys[5], b"old")
+
+        pairs = [(k, b"v" + k) for k in keys] + [(keys[0], b"duplicate")]
+        result = server.set_many(pairs)
+
+        assert result == [i != 5 for i in range(200)] + [False]
+        assert server.get_many(keys) == [b"old" if i == 5 else b"v" + k
+                                         for i, k in enumerate(keys)]
+        assert server.set_many({unique_key(): b"x"}) == [True]
+
     def test_keys(self, server):
         keys_to_add = [unique_key("lst") for _ in range(3)]
         for k in keys_to_add:
@@ -171,6 +266,49 @@ class TestDiskHashClient:
         server[unique_key()] = b"v"
         assert len(server) == before + 2
 
+    def test_stats(self, server):
+        before = server.stats()
+        key = unique_key("st")
+        server[key] = b"value"
+        after = server.stats()
+        assert after["records"] == before["records"] + 1
+        assert after["key_bytes"] == before["key_bytes"] + len(key)
+        assert after["value_bytes"] == before["value_bytes"] + len(b"value")
+        # the bucket walk is left to /structure
+        assert "chains" not in after
+
+    def test_structure(self, server):
+        server[unique_key("st")] = b"value"
+        structure = server.structure()
+        assert structure["buckets"] >= structure["chains"] > 0
+        assert structure["bytes_used"] > 0
+        assert sum(v for k, v in structure.items() if k.startswith("chain_length_")) == \
+            structure["chains"]
+        assert structure["global_depth"] >= structure["median_local_depth"]
+
+    def test_scan(self, server):
+        keys_to_add = {unique_key("scan") for _ in range(50)}
+        for k in keys_to_add:
+            server.set(k, b"v")
+
+        seen = []
+        cursor, pages = "0", 0
+        while True:
+            cursor, keys = server.scan(cursor, count=5)
+            seen.extend(keys)
+            pages += 1
+            if cursor == "0":
+                break
+
+        assert pages > 1
+        assert len(seen) == len(set(seen))
+        assert keys_to_add <= set(seen)
+        assert set(seen) == set(server.keys())
+
+    def test_scan_invalid_cursor(self, server):
+        with pytest.raises(requests.HTTPError):
+            server.scan("not-a-cursor")
+
     def test_iter(self, server):
         keys_to_add = {unique_key("it") for _ in range(3)}
         for k in keys_to_add:
@@ -192,6 +330,14 @@ class TestDiskHashClient:
         server.set(key, value)
         assert server.get(key) == value
 
+    def test_value_written_from_mapping(self, server):
+        # values of 1 KB and more skip the copy into the response
+        key = unique_key("direct")
+        value = bytes(range(256)) * 12
+        server.set(key, value)
+        assert server.get(key) == value
+        assert server.get_many([key]) == [value]
+
     def test_many_keys(self, server):
         prefix = uuid.uuid4().hex[:6]
         for i in range(100):
@@ -204,3 +350,660 @@ class TestDiskHashClient:
         client = DiskHashClient("127.0.0.1", 1)
         with client:
             pass
+
+
+def check_set_then_garbage(client, port):
+    """A SET followed by a frame over the size limit is answered, then the connection is
+    closed after an error."""
+    key = unique_key("garbage")
+    frames = struct.pack("<IBI", 4 + len(key) + 1, 2, len(key)) + key + b"v"
+    frames += struct.pack("<IB", (64 << 20) + 1, 1) + os.urandom(1000)
+
+    with socket.create_connection(("127.0.0.1", port), timeout=5.0) as sock:
+        sock.sendall(frames)
+        data = b""
+        while True:
+            chunk = sock.recv(4096)
+            if not chunk:
+                break
+            data += chunk
+
+    assert data[:5] == struct.pack("<IB", 0, 0)
+    (length, status) = struct.unpack_from("<IB", data, 5)
+    assert status == 3
+    assert len(data) == 10 + length
+    assert client.get(key) == b"v"
+
+
+class TestDiskHashBinaryClient:
+    """Tests for DiskHashBinaryClient against the same server."""
+
+    def test_set_and_get(self, binary_client):
+        key = unique_key()
+        assert binary_client.set(key, b"world") is True
+        assert binary_client.get(key) == b"world"
+        assert binary_client.get(unique_key("miss")) is None
+
+    def test_set_duplicate_returns_false(self, binary_client):
+        key = unique_key()
+        assert binary_client.set(key, b"value1") is True
+        assert binary_client.set(key, b"value2") is False
+
+    def test_delete(self, binary_client):
+        key = unique_key()
+        binary_client[key] = b"value"
+        assert binary_client.delete(key) is True
+        assert binary_client.delete(key) is False
+        assert key not in binary_client
+
+    def test_get_many(self, binary_client):
+        keys = [unique_key("many") for _ in range(3)]
+        binary_client.set(keys[0], b"a")
+        binary_client.set(keys[2], b"")
+        assert binary_client.get_many(keys) == [b"a", None, b""]
+        assert binary_client.get_many([]) == []
+
+    def test_oversized_mget(self, server, binary_client):
+        # the values would take more than the 64 MB a frame may hold
+        key = unique_key("wide")
+        value = b"v" * 3900
+        binary_client.set(key, value)
+        keys = [key] * 17500
+
+        with pytest.raises(RuntimeError, match="too large"):
+            binary_client.get_many(keys)
+        assert binary_client.get(key) == value
+
+        with pytest.raises(requests.HTTPError) as error:
+            server.get_many(keys)
+        assert error.value.response.status_code == 413
+
+    def test_shares_data_with_http(self, server, binary_client):
+        key = b"\x00\xff binary\n" + unique_key()
+        server.set(key, b"\x01\x02")
+        assert binary_client.get(key) == b"\x01\x02"
+        binary_client.delete(key)
+        assert server.get(key) is None
+
+    def test_pipelined_frames(self, binary_client, binary_port):
+        # several requests in one write are answered in order
+        key = unique_key("pipe")
+        frames = b""
+        frames += struct.pack("<IBI", 4 + len(key) + 1, 2, len(key)) + key + b"v"
+        frames += struct.pack("<IB", len(key), 1) + key
+        frames += struct.pack("<IB", len(key), 3) + key
+        frames += struct.pack("<IB", len(key), 1) + key
+
+        with socket.create_connection(("127.0.0.1", binary_port), timeout=5.0) as sock:
+            sock.sendall(frames)
+            data = b""
+            while len(data) < 5 * 4 + 1:
+                data += sock.recv(4096)
+
+        assert data == (struct.pack("<IB", 0, 0) + struct.pack("<IB", 1, 0) + b"v"
+                        + struct.pack("<IB", 0, 0) + struct.pack("<IB", 0, 1))
+
+    def test_oversized_frame_closes_connection(self, server, binary_port):
+        check_set_then_garbage(server, binary_port)
+
+    def test_pipelined_large_values(self, binary_client, binary_port):
+        # responses too large for the socket buffer are finished asynchronously, in order
+        big, small = unique_key("big"), unique_key("small")
+        value = bytes(range(256)) * 12
+        binary_client.set(big, value)
+        binary_client.set(small, b"s")
+
+        get = lambda key: struct.pack("<IB", len(key), 1) + key
+        frames = (get(big) + get(small)) * 1000
+        expected = (struct.pack("<IB", len(value), 0) + value + struct.pack("<IB", 1, 0) + b"s") * 1000
+
+        with socket.create_connection(("127.0.0.1", binary_port), timeout=5.0) as sock:
+            sock.sendall(frames)
+            data = b""
+            while len(data) < len(expected):
+                chunk = sock.recv(1 << 16)
+                assert chunk
+                data += chunk
+
+        assert data == expected
+
+
+class TestIoUringBinaryClient:
+    """The binary protocol served by --io-uring, which falls back to epoll without it."""
+
+    def test_set_get_delete(self, uring_server, uring_binary_port):
+        with DiskHashBinaryClient("127.0.0.1", uring_binary_port, timeout=5.0) as client:
+            key = unique_key()
+            assert client.set(key, b"world") is True
+            assert client.set(key, b"again") is False
+            assert client.get(key) == b"world"
+            assert uring_server.get(key) == b"world"
+            assert client.delete(key) is True
+            assert client.get(key) is None
+
+    def test_pipelined_large_values(self, uring_server, uring_binary_port):
+        big, small = unique_key("big"), unique_key("small")
+        value = bytes(range(256)) * 12
+        uring_server.set(big, value)
+        uring_server.set(small, b"s")
+
+        get = lambda key: struct.pack("<IB", len(key), 1) + key
+        frames = (get(big) + get(small)) * 1000
+        expected = (struct.pack("<IB", len(value), 0) + value + struct.pack("<IB", 1, 0) + b"s") * 1000
+
+        with socket.create_connection(("127.0.0.1", uring_binary_port), timeout=5.0) as sock:
+            sock.sendall(frames)
+            data = b""
+            while len(data) < len(expected):
+                chunk = sock.recv(1 << 16)
+                assert chunk
+                data += chunk
+
+        assert data == expected
+
+    def test_frame_larger_than_read_buffer(self, uring_server, uring_binary_port):
+        # an MGET of 200 KB of keys spans several reads
+        keys = [unique_key("wide") * 8 for _ in range(3000)]
+        uring_server.set(keys[7], b"seven")
+        with DiskHashBinaryClient("127.0.0.1", uring_binary_port, timeout=5.0) as client:
+            values = client.get_many(keys)
+            assert values[7] == b"seven"
+            assert values.count(None) == len(keys) - 1
+            assert client.get(keys[7]) == b"seven"
+
+    def test_oversized_frame_closes_connection(self, uring_server, uring_binary_port):
+        check_set_then_garbage(uring_server, uring_binary_port)
+
+
+class TestThreadPerCore:
+    """Requests forwarded to the thread that owns their shard."""
+
+    def test_keys_on_every_shard(self, per_core_server):
+        keys = [unique_key("core") for _ in range(50)]
+        for i, key in enumerate(keys):
+            assert per_core_server.set(key, str(i).encode()) is True
+        for i, key in enumerate(keys):
+            assert per_core_server.get(key) == str(i).encode()
+        assert per_core_server.get_many(keys) == [str(i).encode() for i in range(50)]
+        for key in keys:
+            assert per_core_server.delete(key) is True
+            assert per_core_server.get(key) is None
+
+    def test_pipelined_frames_keep_order(self, per_core_server, per_core_binary_port):
+        # consecutive frames for different shards are answered in request order
+        keys = [unique_key("order") for _ in range(200)]
+        frames = b""
+        expected = b""
+        for i, key in enumerate(keys):
+            value = str(i).encode()
+            frames += struct.pack("<IBI", 4 + len(key) + len(value), 2, len(key)) + key + value
+            frames += struct.pack("<IB", len(key), 1) + key
+            expected += struct.pack("<IB", 0, 0) + struct.pack("<IB", len(value), 0) + value
+
+        with socket.create_connection(("127.0.0.1", per_core_binary_port), timeout=5.0) as sock:
+            sock.sendall(frames)
+            data = b""
+            while len(data) < len(expected):
+                chunk = sock.recv(1 << 16)
+                assert chunk
+                data += chunk
+
+        assert data == expected
+
+
+class TestReshard:
+    """Records moved to a new shard count while the server keeps serving."""
+
+    def wait_for_reshard(self, client):
+        for _ in range(100):
+            status = client.reshard_status()
+            if status["target"] == 0 and not status["running"]:
+                return status
+            time.sleep(0.1)
+        pytest.fail(f"Resharding did not finish: {status}")
+
+    def test_grow_and_shrink(self, reshard_server):
+        keys = [unique_key("reshard") for _ in range(500)]
+        for i, key in enumerate(keys):
+            assert reshard_server.set(key, str(i).encode()) is True
+
+        assert reshard_server.reshard(7) is True
+        # written and deleted while records move
+        late = unique_key("late")
+        assert reshard_server.set(late, b"late") is True
+        assert reshard_server.delete(keys[0]) is True
+        status = self.wait_for_reshard(reshard_server)
+        assert status["shards"] == 7
+        assert status["keys_moved"] > 0
+
+        assert reshard_server.reshard(3) is True
+        assert self.wait_for_reshard(reshard_server)["shards"] == 3
+
+        assert reshard_server.get(keys[0]) is None
+        assert reshard_server.get(late) == b"late"
+        assert reshard_server.get_many(keys[1:]) == [str(i).encode() for i in range(1, 500)]
+        assert reshard_server.stats()["records"] == 500
+        assert set(reshard_server.iter_keys()) == set(keys[1:]) | {late}
+
+    def test_invalid_shard_count(self, reshard_server):
+        with pytest.raises(requests.HTTPError):
+            reshard_server.reshard(0)
+
+
+class TestSnapshot:
+    """Copies of a live database that another server can serve."""
+
+    def test_snapshot_is_served(self, snapshot_server):
+        keys = [unique_key("snap") for _ in range(200)]
+        for i, key in enumerate(keys):
+            assert snapshot_server.set(key, str(i).encode()) is True
+
+        snapshot = snapshot_server.snapshot("first")
+        assert snapshot["shards"] == 2
+        assert snapshot["bytes"] > 0
+
+        # later changes stay out of the copy
+        assert snapshot_server.delete(keys[0]) is True
+        late = unique_key("late")
+        assert snapshot_server.set(late, b"late") is True
+
+        copy_server = run_server(find_free_port(), db_path=snapshot["path"])
+        try:
+            copy = next(copy_server)
+            assert copy.get_many(keys) == [str(i).encode() for i in range(200)]
+            assert copy.get(late) is None
+            assert copy.set(late, b"copy") is True
+        finally:
+            copy_server.close()
+
+        assert snapshot_server.get(late) == b"late"
+
+    def test_existing_name(self, snapshot_server):
+        snapshot_server.snapshot("twice")
+        with pytest.raises(requests.HTTPError):
+            snapshot_server.snapshot("twice")
+
+    def test_invalid_name(self, snapshot_server):
+        with pytest.raises(requests.HTTPError):
+            snapshot_server.snapshot("../outside")
+
+    def test_disabled(self, server):
+        with pytest.raises(requests.HTTPError):
+            server.snapshot()
+
+
+def scrub_status(client):
+    resp = requests.get(f"{client.base_url}/scrub", timeout=5.0)
+    resp.raise_for_status()
+    result = {"corrupted": []}
+    for line in resp.text.strip().split("\n"):
+        name, value = line.split(" ", 1)
+        if name == "corrupted":
+            result["corrupted"].append(tuple(int(v) for v in value.split(" ")))
+        else:
+            result[name] = int(value)
+    return result
+
+
+class TestScrubber:
+    """The background scrubber of a server with checksums."""
+
+    # data files have an 88 byte header and 4096 byte buckets of a 24 byte header and the
+    # records, the header starting with prefix bits and bytes used
+    HEADER_SIZE = 88
+    BUCKET_SIZE = 4096
+    BUCKET_HEADER_SIZE = 24
+
+    def test_finds_corrupted_bucket(self):
+        db_path = os.path.join(tempfile.mkdtemp(), "scrubdb")
+        args = ("--checksums", "--scrub-rate", "100000")
+
+        writer = run_server(find_free_port(), *args, db_path=db_path)
+        client = next(writer)
+        for _ in range(200):
+            assert client.set(unique_key("scrub"), b"value") is True
+        assert scrub_status(client)["corrupted"] == []
+        writer.close()
+
+        # flip a record byte of the first bucket holding records
+        with open(db_path + "_shard1dat", "r+b") as f:
+            data = f.read()
+            bucket_id = 0
+            while True:
+                offset = self.HEADER_SIZE + bucket_id * self.BUCKET_SIZE
+                (bytes_used,) = struct.unpack_from("<Q", data, offset + 8)
+                if bytes_used:
+                    break
+                bucket_id += 1
+            f.seek(offset + self.BUCKET_HEADER_SIZE)
+            f.write(bytes([data[offset + self.BUCKET_HEADER_SIZE] ^ 0x40]))
+
+        reader = run_server(find_free_port(), *args, db_path=db_path)
+        try:
+            client = next(reader)
+            for _ in range(100):
+                status = scrub_status(client)
+                if status["passes_completed"] > 0:
+                    break
+                time.sleep(0.05)
+            assert status["buckets_scrubbed"] > 0
+            assert status["corrupted"] == [(1, bucket_id)]
+        finally:
+            reader.close()
+
+    def test_disabled(self, server):
+        resp = requests.get(f"{server.base_url}/scrub", timeout=5.0)
+        assert resp.status_code == 404
+
+
+def filter_stats(client):
+    """The /filters counters of a server, None if it runs without filters."""
+    resp = requests.get(f"{client.base_url}/filters", timeout=5.0)
+    if resp.status_code == 404:
+        return None
+    resp.raise_for_status()
+    result = {}
+    for line in resp.text.strip().split("\n"):
+        name, value = line.split(" ")
+        result[name] = float(value)
+    return result
+
+
+class TestFilters:
+    """The bucket filters of a server started with --filters."""
+
+    def test_missing_keys_skip_buckets(self):
+        db_path = os.path.join(tempfile.mkdtemp(), "filterdb")
+        keys = [unique_key("flt") for _ in range(500)]
+
+        writer = run_server(find_free_port(), "--filters", db_path=db_path)
+        client = next(writer)
+        for key in keys:
+            assert client.set(key, b"value") is True
+
+        before = filter_stats(client)
+        for _ in range(500):
+            assert client.get(unique_key("missing")) is None
+        for key in keys[:50]:
+            assert client.get(key) == b"value"
+        after = filter_stats(client)
+
+        assert after["lookups"] - before["lookups"] == 550
+        # lookups of stored keys always pass the filter, so only missing ones are counted here
+        misses = (after["negatives"] - before["negatives"]
+                  + after["false_positives"] - before["false_positives"])
+        assert misses == 500
+        assert after["negatives"] - before["negatives"] >= 400
+        assert after["false_positive_rate"] < 0.2
+        writer.close()
+        assert os.path.exists(db_path + "_shard0flt")
+
+        # the filters closed in sync are used again, and still let every stored key through
+        reader = run_server(find_free_port(), "--filters", db_path=db_path)
+        try:
+            client = next(reader)
+            assert client.get_many(keys) == [b"value"] * len(keys)
+            assert client.get(unique_key("missing")) is None
+            assert filter_stats(client)["lookups"] > 0
+        finally:
+            reader.close()
+
+    def test_deleted_keys(self):
+        filtered = run_server(find_free_port(), "--filters")
+        client = next(filtered)
+        try:
+            keys = [unique_key("flt") for _ in range(200)]
+            for key in keys:
+                assert client.set(key, b"value") is True
+            for key in keys[:100]:
+                assert client.delete(key) is True
+            assert client.get_many(keys) == [None] * 100 + [b"value"] * 100
+        finally:
+            filtered.close()
+
+    def test_disabled(self, server):
+        assert filter_stats(server) is None
+
+
+def cache_stats(client):
+    """The /cache counters of a server, None if it runs without a cache."""
+    resp = requests.get(f"{client.base_url}/cache", timeout=5.0)
+    if resp.status_code == 404:
+        return None
+    resp.raise_for_status()
+    result = {}
+    for line in resp.text.strip().split("\n"):
+        name, value = line.split(" ")
+        result[name] = float(value)
+    return result
+
+
+@pytest.fixture(scope="module")
+def cache_binary_port():
+    """Port of the binary listener of the caching test server."""
+    return find_free_port()
+
+
+@pytest.fixture(scope="module")
+def cache_server(cache_binary_port):
+    """A test server with a cache of recent lookups."""
+    yield from run_server(cache_binary_port, "--cache-bytes", "1000000")
+
+
+class TestCache:
+    """The lookup cache of a server started with --cache-bytes."""
+
+    def test_hits(self, cache_server):
+        key = unique_key("cache")
+        assert cache_server.set(key, b"value") is True
+        before = cache_stats(cache_server)
+        for _ in range(3):
+            assert cache_server.get(key) == b"value"
+        after = cache_stats(cache_server)
+        assert after["misses"] - before["misses"] == 1
+        assert after["hits"] - before["hits"] == 2
+
+    def test_set_after_get(self, cache_server):
+        key = unique_key("cache")
+        # the miss is cached, the set must not be hidden by it
+        assert cache_server.get(key) is None
+        assert cache_server.get(key) is None
+        assert cache_server.set(key, b"value") is True
+        assert cache_server.get(key) == b"value"
+        assert cache_server.get_many([key]) == [b"value"]
+
+    def test_delete_after_get(self, cache_server):
+        key = unique_key("cache")
+        assert cache_server.set(key, b"value") is True
+        assert cache_server.get(key) == b"value"
+        assert cache_server.delete(key) is True
+        assert cache_server.get(key) is None
+        assert cache_server.set(key, b"again") is True
+        assert cache_server.get(key) == b"again"
+
+    def test_set_many_after_get(self, cache_server):
+        keys = [unique_key("cache") for _ in range(10)]
+        assert cache_server.get_many(keys) == [None] * 10
+        assert cache_server.set_many([(key, b"value") for key in keys]) == [True] * 10
+        assert cache_server.get_many(keys) == [b"value"] * 10
+
+    def test_binary_set_after_get(self, cache_server, cache_binary_port):
+        key = unique_key("cache")
+        with DiskHashBinaryClient("127.0.0.1", cache_binary_port, timeout=5.0) as client:
+            assert client.get(key) is None
+            assert client.set(key, b"value") is True
+            assert client.get(key) == b"value"
+        assert cache_server.get(key) == b"value"
+
+    def test_byte_budget(self):
+        capacity = 8192
+        small = run_server(find_free_port(), "--cache-bytes", str(capacity))
+        client = next(small)
+        try:
+            keys = [unique_key("cache") for _ in range(200)]
+            for key in keys:
+                assert client.set(key, b"x" * 100) is True
+            for key in keys:
+                assert client.get(key) == b"x" * 100
+            stats = cache_stats(client)
+            assert stats["capacity_bytes"] == capacity
+            assert 0 < stats["bytes"] <= capacity
+            assert stats["evictions"] > 0
+            # evicted entries are read from the map again
+            assert client.get_many(keys) == [b"x" * 100] * len(keys)
+        finally:
+            small.close()
+
+    def test_disabled(self, server):
+        assert cache_stats(server) is None
+
+
+def replication_metrics(client):
+    resp = requests.get(f"{client.base_url}/metrics", timeout=5.0)
+    resp.raise_for_status()
+    result = {}
+    for line in resp.text.split("\n"):
+        if line.startswith("diskhash_replication_"):
+            name, value = line.split(" ")
+            result[name[len("diskhash_replication_"):]] = float(value)
+    return result
+
+
+class TestReplication:
+    """A replica applying the primary's sets and deletes."""
+
+    def wait_for(self, condition):
+        for _ in range(100):
+            if condition():
+                return
+            time.sleep(0.05)
+        pytest.fail("Replica did not catch up")
+
+    def test_changes_reach_replica(self, replicated):
+        primary, replica = replicated
+        keys = [unique_key("repl") for _ in range(100)]
+        for i, key in enumerate(keys):
+            assert primary.set(key, str(i).encode()) is True
+        for key in keys[:10]:
+            assert primary.delete(key) is True
+
+        # streams are applied independently, so wait for all of them
+        expected = [None] * 10 + [str(i).encode() for i in range(10, 100)]
+        self.wait_for(lambda: replica.get_many(keys) == expected)
+
+        self.wait_for(lambda: replication_metrics(replica)["lag_operations"] == 0)
+        metrics = replication_metrics(replica)
+        assert metrics["connected"] == 1
+        assert metrics["operations_total"] >= 110
+
+    def test_replica_rejects_writes(self, replicated):
+        _, replica = replicated
+        with pytest.raises(requests.HTTPError):
+            replica.set(unique_key("repl"), b"value")
+
+
+def server_port(client):
+    return int(client.base_url.rsplit(":", 1)[1])
+
+
+def send_health(sock):
+    """Send GET /health on a raw connection and return the status code of the response."""
+    sock.sendall(b"GET /health HTTP/1.1\r\nHost: localhost\r\n\r\n")
+    response = b""
+    while b"\r\n\r\n" not in response:
+        chunk = sock.recv(4096)
+        if not chunk:
+            raise ConnectionError("closed before the response")
+        response += chunk
+    head, body = response.split(b"\r\n\r\n", 1)
+    lines = head.decode("latin-1").split("\r\n")
+    length = 0
+    for line in lines[1:]:
+        name, value = line.split(":", 1)
+        if name.lower() == "content-length":
+            length = int(value)
+    while len(body) < length:
+        body += sock.recv(4096)
+    return int(lines[0].split(" ")[1])
+
+
+def wait_closed(sock, timeout):
+    """Seconds until the server closed sock, fails after timeout."""
+    start = time.monotonic()
+    sock.settimeout(timeout)
+    try:
+        assert sock.recv(1) == b""
+    except socket.timeout:
+        pytest.fail("connection was not closed")
+    except ConnectionResetError:
+        pass
+    return time.monotonic() - start
+
+
+class TestConnections:
+    """Idle timeout and connection limit of the server."""
+
+    def test_idle_timeout(self):
+        binary_port = find_free_port()
+        idle = run_server(binary_port, "--idle-timeout", "1")
+        client = next(idle)
+        try:
+            port = server_port(client)
+
+            # a connection that never sends a request
+            with socket.create_connection(("127.0.0.1", port), timeout=5.0) as sock:
+                assert 0.5 < wait_closed(sock, 5.0) < 4.0
+
+            # a keep-alive connection that stops sending after a request
+            with socket.create_connection(("127.0.0.1", port), timeout=5.0) as sock:
+                assert send_health(sock) == 200
+                assert 0.5 < wait_closed(sock, 5.0) < 4.0
+
+            with socket.create_connection(("127.0.0.1", binary_port), timeout=5.0) as sock:
+                assert 0.5 < wait_closed(sock, 5.0) < 4.0
+
+            # busy connections are not affected
+            key = unique_key("idle")
+            with DiskHashBinaryClient("127.0.0.1", binary_port, timeout=5.0) as binary:
+                for _ in range(4):
+                    assert binary.get(key) is None
+                    time.sleep(0.5)
+        finally:
+            idle.close()
+
+    def test_max_connections(self):
+        # the client's pooled connection is one of the three
+        limited = run_server(find_free_port(), "--max-connections", "3")
+        client = next(limited)
+        port = server_port(client)
+        open_sockets = []
+        try:
+            for _ in range(2):
+                sock = socket.create_connection(("127.0.0.1", port), timeout=5.0)
+                open_sockets.append(sock)
+                assert send_health(sock) == 200
+
+            with socket.create_connection(("127.0.0.1", port), timeout=5.0) as sock:
+                assert send_health(sock) == 503
+                wait_closed(sock, 5.0)
+
+            # a freed slot is available again
+            open_sockets.pop().close()
+            for _ in range(50):
+                with socket.create_connection(("127.0.0.1", port), timeout=5.0) as sock:
+                    if send_health(sock) == 200:
+                        break
+                time.sleep(0.05)
+            else:
+                pytest.fail("connection slot was not freed")
+
+            # over the client's own connection, so it is not refused
+            resp = client._session.get(f"{client.base_url}/metrics", timeout=5.0)
+            resp.raise_for_status()
+            rejected = [line for line in resp.text.split("\n")
+                        if line.startswith("diskhash_connections_rejected_total ")]
+            assert float(rejected[0].split(" ")[1]) >= 1
+        finally:
+            for sock in open_sockets:
+                sock.close()
+            limited.close()
@@ -1,7 +1,11 @@
 """Tests for DiskHash Python bindings."""
 
 import os
+import shutil
+import subprocess
 import tempfile
+import threading
+from collections import Counter
 
 import pytest
 
@@ -15,6 +19,29 @@ def temp_db():
         yield os.path.join(tmpdir, "testdb")
 
 
+def get_freeze_path():
+    """Get path to the diskhash_freeze binary."""
+    on_path = shutil.which("diskhash_freeze")
+    if on_path:
+        return on_path
+    candidates = [
+        os.path.join(os.path.dirname(__file__), "../../build/diskhash_freeze"),
+        os.path.join(os.path.dirname(__file__), "../../../build/diskhash_freeze"),
+        "build/diskhash_freeze",
+        "./diskhash_freeze",
+    ]
+    for path in candidates:
+        abs_path = os.path.abspath(path)
+        if os.path.isfile(abs_path) and os.access(abs_path, os.X_OK):
+            return abs_path
+    pytest.skip("diskhash_freeze binary not found. Install with: pip install .")
+
+
+def freeze(db_path):
+    """Write the frozen copy of the map at db_path."""
+    subprocess.run([get_freeze_path(), "--db", db_path], check=True, capture_output=True)
+
+
 class TestDiskHash:
     """Tests for DiskHash native bindings."""
 
@@ -85,6 +112,18 @@ class TestDiskHash:
             db[b"key"] = b"value"
             assert db.bytes_allocated() > 0
 
+    def test_len(self, temp_db):
+        """Test len counts records across inserts, removals and reopening."""
+        with DiskHash(temp_db) as db:
+            assert len(db) == 0
+            for i in range(1000):
+                db[f"key{i}".encode()] = b"v"
+            del db[b"key0"]
+            assert len(db) == 999
+
+        with DiskHash(temp_db, read_only=True) as db:
+            assert len(db) == 999
+
     def test_binary_data(self, temp_db):
         """Test storing binary data with null bytes."""
         with DiskHash(temp_db) as db:
@@ -113,3 +152,224 @@ class TestDiskHash:
                 key = f"key{i}".encode()
                 value = f"value{i}".encode()
                 assert db[key] == value
+
+
+class TestFilters:
+    """Tests for maps opened with bucket filters."""
+
+    def test_filter_stats_disabled(self, temp_db):
+        """Test filter_stats is None without filters."""
+        with DiskHash(temp_db) as db:
+            db[b"key"] = b"value"
+            assert db.filter_stats() is None
+
+    def test_filter_stats(self, temp_db):
+        """Test lookups of missing keys are counted and mostly rejected by the filters."""
+        with DiskHash(temp_db, filters=True) as db:
+            for i in range(2000):
+                db[f"key{i}".encode()] = b"v"
+
+            before = db.filter_stats()
+            for i in range(2000):
+                assert f"missing{i}".encode() not in db
+            for i in range(100):
+                assert db[f"key{i}".encode()] == b"v"
+            after = db.filter_stats()
+
+            assert after["lookups"] - before["lookups"] == 2100
+            # lookups of stored keys always pass the filter, so only missing ones are counted here
+            misses = (after["negatives"] - before["negatives"]
+                      + after["false_positives"] - before["false_positives"])
+            assert misses == 2000
+            assert after["negatives"] - before["negatives"] >= 1600
+            assert 0.0 <= after["false_positive_rate"] < 0.2
+
+    def test_filters_after_removal_and_reopen(self, temp_db):
+        """Test the filters let every stored key through after removals and reopening."""
+        with DiskHash(temp_db, filters=True) as db:
+            for i in range(2000):
+                db[f"key{i}".encode()] = b"v"
+            for i in range(0, 2000, 3):
+                del db[f"key{i}".encode()]
+        assert os.path.exists(temp_db + "flt")
+
+        # modified without filters, so the sidecar is out of date and rebuilt
+        with DiskHash(temp_db) as db:
+            db[b"extra"] = b"v"
+
+        for read_only in (False, True):
+            with DiskHash(temp_db, read_only=read_only, filters=True) as db:
+                assert db[b"extra"] == b"v"
+                for i in range(2000):
+                    assert (f"key{i}".encode() in db) == (i % 3 != 0)
+
+
+class TestParallelItems:
+    """Tests for parallel_items scans."""
+
+    def collect(self, db, n_workers):
+        seen = Counter()
+        values = {}
+        lock = threading.Lock()
+
+        def visit(key, value):
+            with lock:
+                seen[key] += 1
+                values[key] = value
+
+        db.parallel_items(n_workers, visit)
+        return seen, values
+
+    @pytest.mark.parametrize("n_workers", [1, 4, 16])
+    def test_visits_every_record_once(self, temp_db, n_workers):
+        """Test every record is passed to fn exactly once, whatever the number of workers."""
+        expected = {f"key{i}".encode(): f"value{i}".encode() for i in range(5000)}
+        with DiskHash(temp_db) as db:
+            for key, value in expected.items():
+                db[key] = value
+            for i in range(0, 5000, 7):
+                del db[f"key{i}".encode()]
+                del expected[f"key{i}".encode()]
+
+            seen, values = self.collect(db, n_workers)
+            assert set(seen.values()) == {1}
+            assert values == expected
+
+    def test_empty_map(self, temp_db):
+        """Test scanning an empty map calls fn for nothing."""
+        with DiskHash(temp_db) as db:
+            seen, _ = self.collect(db, 4)
+            assert not seen
+
+    def test_frozen_copy(self, temp_db):
+        """Test parallel_items scans a frozen copy."""
+        expected = {f"key{i}".encode(): b"v" for i in range(1000)}
+        with DiskHash(temp_db) as db:
+            for key, value in expected.items():
+                db[key] = value
+        freeze(temp_db)
+
+        with DiskHash(temp_db, read_only=True) as db:
+            seen, values = self.collect(db, 4)
+            assert set(seen.values()) == {1}
+            assert values == expected
+
+    def test_exception_in_fn(self, temp_db):
+        """Test an exception raised by fn is propagated to the caller."""
+        with DiskHash(temp_db) as db:
+            db[b"key"] = b"value"
+
+            def fail(key, value):
+                raise ValueError("stop")
+
+            with pytest.raises(ValueError):
+                db.parallel_items(2, fail)
+
+    def test_modifying_from_fn(self, temp_db):
+        """Test fn cannot change or close the map while workers read from it."""
+        with DiskHash(temp_db) as db:
+            for i in range(100):
+                db[f"key{i}".encode()] = b"value"
+
+            def modify(key, value):
+                db[b"new_" + key] = b"value"
+
+            with pytest.raises(RuntimeError):
+                db.parallel_items(4, modify)
+
+            errors = []
+            lock = threading.Lock()
+
+            def try_all(key, value):
+                for action in (lambda: db.__delitem__(key), db.close):
+                    try:
+                        action()
+                    except RuntimeError:
+                        with lock:
+                            errors.append(key)
+
+            db.parallel_items(4, try_all)
+            assert len(errors) == 200
+
+            # allowed again once the scan has returned
+            db[b"new"] = b"value"
+            del db[b"key0"]
+            assert len(db) == 100
+
+    def test_modifying_from_another_thread(self, temp_db):
+        """Test another thread cannot change the map while a scan is running."""
+        with DiskHash(temp_db) as db:
+            db[b"key"] = b"value"
+            errors = []
+
+            def writer():
+                try:
+                    db[b"other"] = b"value"
+                except RuntimeError as e:
+                    errors.append(e)
+
+            def visit(key, value):
+                # waits without the GIL, so the writer runs in the middle of the scan
+                thread = threading.Thread(target=writer)
+                thread.start()
+                thread.join()
+
+            db.parallel_items(1, visit)
+            assert len(errors) == 1
+            assert b"other" not in db
+
+
+class TestFrozen:
+    """Tests for read-only opens of maps with a frozen copy."""
+
+    def test_uses_frozen_copy(self, temp_db):
+        """Test a read-only open answers from the frozen copy while the map is unchanged."""
+        with DiskHash(temp_db, filters=True) as db:
+            for i in range(100):
+                db[f"key{i}".encode()] = f"value{i}".encode()
+        freeze(temp_db)
+
+        with DiskHash(temp_db, read_only=True, filters=True) as db:
+            # the frozen copy has no bucket filters, the live map would report them
+            assert db.filter_stats() is None
+            assert len(db) == 100
+            assert db[b"key42"] == b"value42"
+            assert b"missing" not in db
+            assert dict(db) == {f"key{i}".encode(): f"value{i}".encode() for i in range(100)}
+
+    def test_frozen_copy_without_source(self, temp_db):
+        """Test the frozen copy is used when the map it was made from is gone."""
+        with DiskHash(temp_db) as db:
+            db[b"key"] = b"value"
+        freeze(temp_db)
+        for suffix in ("cat", "dat", "flt"):
+            if os.path.exists(temp_db + suffix):
+                os.remove(temp_db + suffix)
+
+        with DiskHash(temp_db, read_only=True) as db:
+            assert db[b"key"] == b"value"
+            assert len(db) == 1
+
+    def test_falls_back_when_source_changed(self, temp_db):
+        """Test a read-only open uses the map itself once it changed after freezing."""
+        with DiskHash(temp_db, filters=True) as db:
+            db[b"old"] = b"1"
+        freeze(temp_db)
+        with DiskHash(temp_db, filters=True) as db:
+            db[b"new"] = b"2"
+
+        with DiskHash(temp_db, read_only=True, filters=True) as db:
+            assert db.filter_stats() is not None
+            assert db[b"old"] == b"1"
+            assert db[b"new"] == b"2"
+            assert len(db) == 2
+
+    def test_writable_open_ignores_frozen_copy(self, temp_db):
+        """Test a writable open always uses the map itself."""
+        with DiskHash(temp_db) as db:
+            db[b"old"] = b"1"
+        freeze(temp_db)
+
+        with DiskHash(temp_db) as db:
+            db[b"new"] = b"2"
+            assert db[b"new"] == b"2"
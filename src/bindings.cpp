@@ -1,12 +1,16 @@
 #include <nanobind/nanobind.h>
 #include <nanobind/stl/string.h>
+#include <filesystem>
 #include <memory>
+#include <optional>
 #include <string>
 #include <string_view>
 #include <stdexcept>
+#include <vector>
 
 #include "settings.h"
 #include "hash_map.h"
+#include "frozen_hash_map.h"
 #include "fnv.h"
 
 namespace nb = nanobind;
@@ -15,17 +19,20 @@ namespace {
 
 class PyDiskHash {
 public:
-    PyDiskHash(const std::string &path, bool read_only)
-        : map_(std::make_unique<diskhash::hash_map<>>(path.c_str(), read_only)),
-          path_(path), read_only_(read_only)
+    PyDiskHash(const std::string &path, bool read_only, bool durable, bool checksums, bool filters)
+        : path_(path), read_only_(read_only), filters_(filters), scans_(0)
     {
+        if (read_only && diskhash::frozen_hash_map::exists(path.c_str()))
+            open_frozen();
+        if (!frozen_ && !map_)
+            map_ = std::make_unique<diskhash::hash_map<>>(path.c_str(), read_only, durable, checksums, filters);
     }
 
     nb::bytes get(nb::bytes key) {
         ensure_open();
         auto k = make_key(key);
         diskhash::hash_t h = diskhash::fnv1a(k);
-        auto r = map_->find(h, k);
+        auto r = find(h, k);
         if (!r)
             throw nb::key_error(std::string(key.c_str(), key.size()).c_str());
         return nb::bytes(r->data(), r->size());
@@ -35,7 +42,7 @@ public:
         ensure_open();
         auto k = make_key(key);
         diskhash::hash_t h = diskhash::fnv1a(k);
-        auto r = map_->find(h, k);
+        auto r = find(h, k);
         if (!r)
             return default_val;
         return nb::cast(nb::bytes(r->data(), r->size()));
@@ -43,6 +50,7 @@ public:
 
     void put(nb::bytes key, nb::bytes value) {
         ensure_open();
+        ensure_not_scanned();
         if (read_only_)
             throw std::runtime_error("hash map is read-only");
         auto k = make_key(key);
@@ -58,11 +66,12 @@ public:
         ensure_open();
         auto k = make_key(key);
         diskhash::hash_t h = diskhash::fnv1a(k);
-        return map_->find(h, k).has_value();
+        return find(h, k).has_value();
     }
 
     void remove(nb::bytes key) {
         ensure_open();
+        ensure_not_scanned();
         if (read_only_)
             throw std::runtime_error("hash map is read-only");
         auto k = make_key(key);
@@ -71,16 +80,66 @@ public:
             throw nb::key_error(std::string(key.c_str(), key.size()).c_str());
     }
 
+    size_t size() {
+        ensure_open();
+        return frozen_ ? frozen_->size() : map_->size();
+    }
+
     size_t bytes_allocated() {
         ensure_open();
-        return map_->bytes_allocated();
+        return frozen_ ? frozen_->bytes_allocated() : map_->bytes_allocated();
+    }
+
+    // fn(key, value) for every record, from n_workers threads that each scan their own part of
+    // the map without the GIL and only take it to call fn. until the scan returns, put, remove
+    // and close raise RuntimeError, whether called from fn or from another thread
+    void parallel_items(size_t n_workers, nb::callable fn) {
+        ensure_open();
+
+        // counted and checked with the GIL held
+        struct scan_guard {
+            size_t &scans;
+            explicit scan_guard(size_t &s) : scans(s) { ++scans; }
+            ~scan_guard() { --scans; }
+        } guard(scans_);
+
+        auto visit = [&fn](size_t, std::vector<diskhash::record_view> const &batch) {
+            nb::gil_scoped_acquire acquire;
+            for (auto const &rv : batch)
+                fn(nb::bytes(rv.key.data(), rv.key.size()), nb::bytes(rv.value.data(), rv.value.size()));
+        };
+
+        nb::gil_scoped_release release;
+        if (frozen_)
+            frozen_->parallel_scan(n_workers, visit);
+        else
+            map_->parallel_scan(n_workers, visit);
+    }
+
+    // lookups answered by the bucket filters, None if the map is opened without them
+    nb::object filter_stats() {
+        ensure_open();
+        auto stats = map_ ? map_->filter_stats() : std::nullopt;
+        if (!stats)
+            return nb::none();
+        nb::dict result;
+        result["lookups"] = stats->lookups;
+        result["negatives"] = stats->negatives;
+        result["false_positives"] = stats->false_positives;
+        result["false_positive_rate"] = stats->false_positive_rate();
+        return result;
     }
 
     void close() {
+        ensure_not_scanned();
         if (map_) {
             map_->close();
             map_.reset();
         }
+        if (frozen_) {
+            frozen_->close();
+            frozen_.reset();
+        }
     }
 
     PyDiskHash *enter() {
@@ -96,24 +155,63 @@ public:
         return map_.get();
     }
 
+    diskhash::frozen_hash_map *frozen_ptr() {
+        ensure_open();
+        return frozen_.get();
+    }
+
 private:
     std::unique_ptr<diskhash::hash_map<>> map_;
+    std::unique_ptr<diskhash::frozen_hash_map> frozen_;
     std::string path_;
     bool read_only_;
+    bool filters_;
+
+    // parallel_items() calls in progress, their workers hold pointers into the mappings
+    size_t scans_;
 
     void ensure_open() {
-        if (!map_)
+        if (!map_ && !frozen_)
             throw std::runtime_error("hash map is closed");
     }
 
+    void ensure_not_scanned() {
+        if (scans_ != 0)
+            throw std::runtime_error("hash map is being scanned by parallel_items");
+    }
+
+    std::optional<std::string_view> find(diskhash::hash_t h, std::string_view k) {
+        return frozen_ ? frozen_->find(h, k) : map_->find(h, k);
+    }
+
+    // a frozen copy (see diskhash_freeze) is only used while the map it was made from
+    // is unchanged or gone, otherwise the map itself is opened
+    void open_frozen() {
+        auto frozen = std::make_unique<diskhash::frozen_hash_map>(path_.c_str());
+
+        std::error_code ec;
+        if (std::filesystem::exists(path_ + "dat", ec)) {
+            auto map = std::make_unique<diskhash::hash_map<>>(path_.c_str(), true, false, false, filters_);
+            if (map->write_generation() != frozen->source_generation()) {
+                frozen->close();
+                map_ = std::move(map);
+                return;
+            }
+            map->close();
+        }
+
+        frozen_ = std::move(frozen);
+    }
+
     static std::string_view make_key(nb::bytes &b) {
         return std::string_view(b.c_str(), b.size());
     }
 };
 
+template<class Map>
 class PyDiskHashIterator {
 public:
-    PyDiskHashIterator(diskhash::hash_map<> *map):
+    PyDiskHashIterator(Map *map):
         it_(map->begin()), end_(map->end()) {}
 
     nb::tuple next()
@@ -127,15 +225,48 @@ public:
     }
 
 private:
-    diskhash::hash_map<>::const_iterator it_, end_;
+    typename Map::const_iterator it_, end_;
 };
 
+// converts a bucket of records at a time, so the map may be modified between next() calls
+class PyMapIterator {
+public:
+    PyMapIterator(diskhash::hash_map<> *map):
+        cursor_(map->scan()), position_(0) {}
+
+    nb::object next()
+    {
+        if (position_ == items_.size()) {
+            items_.clear();
+            position_ = 0;
+
+            if (!cursor_.next(batch_))
+                throw nb::stop_iteration();
+
+            for (auto const &rv : batch_)
+                items_.push_back(nb::make_tuple(nb::bytes(rv.key.data(), rv.key.size()),
+                                                nb::bytes(rv.value.data(), rv.value.size())));
+        }
+
+        return std::move(items_[position_++]);
+    }
+
+private:
+    diskhash::hash_map<>::cursor cursor_;
+    std::vector<diskhash::record_view> batch_;
+    std::vector<nb::object> items_;
+    size_t position_;
+};
+
+using PyFrozenIterator = PyDiskHashIterator<diskhash::frozen_hash_map>;
+
 } // anonymous namespace
 
 NB_MODULE(_diskhash, m) {
     nb::class_<PyDiskHash>(m, "DiskHash")
-        .def(nb::init<const std::string &, bool>(),
-             nb::arg("path"), nb::arg("read_only") = false)
+        .def(nb::init<const std::string &, bool, bool, bool, bool>(),
+             nb::arg("path"), nb::arg("read_only") = false, nb::arg("durable") = false,
+             nb::arg("checksums") = false, nb::arg("filters") = false)
         .def("get", &PyDiskHash::get_default,
              nb::arg("key"), nb::arg("default") = nb::none())
         .def("__getitem__", &PyDiskHash::get)
@@ -146,12 +277,22 @@ NB_MODULE(_diskhash, m) {
         .def("__enter__", &PyDiskHash::enter, nb::rv_policy::reference)
         .def("__exit__", [](PyDiskHash &self, nb::args) { self.exit(); })
         .def("close", &PyDiskHash::close)
+        .def("__len__", &PyDiskHash::size)
         .def("bytes_allocated", &PyDiskHash::bytes_allocated)
-        .def("__iter__", [](PyDiskHash &self) {
-            return PyDiskHashIterator(self.map_ptr());
+        .def("filter_stats", &PyDiskHash::filter_stats)
+        .def("parallel_items", &PyDiskHash::parallel_items,
+             nb::arg("n_workers"), nb::arg("fn"))
+        .def("__iter__", [](PyDiskHash &self) -> nb::object {
+            if (auto frozen = self.frozen_ptr())
+                return nb::cast(PyFrozenIterator(frozen));
+            return nb::cast(PyMapIterator(self.map_ptr()));
         });
 
-    nb::class_<PyDiskHashIterator>(m, "DiskHashIterator")
-        .def("__iter__", [](PyDiskHashIterator &self) -> PyDiskHashIterator & { return self; })
-        .def("__next__", &PyDiskHashIterator::next);
+    nb::class_<PyMapIterator>(m, "DiskHashIterator")
+        .def("__iter__", [](PyMapIterator &self) -> PyMapIterator & { return self; })
+        .def("__next__", &PyMapIterator::next);
+
+    nb::class_<PyFrozenIterator>(m, "FrozenDiskHashIterator")
+        .def("__iter__", [](PyFrozenIterator &self) -> PyFrozenIterator & { return self; })
+        .def("__next__", &PyFrozenIterator::next);
 }
@@ -0,0 +1,103 @@
+#include <stdexcept>
+#include <string>
+
+#include "bucket_filter.h"
+
+diskhash::bucket_filter::bucket_filter(const char *filename, bool read_only):
+	file_map_(filename, read_only, sizeof(layout_t) + FILTER_BYTES),
+	lookups_(0),
+	negatives_(0),
+	false_positives_(0)
+{
+	remap();
+
+	if(layout_->signature == 0 && !read_only)
+	{
+		layout_->signature = SIGNATURE;
+		layout_->clean = 0;
+	}
+	else if(layout_->signature != SIGNATURE)
+	{
+		file_map_.close();
+		throw std::runtime_error(std::string("invalid bucket filter signature in file ") + filename);
+	}
+}
+
+void diskhash::bucket_filter::remap()
+{
+	std::atomic_ref<layout_t *>(layout_).store((layout_t *) file_map_.start(), std::memory_order_release);
+	capacity_.store((file_map_.length() - sizeof(layout_t)) / FILTER_BYTES, std::memory_order_release);
+}
+
+void diskhash::bucket_filter::clear(size_t bucket_id)
+{
+	uint64_t *words = filter(layout_, bucket_id);
+
+	for(size_t i = 0; i < WORDS; i++)
+	{
+		std::atomic_ref<uint64_t>(words[i]).store(0, std::memory_order_relaxed);
+	}
+
+	if(bucket_id < stale_.size())
+	{
+		stale_[bucket_id] = 0;
+	}
+}
+
+void diskhash::bucket_filter::fill(size_t bucket_id)
+{
+	uint64_t *words = filter(layout_, bucket_id);
+
+	for(size_t i = 0; i < WORDS; i++)
+	{
+		std::atomic_ref<uint64_t>(words[i]).store(~uint64_t(0), std::memory_order_relaxed);
+	}
+}
+
+void diskhash::bucket_filter::reserve(size_t buckets_count)
+{
+	if(buckets_count > capacity_.load(std::memory_order_relaxed))
+	{
+		file_map_.resize(sizeof(layout_t) + (buckets_count * 11 / 10 + 1) * FILTER_BYTES);
+		remap();
+	}
+
+	stale_.resize(capacity_.load(std::memory_order_relaxed));
+}
+
+void diskhash::bucket_filter::refresh()
+{
+	if(file_map_.refresh())
+	{
+		remap();
+	}
+}
+
+void diskhash::bucket_filter::begin_updates()
+{
+	if(layout_->clean)
+	{
+		layout_->clean = 0;
+		file_map_.sync();
+	}
+}
+
+void diskhash::bucket_filter::end_updates(uint64_t generation)
+{
+	// filter bits must be on disk before the header that vouches for them
+	file_map_.sync();
+
+	layout_->generation = generation;
+	layout_->clean = 1;
+
+	file_map_.sync();
+}
+
+diskhash::filter_stats diskhash::bucket_filter::stats() const
+{
+	filter_stats result;
+	result.lookups = lookups_.load(std::memory_order_relaxed);
+	result.negatives = negatives_.load(std::memory_order_relaxed);
+	result.false_positives = false_positives_.load(std::memory_order_relaxed);
+	return result;
+}
@@ -0,0 +1,208 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <functional>
+#include <vector>
+
+#include "settings.h"
+#include "file_map.h"
+
+namespace diskhash {
+
+// lookups answered by a bucket_filter, see container::filter_stats()
+struct filter_stats {
+	uint64_t lookups = 0;
+
+	// lookups the filter rejected without touching the bucket chain
+	uint64_t negatives = 0;
+
+	// lookups the filter let through that found nothing
+	uint64_t false_positives = 0;
+
+	// fraction of lookups for missing keys the filter did not catch
+	double false_positive_rate() const {
+		uint64_t misses = negatives + false_positives;
+		return misses == 0 ? 0.0 : double(false_positives) / double(misses);
+	}
+};
+
+// Bloom filter of the record hashes of every bucket chain, indexed by the id of the chain
+// head and kept in a sidecar file. bits can only be set, so the filter of a chain keeps the
+// hashes of removed records, which only cost false positives, until enough of them have piled
+// up to clear and refill it, see remove().
+//
+// the file records whether it is in sync with the container and at which write generation
+// (see container::begin_write) it was closed, so that a filter that missed updates is never
+// trusted.
+class bucket_filter {
+public:
+	static const size_t FILTER_BITS = 2048;
+	static const size_t HASH_FUNCTIONS = 4;
+
+	// hashes of removed records a filter keeps before it is refilled. each sets at most
+	// HASH_FUNCTIONS bits, so together they set at most 1/16 of the filter
+	static const size_t STALE_HASHES = 32;
+
+	bucket_filter(const char *filename, bool read_only);
+
+	// false if no record with hash is in the chain starting at bucket_id. chains past the
+	// end of the mapping may contain anything
+	bool may_contain(size_t bucket_id, hash_t hash) const
+	{
+		const layout_t *layout = std::atomic_ref<layout_t *>(const_cast<layout_t *&>(layout_)).load(std::memory_order_acquire);
+
+		if(bucket_id >= capacity_.load(std::memory_order_acquire))
+		{
+			return true;
+		}
+
+		const uint64_t *words = filter(layout, bucket_id);
+		uint64_t bits = mix(hash);
+
+		for(size_t i = 0; i < HASH_FUNCTIONS; i++, bits >>= BIT_INDEX_BITS)
+		{
+			size_t bit = bits & (FILTER_BITS - 1);
+
+			if(!(std::atomic_ref<const uint64_t>(words[bit / 64]).load(std::memory_order_relaxed) & (uint64_t(1) << (bit % 64))))
+			{
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	void add(size_t bucket_id, hash_t hash)
+	{
+		uint64_t *words = filter(layout_, bucket_id);
+		uint64_t bits = mix(hash);
+
+		for(size_t i = 0; i < HASH_FUNCTIONS; i++, bits >>= BIT_INDEX_BITS)
+		{
+			size_t bit = bits & (FILTER_BITS - 1);
+			std::atomic_ref<uint64_t>(words[bit / 64]).fetch_or(uint64_t(1) << (bit % 64), std::memory_order_relaxed);
+		}
+	}
+
+	void clear(size_t bucket_id);
+
+	// count a record removed from the chain starting at bucket_id, true once the filter holds
+	// STALE_HASHES hashes of removed records and should be cleared and refilled. the counts
+	// are not kept in the file, so a reopened filter starts counting from zero
+	bool remove(size_t bucket_id)
+	{
+		return bucket_id >= stale_.size() || ++stale_[bucket_id] >= STALE_HASHES;
+	}
+
+	// let every hash through the filter of bucket_id
+	void fill(size_t bucket_id);
+
+	// make room for filters of buckets_count chains
+	void reserve(size_t buckets_count);
+
+	size_t capacity() const {
+		return capacity_.load(std::memory_order_relaxed);
+	}
+
+	// for read-only filters: map the file again if a writer in another process has grown it
+	void refresh();
+
+	// true if the filter was closed in sync with a container at write generation generation
+	bool current(uint64_t generation) const {
+		return layout_->clean && layout_->generation == generation;
+	}
+
+	// mark the filter as being modified, so that it is rebuilt if the process dies
+	void begin_updates();
+
+	// mark the filter as in sync with a container at write generation generation
+	void end_updates(uint64_t generation);
+
+	void count_lookup(bool rejected) const
+	{
+		lookups_.fetch_add(1, std::memory_order_relaxed);
+
+		if(rejected)
+		{
+			negatives_.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+
+	void count_false_positive() const
+	{
+		false_positives_.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	filter_stats stats() const;
+
+	size_t bytes_allocated() const {
+		return file_map_.length();
+	}
+
+	void set_retire_function(std::function<void(void *, size_t)> f) {
+		file_map_.set_retire_function(std::move(f));
+	}
+
+	void close() {
+		file_map_.close();
+		layout_ = 0;
+	}
+
+private:
+	static const unsigned SIGNATURE = 0x3b1f7e0d;
+	static const size_t WORDS = FILTER_BITS / 64;
+	static const size_t FILTER_BYTES = WORDS * sizeof(uint64_t);
+	static const size_t BIT_INDEX_BITS = 11;
+
+	static_assert(size_t(1) << BIT_INDEX_BITS == FILTER_BITS, "BIT_INDEX_BITS must match FILTER_BITS");
+	static_assert(HASH_FUNCTIONS * BIT_INDEX_BITS <= 64, "bit indices must fit into one mixed hash");
+
+	// the file header, followed by WORDS words of filter for every chain
+#pragma pack(push, 1)
+	struct layout_t {
+		unsigned signature;
+		unsigned clean;
+		uint64_t generation;
+	};
+#pragma pack(pop)
+
+	file_map file_map_;
+	layout_t *layout_;
+
+	// number of filters the current mapping can hold, published after layout_
+	std::atomic<size_t> capacity_;
+
+	// hashes of removed records in every filter, see remove(). grows in reserve(), which
+	// concurrent writers never call at the same time as remove() or clear()
+	std::vector<uint8_t> stale_;
+
+	mutable std::atomic<uint64_t> lookups_, negatives_, false_positives_;
+
+	static uint64_t *filter(layout_t *layout, size_t bucket_id)
+	{
+		return reinterpret_cast<uint64_t *>(reinterpret_cast<char *>(layout) + sizeof(layout_t)) + bucket_id * WORDS;
+	}
+
+	static const uint64_t *filter(const layout_t *layout, size_t bucket_id)
+	{
+		return reinterpret_cast<const uint64_t *>(reinterpret_cast<const char *>(layout) + sizeof(layout_t)) + bucket_id * WORDS;
+	}
+
+	static uint64_t mix(hash_t hash)
+	{
+		// murmur3 finalizer, hash_t may be narrower than the bits we need
+		uint64_t x = hash;
+		x ^= x >> 33;
+		x *= 0xff51afd7ed558ccdull;
+		x ^= x >> 33;
+		x *= 0xc4ceb9fe1a85ec53ull;
+		x ^= x >> 33;
+		return x;
+	}
+
+	void remap();
+};
+
+// namespace diskhash
+}
@@ -1,14 +1,15 @@
+#include <stddef.h>
 #include "catalogue.h"
 
 diskhash::catalogue::catalogue(const char *filename, size_t prefix_bits, bool read_only):
 	file_map_(filename, read_only, sizeof(layout_t))
 {
-	layout_ = (layout_t *) file_map_.start();
+	remap();
 
 	if(layout_->signature == 0)
 	{
 		file_map_.resize(sizeof(layout_t) + ((size_t(1) << prefix_bits) - 1) * sizeof(value_type));
-		layout_ = (layout_t *) file_map_.start();
+		remap();
 
 		layout_->signature = SIGNATURE;
 		layout_->prefix_bits = prefix_bits;
@@ -27,6 +28,12 @@ diskhash::catalogue::catalogue(const char *filename, size_t prefix_bits, bool re
 	}
 }
 
+void diskhash::catalogue::remap()
+{
+	std::atomic_ref<layout_t *>(layout_).store((layout_t *) file_map_.start(), std::memory_order_release);
+	capacity_.store((file_map_.length() - offsetof(layout_t, buffer)) / sizeof(value_type), std::memory_order_release);
+}
+
 void diskhash::catalogue::set(hash_t const &hash, size_t offset, value_type value)
 {
 	hash_t hash_copy = hash & ~((size_t(1) << (HASH_BITS - offset)) - 1);
@@ -50,7 +57,7 @@ void diskhash::catalogue::split()
 	layout_->buffer_size = (old_buffer_size << 1);
 
 	file_map_.resize(sizeof(layout_t) + (layout_->buffer_size - 1) * sizeof(value_type));
-	layout_ = (layout_t *) file_map_.start();
+	remap();
 
 	value_type *get = &layout_->buffer[old_buffer_size - 1];
 	value_type *put = &layout_->buffer[layout_->buffer_size - 1];
@@ -61,3 +68,18 @@ void diskhash::catalogue::split()
 		*put-- = *get--;
 	}
 }
+
+void diskhash::catalogue::journal_set(journal &j, size_t target, hash_t const &hash, size_t offset) const
+{
+	hash_t hash_copy = hash & ~((size_t(1) << (HASH_BITS - offset)) - 1);
+
+	const value_type *first = &layout_->buffer[size_t((hash_copy & layout_->prefix_mask) >> layout_->prefix_shift)];
+	size_t count = size_t(1) << (layout_->prefix_bits - offset);
+
+	j.save(target, (const unsigned char *) first - (const unsigned char *) layout_, first, count * sizeof(value_type));
+}
+
+void diskhash::catalogue::journal_split(journal &j, size_t target) const
+{
+	j.save(target, 0, layout_, sizeof(layout_t) + (layout_->buffer_size - 1) * sizeof(value_type));
+}
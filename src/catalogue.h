@@ -1,11 +1,14 @@
 #pragma once
 
 #include <limits.h>
+#include <atomic>
+#include <functional>
 #include <string>
 #include <stdexcept>
 
 #include "settings.h"
 #include "file_map.h"
+#include "journal.h"
 
 namespace diskhash {
 
@@ -30,9 +33,32 @@ public:
 		return layout_->buffer[size_t((hash & layout_->prefix_mask) >> layout_->prefix_shift)];
 	}
 
+	// find() for lock-free readers racing with a writer, see concurrent_hash_map. never reads
+	// outside the mapping, returns INVALID_BLOCK_ID if the directory looks mid-split
+	value_type find_speculative(hash_t const &hash) const
+	{
+		size_t capacity = capacity_.load(std::memory_order_acquire);
+		const layout_t *layout = std::atomic_ref<layout_t *>(const_cast<layout_t *&>(layout_)).load(std::memory_order_acquire);
+
+		size_t prefix_shift = layout->prefix_shift;
+		hash_t prefix_mask = layout->prefix_mask;
+
+		if(prefix_shift >= HASH_BITS)
+		{
+			return INVALID_BLOCK_ID;
+		}
+
+		size_t index = size_t((hash & prefix_mask) >> prefix_shift);
+		return index < capacity ? layout->buffer[index] : INVALID_BLOCK_ID;
+	}
+
 	void set(hash_t const &hash, size_t offset, value_type value);
 	void split();
 
+	// save images of everything set(hash, offset, ...) or split() modify into journal j
+	void journal_set(journal &j, size_t target, hash_t const &hash, size_t offset) const;
+	void journal_split(journal &j, size_t target) const;
+
 	iterator begin() {
 		return &layout_->buffer[0];
 	}
@@ -61,6 +87,34 @@ public:
 		return file_map_.length();
 	}
 
+	// for read-only catalogues: map the file again if a writer in another process has split
+	// the directory past the end of the mapping
+	void refresh()
+	{
+		if(layout_->buffer_size > capacity_.load(std::memory_order_relaxed) && file_map_.refresh())
+		{
+			remap();
+		}
+	}
+
+	// number of slots the mapping holds, lock-free readers must not look past it
+	size_t capacity() const
+	{
+		return capacity_.load(std::memory_order_acquire);
+	}
+
+	void sync() {
+		file_map_.sync();
+	}
+
+	void copy_to(char const *file_name) const {
+		file_map_.copy_to(file_name);
+	}
+
+	void set_retire_function(std::function<void(void *, size_t)> f) {
+		file_map_.set_retire_function(std::move(f));
+	}
+
 	void close() {
 		file_map_.close();
 		layout_ = 0;
@@ -81,6 +135,11 @@ private:
 
 	file_map file_map_;
 	layout_t *layout_;
+
+	// number of entries the current mapping can hold, published after layout_
+	std::atomic<size_t> capacity_;
+
+	void remap();
 };
 
 // namespace diskhash
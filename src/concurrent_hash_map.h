@@ -0,0 +1,456 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "hash_map.h"
+#include "epoch.h"
+
+namespace diskhash {
+
+// hash_map with lock-free readers and concurrent writers.
+//
+// writers hold the directory lock shared and lock the bucket chain they modify through a
+// table of striped mutexes keyed by the chain head, new buckets are allocated lock-free (see
+// container::set_concurrent). only splits and growing the file take the directory lock
+// exclusively, so writers to different chains proceed in parallel. splits lock the chain
+// they split as well, for with_value().
+//
+// readers write no shared memory but the bits of buckets whose checksums they verified on
+// first access, see container::probe_view. they follow the catalogue and bucket chains
+// speculatively and validate what they read with seqlocks, retrying if a writer interfered.
+// a generation counter covers structural changes (bucket and catalogue splits), a table of
+// striped counters covers record changes inside one bucket chain, keyed by the chain head.
+// mappings that a resize moves are not unmapped until every reader that might use them has
+// left its epoch::guard.
+template<size_t BucketSize = DEFAULT_BUCKET_SIZE>
+class concurrent_hash_map {
+public:
+	concurrent_hash_map(const char *filename, bool read_only = false, bool durable = false, bool checksums = false,
+		bool filters = false):
+		map_(filename, read_only, durable, checksums, filters),
+		chain_mutexes_(new std::mutex[STRIPES]),
+		generation_(0),
+		stripes_(new std::atomic<uint64_t>[STRIPES])
+	{
+		for(size_t i = 0; i < STRIPES; i++)
+		{
+			stripes_[i].store(0, std::memory_order_relaxed);
+		}
+
+		map_.set_retire_function([](void *start, size_t length) {
+			epoch::retire([start, length]() { file_map::unmap(start, length); });
+		});
+
+		if(!read_only)
+		{
+			map_.set_concurrent();
+		}
+	}
+
+	// lock-free, copies the value of (hash, key) into value, returns false if not found
+	bool find(hash_t hash, std::string_view key, std::string &value) const
+	{
+		epoch::guard guard;
+		return find_pinned(hash, key, value);
+	}
+
+	// lock-free, find for every record of keys under one epoch pin. found[i] tells whether
+	// values[i] holds the value of keys[i], the values of keys not found are left empty
+	void find_many(std::vector<record_view> const &keys, std::vector<std::string> &values,
+		std::vector<bool> &found) const
+	{
+		values.assign(keys.size(), std::string());
+		found.assign(keys.size(), false);
+
+		epoch::guard guard;
+		for(size_t i = 0; i < keys.size(); i++)
+		{
+			found[i] = find_pinned(keys[i].hash, keys[i].key, values[i]);
+		}
+	}
+
+	// call f(std::string_view) with the value of (hash, key) where it is stored in the mapping,
+	// return false without calling f if not found. only the mutex of the value's chain is held
+	// while f runs, which keeps the writers of the chain and a split of it off, so f must be
+	// short and must not modify the map. other chains and file growth are not held up, a
+	// mapping that growth moves stays valid until f returns
+	template<class F>
+	bool with_value(hash_t hash, std::string_view key, F &&f)
+	{
+		epoch::guard guard;
+
+		for(unsigned attempt = 0; ; attempt++)
+		{
+			if(attempt != 0)
+			{
+				backoff(attempt);
+			}
+
+			uint64_t generation = generation_.load(std::memory_order_acquire);
+			if(generation & 1)
+			{
+				continue;
+			}
+
+			size_t bucket_id = map_.find_bucket_speculative(hash);
+			if(bucket_id == catalogue::INVALID_BLOCK_ID)
+			{
+				std::atomic_thread_fence(std::memory_order_acquire);
+
+				if(generation_.load(std::memory_order_relaxed) == generation)
+				{
+					throw std::runtime_error("diskhash: corrupted catalogue");
+				}
+				continue;
+			}
+
+			std::lock_guard chain(chain_mutexes_[bucket_id % STRIPES]);
+
+			// a split locks the chain it splits before it starts, so one of this chain has
+			// either finished and moved the generation or waits for f
+			if(generation_.load(std::memory_order_acquire) != generation)
+			{
+				continue;
+			}
+
+			std::string_view value;
+			size_t corrupted_bucket_id = bucket_id;
+
+			switch(map_.probe(bucket_id, hash, key, value, &corrupted_bucket_id))
+			{
+			case PROBE_FOUND:
+				f(value);
+				return true;
+			case PROBE_NOT_FOUND:
+				return false;
+			default:
+				// no writer can be changing the chain
+				throw checksum_error(corrupted_bucket_id);
+			}
+		}
+	}
+
+	// insert (hash, key, value) unless key is present, return false if it was. if lock_wait
+	// is given, the time spent blocked on locks is added to it
+	bool insert(hash_t hash, std::string_view key, std::string_view value,
+		std::chrono::nanoseconds *lock_wait = nullptr)
+	{
+		{
+			std::shared_lock directory(directory_mutex_, std::defer_lock);
+			acquire(directory, lock_wait);
+
+			size_t bucket_id = map_.find_bucket(hash);
+			std::unique_lock chain(chain_mutexes_[bucket_id % STRIPES], std::defer_lock);
+			acquire(chain, lock_wait);
+
+			if(map_.find(hash, key))
+			{
+				return false;
+			}
+
+			if(!map_.may_split(hash))
+			{
+				try
+				{
+					write_section section(*this, false, bucket_id);
+					map_.get(hash, key, value);
+					return true;
+				}
+				catch(bucket_allocation_error const &)
+				{
+					// nothing has been written, grow the file below
+				}
+			}
+		}
+
+		std::unique_lock directory(directory_mutex_, std::defer_lock);
+		acquire(directory, lock_wait);
+
+		if(map_.find(hash, key))
+		{
+			return false;
+		}
+
+		// a split rewrites the chain into at most twice as many buckets, plus one for the record
+		map_.reserve(2 * map_.chain_length(hash) + 1);
+
+		// with_value() holds the chain mutex without the directory lock
+		size_t bucket_id = map_.find_bucket(hash);
+		std::unique_lock chain(chain_mutexes_[bucket_id % STRIPES], std::defer_lock);
+		acquire(chain, lock_wait);
+
+		write_section section(*this, map_.may_split(hash), bucket_id);
+		map_.get(hash, key, value);
+
+		return true;
+	}
+
+	// insert every record whose key is not present, in order, taking the directory lock once
+	// for all records that fit without a split. inserted[i] tells whether records[i] was, so
+	// of records with the same key only the first is
+	void insert_many(std::vector<record_view> const &records, std::vector<bool> &inserted,
+		std::chrono::nanoseconds *lock_wait = nullptr)
+	{
+		inserted.assign(records.size(), false);
+
+		for(size_t i = 0; i < records.size(); )
+		{
+			{
+				std::shared_lock directory(directory_mutex_, std::defer_lock);
+				acquire(directory, lock_wait);
+
+				for(; i < records.size(); i++)
+				{
+					record_view const &r = records[i];
+
+					size_t bucket_id = map_.find_bucket(r.hash);
+					std::unique_lock chain(chain_mutexes_[bucket_id % STRIPES], std::defer_lock);
+					acquire(chain, lock_wait);
+
+					if(map_.find(r.hash, r.key))
+					{
+						continue;
+					}
+
+					if(map_.may_split(r.hash))
+					{
+						break;
+					}
+
+					try
+					{
+						write_section section(*this, false, bucket_id);
+						map_.get(r.hash, r.key, r.value);
+						inserted[i] = true;
+					}
+					catch(bucket_allocation_error const &)
+					{
+						break;
+					}
+				}
+			}
+
+			// needs a split or a larger file, which take the directory lock exclusively
+			if(i < records.size())
+			{
+				inserted[i] = insert(records[i].hash, records[i].key, records[i].value, lock_wait);
+				i++;
+			}
+		}
+	}
+
+	bool remove(hash_t hash, std::string_view key, std::chrono::nanoseconds *lock_wait = nullptr)
+	{
+		std::shared_lock directory(directory_mutex_, std::defer_lock);
+		acquire(directory, lock_wait);
+
+		size_t bucket_id = map_.find_bucket(hash);
+		std::unique_lock chain(chain_mutexes_[bucket_id % STRIPES], std::defer_lock);
+		acquire(chain, lock_wait);
+
+		write_section section(*this, false, bucket_id);
+		return map_.remove(hash, key);
+	}
+
+	// run f(hash_map &) with writers excluded, for iteration and maintenance. lock-free
+	// readers keep running, so f must not modify the map
+	template<class F>
+	auto exclusive(F &&f)
+	{
+		std::unique_lock directory(directory_mutex_);
+		return f(static_cast<hash_map<BucketSize> const &>(map_));
+	}
+
+	// see hash_map::snapshot(), writers wait until the copy is done, lock-free readers do not
+	void snapshot(const char *filename)
+	{
+		exclusive([&](hash_map<BucketSize> const &map) { map.snapshot(filename); });
+	}
+
+	// see container::verify_bucket. checked alongside the writers of its chain, so that a
+	// scrub does not hold them up, and checked again with writers excluded if it fails, in case
+	// a writer was changing the bucket
+	bool verify_bucket(size_t bucket_id)
+	{
+		{
+			std::shared_lock directory(directory_mutex_);
+			if(map_.verify_bucket(bucket_id))
+			{
+				return true;
+			}
+		}
+
+		return exclusive([bucket_id](hash_map<BucketSize> const &map) { return map.verify_bucket(bucket_id); });
+	}
+
+	// lock-free, see container::usage()
+	usage_stats usage() const
+	{
+		epoch::guard guard;
+		return map_.usage();
+	}
+
+	size_t size() const
+	{
+		return usage().records;
+	}
+
+	// lock-free like usage(), reads only the lengths of the files, which writers may be growing
+	size_t bytes_allocated() const
+	{
+		return map_.bytes_allocated();
+	}
+
+	// the counters are updated by readers without synchronization, so they are approximate
+	std::optional<diskhash::filter_stats> filter_stats() const
+	{
+		return map_.filter_stats();
+	}
+
+	// no reader may be running or start while the map is closed
+	void close()
+	{
+		std::unique_lock directory(directory_mutex_);
+		map_.close();
+		epoch::synchronize();
+	}
+
+private:
+	static const size_t STRIPES = 1024;
+
+	hash_map<BucketSize> map_;
+
+	// find within the caller's epoch::guard. a lookup that cannot be trusted although no
+	// writer interfered read corrupted data, which throws checksum_error rather than retrying
+	// forever and holding up epoch::synchronize()
+	bool find_pinned(hash_t hash, std::string_view key, std::string &value) const
+	{
+		for(unsigned attempt = 0; ; attempt++)
+		{
+			if(attempt != 0)
+			{
+				backoff(attempt);
+			}
+
+			uint64_t generation = generation_.load(std::memory_order_acquire);
+			if(generation & 1)
+			{
+				continue;
+			}
+
+			size_t bucket_id = map_.find_bucket_speculative(hash);
+			if(bucket_id == catalogue::INVALID_BLOCK_ID)
+			{
+				std::atomic_thread_fence(std::memory_order_acquire);
+
+				if(generation_.load(std::memory_order_relaxed) == generation)
+				{
+					throw std::runtime_error("diskhash: corrupted catalogue");
+				}
+				continue;
+			}
+
+			std::atomic<uint64_t> &stripe = stripes_[bucket_id % STRIPES];
+			uint64_t version = stripe.load(std::memory_order_acquire);
+			if(version & 1)
+			{
+				continue;
+			}
+
+			size_t corrupted_bucket_id = bucket_id;
+			probe_result result = map_.probe(bucket_id, hash, key, value, &corrupted_bucket_id);
+
+			std::atomic_thread_fence(std::memory_order_acquire);
+
+			if(stripe.load(std::memory_order_relaxed) != version
+				|| generation_.load(std::memory_order_relaxed) != generation)
+			{
+				continue;
+			}
+
+			switch(result)
+			{
+			case PROBE_FOUND:
+				return true;
+			case PROBE_NOT_FOUND:
+				return false;
+			default:
+				// nothing was being written, so what probe() saw is really there
+				throw checksum_error(corrupted_bucket_id);
+			}
+		}
+	}
+
+	// held shared by writers, exclusively by splits and file growth
+	std::shared_mutex directory_mutex_;
+
+	// serialize writers of chains whose head maps to the same stripe
+	std::unique_ptr<std::mutex[]> chain_mutexes_;
+
+	// odd while a split is in progress
+	std::atomic<uint64_t> generation_;
+
+	// odd while records of a chain whose head maps to the stripe are changing, only modified
+	// under the matching chain mutex or with the directory lock held exclusively
+	std::unique_ptr<std::atomic<uint64_t>[]> stripes_;
+
+	// makes the generation or the stripe of bucket_id odd for its lifetime
+	class write_section {
+	public:
+		write_section(concurrent_hash_map &map, bool structural, size_t bucket_id):
+			counter_(structural ? map.generation_ : map.stripes_[bucket_id % STRIPES])
+		{
+			counter_.store(counter_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_release);
+		}
+
+		~write_section()
+		{
+			counter_.store(counter_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+			epoch::reclaim();
+		}
+
+	private:
+		std::atomic<uint64_t> &counter_;
+	};
+
+	// lock, timing only locks that are contended
+	template<class Lock>
+	static void acquire(Lock &lock, std::chrono::nanoseconds *wait)
+	{
+		if(!wait)
+		{
+			lock.lock();
+			return;
+		}
+
+		if(lock.try_lock())
+		{
+			return;
+		}
+
+		auto start = std::chrono::steady_clock::now();
+		lock.lock();
+		*wait += std::chrono::steady_clock::now() - start;
+	}
+
+	static void backoff(unsigned attempt)
+	{
+		if(attempt > 64)
+		{
+			std::this_thread::yield();
+		}
+	}
+};
+
+// namespace diskhash
+}
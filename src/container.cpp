@@ -1,21 +1,61 @@
 #include <assert.h>
+#include <stddef.h>
+#include <algorithm>
 #include "container.h"
+#include "crc32c.h"
 #include "vbe.h"
 
 template<size_t BucketSize>
-diskhash::container<BucketSize>::container(const char *filename, bool read_only):
-	file_map_(filename, read_only, sizeof(layout_t))
+diskhash::container<BucketSize>::container(const char *filename, bool read_only, bool checksums):
+	file_map_(filename, read_only, sizeof(layout_t) + sizeof(extension_t)),
+	legacy_extension_(),
+	concurrent_(false),
+	filter_read_only_(true)
 {
-	layout_ = (layout_t *) file_map_.start();
+	unsigned signature = ((const layout_t *) file_map_.start())->signature;
 
-	if(layout_->signature == 0)
+	if(signature != 0 && signature != SIGNATURE && signature != LEGACY_SIGNATURE)
+	{
+		throw std::runtime_error(std::string("invalid hash container signature in file ") + filename);
+	}
+
+	bool legacy = signature == LEGACY_SIGNATURE;
+	extension_ = legacy ? &legacy_extension_ : nullptr;
+	header_size_ = sizeof(layout_t) + (legacy ? 0 : sizeof(extension_t));
+
+	remap();
+
+	if(signature == 0)
 	{
 		layout_->signature = SIGNATURE;
 		layout_->first_free_bucket_id = INVALID_BUCKET_ID;
+		extension_->flags = checksums ? CHECKSUMS_FLAG : 0;
 	}
-	else if(layout_->signature != SIGNATURE)
+
+	checksums_ = extension_->flags & CHECKSUMS_FLAG;
+	bucket_capacity_ = BUCKET_SIZE - (checksums_ ? CHECKSUM_BYTES : 0);
+
+	if(checksums_)
 	{
-		throw std::runtime_error(std::string("invalid hash container signature in file ") + filename);
+		verified_ = std::make_unique<bucket_bitmap>();
+	}
+
+	if(legacy)
+	{
+		recount();
+	}
+}
+
+template<size_t BucketSize>
+diskhash::container<BucketSize>::~container()
+{
+	try
+	{
+		close_filter();
+	}
+	catch(std::exception const &)
+	{
+		// the filter stays marked out of date and is rebuilt on the next open
 	}
 }
 
@@ -24,14 +64,20 @@ size_t diskhash::container<BucketSize>::create_bucket(size_t prefix_bits)
 {
 	size_t bucket_id;
 
-	if(layout_->first_free_bucket_id == INVALID_BUCKET_ID)
+	if(concurrent_)
 	{
-		size_t bytes_needed = layout_->buckets_count * sizeof(bucket_t) + sizeof(layout_t);
-
-		if(bytes_needed > file_map_.length())
+		bucket_id = allocate_bucket();
+	}
+	else if(layout_->first_free_bucket_id == INVALID_BUCKET_ID)
+	{
+		if(layout_->buckets_count + 1 > capacity_.load(std::memory_order_relaxed))
 		{
-			file_map_.resize((bytes_needed * 11) / 10);
-			layout_ = (layout_t *) file_map_.start();
+			grow(layout_->buckets_count + 1);
+
+			if(filter_)
+			{
+				filter_->reserve(capacity_.load(std::memory_order_relaxed));
+			}
 		}
 
 		bucket_id = layout_->buckets_count++;
@@ -39,41 +85,264 @@ size_t diskhash::container<BucketSize>::create_bucket(size_t prefix_bits)
 	else
 	{
 		bucket_id = layout_->first_free_bucket_id;
-		layout_->first_free_bucket_id = layout_->buckets[bucket_id].next_bucket_id;
+		layout_->first_free_bucket_id = buckets_[bucket_id].next_bucket_id;
+		sub_counter(extension_->free_buckets_count, 1);
 	}
 
-	bucket_t *bucket_ptr = &layout_->buckets[bucket_id];
+	bucket_t *bucket_ptr = &buckets_[bucket_id];
 	bucket_ptr->prefix_bits = prefix_bits;
 	bucket_ptr->bytes_used = 0;
 	bucket_ptr->next_bucket_id = INVALID_BUCKET_ID;
 
+	if(checksums_)
+	{
+		store_checksum(bucket_ptr, 0);
+		set_verified(bucket_id);
+	}
+
+	if(filter_)
+	{
+		filter_->clear(bucket_id);
+	}
+
 	return bucket_id;
 }
 
+template<size_t BucketSize>
+size_t diskhash::container<BucketSize>::allocate_bucket()
+{
+	// buckets are only pushed onto the free list by split(), which never runs concurrently
+	// with create_bucket, so popping with compare-and-swap cannot suffer from ABA
+	std::atomic_ref<size_t> first_free_bucket_id(layout_->first_free_bucket_id);
+	size_t bucket_id = first_free_bucket_id.load(std::memory_order_acquire);
+
+	while(bucket_id != INVALID_BUCKET_ID && !first_free_bucket_id.compare_exchange_weak(bucket_id,
+		buckets_[bucket_id].next_bucket_id, std::memory_order_acquire))
+	{
+	}
+
+	if(bucket_id != INVALID_BUCKET_ID)
+	{
+		sub_counter(extension_->free_buckets_count, 1);
+		return bucket_id;
+	}
+
+	std::atomic_ref<size_t> buckets_count(layout_->buckets_count);
+	bucket_id = buckets_count.load(std::memory_order_relaxed);
+
+	do
+	{
+		if(bucket_id >= capacity_.load(std::memory_order_relaxed))
+		{
+			throw bucket_allocation_error();
+		}
+	}
+	while(!buckets_count.compare_exchange_weak(bucket_id, bucket_id + 1, std::memory_order_relaxed));
+
+	return bucket_id;
+}
+
+template<size_t BucketSize>
+void diskhash::container<BucketSize>::set_concurrent()
+{
+	concurrent_ = true;
+	reserve(0);
+}
+
+template<size_t BucketSize>
+void diskhash::container<BucketSize>::reserve(size_t count)
+{
+	if(layout_->buckets_count + count + 1 > capacity_.load(std::memory_order_relaxed))
+	{
+		grow(layout_->buckets_count + count + 1);
+	}
+
+	if(filter_)
+	{
+		// concurrent create_bucket calls clear the filter of their bucket
+		filter_->reserve(capacity_.load(std::memory_order_relaxed));
+	}
+}
+
+template<size_t BucketSize>
+size_t diskhash::container<BucketSize>::chain_length(size_t bucket_id) const
+{
+	size_t length = 0;
+
+	for(size_t id = bucket_id; id != INVALID_BUCKET_ID; id = buckets_[id].next_bucket_id)
+	{
+		length++;
+	}
+
+	return length;
+}
+
+template<size_t BucketSize>
+void diskhash::container<BucketSize>::open_filter(const char *filename, bool read_only)
+{
+	filter_ = std::make_unique<bucket_filter>(filename, read_only);
+	filter_read_only_ = read_only;
+
+	// the write generation of a 1.0 file restarts with every open and diskhash 1.0 may have
+	// written it since, so its filter is never taken to be in sync
+	bool current = !legacy() && filter_->current(write_generation());
+
+	if(read_only)
+	{
+		if(!current)
+		{
+			filter_.reset();
+		}
+
+		return;
+	}
+
+	filter_->begin_updates();
+	filter_->reserve(capacity_.load(std::memory_order_relaxed));
+
+	if(!current)
+	{
+		rebuild_filters();
+	}
+}
+
+template<size_t BucketSize>
+void diskhash::container<BucketSize>::rebuild_filter(size_t bucket_id)
+{
+	filter_->clear(bucket_id);
+
+	for(size_t id = bucket_id; id != INVALID_BUCKET_ID; id = buckets_[id].next_bucket_id)
+	{
+		record_view rv;
+
+		for(size_t offset = 0; read_record(id, offset, rv); )
+		{
+			filter_->add(bucket_id, rv.hash);
+		}
+	}
+}
+
+template<size_t BucketSize>
+void diskhash::container<BucketSize>::rebuild_filters()
+{
+	size_t buckets_count = layout_->buckets_count;
+
+	// chain heads are the buckets neither on the free list nor linked from another bucket,
+	// corrupted links are not followed
+	std::vector<bool> is_head(buckets_count, true), corrupted(buckets_count, false);
+
+	for(size_t bucket_id = 0; bucket_id < buckets_count; bucket_id++)
+	{
+		corrupted[bucket_id] = !verify_bucket(bucket_id);
+	}
+
+	for(size_t bucket_id = layout_->first_free_bucket_id, steps = 0; bucket_id < buckets_count
+		&& steps < buckets_count && !corrupted[bucket_id]; bucket_id = buckets_[bucket_id].next_bucket_id, steps++)
+	{
+		is_head[bucket_id] = false;
+	}
+
+	for(size_t bucket_id = 0; bucket_id < buckets_count; bucket_id++)
+	{
+		size_t next_bucket_id = buckets_[bucket_id].next_bucket_id;
+
+		if(!corrupted[bucket_id] && next_bucket_id != INVALID_BUCKET_ID)
+		{
+			is_head[next_bucket_id] = false;
+		}
+	}
+
+	for(size_t bucket_id = 0; bucket_id < buckets_count; bucket_id++)
+	{
+		filter_->clear(bucket_id);
+
+		if(!is_head[bucket_id])
+		{
+			continue;
+		}
+
+		size_t chain_length = 0;
+		size_t id = bucket_id;
+
+		for(; id != INVALID_BUCKET_ID && !corrupted[id] && chain_length++ < buckets_count;
+			id = buckets_[id].next_bucket_id)
+		{
+			// verified above, so records can be parsed without read_record() checking again
+			const bucket_t *bucket_ptr = &buckets_[id];
+			const unsigned char *cursor = bucket_ptr->data;
+			const unsigned char *end = bucket_ptr->data + bucket_ptr->bytes_used;
+
+			while(cursor != end)
+			{
+				hash_t hash;
+				size_t key_length, value_length;
+
+				std::copy(cursor, cursor + sizeof(hash_t), (unsigned char *) &hash);
+				cursor = vbe::read(cursor + sizeof(hash_t), end, key_length);
+				cursor = vbe::read(cursor, end, value_length);
+				cursor += key_length + value_length;
+
+				filter_->add(bucket_id, hash);
+			}
+		}
+
+		if(id != INVALID_BUCKET_ID)
+		{
+			// lookups have to reach the corrupted bucket to report it
+			filter_->fill(bucket_id);
+		}
+	}
+}
+
+template<size_t BucketSize>
+void diskhash::container<BucketSize>::close_filter()
+{
+	if(!filter_)
+	{
+		return;
+	}
+
+	if(!filter_read_only_)
+	{
+		filter_->end_updates(write_generation());
+	}
+
+	filter_->close();
+	filter_.reset();
+}
+
 template<size_t BucketSize>
 std::string_view diskhash::container<BucketSize>::create_record(size_t bucket_id, hash_t const &hash, std::string_view key,
 	std::string_view value)
 {
-	bucket_t *bucket_ptr = &layout_->buckets[bucket_id];
+	touch(bucket_id);
+
+	if(filter_)
+	{
+		filter_->add(bucket_id, hash);
+	}
+
+	bucket_t *bucket_ptr = &buckets_[bucket_id];
 
 	size_t bytes_required = sizeof(hash_t) + vbe::length(key.size()) + key.size()
 		+ vbe::length(value.size()) + value.size();
 
-	while(bucket_ptr->bytes_used + bytes_required > BUCKET_SIZE)
+	while(bucket_ptr->bytes_used + bytes_required > bucket_capacity_)
 	{
 		if(bucket_ptr->next_bucket_id == INVALID_BUCKET_ID)
 		{
 			size_t new_bucket_id = create_bucket(bucket_ptr->prefix_bits);
 
-			layout_->buckets[bucket_id].next_bucket_id = new_bucket_id;
+			buckets_[bucket_id].next_bucket_id = new_bucket_id;
 
 			bucket_id = new_bucket_id;
-			bucket_ptr = &layout_->buckets[bucket_id];
+			bucket_ptr = &buckets_[bucket_id];
 		}
 		else
 		{
 			bucket_id = bucket_ptr->next_bucket_id;
-			bucket_ptr = &layout_->buckets[bucket_ptr->next_bucket_id];
+			touch(bucket_id);
+			bucket_ptr = &buckets_[bucket_id];
 		}
 	}
 
@@ -87,8 +356,17 @@ std::string_view diskhash::container<BucketSize>::create_record(size_t bucket_id
 	cursor = std::copy(key_bytes, key_bytes + key.size(), cursor);
 	std::copy(value_bytes, value_bytes + value.size(), cursor);
 
+	if(checksums_)
+	{
+		store_checksum(bucket_ptr, crc32c(load_checksum(bucket_ptr), bucket_ptr->data + bucket_ptr->bytes_used, bytes_required));
+	}
+
 	bucket_ptr->bytes_used += bytes_required;
 
+	add_counter(extension_->records_count, 1);
+	add_counter(extension_->key_bytes, key.size());
+	add_counter(extension_->value_bytes, value.size());
+
 	return std::string_view(reinterpret_cast<const char *>(cursor), value.size());
 }
 
@@ -99,7 +377,9 @@ std::optional<std::string_view> diskhash::container<BucketSize>::find_value(size
 
 	while(bucket_id != INVALID_BUCKET_ID)
 	{
-		bucket_t *bucket_ptr = &layout_->buckets[bucket_id];
+		touch(bucket_id);
+
+		bucket_t *bucket_ptr = &buckets_[bucket_id];
 
 		unsigned char *cursor = bucket_ptr->data;
 
@@ -132,7 +412,116 @@ std::optional<std::string_view> diskhash::container<BucketSize>::find_value(size
 template<size_t BucketSize>
 std::optional<std::string_view> diskhash::container<BucketSize>::find_record(size_t bucket_id, const hash_t &hash, std::string_view key) const
 {
-	return find_value(bucket_id, hash, key);
+	if(!filter_)
+	{
+		return find_value(bucket_id, hash, key);
+	}
+
+	bool rejected = !filter_->may_contain(bucket_id, hash);
+	filter_->count_lookup(rejected);
+
+	if(rejected)
+	{
+		return std::nullopt;
+	}
+
+	auto result = find_value(bucket_id, hash, key);
+
+	if(!result)
+	{
+		filter_->count_false_positive();
+	}
+
+	return result;
+}
+
+template<size_t BucketSize>
+diskhash::probe_result diskhash::container<BucketSize>::probe_record(size_t bucket_id, const hash_t &hash,
+	std::string_view key, std::string &value, size_t *corrupted_bucket_id) const
+{
+	std::string_view view;
+	probe_result result = probe_view(bucket_id, hash, key, view, corrupted_bucket_id);
+
+	if(result == PROBE_FOUND)
+	{
+		value.assign(view);
+	}
+
+	return result;
+}
+
+template<size_t BucketSize>
+diskhash::probe_result diskhash::container<BucketSize>::probe_view(size_t bucket_id, const hash_t &hash,
+	std::string_view key, std::string_view &value, size_t *corrupted_bucket_id) const
+{
+	size_t capacity = capacity_.load(std::memory_order_acquire);
+	const bucket_t *buckets = load_buckets();
+
+	if(filter_)
+	{
+		bool rejected = !filter_->may_contain(bucket_id, hash);
+		filter_->count_lookup(rejected);
+
+		if(rejected)
+		{
+			return PROBE_NOT_FOUND;
+		}
+	}
+
+	for(size_t steps = 0; bucket_id != INVALID_BUCKET_ID; steps++)
+	{
+		if(bucket_id >= capacity || steps > capacity)
+		{
+			return PROBE_RETRY;
+		}
+
+		const bucket_t *bucket_ptr = &buckets[bucket_id];
+
+		size_t bytes_used = bucket_ptr->bytes_used;
+		if(bytes_used > bucket_capacity_)
+		{
+			return PROBE_RETRY;
+		}
+
+		if(corrupted_bucket_id && checksums_ && !verified(bucket_id))
+		{
+			if(!verify_bucket(bucket_id))
+			{
+				*corrupted_bucket_id = bucket_id;
+				return PROBE_CORRUPTED;
+			}
+
+			set_verified(bucket_id);
+		}
+
+		const unsigned char *cursor = bucket_ptr->data;
+		const unsigned char *end = bucket_ptr->data + bytes_used;
+
+		while(cursor != end)
+		{
+			record_view rv;
+
+			if(!parse_record(cursor, end, rv))
+			{
+				return PROBE_RETRY;
+			}
+
+			if(rv.hash == hash && rv.key == key)
+			{
+				value = rv.value;
+				return PROBE_FOUND;
+			}
+		}
+
+		bucket_id = bucket_ptr->next_bucket_id;
+	}
+
+	if(filter_)
+	{
+		filter_->count_false_positive();
+	}
+
+	return PROBE_NOT_FOUND;
 }
 
 template<size_t BucketSize>
@@ -140,9 +529,18 @@ bool diskhash::container<BucketSize>::remove_record(size_t bucket_id, const hash
 {
 	const unsigned char *key_bytes = reinterpret_cast<const unsigned char *>(key.data());
 
+	if(filter_ && !filter_->may_contain(bucket_id, hash))
+	{
+		return false;
+	}
+
+	size_t head_bucket_id = bucket_id;
+
 	while(bucket_id != INVALID_BUCKET_ID)
 	{
-		bucket_t *bucket_ptr = &layout_->buckets[bucket_id];
+		touch(bucket_id);
+
+		bucket_t *bucket_ptr = &buckets_[bucket_id];
 
 		unsigned char *cursor = bucket_ptr->data;
 
@@ -165,6 +563,18 @@ bool diskhash::container<BucketSize>::remove_record(size_t bucket_id, const hash
 				unsigned char *bucket_end = bucket_ptr->data + bucket_ptr->bytes_used;
 				std::copy(record_end, bucket_end, record_start);
 				bucket_ptr->bytes_used -= record_length;
+				update_checksum(bucket_id);
+
+				sub_counter(extension_->records_count, 1);
+				sub_counter(extension_->key_bytes, key_length);
+				sub_counter(extension_->value_bytes, value_length);
+
+				if(filter_ && filter_->remove(head_bucket_id))
+				{
+					// bloom filters cannot forget a hash, other records may share its bits
+					rebuild_filter(head_bucket_id);
+				}
+
 				return true;
 			}
 
@@ -183,7 +593,12 @@ bool diskhash::container<BucketSize>::remove_record(size_t bucket_id, const hash
 template<size_t BucketSize>
 size_t diskhash::container<BucketSize>::split(size_t bucket_id)
 {
-	size_t prefix_bits = ++layout_->buckets[bucket_id].prefix_bits;
+	for(size_t id = bucket_id; id != INVALID_BUCKET_ID; id = buckets_[id].next_bucket_id)
+	{
+		touch(id);
+	}
+
+	size_t prefix_bits = ++buckets_[bucket_id].prefix_bits;
 
 	size_t bit0_bucket_id = bucket_id;
 	size_t bit1_bucket_id = create_bucket(prefix_bits);
@@ -192,16 +607,25 @@ size_t diskhash::container<BucketSize>::split(size_t bucket_id)
 
 	hash_t new_bit = hash_t(1) << (HASH_BITS - prefix_bits);
 
-	bucket_t *bit0_bucket_ptr = &layout_->buckets[bit0_bucket_id];
-	bucket_t *bit1_bucket_ptr = &layout_->buckets[bit1_bucket_id];
+	// the filters of both halves are filled as their records are moved, create_bucket() has
+	// cleared that of the new one
+	if(filter_)
+	{
+		filter_->clear(bucket_id);
+	}
+
+	bucket_t *bit0_bucket_ptr = &buckets_[bit0_bucket_id];
+	bucket_t *bit1_bucket_ptr = &buckets_[bit1_bucket_id];
+
+	size_t bytes_moved = 0;
 
 	unsigned char *bit0_bucket_put = bit0_bucket_ptr->data;
 	unsigned char *bit1_bucket_put = bit1_bucket_ptr->data;
 
 	for(size_t get_bucket_id = bucket_id; get_bucket_id != INVALID_BUCKET_ID;
-		get_bucket_id = layout_->buckets[get_bucket_id].next_bucket_id)
+		get_bucket_id = buckets_[get_bucket_id].next_bucket_id)
 	{
-		bucket_t *get_bucket_ptr = &layout_->buckets[get_bucket_id];
+		bucket_t *get_bucket_ptr = &buckets_[get_bucket_id];
 		unsigned char *get_ptr = get_bucket_ptr->data;
 
 		size_t get_last = get_bucket_ptr->bytes_used;
@@ -220,9 +644,14 @@ size_t diskhash::container<BucketSize>::split(size_t bucket_id)
 			assert(record_length == sizeof(hash_t) + vbe::length(key_length) + key_length
 				+ vbe::length(value_length) + value_length);
 
+			if(filter_)
+			{
+				filter_->add(hash & new_bit ? result_bucket_id : bucket_id, hash);
+			}
+
 			if(hash & new_bit)
 			{
-				if(bit1_bucket_ptr->bytes_used + record_length > BUCKET_SIZE)
+				if(bit1_bucket_ptr->bytes_used + record_length > bucket_capacity_)
 				{
 					assert(bit1_bucket_put - bit1_bucket_ptr->data == (ptrdiff_t) bit1_bucket_ptr->bytes_used);
 
@@ -230,16 +659,16 @@ size_t diskhash::container<BucketSize>::split(size_t bucket_id)
 
 					size_t new_bucket_id = create_bucket(prefix_bits);
 
-					layout_->buckets[bit1_bucket_id].next_bucket_id = new_bucket_id;
+					buckets_[bit1_bucket_id].next_bucket_id = new_bucket_id;
 					bit1_bucket_id = new_bucket_id;
 
-					bit0_bucket_ptr = &layout_->buckets[bit0_bucket_id];
-					bit1_bucket_ptr = &layout_->buckets[bit1_bucket_id];
+					bit0_bucket_ptr = &buckets_[bit0_bucket_id];
+					bit1_bucket_ptr = &buckets_[bit1_bucket_id];
 
 					bit0_bucket_put = bit0_bucket_ptr->data + bit0_bucket_ptr->bytes_used;
 					bit1_bucket_put = bit1_bucket_ptr->data;
 
-					get_bucket_ptr = &layout_->buckets[get_bucket_id];
+					get_bucket_ptr = &buckets_[get_bucket_id];
 					get_ptr = get_bucket_ptr->data + offset;
 				}
 
@@ -247,32 +676,33 @@ size_t diskhash::container<BucketSize>::split(size_t bucket_id)
 
 				get_ptr += record_length;
 				bit1_bucket_ptr->bytes_used += record_length;
+				bytes_moved += record_length;
 			}
 			else
 			{
-				if(bit0_bucket_ptr->bytes_used + record_length > BUCKET_SIZE)
+				if(bit0_bucket_ptr->bytes_used + record_length > bucket_capacity_)
 				{
 					assert(bit0_bucket_put - bit0_bucket_ptr->data == (ptrdiff_t) bit0_bucket_ptr->bytes_used);
 
 					if(bit0_bucket_ptr->next_bucket_id != INVALID_BUCKET_ID)
 					{
 						bit0_bucket_id = bit0_bucket_ptr->next_bucket_id;
-						bit0_bucket_ptr = &layout_->buckets[bit0_bucket_id];
+						bit0_bucket_ptr = &buckets_[bit0_bucket_id];
 					}
 					else
 					{
 						size_t offset = get_ptr - get_bucket_ptr->data;
 
 						size_t new_bucket_id = create_bucket(prefix_bits);
-						layout_->buckets[bit0_bucket_id].next_bucket_id = new_bucket_id;
+						buckets_[bit0_bucket_id].next_bucket_id = new_bucket_id;
 
 						bit0_bucket_id = new_bucket_id;
-						bit0_bucket_ptr = &layout_->buckets[bit0_bucket_id];
+						bit0_bucket_ptr = &buckets_[bit0_bucket_id];
 
-						get_bucket_ptr = &layout_->buckets[get_bucket_id];
+						get_bucket_ptr = &buckets_[get_bucket_id];
 						get_ptr = get_bucket_ptr->data + offset;
 
-						bit1_bucket_ptr = &layout_->buckets[bit1_bucket_id];
+						bit1_bucket_ptr = &buckets_[bit1_bucket_id];
 						bit1_bucket_put = bit1_bucket_ptr->data + bit1_bucket_ptr->bytes_used;
 					}
 
@@ -293,7 +723,7 @@ size_t diskhash::container<BucketSize>::split(size_t bucket_id)
 
 	while(free_bucket_id != INVALID_BUCKET_ID)
 	{
-		bit0_bucket_ptr = &layout_->buckets[free_bucket_id];
+		bit0_bucket_ptr = &buckets_[free_bucket_id];
 
 		assert(bit0_bucket_ptr->bytes_used == 0);
 
@@ -302,36 +732,282 @@ size_t diskhash::container<BucketSize>::split(size_t bucket_id)
 		bit0_bucket_ptr->next_bucket_id = layout_->first_free_bucket_id;
 		layout_->first_free_bucket_id = free_bucket_id;
 
+		if(checksums_)
+		{
+			store_checksum(bit0_bucket_ptr, 0);
+		}
+		add_counter(extension_->free_buckets_count, 1);
+
 		free_bucket_id = next_bucket_id;
 	}
 
+	if(checksums_)
+	{
+		for(size_t id = bucket_id; id != INVALID_BUCKET_ID; id = buckets_[id].next_bucket_id)
+		{
+			update_checksum(id);
+		}
+
+		for(size_t id = result_bucket_id; id != INVALID_BUCKET_ID; id = buckets_[id].next_bucket_id)
+		{
+			update_checksum(id);
+		}
+	}
+
+	add_counter(extension_->splits_count, 1);
+	add_counter(extension_->bytes_moved, bytes_moved);
+
 	return result_bucket_id;
 }
 
+template<size_t BucketSize>
+void diskhash::container<BucketSize>::recount()
+{
+	size_t buckets_count = layout_->buckets_count;
+	usage_stats usage;
+
+	// free buckets are empty, so every record is in a chain
+	for(size_t bucket_id = 0; bucket_id < buckets_count; bucket_id++)
+	{
+		if(!verify_bucket(bucket_id))
+		{
+			continue;
+		}
+
+		const bucket_t *bucket_ptr = &buckets_[bucket_id];
+		const unsigned char *cursor = bucket_ptr->data;
+		const unsigned char *end = bucket_ptr->data + bucket_ptr->bytes_used;
+
+		while(cursor != end)
+		{
+			size_t key_length, value_length;
+
+			cursor = vbe::read(cursor + sizeof(hash_t), end, key_length);
+			cursor = vbe::read(cursor, end, value_length);
+			cursor += key_length + value_length;
+
+			usage.records++;
+			usage.key_bytes += key_length;
+			usage.value_bytes += value_length;
+		}
+	}
+
+	// a corrupted link could make the free list loop, so never walk more than all buckets
+	for(size_t bucket_id = layout_->first_free_bucket_id; bucket_id < buckets_count
+		&& usage.free_buckets < buckets_count; bucket_id = buckets_[bucket_id].next_bucket_id)
+	{
+		usage.free_buckets++;
+	}
+
+	extension_->records_count = usage.records;
+	extension_->key_bytes = usage.key_bytes;
+	extension_->value_bytes = usage.value_bytes;
+	extension_->free_buckets_count = usage.free_buckets;
+}
+
+template<size_t BucketSize>
+void diskhash::container<BucketSize>::journal_split(journal &j, size_t target, size_t bucket_id) const
+{
+	const unsigned char *start = (const unsigned char *) layout_;
+
+	j.save(target, 0, start, header_size_);
+
+	size_t chain_length = 0;
+
+	for(; bucket_id != INVALID_BUCKET_ID; bucket_id = buckets_[bucket_id].next_bucket_id)
+	{
+		const bucket_t *bucket_ptr = &buckets_[bucket_id];
+		j.save(target, (const unsigned char *) bucket_ptr - start, bucket_ptr, sizeof(bucket_t));
+		chain_length++;
+	}
+
+	// split relinks the buckets it takes from the free list, so save the link fields of as
+	// many free list entries as it can take. each half holds some of the chain's records in
+	// chain order and is packed in order, so it fits in chain_length buckets: the records of
+	// the first k buckets of the chain that belong to it fit into its first k buckets. the new
+	// half takes all of its buckets from the free list. the old half reuses the chain's
+	// buckets and would only take more past its end. so split takes at most 2 * chain_length.
+	// the one more is slack, the head of the new half is taken before any record moves but
+	// is one of its chain_length buckets
+	size_t free_bucket_id = layout_->first_free_bucket_id;
+
+	for(size_t i = 0; i < 2 * chain_length + 1 && free_bucket_id != INVALID_BUCKET_ID; i++)
+	{
+		const bucket_t *bucket_ptr = &buckets_[free_bucket_id];
+		j.save(target, (const unsigned char *) bucket_ptr - start, bucket_ptr, offsetof(bucket_t, data));
+
+		if(checksums_)
+		{
+			const unsigned char *checksum = bucket_ptr->data + BUCKET_SIZE - CHECKSUM_BYTES;
+			j.save(target, checksum - start, checksum, CHECKSUM_BYTES);
+		}
+
+		free_bucket_id = bucket_ptr->next_bucket_id;
+	}
+}
+
+template<size_t BucketSize>
+bool diskhash::container<BucketSize>::parse_record(const unsigned char *&cursor, const unsigned char *end, record_view &rv)
+{
+	size_t key_length, value_length;
+	const unsigned char *next;
+
+	if(size_t(end - cursor) < sizeof(hash_t))
+	{
+		return false;
+	}
+
+	std::copy(cursor, cursor + sizeof(hash_t), (unsigned char *) &rv.hash);
+
+	if(!(next = vbe::read(cursor + sizeof(hash_t), end, key_length))
+		|| !(next = vbe::read(next, end, value_length))
+		|| size_t(end - next) < key_length
+		|| size_t(end - next) - key_length < value_length)
+	{
+		return false;
+	}
+
+	rv.key = std::string_view(reinterpret_cast<const char *>(next), key_length);
+	rv.value = std::string_view(reinterpret_cast<const char *>(next + key_length), value_length);
+	cursor = next + key_length + value_length;
+
+	return true;
+}
+
 template<size_t BucketSize>
 bool diskhash::container<BucketSize>::read_record(size_t bucket_id, size_t &byte_offset, record_view &rv) const
 {
-	bucket_t *bucket_ptr = &layout_->buckets[bucket_id];
+	touch(bucket_id);
 
-	if(byte_offset >= bucket_ptr->bytes_used)
+	const bucket_t *bucket_ptr = &buckets_[bucket_id];
+	size_t bytes_used = std::min(load_counter(bucket_ptr->bytes_used), bucket_capacity_);
+
+	if(byte_offset >= bytes_used)
 		return false;
 
-	unsigned char *cursor = bucket_ptr->data + byte_offset;
+	const unsigned char *cursor = bucket_ptr->data + byte_offset;
 
-	hash_t record_hash;
-	size_t key_length, value_length;
+	if(!parse_record(cursor, bucket_ptr->data + bytes_used, rv))
+		return false;
+
+	byte_offset = cursor - bucket_ptr->data;
+
+	return true;
+}
+
+template<size_t BucketSize>
+void diskhash::container<BucketSize>::read_records(size_t bucket_id, std::vector<record_view> &records) const
+{
+	touch(bucket_id);
+
+	const bucket_t *bucket_ptr = &buckets_[bucket_id];
+	const unsigned char *cursor = bucket_ptr->data;
+	const unsigned char *end = bucket_ptr->data + std::min(load_counter(bucket_ptr->bytes_used), bucket_capacity_);
+
+	record_view rv;
+	while(cursor != end && parse_record(cursor, end, rv))
+	{
+		records.push_back(rv);
+	}
+}
+
+template<size_t BucketSize>
+bool diskhash::container<BucketSize>::verify_bucket(size_t bucket_id) const
+{
+	if(bucket_id >= layout_->buckets_count)
+	{
+		return false;
+	}
+
+	const bucket_t *bucket_ptr = &buckets_[bucket_id];
 
-	std::copy(cursor, cursor + sizeof(hash_t), (unsigned char *) &record_hash);
-	cursor = vbe::read(cursor + sizeof(hash_t), key_length);
-	cursor = vbe::read(cursor, value_length);
+	// read once, a writer of the chain may be changing it, see concurrent_hash_map::verify_bucket
+	size_t bytes_used = load_counter(bucket_ptr->bytes_used);
 
-	rv.hash = record_hash;
-	rv.key = std::string_view(reinterpret_cast<const char *>(cursor), key_length);
-	rv.value = std::string_view(reinterpret_cast<const char *>(cursor + key_length), value_length);
+	if(bytes_used > bucket_capacity_ || bucket_ptr->prefix_bits > HASH_BITS
+		|| (bucket_ptr->next_bucket_id != INVALID_BUCKET_ID && bucket_ptr->next_bucket_id >= layout_->buckets_count))
+	{
+		return false;
+	}
+
+	if(checksums_ && crc32c(0, bucket_ptr->data, bytes_used) != load_checksum(bucket_ptr))
+	{
+		return false;
+	}
+
+	const unsigned char *cursor = bucket_ptr->data;
+	const unsigned char *end = bucket_ptr->data + bytes_used;
+
+	while(cursor != end)
+	{
+		size_t key_length, value_length;
 
-	byte_offset = (cursor + key_length + value_length) - bucket_ptr->data;
+		if(size_t(end - cursor) < sizeof(hash_t)
+			|| !(cursor = vbe::read(cursor + sizeof(hash_t), end, key_length))
+			|| !(cursor = vbe::read(cursor, end, value_length))
+			|| size_t(end - cursor) < key_length
+			|| size_t(end - cursor) - key_length < value_length)
+		{
+			return false;
+		}
+
+		cursor += key_length + value_length;
+	}
 
 	return true;
 }
 
+template<size_t BucketSize>
+void diskhash::container<BucketSize>::grow(size_t buckets_count)
+{
+	size_t bytes_needed = header_size_ + buckets_count * sizeof(bucket_t);
+
+	file_map_.resize((bytes_needed * 11) / 10);
+	remap();
+
+	add_counter(extension_->resizes_count, 1);
+}
+
+template<size_t BucketSize>
+void diskhash::container<BucketSize>::remap()
+{
+	char *start = (char *) file_map_.start();
+
+	if(!legacy())
+	{
+		std::atomic_ref<extension_t *>(extension_).store((extension_t *) (start + sizeof(layout_t)), std::memory_order_release);
+	}
+
+	std::atomic_ref<bucket_t *>(buckets_).store((bucket_t *) (start + header_size_), std::memory_order_release);
+	std::atomic_ref<layout_t *>(layout_).store((layout_t *) start, std::memory_order_release);
+	capacity_.store((file_map_.length() - header_size_) / sizeof(bucket_t), std::memory_order_release);
+}
+
+template<size_t BucketSize>
+void diskhash::container<BucketSize>::touch_slow(size_t bucket_id) const
+{
+	if(!verify_bucket(bucket_id))
+	{
+		throw checksum_error(bucket_id);
+	}
+
+	set_verified(bucket_id);
+}
+
+template<size_t BucketSize>
+void diskhash::container<BucketSize>::set_verified(size_t bucket_id) const
+{
+	verified_->set(bucket_id);
+}
+
+template<size_t BucketSize>
+void diskhash::container<BucketSize>::update_checksum(size_t bucket_id)
+{
+	if(checksums_)
+	{
+		bucket_t *bucket_ptr = &buckets_[bucket_id];
+		store_checksum(bucket_ptr, crc32c(0, bucket_ptr->data, bucket_ptr->bytes_used));
+	}
+}
+
 template class diskhash::container<>;
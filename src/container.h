@@ -1,14 +1,134 @@
 #pragma once
 
 #include "settings.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <cstring>
+#include <atomic>
+#include <functional>
+#include <memory>
 #include <string>
 #include <string_view>
 #include <optional>
 #include <stdexcept>
+#include <vector>
 #include "file_map.h"
+#include "journal.h"
+#include "bucket_filter.h"
 
 namespace diskhash {
 
+// outcome of container::probe_record and container::probe_view
+enum probe_result { PROBE_FOUND, PROBE_NOT_FOUND, PROBE_RETRY, PROBE_CORRUPTED };
+
+// thrown when a bucket fails verification on first access after open
+class checksum_error: public std::runtime_error {
+public:
+	explicit checksum_error(size_t bucket_id):
+		std::runtime_error("diskhash: corrupted bucket " + std::to_string(bucket_id)),
+		bucket_id_(bucket_id)
+	{
+	}
+
+	size_t bucket_id() const {
+		return bucket_id_;
+	}
+
+private:
+	size_t bucket_id_;
+};
+
+// one bit per bucket, allocated in chunks that never move, so that lock-free readers may
+// test and set bits while writers add buckets. bits past MAX_BITS are never set
+class bucket_bitmap {
+public:
+	static const size_t CHUNK_WORDS = 1 << 14;
+	static const size_t CHUNK_BITS = CHUNK_WORDS * 64;
+	static const size_t MAX_BITS = size_t(1 << 12) * CHUNK_BITS;
+
+	bucket_bitmap() = default;
+
+	bucket_bitmap(bucket_bitmap const &) = delete;
+	bucket_bitmap &operator=(bucket_bitmap const &) = delete;
+
+	~bucket_bitmap()
+	{
+		for(auto &chunk: chunks_)
+		{
+			delete[] chunk.load(std::memory_order_relaxed);
+		}
+	}
+
+	bool test(size_t bit) const
+	{
+		if(bit >= MAX_BITS)
+		{
+			return false;
+		}
+
+		std::atomic<uint64_t> const *chunk = chunks_[bit / CHUNK_BITS].load(std::memory_order_acquire);
+		return chunk && (chunk[bit % CHUNK_BITS / 64].load(std::memory_order_relaxed) & (uint64_t(1) << (bit % 64)));
+	}
+
+	void set(size_t bit)
+	{
+		if(bit >= MAX_BITS)
+		{
+			return;
+		}
+
+		std::atomic<std::atomic<uint64_t> *> &slot = chunks_[bit / CHUNK_BITS];
+		std::atomic<uint64_t> *chunk = slot.load(std::memory_order_acquire);
+
+		if(!chunk)
+		{
+			// racing setters each allocate a chunk, one is kept
+			std::atomic<uint64_t> *fresh = new std::atomic<uint64_t>[CHUNK_WORDS]();
+			if(slot.compare_exchange_strong(chunk, fresh, std::memory_order_acq_rel))
+			{
+				chunk = fresh;
+			}
+			else
+			{
+				delete[] fresh;
+			}
+		}
+
+		chunk[bit % CHUNK_BITS / 64].fetch_or(uint64_t(1) << (bit % 64), std::memory_order_relaxed);
+	}
+
+private:
+	std::atomic<std::atomic<uint64_t> *> chunks_[size_t(1) << 12] = {};
+};
+
+// thrown by create_bucket of a concurrent container that has run out of mapped space,
+// see container::reserve()
+class bucket_allocation_error: public std::runtime_error {
+public:
+	bucket_allocation_error():
+		std::runtime_error("diskhash: no room for a new bucket")
+	{
+	}
+};
+
+// live records and free space of a container, kept up to date in the file header
+struct usage_stats {
+	size_t records = 0;
+	size_t key_bytes = 0;
+	size_t value_bytes = 0;
+	// buckets on the free list
+	size_t free_buckets = 0;
+};
+
+// cumulative counts of structural changes over the life of a container
+struct growth_stats {
+	size_t splits = 0;
+	// times the file was grown
+	size_t resizes = 0;
+	// record bytes that splits moved to the new bucket chain
+	size_t bytes_moved = 0;
+};
+
 struct record_view {
 	hash_t hash;
 	std::string_view key;
@@ -20,11 +140,47 @@ class container {
 public:
 	static size_t const BUCKET_SIZE = BucketSize;
 
-	container(const char *filename, bool read_only = false);
+	// checksums only has effect when the file is created, existing files keep their setting.
+	// with checksums every bucket carries a CRC32C of its records, updated on write and
+	// verified the first time the bucket is accessed after open.
+	//
+	// files written by diskhash 1.0 are read and written in place, see legacy()
+	container(const char *filename, bool read_only = false, bool checksums = false);
+
+	// marks the filter in sync, see open_filter()
+	~container();
 
 	// create bucket and return bucket id
 	size_t create_bucket(size_t prefix_bits);
 
+	// let create_bucket run concurrently with itself and with writers of other bucket chains:
+	// buckets are taken from the free list and the tail with compare-and-swap, and the file is
+	// never grown implicitly, create_bucket throws bucket_allocation_error instead
+	void set_concurrent();
+
+	// make sure count more buckets fit into the mapping, must not run concurrently with
+	// anything but lock-free readers
+	void reserve(size_t count);
+
+	// number of buckets in the chain starting at bucket_id
+	size_t chain_length(size_t bucket_id) const;
+
+	// keep a bucket_filter of every chain in filename and consult it before reading a chain.
+	// a writable container rebuilds a filter that is out of date, a read-only one only uses a
+	// filter that was closed in sync with the current write generation
+	void open_filter(const char *filename, bool read_only);
+
+	// lookups answered by the filter, nullopt if there is none
+	std::optional<diskhash::filter_stats> filter_stats() const
+	{
+		if(!filter_)
+		{
+			return std::nullopt;
+		}
+
+		return filter_->stats();
+	}
+
 	// write record (hash, key, value) into bucket bucket_id, return stored value
 	std::string_view create_record(size_t bucket_id, hash_t const &hash, std::string_view key,
 		std::string_view value);
@@ -33,18 +189,55 @@ public:
 	// return nullopt if no such record found
 	std::optional<std::string_view> find_record(size_t bucket_id, const hash_t &hash, std::string_view key) const;
 
+	// find_record() for lock-free readers racing with a writer, see concurrent_hash_map: copies
+	// the value into value, never reads outside the mapping and never follows a chain forever.
+	// returns PROBE_RETRY if what it read cannot be trusted. does not verify checksums
+	probe_result probe_record(size_t bucket_id, const hash_t &hash, std::string_view key, std::string &value,
+		size_t *corrupted_bucket_id = nullptr) const;
+
+	// probe_record() returning a view into the mapping instead of a copy. if corrupted_bucket_id
+	// is given, buckets not verified since open have their checksums checked and PROBE_CORRUPTED
+	// is returned with the id of the first one that fails
+	probe_result probe_view(size_t bucket_id, const hash_t &hash, std::string_view key, std::string_view &value,
+		size_t *corrupted_bucket_id = nullptr) const;
+
 	// parse record at byte_offset in bucket_id, fill rv, advance byte_offset.
 	// returns false if byte_offset >= bytes_used (no more records in this bucket).
+	// never reads outside the bucket: a record that does not parse, which only a racing writer
+	// leaves behind once checksums passed, ends the bucket early
 	bool read_record(size_t bucket_id, size_t &byte_offset, record_view &rv) const;
 
+	// append all records of bucket bucket_id to records, parsing them as read_record() does
+	void read_records(size_t bucket_id, std::vector<record_view> &records) const;
+
+	// ask the operating system to start reading bucket_id from disk
+	void will_need(size_t bucket_id) const
+	{
+		file_map_.will_need(header_size_ + bucket_id * sizeof(bucket_t), sizeof(bucket_t));
+	}
+
 	// return the next_bucket_id for the given bucket, or INVALID_BUCKET_ID if none
 	size_t next_bucket(size_t bucket_id) const
 	{
-		return layout_->buckets[bucket_id].next_bucket_id;
+		return buckets_[bucket_id].next_bucket_id;
+	}
+
+	// return the head of the free bucket list, or INVALID_BUCKET_ID if it is empty
+	size_t first_free_bucket() const
+	{
+		return layout_->first_free_bucket_id;
 	}
 
 	static size_t invalid_bucket_id() { return INVALID_BUCKET_ID; }
 
+	// signature of the data files of diskhash 1.0, whose header ends after the free list head,
+	// see legacy()
+	static const unsigned LEGACY_SIGNATURE = 0x69d3db7a;
+
+	// with checksums the last CHECKSUM_BYTES of every bucket hold its CRC32C and records have
+	// that much less room
+	static const size_t CHECKSUM_BYTES = sizeof(uint32_t);
+
 	// remove record (hash, key) from bucket chain starting at bucket_id
 	// return true if found and removed, false if not found
 	bool remove_record(size_t bucket_id, const hash_t &hash, std::string_view key);
@@ -70,31 +263,166 @@ public:
 		return layout_->buckets_count;
 	}
 
+	// number of buckets the mapping holds, lock-free readers must not look past it
+	size_t capacity() const
+	{
+		return capacity_.load(std::memory_order_acquire);
+	}
+
 	size_t bucket_bytes_used(size_t bucket_id) const
 	{
-		return layout_->buckets[bucket_id].bytes_used;
+		return buckets_[bucket_id].bytes_used;
 	}
 
 	size_t bucket_prefix_bits(size_t bucket_id) const
 	{
-		return layout_->buckets[bucket_id].prefix_bits;
+		return buckets_[bucket_id].prefix_bits;
+	}
+
+	// bytes of records a bucket can hold
+	size_t bucket_capacity() const {
+		return bucket_capacity_;
 	}
 
 	size_t bytes_allocated() const {
 		return file_map_.length();
 	}
 
+	// O(1), safe to call concurrently with writers and from read-only containers
+	usage_stats usage() const
+	{
+		const extension_t *extension = load_extension();
+
+		usage_stats result;
+		result.records = load_counter(extension->records_count);
+		result.key_bytes = load_counter(extension->key_bytes);
+		result.value_bytes = load_counter(extension->value_bytes);
+		result.free_buckets = load_counter(extension->free_buckets_count);
+		return result;
+	}
+
+	// O(1), like usage()
+	growth_stats growth() const
+	{
+		const extension_t *extension = load_extension();
+
+		growth_stats result;
+		result.splits = load_counter(extension->splits_count);
+		result.resizes = load_counter(extension->resizes_count);
+		result.bytes_moved = load_counter(extension->bytes_moved);
+		return result;
+	}
+
+	// recompute the usage counters from bucket contents, for writers only. corrupted buckets
+	// are not counted
+	void recount();
+
+	bool checksums() const {
+		return checksums_;
+	}
+
+	// true for a file written by diskhash 1.0. its header has no room for flags, the write
+	// generation or the counters, the container keeps them in memory: usage counters are
+	// recounted on open, growth counters start at zero, there are no checksums, and readers in
+	// other processes cannot tell that a writer changed what they read. upgrade_legacy() in
+	// fsck.h converts such a file to the current format
+	bool legacy() const {
+		return extension_ == &legacy_extension_;
+	}
+
+	// check header fields, record framing and, if enabled, the checksum of a bucket,
+	// return false if the bucket is corrupted. never throws and does not mark it verified
+	bool verify_bucket(size_t bucket_id) const;
+
 	bool bucket_to_split(size_t bucket_id) const {
-		bucket_t *first_bucket_ptr = &layout_->buckets[bucket_id];
+		bucket_t *first_bucket_ptr = &buckets_[bucket_id];
 		if(first_bucket_ptr->next_bucket_id == INVALID_BUCKET_ID) return false;
 
-		bucket_t *second_bucket_ptr = &layout_->buckets[first_bucket_ptr->next_bucket_id];
+		bucket_t *second_bucket_ptr = &buckets_[first_bucket_ptr->next_bucket_id];
 		if(second_bucket_ptr->next_bucket_id != INVALID_BUCKET_ID) return true;
 
-		return (first_bucket_ptr->bytes_used + second_bucket_ptr->bytes_used) > 3 * BUCKET_SIZE / 2;
+		return (first_bucket_ptr->bytes_used + second_bucket_ptr->bytes_used) > 3 * bucket_capacity_ / 2;
+	}
+
+	// save images of everything split(bucket_id) may modify into journal j
+	void journal_split(journal &j, size_t target, size_t bucket_id) const;
+
+	// writers bracket every modification with begin_write() and end_write(), which count it in
+	// the file header, so that readers in other processes can validate what they read: a lookup
+	// is consistent if write_generation() returned the same value before and after it and no
+	// write was in progress. several threads of one process may be writing at once
+	void begin_write()
+	{
+		std::atomic_ref<uint64_t>(extension_->generation).fetch_add(1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+	}
+
+	void end_write()
+	{
+		std::atomic_ref<uint64_t>(extension_->generation).fetch_add(WRITE_FINISHED - 1, std::memory_order_release);
+	}
+
+	uint64_t write_generation() const
+	{
+		return std::atomic_ref<uint64_t>(const_cast<uint64_t &>(load_extension()->generation)).load(std::memory_order_acquire);
+	}
+
+	static bool write_in_progress(uint64_t generation)
+	{
+		return generation & (WRITE_FINISHED - 1);
+	}
+
+	// forget writes left unfinished by a process that died, only the process holding the
+	// writer lock of the map may call this. the usage counters of an unfinished write may be
+	// out of step with the buckets, so they are recounted
+	void reset_writes()
+	{
+		uint64_t generation = write_generation();
+
+		if(write_in_progress(generation))
+		{
+			recount();
+		}
+
+		extension_->generation = (generation | (WRITE_FINISHED - 1)) + 1;
+	}
+
+	// for read-only containers: map the file again if a writer in another process has added
+	// buckets past the end of the mapping
+	void refresh()
+	{
+		size_t buckets_count = std::atomic_ref<size_t>(layout_->buckets_count).load(std::memory_order_relaxed);
+
+		if(buckets_count > capacity_.load(std::memory_order_relaxed) && file_map_.refresh())
+		{
+			remap();
+		}
+
+		if(filter_ && buckets_count > filter_->capacity())
+		{
+			filter_->refresh();
+		}
+	}
+
+	void sync() {
+		file_map_.sync();
+	}
+
+	void copy_to(char const *file_name) const {
+		file_map_.copy_to(file_name);
+	}
+
+	void set_retire_function(std::function<void(void *, size_t)> f) {
+		if(filter_)
+		{
+			filter_->set_retire_function(f);
+		}
+
+		file_map_.set_retire_function(std::move(f));
 	}
 
 	void close() {
+		close_filter();
 		file_map_.close();
 		layout_ = 0;
 	}
@@ -104,8 +432,15 @@ private:
 	std::optional<std::string_view> find_value(size_t bucket_id, const hash_t &hash, std::string_view key) const;
 
 	static const size_t INVALID_BUCKET_ID = size_t(-1);
-	static const unsigned SIGNATURE = 0x69d3db7a;
+	static const unsigned SIGNATURE = 0x69d3db7f;
+	static const unsigned CHECKSUMS_FLAG = 1;
 
+	// the low bits of the write generation count writes in progress, the rest finished ones
+	static const uint64_t WRITE_FINISHED = uint64_t(1) << 16;
+
+	// a file starts with layout_t, then extension_t unless it was written by diskhash 1.0, then
+	// the buckets. buckets are laid out as in 1.0, with checksums the last CHECKSUM_BYTES of
+	// data hold a CRC32C of data[0, bytes_used)
 #pragma pack(push, 1)
 	struct bucket_t {
 		size_t prefix_bits, bytes_used, next_bucket_id;
@@ -116,12 +451,126 @@ private:
 		unsigned signature;
 		size_t buckets_count;
 		size_t first_free_bucket_id;
-		bucket_t buckets[1];
+	};
+
+	struct extension_t {
+		unsigned flags;
+		// see begin_write()
+		uint64_t generation;
+		// see usage()
+		size_t records_count, key_bytes, value_bytes, free_buckets_count;
+		// see growth()
+		size_t splits_count, resizes_count, bytes_moved;
 	};
 #pragma pack(pop)
 
+	// verify bucket_id if it has not been verified since open, throw checksum_error if corrupted
+	void touch(size_t bucket_id) const
+	{
+		if(checksums_ && !verified(bucket_id))
+		{
+			touch_slow(bucket_id);
+		}
+	}
+
+	bool verified(size_t bucket_id) const
+	{
+		return verified_ && verified_->test(bucket_id);
+	}
+
+	// usage counters are updated by concurrent writers and read by lock-free readers
+	static void add_counter(size_t &counter, size_t delta)
+	{
+		std::atomic_ref<size_t>(counter).fetch_add(delta, std::memory_order_relaxed);
+	}
+
+	static void sub_counter(size_t &counter, size_t delta)
+	{
+		std::atomic_ref<size_t>(counter).fetch_sub(delta, std::memory_order_relaxed);
+	}
+
+	static size_t load_counter(size_t const &counter)
+	{
+		return std::atomic_ref<size_t>(const_cast<size_t &>(counter)).load(std::memory_order_relaxed);
+	}
+
+	// the mapping of buckets_ and extension_ for lock-free readers, see remap()
+	const bucket_t *load_buckets() const
+	{
+		return std::atomic_ref<bucket_t *>(const_cast<bucket_t *&>(buckets_)).load(std::memory_order_acquire);
+	}
+
+	const extension_t *load_extension() const
+	{
+		return std::atomic_ref<extension_t *>(const_cast<extension_t *&>(extension_)).load(std::memory_order_acquire);
+	}
+
+	static uint32_t load_checksum(const bucket_t *bucket_ptr)
+	{
+		uint32_t checksum;
+		std::memcpy(&checksum, bucket_ptr->data + BUCKET_SIZE - CHECKSUM_BYTES, CHECKSUM_BYTES);
+		return checksum;
+	}
+
+	static void store_checksum(bucket_t *bucket_ptr, uint32_t checksum)
+	{
+		std::memcpy(bucket_ptr->data + BUCKET_SIZE - CHECKSUM_BYTES, &checksum, CHECKSUM_BYTES);
+	}
+
+	// parse the record at cursor, which must not extend past end, and advance cursor past it.
+	// return false if it does not fit
+	static bool parse_record(const unsigned char *&cursor, const unsigned char *end, record_view &rv);
+
+	// lock-free part of create_bucket for concurrent containers
+	size_t allocate_bucket();
+
+	void touch_slow(size_t bucket_id) const;
+	void set_verified(size_t bucket_id) const;
+	void update_checksum(size_t bucket_id);
+
+	// refill the filter of the chain starting at bucket_id from its records
+	void rebuild_filter(size_t bucket_id);
+
+	// refill the filters of all chains, chains with corrupted buckets let every hash through
+	void rebuild_filters();
+
+	void close_filter();
+
+	// grow the file to hold buckets_count buckets and then some
+	void grow(size_t buckets_count);
+
+	void remap();
+
 	file_map file_map_;
 	layout_t *layout_;
+
+	// pointers into the mapping, set with layout_. extension_ points to legacy_extension_ for
+	// files of diskhash 1.0
+	bucket_t *buckets_;
+	extension_t *extension_;
+	extension_t legacy_extension_;
+
+	// offset of the first bucket in the file
+	size_t header_size_;
+
+	// number of buckets the current mapping can hold, published after layout_
+	std::atomic<size_t> capacity_;
+
+	bool checksums_;
+
+	// BUCKET_SIZE, less CHECKSUM_BYTES with checksums
+	size_t bucket_capacity_;
+
+	// create_bucket may run concurrently, see set_concurrent()
+	bool concurrent_;
+
+	// one bit per bucket checked since open, set by readers and create_bucket. null without
+	// checksums
+	std::unique_ptr<bucket_bitmap> verified_;
+
+	// see open_filter(), null if there is none
+	std::unique_ptr<bucket_filter> filter_;
+	bool filter_read_only_;
 };
 
 // namespace diskhash
@@ -0,0 +1,96 @@
+#include <array>
+#include <string.h>
+
+#include "crc32c.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+	#include <nmmintrin.h>
+	#define DISKHASH_CRC32C_SSE42 1
+#endif
+
+namespace {
+
+uint32_t const POLYNOMIAL = 0x82f63b78;
+
+constexpr std::array<uint32_t, 256> make_table()
+{
+	std::array<uint32_t, 256> table{};
+
+	for(uint32_t i = 0; i < 256; i++)
+	{
+		uint32_t crc = i;
+
+		for(int bit = 0; bit < 8; bit++)
+		{
+			crc = (crc & 1) ? (crc >> 1) ^ POLYNOMIAL : crc >> 1;
+		}
+
+		table[i] = crc;
+	}
+
+	return table;
+}
+
+constexpr std::array<uint32_t, 256> table = make_table();
+
+uint32_t crc32c_table(uint32_t crc, const unsigned char *ptr, size_t length)
+{
+	while(length-- > 0)
+	{
+		crc = table[(crc ^ *ptr++) & 0xff] ^ (crc >> 8);
+	}
+
+	return crc;
+}
+
+#if defined(DISKHASH_CRC32C_SSE42)
+__attribute__((target("sse4.2")))
+uint32_t crc32c_sse42(uint32_t crc, const unsigned char *ptr, size_t length)
+{
+#if defined(__x86_64__)
+	uint64_t crc64 = crc;
+
+	while(length >= sizeof(uint64_t))
+	{
+		uint64_t word;
+		memcpy(&word, ptr, sizeof(word));
+		crc64 = _mm_crc32_u64(crc64, word);
+		ptr += sizeof(word);
+		length -= sizeof(word);
+	}
+
+	crc = uint32_t(crc64);
+#endif
+
+	while(length-- > 0)
+	{
+		crc = _mm_crc32_u8(crc, *ptr++);
+	}
+
+	return crc;
+}
+
+bool has_sse42()
+{
+	static bool const result = (__builtin_cpu_init(), __builtin_cpu_supports("sse4.2"));
+	return result;
+}
+#endif
+
+}
+
+uint32_t diskhash::crc32c(uint32_t crc, const void *data, size_t length)
+{
+	const unsigned char *ptr = (const unsigned char *) data;
+
+	crc = ~crc;
+
+#if defined(DISKHASH_CRC32C_SSE42)
+	if(has_sse42())
+	{
+		return ~crc32c_sse42(crc, ptr, length);
+	}
+#endif
+
+	return ~crc32c_table(crc, ptr, length);
+}
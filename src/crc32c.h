@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace diskhash {
+
+// CRC-32C (Castagnoli) of length bytes at data, continuing from crc. crc32c(0, ...) starts
+// a new checksum and crc32c(crc32c(0, a), b) == crc32c(0, a + b), so appends can extend it.
+// uses the SSE4.2 crc32 instruction when the CPU has it, a lookup table otherwise.
+uint32_t crc32c(uint32_t crc, const void *data, size_t length);
+
+// namespace diskhash
+}
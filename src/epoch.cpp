@@ -0,0 +1,156 @@
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "epoch.h"
+
+namespace {
+
+// one per thread that ever pinned, reused after the thread exits. holds the global epoch
+// the thread observed when it pinned, 0 while it is not pinned
+struct alignas(64) slot_t {
+	std::atomic<uint64_t> epoch{0};
+	std::atomic<bool> in_use{false};
+};
+
+struct retired_t {
+	uint64_t epoch;
+	std::function<void()> deleter;
+};
+
+std::atomic<uint64_t> global_epoch{1};
+
+std::mutex slots_mutex;
+std::vector<std::unique_ptr<slot_t>> slots;
+
+std::mutex retired_mutex;
+std::vector<retired_t> retired;
+std::atomic<size_t> retired_count{0};
+
+slot_t *acquire_slot()
+{
+	std::lock_guard lock(slots_mutex);
+
+	for(auto &slot : slots)
+	{
+		bool expected = false;
+		if(slot->in_use.compare_exchange_strong(expected, true))
+		{
+			return slot.get();
+		}
+	}
+
+	slots.push_back(std::make_unique<slot_t>());
+	slots.back()->in_use = true;
+	return slots.back().get();
+}
+
+struct thread_state {
+	slot_t *slot = acquire_slot();
+	unsigned depth = 0;
+
+	~thread_state()
+	{
+		slot->epoch.store(0, std::memory_order_release);
+		slot->in_use.store(false, std::memory_order_release);
+	}
+};
+
+thread_local thread_state state;
+
+// smallest epoch announced by a pinned thread, or UINT64_MAX if none is pinned
+uint64_t min_active_epoch()
+{
+	std::lock_guard lock(slots_mutex);
+
+	uint64_t result = UINT64_MAX;
+
+	for(auto &slot : slots)
+	{
+		uint64_t epoch = slot->epoch.load(std::memory_order_acquire);
+		if(epoch != 0 && epoch < result)
+		{
+			result = epoch;
+		}
+	}
+
+	return result;
+}
+
+}
+
+diskhash::epoch::guard::guard()
+{
+	if(state.depth++ == 0)
+	{
+		state.slot->epoch.store(global_epoch.load(std::memory_order_relaxed), std::memory_order_relaxed);
+		// the announcement must be visible before anything shared is read, pairs with
+		// the fetch_add in retire() and the fence in reclaim()
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+	}
+}
+
+diskhash::epoch::guard::~guard()
+{
+	if(--state.depth == 0)
+	{
+		state.slot->epoch.store(0, std::memory_order_release);
+	}
+}
+
+void diskhash::epoch::retire(std::function<void()> deleter)
+{
+	// threads that pin from now on observe a later epoch and cannot reach what was retired
+	uint64_t epoch = global_epoch.fetch_add(1, std::memory_order_seq_cst);
+
+	{
+		std::lock_guard lock(retired_mutex);
+		retired.push_back({epoch, std::move(deleter)});
+		retired_count.store(retired.size(), std::memory_order_relaxed);
+	}
+
+	reclaim();
+}
+
+void diskhash::epoch::reclaim()
+{
+	if(retired_count.load(std::memory_order_relaxed) == 0)
+	{
+		return;
+	}
+
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	uint64_t min_epoch = min_active_epoch();
+
+	std::vector<retired_t> ready;
+
+	{
+		std::lock_guard lock(retired_mutex);
+
+		auto it = std::partition(retired.begin(), retired.end(),
+			[min_epoch](retired_t const &r) { return r.epoch >= min_epoch; });
+
+		std::move(it, retired.end(), std::back_inserter(ready));
+		retired.erase(it, retired.end());
+		retired_count.store(retired.size(), std::memory_order_relaxed);
+	}
+
+	for(auto &r : ready)
+	{
+		r.deleter();
+	}
+}
+
+void diskhash::epoch::synchronize()
+{
+	while(retired_count.load(std::memory_order_relaxed) != 0)
+	{
+		reclaim();
+		std::this_thread::yield();
+	}
+}
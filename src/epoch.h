@@ -0,0 +1,35 @@
+#pragma once
+
+#include <functional>
+
+namespace diskhash {
+
+// process-wide epoch based reclamation. readers hold an epoch::guard while they look at
+// shared memory without locks, writers hand memory they unlinked to epoch::retire() instead
+// of releasing it directly; it is released once every guard that could have seen it is gone.
+namespace epoch {
+
+// pins the calling thread, guards may nest
+class guard {
+public:
+	guard();
+	~guard();
+
+	guard(guard const &) = delete;
+	guard &operator=(guard const &) = delete;
+};
+
+// run deleter once no guard that was alive at the time of the call remains
+void retire(std::function<void()> deleter);
+
+// run deleters that became safe, cheap when there is nothing retired
+void reclaim();
+
+// wait until every deleter retired so far has run, must not be called under a guard
+void synchronize();
+
+// namespace epoch
+}
+
+// namespace diskhash
+}
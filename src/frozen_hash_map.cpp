@@ -0,0 +1,371 @@
+#include <stddef.h>
+#include <algorithm>
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+
+#include "frozen_hash_map.h"
+#include "vbe.h"
+
+namespace {
+
+uint64_t mix(uint64_t x)
+{
+	// murmur3 finalizer
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdull;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ull;
+	x ^= x >> 33;
+	return x;
+}
+
+size_t align_up(size_t offset, size_t alignment)
+{
+	return (offset + alignment - 1) / alignment * alignment;
+}
+
+size_t record_length(diskhash::record_view const &rv)
+{
+	return sizeof(diskhash::hash_t) + diskhash::vbe::length(rv.key.size()) + rv.key.size()
+		+ diskhash::vbe::length(rv.value.size()) + rv.value.size();
+}
+
+// pilot search for one seed, returns false if some bucket found no pilot
+bool find_pilots(std::vector<uint64_t> const &hashes, uint64_t seed, uint64_t table_size,
+	std::vector<uint32_t> &pilots, std::vector<bool> &taken,
+	uint64_t (*bucket)(uint64_t, uint64_t),
+	uint64_t (*position)(uint64_t, uint32_t, uint64_t, uint64_t))
+{
+	const uint32_t MAX_PILOT = 1 << 20;
+
+	uint64_t buckets_count = pilots.size();
+
+	// keys grouped by bucket
+	std::vector<size_t> bucket_start(buckets_count + 1, 0);
+	for(uint64_t h : hashes)
+	{
+		bucket_start[bucket(h, buckets_count) + 1]++;
+	}
+	for(size_t i = 0; i < buckets_count; i++)
+	{
+		bucket_start[i + 1] += bucket_start[i];
+	}
+
+	std::vector<uint64_t> bucket_keys(hashes.size());
+	std::vector<size_t> fill(bucket_start.begin(), bucket_start.end() - 1);
+	for(uint64_t h : hashes)
+	{
+		bucket_keys[fill[bucket(h, buckets_count)]++] = h;
+	}
+
+	// largest buckets first, while the table is still empty
+	std::vector<uint64_t> order(buckets_count);
+	for(uint64_t i = 0; i < buckets_count; i++)
+	{
+		order[i] = i;
+	}
+	std::stable_sort(order.begin(), order.end(), [&bucket_start](uint64_t a, uint64_t b) {
+		return bucket_start[a + 1] - bucket_start[a] > bucket_start[b + 1] - bucket_start[b];
+	});
+
+	std::fill(taken.begin(), taken.end(), false);
+	std::vector<uint64_t> positions;
+
+	for(uint64_t b : order)
+	{
+		size_t first = bucket_start[b], last = bucket_start[b + 1];
+
+		if(first == last)
+		{
+			pilots[b] = 0;
+			continue;
+		}
+
+		uint32_t pilot = 0;
+
+		for(;; pilot++)
+		{
+			if(pilot == MAX_PILOT)
+			{
+				return false;
+			}
+
+			positions.clear();
+
+			bool ok = true;
+			for(size_t i = first; i < last && ok; i++)
+			{
+				uint64_t p = position(bucket_keys[i], pilot, seed, table_size);
+				ok = !taken[p] && std::find(positions.begin(), positions.end(), p) == positions.end();
+				positions.push_back(p);
+			}
+
+			if(ok)
+			{
+				break;
+			}
+		}
+
+		pilots[b] = pilot;
+
+		for(uint64_t p : positions)
+		{
+			taken[p] = true;
+		}
+	}
+
+	return true;
+}
+
+}
+
+diskhash::frozen_hash_map::frozen_hash_map(const char *filename):
+	file_map_((std::string(filename) + "frz").c_str(), true, 0)
+{
+	layout_ = (const layout_t *) file_map_.start();
+
+	if(file_map_.length() < sizeof(layout_t) || layout_->signature != SIGNATURE)
+	{
+		file_map_.close();
+		throw std::runtime_error(std::string("invalid frozen hash map signature in file ") + filename + "frz");
+	}
+
+	size_t pilots_bytes = align_up(layout_->buckets_count * sizeof(uint32_t), sizeof(uint64_t));
+	size_t remap_bytes = (layout_->table_size - layout_->records_count) * sizeof(uint64_t);
+	size_t offsets_bytes = layout_->records_count * sizeof(uint64_t);
+
+	if(layout_->table_size < layout_->records_count
+		|| sizeof(layout_t) + pilots_bytes + remap_bytes + offsets_bytes > layout_->data_offset
+		|| layout_->data_offset + layout_->data_size > file_map_.length())
+	{
+		file_map_.close();
+		throw std::runtime_error(std::string("truncated frozen hash map in file ") + filename + "frz");
+	}
+
+	const unsigned char *start = (const unsigned char *) file_map_.start();
+
+	pilots_ = (const uint32_t *) (start + sizeof(layout_t));
+	remap_ = (const uint64_t *) (start + sizeof(layout_t) + pilots_bytes);
+	offsets_ = (const uint64_t *) (start + sizeof(layout_t) + pilots_bytes + remap_bytes);
+	data_ = start + layout_->data_offset;
+}
+
+uint64_t diskhash::frozen_hash_map::key_hash(std::string_view key, uint64_t seed)
+{
+	// 64-bit FNV-1a, hash_t is too narrow to tell millions of keys apart
+	uint64_t h = 0xcbf29ce484222325ull ^ seed;
+
+	for(unsigned char c : key)
+	{
+		h ^= c;
+		h *= 0x100000001b3ull;
+	}
+
+	return mix(h);
+}
+
+uint64_t diskhash::frozen_hash_map::bucket(uint64_t key_hash, uint64_t buckets_count)
+{
+	// 60% of the keys go to the first 30% of the buckets, like in PTHash: the dense buckets
+	// are placed while the table is mostly empty and the many small ones fill the rest
+	uint64_t dense_buckets = std::max<uint64_t>(1, buckets_count * 3 / 10);
+	uint32_t high = uint32_t(key_hash >> 32);
+
+	if((high & 0xff) < 154 || dense_buckets == buckets_count)
+	{
+		return (high >> 8) % dense_buckets;
+	}
+
+	return dense_buckets + (high >> 8) % (buckets_count - dense_buckets);
+}
+
+uint64_t diskhash::frozen_hash_map::position(uint64_t key_hash, uint32_t pilot, uint64_t seed, uint64_t table_size)
+{
+	return (key_hash ^ mix(pilot + seed)) % table_size;
+}
+
+uint64_t diskhash::frozen_hash_map::slot(uint64_t key_hash) const
+{
+	uint64_t p = position(key_hash, pilots_[bucket(key_hash, layout_->buckets_count)], layout_->seed,
+		layout_->table_size);
+
+	return p < layout_->records_count ? p : remap_[p - layout_->records_count];
+}
+
+bool diskhash::frozen_hash_map::read_record(size_t slot, record_view &rv) const
+{
+	uint64_t offset = offsets_[slot];
+	if(offset + sizeof(hash_t) > layout_->data_size)
+	{
+		return false;
+	}
+
+	const unsigned char *cursor = data_ + offset;
+	const unsigned char *end = data_ + layout_->data_size;
+
+	size_t key_length, value_length;
+
+	std::copy(cursor, cursor + sizeof(hash_t), (unsigned char *) &rv.hash);
+
+	if(!(cursor = vbe::read(cursor + sizeof(hash_t), end, key_length))
+		|| !(cursor = vbe::read(cursor, end, value_length))
+		|| size_t(end - cursor) < key_length
+		|| size_t(end - cursor) - key_length < value_length)
+	{
+		return false;
+	}
+
+	rv.key = std::string_view((const char *) cursor, key_length);
+	rv.value = std::string_view((const char *) cursor + key_length, value_length);
+
+	return true;
+}
+
+std::optional<std::string_view> diskhash::frozen_hash_map::find(hash_t hash, std::string_view key) const
+{
+	if(layout_->records_count == 0)
+	{
+		return std::nullopt;
+	}
+
+	record_view rv;
+
+	if(!read_record(slot(key_hash(key, layout_->seed)), rv))
+	{
+		throw std::runtime_error("diskhash: corrupted frozen hash map");
+	}
+
+	if(rv.hash != hash || rv.key != key)
+	{
+		return std::nullopt;
+	}
+
+	return rv.value;
+}
+
+void diskhash::frozen_hash_map::build(const char *filename, std::vector<record_view> const &records,
+	uint64_t source_generation)
+{
+	const unsigned MAX_SEEDS = 64;
+
+	layout_t header = {};
+	header.signature = SIGNATURE;
+	header.records_count = records.size();
+	header.table_size = std::max<uint64_t>(records.size(), uint64_t(records.size() / TABLE_LOAD) + 1);
+	header.buckets_count = records.size() / KEYS_PER_BUCKET + 2;
+	header.source_generation = source_generation;
+
+	std::vector<uint64_t> hashes(records.size());
+	std::vector<uint32_t> pilots(header.buckets_count);
+	std::vector<bool> taken(header.table_size);
+
+	for(;; header.seed++)
+	{
+		if(header.seed == MAX_SEEDS)
+		{
+			throw std::runtime_error("diskhash: could not build a perfect hash function, are keys unique?");
+		}
+
+		for(size_t i = 0; i < records.size(); i++)
+		{
+			hashes[i] = key_hash(records[i].key, header.seed);
+		}
+
+		// a 64-bit collision is unlikely but would make every pilot fail
+		std::vector<uint64_t> sorted(hashes);
+		std::sort(sorted.begin(), sorted.end());
+		if(std::adjacent_find(sorted.begin(), sorted.end()) != sorted.end())
+		{
+			continue;
+		}
+
+		if(find_pilots(hashes, header.seed, header.table_size, pilots, taken, &bucket, &position))
+		{
+			break;
+		}
+	}
+
+	// positions past the last slot are sent to the holes before it, in order
+	std::vector<uint64_t> remap(header.table_size - header.records_count, 0);
+	uint64_t hole = 0;
+
+	for(uint64_t p = header.records_count; p < header.table_size; p++)
+	{
+		if(taken[p])
+		{
+			while(taken[hole])
+			{
+				hole++;
+			}
+
+			remap[p - header.records_count] = hole++;
+		}
+	}
+
+	// records in slot order, moved to the next page if they would cross a page boundary
+	std::vector<size_t> by_slot(records.size());
+	for(size_t i = 0; i < records.size(); i++)
+	{
+		uint64_t p = position(hashes[i], pilots[bucket(hashes[i], header.buckets_count)], header.seed, header.table_size);
+		by_slot[p < header.records_count ? p : remap[p - header.records_count]] = i;
+	}
+
+	std::vector<uint64_t> offsets(records.size());
+	uint64_t data_size = 0;
+
+	for(size_t slot = 0; slot < records.size(); slot++)
+	{
+		size_t length = record_length(records[by_slot[slot]]);
+
+		if(length <= PAGE_SIZE && data_size % PAGE_SIZE + length > PAGE_SIZE)
+		{
+			data_size = align_up(data_size, PAGE_SIZE);
+		}
+
+		offsets[slot] = data_size;
+		data_size += length;
+	}
+
+	size_t pilots_bytes = align_up(pilots.size() * sizeof(uint32_t), sizeof(uint64_t));
+
+	header.data_offset = align_up(sizeof(layout_t) + pilots_bytes + remap.size() * sizeof(uint64_t)
+		+ offsets.size() * sizeof(uint64_t), PAGE_SIZE);
+	header.data_size = data_size;
+
+	std::string target_filename = std::string(filename) + "frz";
+	std::string temp_filename = target_filename + ".build";
+	std::filesystem::remove(temp_filename);
+
+	file_map map(temp_filename.c_str(), false, header.data_offset + header.data_size);
+	unsigned char *start = (unsigned char *) map.start();
+
+	unsigned char *cursor = std::copy((const unsigned char *) &header, (const unsigned char *) (&header + 1), start);
+	cursor = std::copy((const unsigned char *) pilots.data(), (const unsigned char *) (pilots.data() + pilots.size()), cursor);
+	cursor = start + sizeof(layout_t) + pilots_bytes;
+	cursor = std::copy((const unsigned char *) remap.data(), (const unsigned char *) (remap.data() + remap.size()), cursor);
+	std::copy((const unsigned char *) offsets.data(), (const unsigned char *) (offsets.data() + offsets.size()), cursor);
+
+	for(size_t slot = 0; slot < records.size(); slot++)
+	{
+		record_view const &rv = records[by_slot[slot]];
+
+		cursor = start + header.data_offset + offsets[slot];
+		cursor = std::copy((const unsigned char *) &rv.hash, (const unsigned char *) (&rv.hash + 1), cursor);
+		cursor = vbe::write(cursor, rv.key.size());
+		cursor = vbe::write(cursor, rv.value.size());
+		cursor = std::copy(rv.key.begin(), rv.key.end(), cursor);
+		std::copy(rv.value.begin(), rv.value.end(), cursor);
+	}
+
+	map.sync();
+	map.close();
+
+	std::filesystem::rename(temp_filename, target_filename);
+}
+
+bool diskhash::frozen_hash_map::exists(const char *filename)
+{
+	std::error_code ec;
+	return std::filesystem::exists(std::string(filename) + "frz", ec);
+}
@@ -0,0 +1,219 @@
+#pragma once
+
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <optional>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "settings.h"
+#include "file_map.h"
+#include "hash_map.h"
+
+namespace diskhash {
+
+// immutable, densely packed copy of a hash_map, for maps that are built once and then only read.
+//
+// the records are stored back to back in filename + "frz" and indexed by a minimal perfect hash
+// function of the key built the PTHash way: keys are spread over buckets of a few keys each,
+// every bucket stores a pilot that sends its keys to free positions of a table slightly larger
+// than the number of keys, and the positions past the last record are remapped onto the holes
+// before it. a lookup reads one pilot and one offset and then exactly one record, records no
+// larger than a page never cross a page boundary.
+class frozen_hash_map {
+public:
+	explicit frozen_hash_map(const char *filename);
+
+	// the frozen record for key if the key was in the map, nullopt otherwise. hash must be the
+	// one the source map was given for key
+	std::optional<std::string_view> find(hash_t hash, std::string_view key) const;
+
+	size_t size() const {
+		return layout_->records_count;
+	}
+
+	// container::write_generation() of the map at the time it was frozen
+	uint64_t source_generation() const {
+		return layout_->source_generation;
+	}
+
+	size_t bytes_allocated() const {
+		return file_map_.length();
+	}
+
+	void close() {
+		file_map_.close();
+		layout_ = 0;
+	}
+
+	// write records into filename + "frz", replacing an existing frozen copy atomically
+	static void build(const char *filename, std::vector<record_view> const &records, uint64_t source_generation);
+
+	// true if filename + "frz" exists
+	static bool exists(const char *filename);
+
+	class const_iterator {
+	public:
+		using value_type = std::pair<std::string_view, std::string_view>;
+
+		const_iterator(): map_(nullptr), slot_(0) {}
+
+		const_iterator(const frozen_hash_map *map, size_t slot): map_(map), slot_(slot) {}
+
+		value_type operator*() const
+		{
+			record_view rv;
+			map_->read_record(slot_, rv);
+			return {rv.key, rv.value};
+		}
+
+		const_iterator &operator++()
+		{
+			slot_++;
+			return *this;
+		}
+
+		bool operator==(const const_iterator &o) const { return slot_ == o.slot_; }
+		bool operator!=(const const_iterator &o) const { return slot_ != o.slot_; }
+
+	private:
+		const frozen_hash_map *map_;
+		size_t slot_;
+	};
+
+	const_iterator begin() const
+	{
+		return const_iterator(this, 0);
+	}
+
+	const_iterator end() const
+	{
+		return const_iterator(this, size());
+	}
+
+	// see hash_map::parallel_scan(), records are passed on in batches of SCAN_BATCH
+	template<class Visitor>
+	void parallel_scan(size_t threads, Visitor &&visit) const
+	{
+		threads = std::max<size_t>(threads, 1);
+
+		run_parallel(threads, [&](size_t range, std::atomic<bool> const &failed) {
+			std::vector<record_view> batch;
+			size_t last_slot = size() * (range + 1) / threads;
+
+			for(size_t slot = size() * range / threads; slot < last_slot && !failed.load(std::memory_order_relaxed); )
+			{
+				batch.clear();
+
+				for(; slot < last_slot && batch.size() < SCAN_BATCH; slot++)
+				{
+					record_view rv;
+
+					if(read_record(slot, rv))
+					{
+						batch.push_back(rv);
+					}
+				}
+
+				if(!batch.empty())
+				{
+					visit(range, static_cast<std::vector<record_view> const &>(batch));
+				}
+			}
+		});
+	}
+
+private:
+	static const unsigned SIGNATURE = 0x7f0e2a11;
+
+	// average number of keys per pilot and fraction of table positions holding a key
+	static const size_t KEYS_PER_BUCKET = 5;
+	static constexpr double TABLE_LOAD = 0.99;
+
+	static const size_t PAGE_SIZE = 4096;
+
+	static const size_t SCAN_BATCH = 256;
+
+#pragma pack(push, 1)
+	// followed by uint32_t pilots[buckets_count], uint64_t remap[table_size - records_count]
+	// and uint64_t offsets[records_count], records start at data_offset
+	struct layout_t {
+		unsigned signature;
+		unsigned flags;
+		uint64_t seed;
+		uint64_t records_count;
+		uint64_t table_size;
+		uint64_t buckets_count;
+		uint64_t source_generation;
+		uint64_t data_offset;
+		uint64_t data_size;
+	};
+#pragma pack(pop)
+
+	file_map file_map_;
+	const layout_t *layout_;
+	const uint32_t *pilots_;
+	const uint64_t *remap_;
+	const uint64_t *offsets_;
+	const unsigned char *data_;
+
+	static uint64_t key_hash(std::string_view key, uint64_t seed);
+	static uint64_t bucket(uint64_t key_hash, uint64_t buckets_count);
+	static uint64_t position(uint64_t key_hash, uint32_t pilot, uint64_t seed, uint64_t table_size);
+
+	// slot of a key, whether or not it is in the map
+	uint64_t slot(uint64_t key_hash) const;
+
+	// parse the record in slot, return false if it does not fit into the data
+	bool read_record(size_t slot, record_view &rv) const;
+};
+
+// write a frozen copy of map into filename + "frz", see frozen_hash_map. the map must not be
+// modified while it is being frozen. a read-only map may be written by another process, then
+// this throws rather than write a copy that is no snapshot
+template<size_t BucketSize>
+void freeze(hash_map<BucketSize> const &map, const char *filename)
+{
+	std::vector<record_view> records;
+	uint64_t generation = map.write_generation();
+
+	// the views of a read-only map are only valid until the next batch
+	std::deque<std::string> copies;
+
+	map.scan([&](std::vector<record_view> const &batch) {
+		size_t first = records.size();
+		records.insert(records.end(), batch.begin(), batch.end());
+
+		if(map.read_only())
+		{
+			std::string &copy = copies.emplace_back();
+
+			for(auto const &rv : batch)
+			{
+				copy.append(rv.key).append(rv.value);
+			}
+
+			const char *data = copy.data();
+
+			for(size_t i = first; i < records.size(); i++)
+			{
+				records[i].key = std::string_view(data, records[i].key.size());
+				records[i].value = std::string_view(data + records[i].key.size(), records[i].value.size());
+				data += records[i].key.size() + records[i].value.size();
+			}
+		}
+	});
+
+	if(map.write_generation() != generation)
+	{
+		throw std::runtime_error("diskhash: map modified while it was being frozen");
+	}
+
+	frozen_hash_map::build(filename, records, generation);
+}
+
+// namespace diskhash
+}
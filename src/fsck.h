@@ -0,0 +1,378 @@
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "container.h"
+#include "catalogue.h"
+#include "hash_map.h"
+#include "vbe.h"
+
+namespace diskhash {
+
+struct fsck_report {
+	size_t buckets_count = 0;
+	size_t free_buckets = 0;
+
+	// buckets failing container::verify_bucket
+	std::vector<size_t> corrupted_buckets;
+
+	// chain heads holding records that the catalogue maps to some other bucket
+	std::vector<size_t> misplaced_buckets;
+
+	// catalogue entries pointing past the last bucket
+	size_t bad_catalogue_entries = 0;
+
+	// counted from the buckets that are not corrupted
+	size_t records = 0;
+
+	// the usage counters in the header disagree with bucket contents, see container::recount()
+	bool bad_usage_counters = false;
+
+	bool ok() const {
+		return corrupted_buckets.empty() && misplaced_buckets.empty() && bad_catalogue_entries == 0
+			&& !bad_usage_counters;
+	}
+};
+
+// verify every bucket of cont and check that cat sends every stored record to its own chain
+template<size_t BucketSize>
+fsck_report check(catalogue const &cat, container<BucketSize> const &cont)
+{
+	fsck_report report;
+	report.buckets_count = cont.buckets_count();
+
+	std::vector<bool> corrupted(report.buckets_count, false);
+	usage_stats usage;
+
+	for(size_t bucket_id = 0; bucket_id < report.buckets_count; bucket_id++)
+	{
+		if(!cont.verify_bucket(bucket_id))
+		{
+			corrupted[bucket_id] = true;
+			report.corrupted_buckets.push_back(bucket_id);
+			continue;
+		}
+
+		record_view rv;
+		for(size_t offset = 0; cont.read_record(bucket_id, offset, rv); )
+		{
+			usage.records++;
+			usage.key_bytes += rv.key.size();
+			usage.value_bytes += rv.value.size();
+		}
+	}
+
+	report.records = usage.records;
+
+	// a corrupted link could make the free list loop, so never walk more than all buckets
+	for(size_t bucket_id = cont.first_free_bucket(); bucket_id < report.buckets_count
+		&& report.free_buckets < report.buckets_count; bucket_id = cont.next_bucket(bucket_id))
+	{
+		report.free_buckets++;
+
+		if(corrupted[bucket_id])
+		{
+			break;
+		}
+	}
+
+	usage_stats header = cont.usage();
+	report.bad_usage_counters = report.corrupted_buckets.empty() && (header.records != usage.records
+		|| header.key_bytes != usage.key_bytes || header.value_bytes != usage.value_bytes
+		|| header.free_buckets != report.free_buckets);
+
+	for(catalogue::const_iterator it = cat.begin(); it != cat.end(); ++it)
+	{
+		if(*it >= report.buckets_count)
+		{
+			report.bad_catalogue_entries++;
+			continue;
+		}
+
+		if(it != cat.begin() && *it == *(it - 1))
+		{
+			continue;
+		}
+
+		bool misplaced = false;
+		size_t chain_length = 0;
+
+		for(size_t bucket_id = *it; bucket_id != container<BucketSize>::invalid_bucket_id() && !misplaced
+			&& chain_length++ < report.buckets_count; bucket_id = cont.next_bucket(bucket_id))
+		{
+			if(bucket_id >= report.buckets_count || corrupted[bucket_id])
+			{
+				break;
+			}
+
+			record_view rv;
+			for(size_t offset = 0; cont.read_record(bucket_id, offset, rv); )
+			{
+				if(cat.find(rv.hash) != *it)
+				{
+					misplaced = true;
+					break;
+				}
+			}
+		}
+
+		if(misplaced)
+		{
+			report.misplaced_buckets.push_back(*it);
+		}
+	}
+
+	return report;
+}
+
+// write a new catalogue for cont into filename, derived from bucket contents alone: every chain
+// head is mapped to the hash prefix of its records, catalogue slots left without a chain get
+// unused empty heads or new empty buckets. cont must not contain corrupted buckets.
+// returns the number of buckets created.
+template<size_t BucketSize>
+size_t rebuild_catalogue(container<BucketSize> &cont, const char *filename)
+{
+	typedef container<BucketSize> container_type;
+
+	size_t buckets_count = cont.buckets_count();
+
+	std::vector<bool> is_head(buckets_count, true);
+
+	for(size_t bucket_id = cont.first_free_bucket(); bucket_id != container_type::invalid_bucket_id();
+		bucket_id = cont.next_bucket(bucket_id))
+	{
+		is_head[bucket_id] = false;
+	}
+
+	for(size_t bucket_id = 0; bucket_id < buckets_count; bucket_id++)
+	{
+		size_t next_bucket_id = cont.next_bucket(bucket_id);
+
+		if(is_head[bucket_id] && next_bucket_id != container_type::invalid_bucket_id())
+		{
+			is_head[next_bucket_id] = false;
+		}
+	}
+
+	size_t prefix_bits = 1;
+
+	for(size_t bucket_id = 0; bucket_id < buckets_count; bucket_id++)
+	{
+		if(is_head[bucket_id])
+		{
+			prefix_bits = std::max(prefix_bits, cont.bucket_prefix_bits(bucket_id));
+		}
+	}
+
+	std::string temp_filename = std::string(filename) + ".rebuild";
+	std::filesystem::remove(temp_filename);
+
+	catalogue cat(temp_filename.c_str(), prefix_bits);
+
+	// empty heads by prefix_bits, they can fill any aligned gap of matching size
+	std::vector<std::vector<size_t>> empty_heads(prefix_bits + 1);
+
+	for(size_t bucket_id = 0; bucket_id < buckets_count; bucket_id++)
+	{
+		if(!is_head[bucket_id])
+		{
+			continue;
+		}
+
+		record_view rv;
+		bool found = false;
+
+		for(size_t id = bucket_id; id != container_type::invalid_bucket_id() && !found; id = cont.next_bucket(id))
+		{
+			size_t offset = 0;
+			found = cont.read_record(id, offset, rv);
+		}
+
+		if(found)
+		{
+			cat.set(rv.hash, cont.bucket_prefix_bits(bucket_id), bucket_id);
+		}
+		else
+		{
+			empty_heads[cont.bucket_prefix_bits(bucket_id)].push_back(bucket_id);
+		}
+	}
+
+	size_t buckets_created = 0;
+	catalogue::iterator begin = cat.begin();
+	size_t catalogue_size = cat.end() - cat.begin();
+
+	for(size_t index = 0; index < catalogue_size; index++)
+	{
+		if(begin[index] != catalogue::INVALID_BLOCK_ID)
+		{
+			continue;
+		}
+
+		hash_t hash = hash_t(index) << cat.prefix_shift();
+		bool filled = false;
+
+		for(size_t bits = 1; bits <= prefix_bits && !filled; bits++)
+		{
+			size_t block = size_t(1) << (prefix_bits - bits);
+
+			if(empty_heads[bits].empty() || index % block != 0
+				|| std::any_of(begin + index, begin + index + block,
+					[](size_t v) { return v != catalogue::INVALID_BLOCK_ID; }))
+			{
+				continue;
+			}
+
+			cat.set(hash, bits, empty_heads[bits].back());
+			empty_heads[bits].pop_back();
+			filled = true;
+		}
+
+		if(!filled)
+		{
+			cat.set(hash, prefix_bits, cont.create_bucket(prefix_bits));
+			buckets_created++;
+		}
+	}
+
+	cat.sync();
+	cat.close();
+
+	std::filesystem::rename(temp_filename, filename);
+
+	return buckets_created;
+}
+
+// copy the records of the diskhash 1.0 map at filename into a map of the current format, with
+// checksums if asked, and put it in place of the old one. 1.0 maps can be used as they are,
+// converted ones keep their counters and write generation in the file, see container::legacy().
+// the old catalogue is not read, so if the process dies after replacing the catalogue and before
+// replacing the data file, running it again finishes the job. returns the number of records
+inline size_t upgrade_legacy(const std::string &filename, bool checksums)
+{
+	// 1.0 layout: signature, bucket count and free list head, then buckets of three size_t,
+	// prefix bits, bytes used and next bucket, and the records
+	const size_t header_size = sizeof(unsigned) + 2 * sizeof(size_t);
+	const size_t bucket_size = 4096;
+	const size_t bucket_header_size = 3 * sizeof(size_t);
+	const size_t invalid_bucket_id = size_t(-1);
+
+	std::string dat_filename = filename + "dat";
+	std::string temp_filename = filename + "_upgrade_";
+	std::filesystem::remove(temp_filename + "cat");
+	std::filesystem::remove(temp_filename + "dat");
+
+	size_t records = 0;
+	{
+		file_map old(dat_filename.c_str(), true);
+		const unsigned char *start = static_cast<const unsigned char *>(old.start());
+
+		unsigned signature = 0;
+		size_t buckets_count = 0;
+		size_t first_free_bucket_id = invalid_bucket_id;
+
+		if(old.length() >= header_size)
+		{
+			std::memcpy(&signature, start, sizeof(unsigned));
+			std::memcpy(&buckets_count, start + sizeof(unsigned), sizeof(size_t));
+			std::memcpy(&first_free_bucket_id, start + sizeof(unsigned) + sizeof(size_t), sizeof(size_t));
+		}
+
+		if(signature != container<>::LEGACY_SIGNATURE)
+		{
+			throw std::runtime_error(dat_filename + " is not a diskhash 1.0 data file");
+		}
+		if(buckets_count > (old.length() - header_size) / bucket_size)
+		{
+			throw std::runtime_error(dat_filename + " is truncated");
+		}
+
+		auto field = [&](size_t bucket_id, size_t index) {
+			size_t value;
+			std::memcpy(&value, start + header_size + bucket_id * bucket_size + index * sizeof(size_t), sizeof(size_t));
+			return value;
+		};
+
+		// a corrupted link could make the free list loop, so never walk more than all buckets
+		std::vector<bool> free_bucket(buckets_count, false);
+		for(size_t bucket_id = first_free_bucket_id, steps = 0; bucket_id < buckets_count && steps < buckets_count;
+			bucket_id = field(bucket_id, 2), steps++)
+		{
+			free_bucket[bucket_id] = true;
+		}
+
+		hash_map<> map(temp_filename.c_str(), false, false, checksums);
+
+		for(size_t bucket_id = 0; bucket_id < buckets_count; bucket_id++)
+		{
+			size_t bytes_used = field(bucket_id, 1);
+			if(free_bucket[bucket_id])
+			{
+				continue;
+			}
+			if(bytes_used > bucket_size - bucket_header_size)
+			{
+				throw std::runtime_error(dat_filename + ": corrupted bucket " + std::to_string(bucket_id));
+			}
+
+			const unsigned char *cursor = start + header_size + bucket_id * bucket_size + bucket_header_size;
+			const unsigned char *end = cursor + bytes_used;
+
+			while(cursor != end)
+			{
+				hash_t hash;
+				size_t key_length, value_length;
+
+				if(size_t(end - cursor) < sizeof(hash_t))
+				{
+					throw std::runtime_error(dat_filename + ": corrupted bucket " + std::to_string(bucket_id));
+				}
+
+				std::memcpy(&hash, cursor, sizeof(hash_t));
+
+				if(!(cursor = vbe::read(cursor + sizeof(hash_t), end, key_length))
+					|| !(cursor = vbe::read(cursor, end, value_length))
+					|| size_t(end - cursor) < key_length
+					|| size_t(end - cursor) - key_length < value_length)
+				{
+					throw std::runtime_error(dat_filename + ": corrupted bucket " + std::to_string(bucket_id));
+				}
+
+				std::string_view key(reinterpret_cast<const char *>(cursor), key_length);
+				std::string_view value(reinterpret_cast<const char *>(cursor + key_length), value_length);
+
+				// checksums take room from the records, so the largest 1.0 records may no longer fit
+				if(sizeof(hash_t) + vbe::length(key_length) + key_length + vbe::length(value_length) + value_length
+					> DEFAULT_BUCKET_SIZE - (checksums ? container<>::CHECKSUM_BYTES : 0))
+				{
+					throw std::runtime_error(dat_filename + ": a record in bucket " + std::to_string(bucket_id)
+						+ " is too large for the current format");
+				}
+
+				map.get(hash, key, value);
+				records++;
+
+				cursor += key_length + value_length;
+			}
+		}
+
+		map.close();
+		old.close();
+	}
+
+	std::filesystem::rename(temp_filename + "cat", filename + "cat");
+	std::filesystem::rename(temp_filename + "dat", dat_filename);
+
+	// filters and journals did not exist in 1.0
+	std::filesystem::remove(filename + "flt");
+
+	return records;
+}
+
+// namespace diskhash
+}
@@ -1,19 +1,183 @@
 #pragma once
 
+#include <assert.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <optional>
+#include <stdexcept>
+#include <string>
 #include <string_view>
+#include <thread>
+#include <vector>
 #include "container.h"
 #include "catalogue.h"
+#include "journal.h"
 
 namespace diskhash {
 
+// run f(part, failed) for part in [0, parts) on parts threads. once f throws, failed is set so
+// that the others can stop early, and the first exception is rethrown after all have finished
+template<class F>
+void run_parallel(size_t parts, F &&f)
+{
+	std::vector<std::thread> workers;
+	std::exception_ptr error;
+	std::mutex error_mutex;
+	std::atomic<bool> failed(false);
+
+	auto fail = [&]() {
+		std::lock_guard lock(error_mutex);
+
+		if(!error)
+		{
+			error = std::current_exception();
+		}
+
+		failed.store(true, std::memory_order_relaxed);
+	};
+
+	for(size_t part = 0; part < parts && !failed.load(std::memory_order_relaxed); part++)
+	{
+		try
+		{
+			workers.emplace_back([&, part]() {
+				try
+				{
+					f(part, static_cast<std::atomic<bool> const &>(failed));
+				}
+				catch(...)
+				{
+					fail();
+				}
+			});
+		}
+		catch(...)
+		{
+			// no thread for this part, the ones already running still have to be joined
+			fail();
+		}
+	}
+
+	for(auto &worker : workers)
+	{
+		worker.join();
+	}
+
+	if(error)
+	{
+		std::rethrow_exception(error);
+	}
+}
+
+// shape of a hash_map, see hash_map::structure_stats()
+struct structure_stats {
+	static constexpr size_t FILL_BINS = 10;
+
+	// chain_lengths[n] chains of n buckets
+	std::vector<size_t> chain_lengths;
+
+	// bucket_fill[i] buckets in chains whose records take i to i + 1 tenths of the bucket,
+	// full buckets are counted in the last bin
+	std::vector<size_t> bucket_fill = std::vector<size_t>(FILL_BINS);
+
+	// local_depths[d] chains whose records share a d bit hash prefix, the catalogue is
+	// indexed by global_depth bits
+	std::vector<size_t> local_depths;
+	size_t global_depth = 0;
+
+	size_t buckets = 0;
+	size_t chains = 0;
+	size_t free_buckets = 0;
+	size_t bytes_used = 0;
+
+	// over the life of the map, see growth_stats. the catalogue file grows exactly when the
+	// catalogue doubles
+	size_t splits = 0;
+	size_t catalogue_doublings = 0;
+	size_t file_resizes = 0;
+	size_t bytes_moved = 0;
+
+	size_t median_local_depth() const
+	{
+		for(size_t depth = 0, seen = 0; depth < local_depths.size(); depth++)
+		{
+			seen += local_depths[depth];
+
+			if(2 * seen >= chains)
+			{
+				return depth;
+			}
+		}
+
+		return 0;
+	}
+
+	// add up the counts of several maps, such as the shards of a server
+	void merge(structure_stats const &other)
+	{
+		auto add = [](std::vector<size_t> &to, std::vector<size_t> const &from) {
+			to.resize(std::max(to.size(), from.size()));
+			std::transform(from.begin(), from.end(), to.begin(), to.begin(), std::plus<size_t>());
+		};
+
+		add(chain_lengths, other.chain_lengths);
+		add(bucket_fill, other.bucket_fill);
+		add(local_depths, other.local_depths);
+		global_depth = std::max(global_depth, other.global_depth);
+
+		buckets += other.buckets;
+		chains += other.chains;
+		free_buckets += other.free_buckets;
+		bytes_used += other.bytes_used;
+
+		splits += other.splits;
+		catalogue_doublings += other.catalogue_doublings;
+		file_resizes += other.file_resizes;
+		bytes_moved += other.bytes_moved;
+	}
+};
+
 template<size_t BucketSize = DEFAULT_BUCKET_SIZE>
 class hash_map {
 public:
-	hash_map(const char *filename, bool read_only = false):
+	// durable maps keep an undo journal in filename + "jnl", so a crash in the middle of a split
+	// is rolled back on the next open instead of losing records. plain inserts are not journaled.
+	// checksums is fixed when the map is created, see container.
+	//
+	// one process at a time may open a map for writing, any number of processes may open it
+	// read-only at the same time, see find()
+	//
+	// with filters a Bloom filter of every bucket chain is kept in filename + "flt" and checked
+	// before the chain is read, see bucket_filter. read-only maps use the filter if a writer
+	// left one in sync with the map
+	hash_map(const char *filename, bool read_only = false, bool durable = false, bool checksums = false,
+		bool filters = false):
+		lock_(read_only ? nullptr : std::make_unique<file_lock>((std::string(filename) + "dat").c_str())),
+		journal_(open_journal(filename, read_only, durable)),
 		catalogue_((std::string(filename) + "cat").c_str(), 1, read_only),
-		container_((std::string(filename) + "dat").c_str(), read_only)
+		container_((std::string(filename) + "dat").c_str(), read_only, checksums)
 	{
+		std::string filter_filename = std::string(filename) + "flt";
+
+		// before reset_writes(), which moves the generation the filter was closed at
+		if(filters && (!read_only || std::filesystem::exists(filter_filename)))
+		{
+			container_.open_filter(filter_filename.c_str(), read_only);
+		}
+
+		if(read_only)
+		{
+			return;
+		}
+
+		container_.reset_writes();
+
 		if(container_.buckets_count() == 0)
 		{
 			catalogue_.find(hash_t(0)) = container_.create_bucket(1);
@@ -30,15 +194,25 @@ public:
 			return result;
 		}
 
+		write_section section(container_);
+
 		if(container_.bucket_to_split(bucket_id))
 		{
-			if(container_.bucket_prefix_bits(bucket_id) == catalogue_.prefix_bits()
-				&& (container_.buckets_count()) > (size_t(1) << catalogue_.prefix_bits()))
+			bool split_catalogue = container_.bucket_prefix_bits(bucket_id) == catalogue_.prefix_bits()
+				&& (container_.buckets_count()) > (size_t(1) << catalogue_.prefix_bits());
+			bool split_bucket = split_catalogue || container_.bucket_prefix_bits(bucket_id) < catalogue_.prefix_bits();
+
+			if(journal_ && split_bucket)
+			{
+				begin_split(bucket_id, hash, split_catalogue);
+			}
+
+			if(split_catalogue)
 			{
 				catalogue_.split();
 			}
 
-			if(container_.bucket_prefix_bits(bucket_id) < catalogue_.prefix_bits())
+			if(split_bucket)
 			{
 				size_t new_bucket_id = container_.split(bucket_id);
 				size_t prefix_bits = container_.bucket_prefix_bits(bucket_id);
@@ -56,39 +230,599 @@ public:
 
 				assert(catalogue_.find(hash) == bucket_id);
 			}
+
+			if(journal_ && split_bucket)
+			{
+				end_split();
+			}
 		}
 
 		return container_.create_record(bucket_id, hash, key, default_value);
 	}
 
+	// on read-only maps the lookup is validated against writes of the process holding the
+	// writer lock and the files are remapped when they have grown. the returned view points
+	// into the mapping, a writer may change what it holds after find() has returned
 	std::optional<std::string_view> find(hash_t hash, std::string_view key) const {
+		if(!lock_)
+		{
+			return find_shared(hash, key);
+		}
+
 		size_t bucket_id = catalogue_.find(hash);
 		return container_.find_record(bucket_id, hash, key);
 	}
 
 	bool remove(hash_t hash, std::string_view key) {
 		size_t bucket_id = catalogue_.find(hash);
+
+		write_section section(container_);
 		return container_.remove_record(bucket_id, hash, key);
 	}
 
+	// head of the bucket chain hash belongs to
+	size_t find_bucket(hash_t hash) const {
+		return catalogue_.find(hash);
+	}
+
+	// true if inserting hash may split its bucket, and with it possibly the catalogue
+	bool may_split(hash_t hash) const {
+		return container_.bucket_to_split(catalogue_.find(hash));
+	}
+
+	// lock-free lookup primitives for concurrent_hash_map, safe to call while another thread
+	// modifies the map as long as mappings are retired through set_retire_function()
+	size_t find_bucket_speculative(hash_t hash) const {
+		return catalogue_.find_speculative(hash);
+	}
+
+	// see container::probe_view()
+	probe_result probe(size_t bucket_id, hash_t hash, std::string_view key, std::string &value,
+		size_t *corrupted_bucket_id = nullptr) const {
+		return container_.probe_record(bucket_id, hash, key, value, corrupted_bucket_id);
+	}
+
+	probe_result probe(size_t bucket_id, hash_t hash, std::string_view key, std::string_view &value,
+		size_t *corrupted_bucket_id = nullptr) const {
+		return container_.probe_view(bucket_id, hash, key, value, corrupted_bucket_id);
+	}
+
+	// let writers of different bucket chains run concurrently, see container::set_concurrent()
+	void set_concurrent() {
+		container_.set_concurrent();
+	}
+
+	void reserve(size_t buckets) {
+		container_.reserve(buckets);
+	}
+
+	// number of buckets in the chain hash belongs to
+	size_t chain_length(hash_t hash) const {
+		return container_.chain_length(catalogue_.find(hash));
+	}
+
+	void set_retire_function(std::function<void(void *, size_t)> f) {
+		catalogue_.set_retire_function(f);
+		container_.set_retire_function(f);
+	}
+
 	size_t bytes_allocated() const {
 		return container_.bytes_allocated() + catalogue_.bytes_allocated();
 	}
 
+	// opened without the writer lock, see find()
+	bool read_only() const {
+		return !lock_;
+	}
+
+	// changes with every modification, see container::begin_write()
+	uint64_t write_generation() const {
+		return container_.write_generation();
+	}
+
+	size_t buckets_count() const {
+		return container_.buckets_count();
+	}
+
+	// number of records, O(1)
+	size_t size() const {
+		return container_.usage().records;
+	}
+
+	// record count, live key and value bytes and free buckets, O(1)
+	usage_stats usage() const {
+		return container_.usage();
+	}
+
+	// write the catalogue and the container to filename + "cat" and filename + "dat", where
+	// hash_map(filename) opens them. the filter is left out and rebuilt by the first writable
+	// open. must not run concurrently with modifications in this process
+	void snapshot(const char *filename) const {
+		catalogue_.copy_to((std::string(filename) + "cat").c_str());
+		container_.copy_to((std::string(filename) + "dat").c_str());
+	}
+
+	// walks the catalogue and the bucket headers of every chain, without reading records.
+	// must not run concurrently with modifications in this process, on read-only maps the
+	// result is approximate if another process writes meanwhile
+	diskhash::structure_stats structure_stats() const {
+		diskhash::structure_stats result;
+
+		if(!lock_)
+		{
+			catalogue_.refresh();
+			container_.refresh();
+		}
+
+		const catalogue::value_type *slots = catalogue_.begin();
+		size_t slots_count = catalogue_size();
+
+		result.global_depth = catalogue_.prefix_bits();
+		result.local_depths.resize(result.global_depth + 1);
+		result.buckets = container_.buckets_count();
+		result.free_buckets = container_.usage().free_buckets;
+
+		for(size_t index = 0; index < slots_count; index++)
+		{
+			if(index != 0 && slots[index] == slots[index - 1])
+			{
+				continue;
+			}
+
+			size_t length = 0;
+
+			// bounded, so that a racing writer cannot send the walk out of the mapping or around a loop
+			for(size_t bucket_id = slots[index]; bucket_id < result.buckets && length < result.buckets;
+				bucket_id = container_.next_bucket(bucket_id))
+			{
+				size_t bytes_used = container_.bucket_bytes_used(bucket_id);
+
+				result.bucket_fill[std::min(bytes_used * result.FILL_BINS / container_.bucket_capacity(), result.FILL_BINS - 1)]++;
+				result.bytes_used += bytes_used;
+				length++;
+			}
+
+			if(length >= result.chain_lengths.size())
+			{
+				result.chain_lengths.resize(length + 1);
+			}
+
+			result.chain_lengths[length]++;
+			if(slots[index] < result.buckets)
+			{
+				result.local_depths[std::min(container_.bucket_prefix_bits(slots[index]), result.global_depth)]++;
+			}
+
+			result.chains++;
+		}
+
+		growth_stats growth = container_.growth();
+		result.splits = growth.splits;
+		result.catalogue_doublings = std::max<size_t>(result.global_depth, 1) - 1;
+		result.file_resizes = growth.resizes;
+		result.bytes_moved = growth.bytes_moved;
+
+		return result;
+	}
+
+	// lookups answered by the bucket filters, nullopt if the map has none
+	std::optional<diskhash::filter_stats> filter_stats() const {
+		return container_.filter_stats();
+	}
+
+	bool verify_bucket(size_t bucket_id) const {
+		return container_.verify_bucket(bucket_id);
+	}
+
 	void close() {
+		if(journal_)
+		{
+			journal_->close();
+		}
+
 		catalogue_.close();
 		container_.close();
+		lock_.reset();
+	}
+
+	// reads the map a bucket at a time, for full scans: chains are visited in catalogue order
+	// with repeated catalogue slots skipped, every record is decoded once and the chain heads
+	// of the next slots are read ahead. the views point into the mapping and are invalidated by
+	// modifications, which may also make the cursor skip or repeat records
+	//
+	// on read-only maps it reads a chain at a time instead and validates it against writes of
+	// another process as find() does, so that a chain is either seen whole or read again. the
+	// records are copied out of the mapping, which the writer may change or move, and their
+	// views stay valid until the next call
+	//
+	// a cursor over catalogue slots [first_slot, last_slot) visits the chains whose first slot
+	// lies in the range, so cursors over adjacent ranges never visit a chain twice. slots are
+	// those of a catalogue of the size it had when the cursor was created, the cursor follows
+	// it as it doubles
+	class cursor {
+	public:
+		explicit cursor(const hash_map *map, size_t first_slot = 0, size_t last_slot = size_t(-1)):
+			map_(map), catalogue_size_(map->catalogue_size()), next_index_(first_slot), end_index_(last_slot),
+			readahead_index_(0), bucket_id_(container_type::invalid_bucket_id())
+		{
+		}
+
+		// replace batch with the records of the next bucket holding any, false at the end
+		bool next(std::vector<record_view> &batch)
+		{
+			if(!map_->lock_)
+			{
+				return next_shared(batch, true) == CHAIN_READ;
+			}
+
+			batch.clear();
+
+			while(batch.empty())
+			{
+				if(bucket_id_ == container_type::invalid_bucket_id())
+				{
+					follow_catalogue(map_->catalogue_size());
+
+					if(!next_chain())
+					{
+						return false;
+					}
+
+					if(bucket_id_ >= map_->container_.buckets_count())
+					{
+						throw std::runtime_error("diskhash: corrupted catalogue");
+					}
+				}
+
+				size_t bucket_id = bucket_id_;
+				bucket_id_ = map_->container_.next_bucket(bucket_id);
+
+				if(bucket_id_ != container_type::invalid_bucket_id() && bucket_id_ >= map_->container_.buckets_count())
+				{
+					throw checksum_error(bucket_id);
+				}
+
+				map_->container_.read_records(bucket_id, batch);
+			}
+
+			return true;
+		}
+
+		// true while no chain has been read in part
+		bool at_chain_end() const
+		{
+			return bucket_id_ == container_type::invalid_bucket_id();
+		}
+
+		// at_chain_end(), the lowest hash of the chains not visited yet, 1 << HASH_BITS if there
+		// are none. splits only divide chains and the catalogue only doubles, so scan_from()
+		// this position after any modifications visits exactly the chains holding larger hashes
+		uint64_t position() const
+		{
+			const catalogue::value_type *slots = map_->catalogue_.begin();
+			size_t catalogue_size = map_->catalogue_size();
+			size_t scale = std::max<size_t>(catalogue_size / catalogue_size_, 1);
+			size_t slots_count = end_index_ == size_t(-1) ? catalogue_size : std::min(catalogue_size, end_index_ * scale);
+			size_t index = next_index_ * scale;
+
+			while(index < slots_count && index != 0 && slots[index] == slots[index - 1])
+			{
+				index++;
+			}
+
+			return (uint64_t(std::min(index, slots_count)) << HASH_BITS) / catalogue_size;
+		}
+
+	private:
+		friend class hash_map;
+
+		// catalogue slots whose chain heads are requested ahead of the scan
+		static const size_t READAHEAD = 64;
+
+		// outcome of read_chain() and next_shared()
+		enum chain_result { CHAIN_READ, CHAIN_END, CHAIN_STALE, CHAIN_CORRUPTED };
+
+		const hash_map *map_;
+		size_t catalogue_size_;
+		size_t next_index_;
+		size_t end_index_;
+		size_t readahead_index_;
+		size_t bucket_id_;
+
+		// copies of the records of the last chain read from a read-only map
+		std::string records_;
+
+		// next() for read-only maps, CHAIN_READ with a chain holding records or CHAIN_END. if the
+		// files have grown past the mappings and refresh is false, it returns CHAIN_STALE instead
+		// of remapping them and the next call reads the same chain
+		chain_result next_shared(std::vector<record_view> &batch, bool refresh)
+		{
+			for(;;)
+			{
+				uint64_t generation = map_->begin_shared_read(refresh);
+				records_.clear();
+				cursor saved = *this;
+				size_t corrupted_bucket_id = container_type::invalid_bucket_id();
+				chain_result result = CHAIN_CORRUPTED;
+				bool consistent;
+
+				try
+				{
+					result = read_chain(batch, corrupted_bucket_id);
+					consistent = map_->end_shared_read(generation);
+				}
+				catch(checksum_error const &)
+				{
+					// nothing was being written, so the checksum really does not match
+					if(map_->end_shared_read(generation))
+					{
+						throw;
+					}
+
+					consistent = false;
+				}
+
+				if(!consistent)
+				{
+					*this = saved;
+					continue;
+				}
+
+				switch(result)
+				{
+				case CHAIN_READ:
+					if(batch.empty())
+					{
+						continue;
+					}
+
+					return result;
+				case CHAIN_END:
+					return result;
+				case CHAIN_STALE:
+					*this = saved;
+
+					if(!refresh)
+					{
+						return result;
+					}
+
+					// begin_shared_read() remaps the files
+					continue;
+				default:
+					if(corrupted_bucket_id == container_type::invalid_bucket_id())
+					{
+						throw std::runtime_error("diskhash: corrupted catalogue");
+					}
+
+					throw checksum_error(corrupted_bucket_id);
+				}
+			}
+		}
+
+		// replace batch with the records of the next chain without trusting anything the files
+		// hold, next_shared() validates the result. CHAIN_CORRUPTED sets corrupted_bucket_id to
+		// the bucket linking to a bucket that does not exist, or leaves it for the catalogue
+		chain_result read_chain(std::vector<record_view> &batch, size_t &corrupted_bucket_id)
+		{
+			batch.clear();
+
+			size_t catalogue_size = map_->catalogue_size();
+			if(catalogue_size > map_->catalogue_.capacity())
+			{
+				return CHAIN_STALE;
+			}
+
+			follow_catalogue(catalogue_size);
+
+			if(!next_chain())
+			{
+				return CHAIN_END;
+			}
+
+			size_t buckets_count = map_->container_.buckets_count();
+			size_t capacity = map_->container_.capacity();
+
+			for(size_t steps = 0; bucket_id_ != container_type::invalid_bucket_id(); steps++)
+			{
+				if(bucket_id_ >= buckets_count || steps >= buckets_count)
+				{
+					return CHAIN_CORRUPTED;
+				}
+
+				if(bucket_id_ >= capacity)
+				{
+					return CHAIN_STALE;
+				}
+
+				size_t bucket_id = bucket_id_;
+				map_->container_.read_records(bucket_id, batch);
+				bucket_id_ = map_->container_.next_bucket(bucket_id);
+				corrupted_bucket_id = bucket_id;
+			}
+
+			for(auto const &rv : batch)
+			{
+				records_.append(rv.key).append(rv.value);
+			}
+
+			const char *copy = records_.data();
+
+			for(auto &rv : batch)
+			{
+				rv.key = std::string_view(copy, rv.key.size());
+				rv.value = std::string_view(copy + rv.key.size(), rv.value.size());
+				copy += rv.key.size() + rv.value.size();
+			}
+
+			return CHAIN_READ;
+		}
+
+		// a split of the catalogue duplicates slot i into 2i and 2i + 1, so the slots of the
+		// cursor double with it
+		void follow_catalogue(size_t catalogue_size)
+		{
+			while(catalogue_size_ < catalogue_size)
+			{
+				catalogue_size_ *= 2;
+				next_index_ *= 2;
+				readahead_index_ *= 2;
+
+				if(end_index_ != size_t(-1))
+				{
+					end_index_ *= 2;
+				}
+			}
+		}
+
+		bool next_chain()
+		{
+			const catalogue::value_type *slots = map_->catalogue_.begin();
+			size_t slots_count = std::min(catalogue_size_, end_index_);
+
+			while(next_index_ < slots_count && next_index_ != 0 && slots[next_index_] == slots[next_index_ - 1])
+			{
+				next_index_++;
+			}
+
+			if(next_index_ >= slots_count)
+			{
+				return false;
+			}
+
+			bucket_id_ = slots[next_index_++];
+
+			// top the window up in batches rather than one bucket per chain
+			if(readahead_index_ < next_index_ + READAHEAD / 2)
+			{
+				readahead_index_ = std::max(readahead_index_, next_index_);
+
+				for(size_t end = std::min(slots_count, next_index_ + READAHEAD); readahead_index_ < end; readahead_index_++)
+				{
+					if(slots[readahead_index_] != slots[readahead_index_ - 1])
+					{
+						map_->container_.will_need(slots[readahead_index_]);
+					}
+				}
+			}
+
+			return true;
+		}
+	};
+
+	cursor scan(size_t first_slot = 0, size_t last_slot = size_t(-1)) const
+	{
+		return cursor(this, first_slot, last_slot);
 	}
 
+	// resume a scan at a cursor::position()
+	cursor scan_from(uint64_t position) const
+	{
+		return cursor(this, size_t((position * catalogue_size()) >> HASH_BITS));
+	}
+
+	// number of catalogue slots, for splitting scans into ranges
+	size_t catalogue_size() const
+	{
+		return catalogue_.end() - catalogue_.begin();
+	}
+
+	// call visit(std::vector<record_view> const &) with the records of every bucket, see cursor
+	template<class Visitor>
+	void scan(Visitor &&visit) const
+	{
+		cursor c(this);
+		std::vector<record_view> batch;
+
+		while(c.next(batch))
+		{
+			visit(static_cast<std::vector<record_view> const &>(batch));
+		}
+	}
+
+	// scan on threads threads, each over its own range of catalogue slots, calling
+	// visit(size_t range, std::vector<record_view> const &) concurrently. the map must not be
+	// modified meanwhile by this process. if visit throws, the other threads stop after their
+	// current bucket and the first exception is rethrown
+	//
+	// on read-only maps chains are validated as cursor does. remapping would move the views
+	// of the other threads, so a thread that finds the files have grown stops, and the scan
+	// resumes once all have stopped and the mappings have been refreshed
+	template<class Visitor>
+	void parallel_scan(size_t threads, Visitor &&visit) const
+	{
+		threads = std::max<size_t>(threads, 1);
+
+		if(!lock_)
+		{
+			catalogue_.refresh();
+			container_.refresh();
+		}
+
+		size_t slots_count = catalogue_size();
+		std::vector<cursor> cursors;
+
+		for(size_t range = 0; range < threads; range++)
+		{
+			cursors.emplace_back(this, slots_count * range / threads, slots_count * (range + 1) / threads);
+		}
+
+		for(bool stale = true; stale; )
+		{
+			std::atomic<bool> stopped(false);
+
+			run_parallel(threads, [&](size_t range, std::atomic<bool> const &failed) {
+				cursor &c = cursors[range];
+				std::vector<record_view> batch;
+
+				while(!failed.load(std::memory_order_relaxed))
+				{
+					typename cursor::chain_result result = lock_ ? (c.next(batch) ? cursor::CHAIN_READ : cursor::CHAIN_END)
+						: c.next_shared(batch, false);
+
+					if(result == cursor::CHAIN_STALE)
+					{
+						stopped.store(true, std::memory_order_relaxed);
+					}
+
+					if(result != cursor::CHAIN_READ)
+					{
+						return;
+					}
+
+					visit(range, static_cast<std::vector<record_view> const &>(batch));
+				}
+			});
+
+			stale = stopped.load(std::memory_order_relaxed);
+
+			if(stale)
+			{
+				catalogue_.refresh();
+				container_.refresh();
+			}
+		}
+	}
+
+	// decodes each record once, in operator++. the views it yields, like those of find(), are
+	// invalidated by modifications, but the iterator itself may be advanced after them
+	//
+	// on read-only maps begin() remaps the files if they have grown, and operator++ throws if a
+	// writer in another process has modified the map since
 	class const_iterator {
 	public:
 		using value_type = std::pair<std::string_view, std::string_view>;
 
-		const_iterator(): map_(nullptr), catalogue_index_(0), bucket_id_(0), byte_offset_(0) {}
+		const_iterator(): map_(nullptr), generation_(0), catalogue_index_(0), bucket_id_(0), byte_offset_(0), next_offset_(0) {}
 
 		const_iterator(const hash_map *map, size_t cat_index):
-			map_(map), catalogue_index_(cat_index), bucket_id_(0), byte_offset_(0)
+			map_(map), generation_(0), catalogue_index_(cat_index), bucket_id_(0), byte_offset_(0), next_offset_(0)
 		{
+			if(!map_->lock_)
+			{
+				generation_ = map_->begin_shared_read(true);
+			}
+
 			if(catalogue_index_ < buffer_size())
 			{
 				bucket_id_ = buffer()[catalogue_index_];
@@ -102,18 +836,18 @@ public:
 
 		value_type operator*() const
 		{
-			record_view rv;
-			size_t offset = byte_offset_;
-			map_->container_.read_record(bucket_id_, offset, rv);
-			return {rv.key, rv.value};
+			return {record_.key, record_.value};
+		}
+
+		// hash the current record was stored with
+		hash_t hash() const
+		{
+			return record_.hash;
 		}
 
 		const_iterator &operator++()
 		{
-			// skip past the current record
-			record_view rv;
-			map_->container_.read_record(bucket_id_, byte_offset_, rv);
-			// now find the next valid record
+			byte_offset_ = next_offset_;
 			find_next_record();
 			return *this;
 		}
@@ -131,31 +865,87 @@ public:
 
 	private:
 		const hash_map *map_;
+
+		// write generation read-only maps are validated against
+		uint64_t generation_;
+
 		size_t catalogue_index_;
 		size_t bucket_id_;
 		size_t byte_offset_;
 
+		// the record at byte_offset_ and where the one after it starts
+		size_t next_offset_;
+		record_view record_;
+
 		const catalogue::value_type *buffer() const { return map_->catalogue_.begin(); }
-		size_t buffer_size() const { return map_->catalogue_.end() - map_->catalogue_.begin(); }
+
+		size_t buffer_size() const
+		{
+			return std::min<size_t>(map_->catalogue_.end() - map_->catalogue_.begin(), map_->catalogue_.capacity());
+		}
+
+		// true if bucket_id may be read
+		bool valid_bucket(size_t bucket_id) const
+		{
+			return bucket_id < map_->container_.buckets_count() && bucket_id < map_->container_.capacity();
+		}
+
+		// read_next_record(), checking on read-only maps that nothing was written meanwhile
+		void find_next_record()
+		{
+			const hash_map *map = map_;
+
+			if(map->lock_)
+			{
+				read_next_record();
+				return;
+			}
+
+			try
+			{
+				read_next_record();
+			}
+			catch(std::runtime_error const &)
+			{
+				// only what was read while nothing was being written is really corrupted
+				if(map->end_shared_read(generation_))
+				{
+					throw;
+				}
+			}
+
+			if(!map->end_shared_read(generation_))
+			{
+				throw std::runtime_error("diskhash: map modified by another process during iteration");
+			}
+		}
 
 		// try to find a record at the current (bucket_id_, byte_offset_) or later.
 		// if no record is found in the current bucket chain / catalogue entries,
 		// advances to the next unique catalogue entry. Sets map_=nullptr at end.
-		void find_next_record()
+		void read_next_record()
 		{
-			record_view rv;
+			if(!valid_bucket(bucket_id_))
+			{
+				throw std::runtime_error("diskhash: corrupted catalogue");
+			}
 
-			for(;;)
+			for(size_t steps = 0; ; steps++)
 			{
 				// check if there's a record at the current position
-				size_t probe = byte_offset_;
-				if(map_->container_.read_record(bucket_id_, probe, rv))
+				next_offset_ = byte_offset_;
+				if(map_->container_.read_record(bucket_id_, next_offset_, record_))
 					return; // byte_offset_ still points at the start of this record
 
 				// no more records in this bucket, try overflow chain
 				size_t next = map_->container_.next_bucket(bucket_id_);
 				if(next != container_type::invalid_bucket_id())
 				{
+					if(!valid_bucket(next) || steps >= map_->container_.buckets_count())
+					{
+						throw checksum_error(bucket_id_);
+					}
+
 					bucket_id_ = next;
 					byte_offset_ = 0;
 					continue;
@@ -177,6 +967,11 @@ public:
 
 				bucket_id_ = buffer()[catalogue_index_];
 				byte_offset_ = 0;
+
+				if(!valid_bucket(bucket_id_))
+				{
+					throw std::runtime_error("diskhash: corrupted catalogue");
+				}
 			}
 		}
 	};
@@ -194,8 +989,168 @@ public:
 private:
 	typedef container<BucketSize> container_type;
 
-	catalogue catalogue_;
-	container_type container_;
+	// journal targets
+	enum { CATALOGUE_TARGET, CONTAINER_TARGET };
+
+	// readers in other processes give up waiting for a write that makes no progress after this
+	static constexpr std::chrono::seconds WRITER_TIMEOUT{10};
+
+	// held by writable maps, taken before the journal is recovered
+	std::unique_ptr<file_lock> lock_;
+	std::unique_ptr<journal> journal_;
+
+	// read-only maps remap them from const lookups when a writer grows the files
+	mutable catalogue catalogue_;
+	mutable container_type container_;
+
+	// counts a modification in the container header for readers in other processes
+	class write_section {
+	public:
+		write_section(container_type &container):
+			container_(container)
+		{
+			container_.begin_write();
+		}
+
+		~write_section()
+		{
+			container_.end_write();
+		}
+
+	private:
+		container_type &container_;
+	};
+
+	// wait until no write of another process is in progress, remap the files if refresh is set
+	// and they have grown, and return the generation to pass to end_shared_read()
+	uint64_t begin_shared_read(bool refresh) const
+	{
+		// a writer that died mid-write leaves its count behind until the map is opened for
+		// writing again, so give up if the generation stays the same for too long
+		uint64_t stalled_generation = 0;
+		auto deadline = std::chrono::steady_clock::now();
+
+		for(unsigned attempt = 0; ; attempt++)
+		{
+			uint64_t generation = container_.write_generation();
+
+			if(!container_type::write_in_progress(generation))
+			{
+				if(refresh)
+				{
+					catalogue_.refresh();
+					container_.refresh();
+				}
+
+				return generation;
+			}
+
+			if(attempt > 64)
+			{
+				std::this_thread::yield();
+			}
+
+			auto now = std::chrono::steady_clock::now();
+
+			if(generation != stalled_generation)
+			{
+				stalled_generation = generation;
+				deadline = now + WRITER_TIMEOUT;
+			}
+			else if(now > deadline)
+			{
+				throw std::runtime_error("diskhash: timed out waiting for a write in another process");
+			}
+		}
+	}
+
+	// true if nothing was written since begin_shared_read() returned generation, so that what
+	// was read meanwhile is really there
+	bool end_shared_read(uint64_t generation) const
+	{
+		std::atomic_thread_fence(std::memory_order_acquire);
+		return container_.write_generation() == generation;
+	}
+
+	std::optional<std::string_view> find_shared(hash_t hash, std::string_view key) const
+	{
+		for(;;)
+		{
+			uint64_t generation = begin_shared_read(true);
+
+			size_t bucket_id = catalogue_.find_speculative(hash);
+			size_t corrupted_bucket_id = bucket_id;
+			std::string_view value;
+
+			probe_result result = bucket_id == catalogue::INVALID_BLOCK_ID ? PROBE_RETRY
+				: container_.probe_view(bucket_id, hash, key, value, &corrupted_bucket_id);
+
+			if(!end_shared_read(generation))
+			{
+				continue;
+			}
+
+			switch(result)
+			{
+			case PROBE_FOUND:
+				return value;
+			case PROBE_NOT_FOUND:
+				return std::nullopt;
+			default:
+				// nothing was being written, so what probe_view() saw is really there
+				if(corrupted_bucket_id == catalogue::INVALID_BLOCK_ID)
+				{
+					throw std::runtime_error("diskhash: corrupted catalogue");
+				}
+
+				throw checksum_error(corrupted_bucket_id);
+			}
+		}
+	}
+
+	// roll back an interrupted split before catalogue and container files are opened
+	static std::unique_ptr<journal> open_journal(const char *filename, bool read_only, bool durable)
+	{
+		std::string journal_filename = std::string(filename) + "jnl";
+
+		if(!read_only)
+		{
+			journal::recover(journal_filename.c_str(),
+				{std::string(filename) + "cat", std::string(filename) + "dat"});
+		}
+
+		if(read_only || !durable)
+		{
+			return nullptr;
+		}
+
+		return std::make_unique<journal>(journal_filename.c_str());
+	}
+
+	void begin_split(size_t bucket_id, hash_t hash, bool split_catalogue)
+	{
+		if(split_catalogue)
+		{
+			// the whole directory is rewritten, this also covers the following set()
+			catalogue_.journal_split(*journal_, CATALOGUE_TARGET);
+		}
+		else
+		{
+			size_t prefix_bits = container_.bucket_prefix_bits(bucket_id) + 1;
+			catalogue_.journal_set(*journal_, CATALOGUE_TARGET,
+				hash | (hash_t(1) << (HASH_BITS - prefix_bits)), prefix_bits);
+		}
+
+		container_.journal_split(*journal_, CONTAINER_TARGET, bucket_id);
+		journal_->commit();
+	}
+
+	void end_split()
+	{
+		catalogue_.sync();
+		container_.sync();
+		journal_->clear();
+	}
 };
 
 // namespace diskhash
@@ -0,0 +1,145 @@
+#include <algorithm>
+#include <filesystem>
+#include <memory>
+
+#include "journal.h"
+
+diskhash::journal::journal(const char *filename):
+	file_map_(filename, false, sizeof(layout_t)),
+	pending_count_(0),
+	pending_bytes_(0)
+{
+	layout_ = (layout_t *) file_map_.start();
+
+	if(layout_->signature == 0)
+	{
+		layout_->signature = SIGNATURE;
+	}
+	else if(layout_->signature != SIGNATURE)
+	{
+		throw std::runtime_error(std::string("invalid journal signature in file ") + filename);
+	}
+	else if(layout_->entries_count != 0)
+	{
+		throw std::runtime_error(std::string("journal has not been recovered: ") + filename);
+	}
+}
+
+void diskhash::journal::save(size_t target, size_t offset, const void *data, size_t length)
+{
+	size_t bytes_needed = sizeof(layout_t) + pending_bytes_ + sizeof(entry_t) + length;
+
+	if(bytes_needed > file_map_.length())
+	{
+		// data may point into a mapping that is not ours, so it stays valid across resize
+		file_map_.resize(bytes_needed * 2);
+		layout_ = (layout_t *) file_map_.start();
+	}
+
+	entry_t entry = { target, offset, length };
+
+	unsigned char *cursor = layout_->data + pending_bytes_;
+	cursor = std::copy((const unsigned char *) &entry, (const unsigned char *) (&entry + 1), cursor);
+	std::copy((const unsigned char *) data, (const unsigned char *) data + length, cursor);
+
+	pending_count_++;
+	pending_bytes_ += sizeof(entry_t) + length;
+}
+
+void diskhash::journal::commit()
+{
+	// images must reach the disk before the header that makes them visible to recover()
+	file_map_.sync();
+
+	layout_->bytes_used = pending_bytes_;
+	layout_->entries_count = pending_count_;
+
+	file_map_.sync();
+}
+
+void diskhash::journal::clear()
+{
+	layout_->entries_count = 0;
+	layout_->bytes_used = 0;
+
+	file_map_.sync();
+
+	pending_count_ = 0;
+	pending_bytes_ = 0;
+}
+
+bool diskhash::journal::recover(const char *filename, std::vector<std::string> const &targets)
+{
+	std::error_code ec;
+	if(!std::filesystem::exists(filename, ec) || std::filesystem::file_size(filename, ec) < sizeof(layout_t))
+	{
+		return false;
+	}
+
+	file_map journal_map(filename, false, sizeof(layout_t));
+	layout_t *layout = (layout_t *) journal_map.start();
+
+	if(layout->signature != SIGNATURE || layout->entries_count == 0)
+	{
+		journal_map.close();
+		return false;
+	}
+
+	std::vector<const unsigned char *> entries;
+	entries.reserve(layout->entries_count);
+
+	const unsigned char *cursor = layout->data;
+	for(size_t i = 0; i < layout->entries_count; i++)
+	{
+		entries.push_back(cursor);
+
+		entry_t entry;
+		std::copy(cursor, cursor + sizeof(entry_t), (unsigned char *) &entry);
+		cursor += sizeof(entry_t) + entry.length;
+
+		if(entry.target >= targets.size() || size_t(cursor - layout->data) > layout->bytes_used)
+		{
+			journal_map.close();
+			throw std::runtime_error(std::string("corrupted journal in file ") + filename);
+		}
+	}
+
+	std::vector<std::unique_ptr<file_map>> target_maps(targets.size());
+
+	// replay newest first, so the oldest image of a range saved twice is the one that stays
+	for(auto it = entries.rbegin(); it != entries.rend(); ++it)
+	{
+		entry_t entry;
+		std::copy(*it, *it + sizeof(entry_t), (unsigned char *) &entry);
+
+		std::unique_ptr<file_map> &target_map = target_maps[entry.target];
+		if(!target_map)
+		{
+			target_map = std::make_unique<file_map>(targets[entry.target].c_str(), false, 0);
+		}
+
+		if(entry.offset + entry.length > target_map->length())
+		{
+			target_map->resize(entry.offset + entry.length);
+		}
+
+		const unsigned char *image = *it + sizeof(entry_t);
+		std::copy(image, image + entry.length, (unsigned char *) target_map->start() + entry.offset);
+	}
+
+	for(auto &target_map : target_maps)
+	{
+		if(target_map)
+		{
+			target_map->sync();
+			target_map->close();
+		}
+	}
+
+	layout->entries_count = 0;
+	layout->bytes_used = 0;
+	journal_map.sync();
+	journal_map.close();
+
+	return true;
+}
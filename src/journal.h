@@ -0,0 +1,68 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <stdexcept>
+
+#include "file_map.h"
+
+namespace diskhash {
+
+// undo journal for multi-bucket updates (container and catalogue splits).
+//
+// before modifying anything the caller saves images of every byte range it is going to
+// overwrite and calls commit(); once the modified files have been synced it calls clear().
+// if the process dies in between, recover() copies the saved images back on the next open,
+// rolling the target files back to the state they had before the update started.
+class journal {
+public:
+	journal(const char *filename);
+
+	// save length bytes found at offset in target file, data must point to those bytes
+	void save(size_t target, size_t offset, const void *data, size_t length);
+
+	// make saved images durable, must be called before targets are modified
+	void commit();
+
+	// forget saved images, must be called after targets are synced
+	void clear();
+
+	size_t bytes_allocated() const {
+		return file_map_.length();
+	}
+
+	void close() {
+		file_map_.close();
+		layout_ = 0;
+	}
+
+	// if filename holds a committed journal, copy its images back into targets (indexed
+	// by the target argument of save()) and clear it, return true if anything was replayed
+	static bool recover(const char *filename, std::vector<std::string> const &targets);
+
+private:
+	static const unsigned SIGNATURE = 0x4a7c1e55;
+
+#pragma pack(push, 1)
+	struct entry_t {
+		size_t target, offset, length;
+	};
+
+	struct layout_t {
+		unsigned signature;
+		size_t entries_count;
+		size_t bytes_used;
+		unsigned char data[1];
+	};
+#pragma pack(pop)
+
+	file_map file_map_;
+	layout_t *layout_;
+
+	// entries saved since the last commit() or clear()
+	size_t pending_count_;
+	size_t pending_bytes_;
+};
+
+// namespace diskhash
+}
@@ -1,7 +1,14 @@
 #include "file_map.h"
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <cerrno>
+#include <algorithm>
 #include <iostream>
+#include <stdexcept>
+#include <string>
 
 diskhash::file_map::file_map(char const *filename, bool read_only, size_t length)
+	: read_only_(read_only)
 {
 	if((fd_ = open(filename, read_only ? O_RDONLY : O_RDWR | O_CREAT, S_IREAD | S_IWRITE)) < 0)
 	{
@@ -16,27 +23,24 @@ diskhash::file_map::file_map(char const *filename, bool read_only, size_t length
 		throw last_error;
 	}
 
-	if(length == 0)
+	if(length <= size_t(st.st_size))
 	{
 		length_ = st.st_size;
 	}
 	else
 	{
-		if(length > size_t(st.st_size))
+		if(lseek(fd_, length, SEEK_SET) < 0)
 		{
-			if(lseek(fd_, length, SEEK_SET) < 0)
-			{
-				system_error last_error;
-				::close(fd_);
-				throw last_error;
-			}
+			system_error last_error;
+			::close(fd_);
+			throw last_error;
+		}
 
-			if(write(fd_, "", 1) != 1)
-			{
-				system_error last_error;
-				::close(fd_);
-				throw last_error;
-			}
+		if(write(fd_, "", 1) != 1)
+		{
+			system_error last_error;
+			::close(fd_);
+			throw last_error;
 		}
 
 		length_ = length;
@@ -90,15 +94,147 @@ void diskhash::file_map::resize(size_t length) {
 		}
 	}
 
-	void *start = mremap(start_, length_, length, MREMAP_MAYMOVE);
+	remap(length);
+}
 
-	if(start == MAP_FAILED)
+bool diskhash::file_map::refresh()
+{
+	struct stat st;
+	if(fstat(fd_, &st) != 0)
 	{
 		throw system_error();
 	}
 
+	if(size_t(st.st_size) <= length_)
+	{
+		return false;
+	}
+
+	remap(st.st_size);
+	return true;
+}
+
+void diskhash::file_map::remap(size_t length)
+{
+	void *start;
+
+	if(retire_)
+	{
+		// grow in place if the address range after the mapping is free, otherwise map the
+		// file again elsewhere and keep the old mapping alive for concurrent readers
+		start = mremap(start_, length_, length, 0);
+
+		if(start == MAP_FAILED)
+		{
+			start = mmap(0, length, read_only_ ? PROT_READ : PROT_READ | PROT_WRITE,
+				MAP_FILE | MAP_SHARED, fd_, 0);
+
+			if(start == MAP_FAILED)
+			{
+				throw system_error();
+			}
+
+			retire_(start_, length_);
+		}
+	}
+	else
+	{
+		start = mremap(start_, length_, length, MREMAP_MAYMOVE);
+
+		if(start == MAP_FAILED)
+		{
+			throw system_error();
+		}
+	}
+
 	start_ = start;
-	length_ = length;
+	std::atomic_ref<size_t>(length_).store(length, std::memory_order_relaxed);
+}
+
+void diskhash::file_map::sync()
+{
+	if(msync(start_, length_, MS_SYNC) < 0)
+	{
+		throw system_error();
+	}
+}
+
+void diskhash::file_map::copy_to(char const *file_name) const
+{
+	int fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC, S_IREAD | S_IWRITE);
+	if(fd < 0)
+	{
+		throw system_error();
+	}
+
+	try
+	{
+		// a reflink shares the extents, so it takes the same time whatever the size of the file.
+		// otherwise copy_file_range keeps the copy in the kernel, and where neither works, for
+		// instance across file systems, write the mapping out. all three see the dirty pages of
+		// the mapping, which live in the page cache of the file
+		if(ioctl(fd, FICLONE, fd_) != 0)
+		{
+			loff_t offset = 0;
+			while(size_t(offset) < length_)
+			{
+				ssize_t copied = copy_file_range(fd_, &offset, fd, 0, length_ - offset, 0);
+				if(copied > 0)
+				{
+					continue;
+				}
+				if(copied < 0 && errno != EXDEV && errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP)
+				{
+					throw system_error();
+				}
+
+				while(size_t(offset) < length_)
+				{
+					ssize_t written = write(fd, (char const *) start_ + offset, length_ - offset);
+					if(written < 0)
+					{
+						throw system_error();
+					}
+					offset += written;
+				}
+			}
+		}
+
+		if(fsync(fd) != 0)
+		{
+			throw system_error();
+		}
+	}
+	catch(...)
+	{
+		::close(fd);
+		throw;
+	}
+
+	if(::close(fd) != 0)
+	{
+		throw system_error();
+	}
+}
+
+void diskhash::file_map::will_need(size_t offset, size_t length) const
+{
+	static const size_t page_size = sysconf(_SC_PAGESIZE);
+
+	if(offset >= length_)
+	{
+		return;
+	}
+
+	size_t begin = offset / page_size * page_size;
+	size_t end = std::min(offset + length, length_);
+
+	madvise((char *) start_ + begin, end - begin, MADV_WILLNEED);
+}
+
+void diskhash::file_map::unmap(void *start, size_t length)
+{
+	munmap(start, length);
 }
 
 void diskhash::file_map::close()
@@ -123,3 +259,31 @@ void diskhash::file_map::close()
 		fd_ = -1;
 	}
 }
+
+diskhash::file_lock::file_lock(char const *file_name)
+{
+	if((fd_ = open(file_name, O_RDWR | O_CREAT, S_IREAD | S_IWRITE)) < 0)
+	{
+		throw system_error();
+	}
+
+	if(flock(fd_, LOCK_EX | LOCK_NB) != 0)
+	{
+		bool held = errno == EWOULDBLOCK;
+		system_error last_error;
+		::close(fd_);
+
+		if(held)
+		{
+			throw std::runtime_error(std::string("diskhash: ") + file_name + " is open for writing in another process");
+		}
+
+		throw last_error;
+	}
+}
+
+diskhash::file_lock::~file_lock()
+{
+	// closing the descriptor releases the lock
+	::close(fd_);
+}
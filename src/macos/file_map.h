@@ -1,11 +1,15 @@
 #pragma once
 
+#include <sys/file.h>
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
 
+#include <atomic>
+#include <functional>
+
 #include "system_error.h"
 
 namespace diskhash {
@@ -23,18 +27,58 @@ public:
 		return start_;
 	}
 
+	// safe to call concurrently with resize(), the length before or after it is returned
 	size_t length() const {
-		return length_;
+		return std::atomic_ref<size_t>(const_cast<size_t &>(length_)).load(std::memory_order_relaxed);
 	}
 
 	void resize(size_t new_length);
+
+	// map the whole file again if another process has made it longer than the mapping,
+	// return true if it did
+	bool refresh();
+
+	void sync();
 	void close();
 
+	// write the mapped bytes to file_name, replacing it, and flush it to disk. the caller
+	// keeps writers out for the duration, readers of the mapping are not affected
+	void copy_to(char const *file_name) const;
+
+	// hint that [offset, offset + length) of the mapping will be read soon, errors are ignored
+	void will_need(size_t offset, size_t length) const;
+
+	// when set, resize() never unmaps the old mapping if it has to move it, but passes it
+	// to f, which must release it with unmap() once no reader can be looking at it anymore
+	void set_retire_function(std::function<void(void *, size_t)> f) {
+		retire_ = std::move(f);
+	}
+
+	static void unmap(void *start, size_t length);
+
 private:
+	void remap(size_t length);
+
 	int fd_;
 	void *start_;
 	size_t length_;
 	bool read_only_;
+	std::function<void(void *, size_t)> retire_;
+};
+
+// advisory lock on a file, shared between processes and released when the object is
+// destroyed. writable maps hold it on their data file so that only one process writes
+class file_lock {
+public:
+	// open file_name, creating it if needed, and lock it, throw if another process holds the lock
+	file_lock(char const *file_name);
+	~file_lock();
+
+	file_lock(file_lock const &) = delete;
+	file_lock &operator=(file_lock const &) = delete;
+
+private:
+	int fd_;
 };
 
 // namespace diskhash
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace diskhash {
+
+// Length-prefixed frames for the binary listener of http_server, with raw binary keys.
+//
+// Every frame is the body length, a 1-byte code and the body, and all lengths are 4 bytes
+// little-endian. Requests carry an opcode, responses a status, and responses come back in
+// request order, so clients may pipeline any number of requests:
+//
+//   GET     key                                   OK value | NOT_FOUND
+//   SET     key length, key, value                OK | EXISTS
+//   DELETE  key                                   OK | NOT_FOUND
+//   MGET    (key length, key) per key             OK (value length, value) per key
+//
+// A missing key of an MGET has the value length NOT_FOUND_SIZE, an MGET whose values would not
+// fit into MAX_FRAME_SIZE gets ERROR. A request the server cannot
+// handle gets ERROR with a message as the body; a frame longer than MAX_FRAME_SIZE closes the
+// connection.
+namespace binary_protocol {
+
+enum opcode : uint8_t { OP_GET = 1, OP_SET = 2, OP_DELETE = 3, OP_MGET = 4 };
+
+enum status : uint8_t { STATUS_OK = 0, STATUS_NOT_FOUND = 1, STATUS_EXISTS = 2, STATUS_ERROR = 3 };
+
+static constexpr size_t HEADER_SIZE = 5;
+static constexpr uint32_t MAX_FRAME_SIZE = 64 << 20;
+static constexpr uint32_t NOT_FOUND_SIZE = 0xffffffff;
+
+inline void put_u32(std::string& out, uint32_t value) {
+    char bytes[4] = {char(value), char(value >> 8), char(value >> 16), char(value >> 24)};
+    out.append(bytes, 4);
+}
+
+inline uint32_t get_u32(const char* p) {
+    auto b = reinterpret_cast<const unsigned char*>(p);
+    return uint32_t(b[0]) | uint32_t(b[1]) << 8 | uint32_t(b[2]) << 16 | uint32_t(b[3]) << 24;
+}
+
+inline void put_u64(std::string& out, uint64_t value) {
+    put_u32(out, uint32_t(value));
+    put_u32(out, uint32_t(value >> 32));
+}
+
+inline uint64_t get_u64(const char* p) {
+    return uint64_t(get_u32(p)) | uint64_t(get_u32(p + 4)) << 32;
+}
+
+// append the header of a frame whose body_size bytes of body follow
+inline void begin_frame(std::string& out, uint8_t code, size_t body_size) {
+    put_u32(out, uint32_t(body_size));
+    out.push_back(char(code));
+}
+
+inline void append_frame(std::string& out, uint8_t code, std::string_view body) {
+    begin_frame(out, code, body.size());
+    out.append(body);
+}
+
+struct frame {
+    uint8_t code = 0;
+    std::string_view body;
+};
+
+// the frame at the start of data, if it is complete: returns its total size, 0 if more bytes
+// are needed. throws std::runtime_error for frames over MAX_FRAME_SIZE
+inline size_t parse_frame(std::string_view data, frame& f) {
+    if (data.size() < HEADER_SIZE) {
+        return 0;
+    }
+
+    uint32_t body_size = get_u32(data.data());
+    if (body_size > MAX_FRAME_SIZE) {
+        throw std::runtime_error("frame too large");
+    }
+    if (data.size() < HEADER_SIZE + body_size) {
+        return 0;
+    }
+
+    f.code = uint8_t(data[4]);
+    f.body = data.substr(HEADER_SIZE, body_size);
+    return HEADER_SIZE + body_size;
+}
+
+// the length-prefixed keys of an MGET body in order, false if the body is malformed
+inline bool split_fields(std::string_view body, std::vector<std::string_view>& fields) {
+    fields.clear();
+    while (!body.empty()) {
+        if (body.size() < 4 || get_u32(body.data()) > body.size() - 4) {
+            return false;
+        }
+        uint32_t size = get_u32(body.data());
+        fields.push_back(body.substr(4, size));
+        body.remove_prefix(4 + size);
+    }
+    return true;
+}
+
+// append a length-prefixed field as split_fields() reads them. throws std::length_error if
+// the length does not fit the prefix
+inline void append_field(std::string& out, std::string_view field) {
+    if (field.size() >= NOT_FOUND_SIZE) {
+        throw std::length_error("field too large");
+    }
+    put_u32(out, uint32_t(field.size()));
+    out.append(field);
+}
+
+inline void append_set(std::string& out, std::string_view key, std::string_view value) {
+    begin_frame(out, OP_SET, 4 + key.size() + value.size());
+    put_u32(out, uint32_t(key.size()));
+    out.append(key);
+    out.append(value);
+}
+
+}  // namespace binary_protocol
+
+}  // namespace diskhash
@@ -0,0 +1,118 @@
+#include "core_group.h"
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include <algorithm>
+
+namespace diskhash {
+
+namespace net = boost::asio;
+
+namespace {
+
+thread_local size_t current_core = core_group::npos;
+
+}  // namespace
+
+core_group::core_group(size_t cores, bool pin)
+    : pin_(pin)
+{
+    cores_.reserve(cores);
+    for (size_t i = 0; i < cores; ++i) {
+        auto c = std::make_unique<core>();
+        for (size_t j = 0; j < cores; ++j) {
+            c->inbox.push_back(std::make_unique<spsc_queue<task*>>(QUEUE_CAPACITY));
+        }
+        cores_.push_back(std::move(c));
+    }
+}
+
+core_group::~core_group() {
+    stop();
+    wait();
+
+    // tasks never run, their coroutines are destroyed with the io_contexts
+    for (auto& c : cores_) {
+        task* t;
+        for (auto& queue : c->inbox) {
+            while (queue->pop(t)) {
+                delete t;
+            }
+        }
+    }
+}
+
+size_t core_group::current() {
+    return current_core;
+}
+
+void core_group::start() {
+    threads_.reserve(cores_.size());
+    for (size_t i = 0; i < cores_.size(); ++i) {
+        threads_.emplace_back([this, i] { run(i); });
+    }
+}
+
+void core_group::stop() {
+    for (auto& c : cores_) {
+        c->ioc.stop();
+    }
+}
+
+void core_group::wait() {
+    for (auto& t : threads_) {
+        if (t.joinable()) {
+            t.join();
+        }
+    }
+    threads_.clear();
+}
+
+void core_group::send(size_t from, size_t to, std::unique_ptr<task> t) {
+    core& target = *cores_[to];
+
+    if (!target.inbox[from]->push(t.get())) {
+        net::post(target.ioc, [t = std::move(t)] { t->run(); });
+        return;
+    }
+    t.release();
+
+    // pairs with the exchange in drain(): either it sees this task or a new drain() is posted
+    if (!target.woken.exchange(true, std::memory_order_acq_rel)) {
+        net::post(target.ioc, [this, to] { drain(to); });
+    }
+}
+
+void core_group::drain(size_t core_index) {
+    core& c = *cores_[core_index];
+    c.woken.exchange(false, std::memory_order_acq_rel);
+
+    task* t;
+    for (auto& queue : c.inbox) {
+        while (queue->pop(t)) {
+            std::unique_ptr<task> owned(t);
+            owned->run();
+        }
+    }
+}
+
+void core_group::run(size_t core_index) {
+    current_core = core_index;
+
+#ifdef __linux__
+    if (pin_) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(core_index % std::max(1u, std::thread::hardware_concurrency()), &cpus);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    }
+#endif
+
+    auto work = net::make_work_guard(cores_[core_index]->ioc);
+    cores_[core_index]->ioc.run();
+}
+
+}  // namespace diskhash
@@ -0,0 +1,140 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <limits>
+#include <memory>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#include "spsc_queue.h"
+
+namespace diskhash {
+
+// Threads that each run their own single-threaded io_context, for http_server's thread-per-core
+// mode, and hand work to each other over lock-free queues.
+//
+// Every ordered pair of cores has an spsc_queue. A core that was sent tasks is woken by one
+// post() to its io_context, which then runs everything its queues hold; further tasks sent
+// before it gets to them ride along without another post(). A task that finds its queue full
+// is posted on its own.
+class core_group {
+public:
+    static constexpr size_t npos = std::numeric_limits<size_t>::max();
+
+    // pin: bind core i to CPU i modulo the number of CPUs, where the platform allows it
+    core_group(size_t cores, bool pin);
+    ~core_group();
+
+    size_t size() const {
+        return cores_.size();
+    }
+
+    boost::asio::io_context& context(size_t core) {
+        return cores_[core]->ioc;
+    }
+
+    // index of the core the calling thread runs, npos outside the group
+    static size_t current();
+
+    void start();
+    // async-signal-safe, wait() joins the threads
+    void stop();
+    void wait();
+
+    // run f() on core and resume the calling coroutine on its own core afterwards, rethrowing
+    // what f threw. f is run in place when called from core itself or from outside the group
+    template<class F>
+    boost::asio::awaitable<void> run_on(size_t core, F f) {
+        size_t home = current();
+        if (core == home || home == npos) {
+            f();
+            co_return;
+        }
+
+        co_await boost::asio::async_initiate<const boost::asio::use_awaitable_t<>&,
+                                             void(std::exception_ptr)>(
+            [this, core, home, &f](auto handler) {
+                using handler_type = decltype(handler);
+                send(home, core, std::make_unique<request<F, handler_type>>(
+                                     *this, home, f, std::move(handler)));
+            },
+            boost::asio::use_awaitable);
+    }
+
+private:
+    struct task {
+        virtual ~task() = default;
+        virtual void run() = 0;
+    };
+
+    // completes the awaiting coroutine on its own core
+    template<class Handler>
+    struct reply : task {
+        Handler handler;
+        std::exception_ptr error;
+
+        reply(Handler h, std::exception_ptr e)
+            : handler(std::move(h))
+            , error(std::move(e))
+        {
+        }
+
+        void run() override {
+            std::move(handler)(error);
+        }
+    };
+
+    template<class F, class Handler>
+    struct request : task {
+        core_group& group;
+        size_t home;
+        // lives in the frame of the suspended run_on()
+        F& f;
+        Handler handler;
+
+        request(core_group& g, size_t h, F& fn, Handler hd)
+            : group(g)
+            , home(h)
+            , f(fn)
+            , handler(std::move(hd))
+        {
+        }
+
+        void run() override {
+            std::exception_ptr error;
+            try {
+                f();
+            } catch (...) {
+                error = std::current_exception();
+            }
+            group.send(group.current(), home,
+                       std::make_unique<reply<Handler>>(std::move(handler), std::move(error)));
+        }
+    };
+
+    struct core {
+        boost::asio::io_context ioc{1};
+        // a drain() is posted and has not started yet
+        std::atomic<bool> woken{false};
+        // by sending core
+        std::vector<std::unique_ptr<spsc_queue<task*>>> inbox;
+    };
+
+    // tasks each pair of cores may have queued before further ones are posted
+    static constexpr size_t QUEUE_CAPACITY = 1024;
+
+    std::vector<std::unique_ptr<core>> cores_;
+    std::vector<std::thread> threads_;
+    bool pin_;
+
+    void send(size_t from, size_t to, std::unique_ptr<task> t);
+    void drain(size_t core_index);
+    void run(size_t core_index);
+};
+
+}  // namespace diskhash
@@ -2,44 +2,321 @@
 
 #include <algorithm>
 #include <array>
+#include <chrono>
+#include <ctime>
+#include <filesystem>
+#include <iomanip>
 #include <iostream>
 #include <sstream>
 
+#ifdef __linux__
+#include <unistd.h>
+
+#include "io_ring.h"
+#endif
+
 namespace diskhash {
 
-http_server::http_server(const std::string& address, uint16_t port,
-                         const std::string& db_path, size_t num_shards,
-                         size_t num_threads)
-    : ioc_(static_cast<int>(num_threads))
-    , acceptor_(ioc_)
-    , db_(db_path, num_shards)
-    , num_threads_(num_threads)
-{
-    beast::error_code ec;
+namespace {
+
+using clock_type = std::chrono::steady_clock;
+
+uint64_t nanoseconds_between(clock_type::time_point start, clock_type::time_point end) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+}
 
-    auto endpoint = tcp::endpoint(net::ip::make_address(address), port);
+// Prometheus histogram buckets, in seconds: 1, 2.5 and 5 times every power of ten from 1us
+std::vector<double> histogram_bounds() {
+    std::vector<double> bounds;
+    for (double decade = 1e-6; decade < 10; decade *= 10) {
+        bounds.push_back(decade);
+        bounds.push_back(decade * 2.5);
+        bounds.push_back(decade * 5);
+    }
+    bounds.push_back(10);
+    return bounds;
+}
+
+void write_histogram(std::ostream& out, const char* name, const std::string& labels,
+                     const latency_histogram& histogram) {
+    static const std::vector<double> bounds = histogram_bounds();
+
+    for (double bound : bounds) {
+        out << name << "_bucket{" << labels << ",le=\"" << bound << "\"} "
+            << histogram.count_at_most(uint64_t(bound * 1e9)) << "\n";
+    }
+    out << name << "_bucket{" << labels << ",le=\"+Inf\"} " << histogram.count() << "\n";
+    out << name << "_sum{" << labels << "} " << double(histogram.sum()) / 1e9 << "\n";
+    out << name << "_count{" << labels << "} " << histogram.count() << "\n";
+}
+
+// reuse_port lets several acceptors share the endpoint, the kernel spreads connections over them
+void open_acceptor(tcp::acceptor& acceptor, const tcp::endpoint& endpoint,
+                   bool reuse_port = false) {
+    beast::error_code ec;
 
-    acceptor_.open(endpoint.protocol(), ec);
+    acceptor.open(endpoint.protocol(), ec);
     if (ec) {
         throw std::runtime_error("Failed to open acceptor: " + ec.message());
     }
 
-    acceptor_.set_option(net::socket_base::reuse_address(true), ec);
+    acceptor.set_option(net::socket_base::reuse_address(true), ec);
     if (ec) {
         throw std::runtime_error("Failed to set reuse_address: " + ec.message());
     }
 
-    acceptor_.bind(endpoint, ec);
+#ifdef SO_REUSEPORT
+    if (reuse_port) {
+        acceptor.set_option(
+            net::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true), ec);
+        if (ec) {
+            throw std::runtime_error("Failed to set SO_REUSEPORT: " + ec.message());
+        }
+    }
+#endif
+
+    acceptor.bind(endpoint, ec);
     if (ec) {
         throw std::runtime_error("Failed to bind: " + ec.message());
     }
 
-    acceptor_.listen(net::socket_base::max_listen_connections, ec);
+    acceptor.listen(net::socket_base::max_listen_connections, ec);
     if (ec) {
         throw std::runtime_error("Failed to listen: " + ec.message());
     }
 }
 
+// MGET and /mget results: the length and value of each, NOT_FOUND_SIZE for missing keys. false
+// without appending anything if they take more than binary_protocol::MAX_FRAME_SIZE bytes, which
+// clients would take for a broken connection
+bool append_values(std::string& out, const std::vector<std::optional<std::string>>& values) {
+    size_t size = 0;
+    for (const auto& value : values) {
+        size += 4 + (value ? value->size() : 0);
+    }
+    if (size > binary_protocol::MAX_FRAME_SIZE) {
+        return false;
+    }
+
+    out.reserve(out.size() + size);
+    for (const auto& value : values) {
+        if (value) {
+            binary_protocol::put_u32(out, uint32_t(value->size()));
+            out += *value;
+        } else {
+            binary_protocol::put_u32(out, binary_protocol::NOT_FOUND_SIZE);
+        }
+    }
+    return true;
+}
+
+// hand buffers to the socket as far as it takes them without blocking, the kernel copies them
+// during the call, and copy the rest to unsent to be written asynchronously. the socket must be
+// in non-blocking mode
+template<class Buffers>
+void write_or_copy(tcp::socket& socket, const Buffers& buffers, std::string& unsent) {
+    beast::error_code ec;
+    // nothing is written on errors, the asynchronous write reports them
+    size_t written = socket.write_some(buffers, ec);
+
+    beast::buffers_suffix<Buffers> rest(buffers);
+    rest.consume(written);
+    unsent.resize(beast::buffer_bytes(rest));
+    net::buffer_copy(net::buffer(unsent), rest);
+}
+
+// /keys cursors are "<shard>-<position>", "0" starts a scan and is returned once it is done
+std::string format_cursor(const sharded_hash_map::scan_cursor& cursor, bool more) {
+    if (!more) {
+        return "0";
+    }
+    return std::to_string(cursor.shard) + "-" + std::to_string(cursor.position);
+}
+
+bool parse_cursor(const std::string& text, sharded_hash_map::scan_cursor& cursor) {
+    if (text == "0") {
+        cursor = {};
+        return true;
+    }
+
+    auto dash = text.find('-');
+    if (dash == std::string::npos || dash == 0 || dash + 1 == text.size() ||
+        text.find_first_not_of("0123456789-") != std::string::npos ||
+        text.find('-', dash + 1) != std::string::npos) {
+        return false;
+    }
+
+    try {
+        cursor.shard = std::stoull(text.substr(0, dash));
+        cursor.position = std::stoull(text.substr(dash + 1));
+    } catch (const std::exception&) {
+        return false;
+    }
+    return true;
+}
+
+// the count parameter of a page of keys, left alone if empty. larger counts are capped at
+// MAX_KEYS_PAGE_SIZE by the caller
+bool parse_count(const std::string& text, size_t& count) {
+    if (!text.empty()) {
+        if (text.size() >= 10 || text.find_first_not_of("0123456789") != std::string::npos) {
+            return false;
+        }
+        count = std::stoull(text);
+    }
+    return count != 0;
+}
+
+// the name of a snapshot, a single path component
+bool valid_snapshot_name(const std::string& name) {
+    return !name.empty() && name.size() <= 255 && name != "." && name != ".." &&
+           name.find_first_not_of("ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz"
+                                  "0123456789_.-") == std::string::npos;
+}
+
+// UTC time to the millisecond, such as 20240131T235959.123Z
+std::string snapshot_timestamp() {
+    auto now = std::chrono::system_clock::now();
+    std::time_t seconds = std::chrono::system_clock::to_time_t(now);
+    auto millis = std::chrono::duration_cast<std::chrono::milliseconds>(
+        now.time_since_epoch()).count() % 1000;
+
+    std::tm utc;
+    gmtime_r(&seconds, &utc);
+    std::ostringstream oss;
+    oss << std::put_time(&utc, "%Y%m%dT%H%M%S") << "." << std::setw(3) << std::setfill('0')
+        << millis << "Z";
+    return oss.str();
+}
+
+// comma-separated sequence numbers of /replication, false if text is malformed
+bool parse_sequence_list(const std::string& text, std::vector<uint64_t>& seqs) {
+    if (text.empty() || text.size() > (1 << 20) ||
+        text.find_first_not_of("0123456789,") != std::string::npos) {
+        return false;
+    }
+
+    std::istringstream list(text);
+    std::string seq;
+    try {
+        while (std::getline(list, seq, ',')) {
+            if (seq.empty()) {
+                return false;
+            }
+            seqs.push_back(std::stoull(seq));
+        }
+    } catch (const std::out_of_range&) {
+        return false;
+    }
+    return true;
+}
+
+// counts a session out of the open connections however it ends
+struct connection_guard {
+    std::atomic<size_t>& connections;
+
+    ~connection_guard() {
+        connections.fetch_sub(1, std::memory_order_relaxed);
+    }
+};
+
+}  // namespace
+
+http_server::http_server(const server_config& config)
+    : ioc_(static_cast<int>(config.num_threads))
+    , acceptor_(ioc_)
+    , binary_acceptor_(ioc_)
+    , db_(config.db_path, config.num_shards, config.checksums, config.frozen, config.filters)
+    // shards added by resharding have no histograms until the next start
+    , metrics_(db_.num_shards())
+    , num_threads_(config.num_threads)
+    , idle_timeout_(config.idle_timeout)
+    , max_connections_(config.max_connections)
+    , db_path_(config.db_path)
+    , snapshot_dir_(config.snapshot_dir)
+{
+    // frozen shards have no buckets to scrub
+    if (config.scrub_rate != 0 && !config.frozen) {
+        scrubber_ = std::make_unique<scrubber>(db_, config.scrub_rate);
+    }
+
+    if (!config.frozen) {
+        resharder_ = std::make_unique<resharder>(db_);
+    }
+
+    if (config.cache_bytes != 0) {
+        cache_ = std::make_unique<record_cache>(db_.num_shards(), config.cache_bytes);
+    }
+
+    if (!config.replica_of.empty()) {
+        if (config.frozen) {
+            throw std::invalid_argument("a frozen database cannot follow a primary");
+        }
+        replica_ = std::make_unique<replica>(
+            config.replica_of, config.db_path + "_replica", db_, [this](std::string_view key) {
+                if (cache_) {
+                    cache_->invalidate(cache_segment(key), key);
+                }
+            });
+    } else if (!config.frozen && config.replication_log_bytes != 0) {
+        log_ = std::make_unique<replication_log>(db_.num_shards(), config.replication_log_bytes);
+    }
+
+    auto address = net::ip::make_address(config.address);
+    tcp::endpoint endpoint(address, config.port);
+    tcp::endpoint binary_endpoint(address, config.binary_port);
+
+    // with one io_context per core, io_uring workers would be threads of their own
+    if (config.thread_per_core) {
+        cores_ = std::make_unique<core_group>(num_threads_, config.pin_threads);
+        for (size_t i = 0; i < num_threads_; ++i) {
+            core_acceptors_.push_back({tcp::acceptor(cores_->context(i)), i, false});
+            open_acceptor(core_acceptors_.back().acceptor, endpoint, true);
+
+            if (config.binary_port != 0) {
+                core_acceptors_.push_back({tcp::acceptor(cores_->context(i)), i, true});
+                open_acceptor(core_acceptors_.back().acceptor, binary_endpoint, true);
+            }
+        }
+        return;
+    }
+
+    open_acceptor(acceptor_, endpoint);
+
+    if (config.binary_port == 0) {
+        return;
+    }
+
+#ifdef __linux__
+    // Asio's reactor serves the port if the kernel has no usable io_uring
+    if (config.io_uring && io_ring::available()) {
+        std::vector<int> listen_fds;
+        for (size_t i = 0; i < num_threads_; ++i) {
+            tcp::acceptor acceptor(ioc_);
+            try {
+                open_acceptor(acceptor, binary_endpoint, true);
+            } catch (...) {
+                for (int fd : listen_fds) {
+                    ::close(fd);
+                }
+                throw;
+            }
+            listen_fds.push_back(acceptor.release());
+        }
+
+        uring_ = std::make_unique<uring_listener>(
+            std::move(listen_fds),
+            [this](const binary_protocol::frame& frame, std::string& out) {
+                handle_binary_request(frame, out, nullptr);
+            },
+            idle_timeout_, max_connections_, connections_, rejected_connections_);
+        return;
+    }
+#endif
+
+    open_acceptor(binary_acceptor_, binary_endpoint);
+}
+
 http_server::~http_server() {
     stop();
     wait();
@@ -47,12 +324,44 @@ http_server::~http_server() {
 
 void http_server::run() {
     running_ = true;
-    do_accept();
+
+    if (cores_) {
+        for (auto& a : core_acceptors_) {
+            net::co_spawn(cores_->context(a.core), do_accept(a.acceptor, a.binary), net::detached);
+        }
+        cores_->start();
+        start_background_tasks();
+        return;
+    }
+
+    net::co_spawn(ioc_, do_accept(acceptor_, false), net::detached);
+    if (binary_acceptor_.is_open()) {
+        net::co_spawn(ioc_, do_accept(binary_acceptor_, true), net::detached);
+    }
+#ifdef __linux__
+    if (uring_) {
+        uring_->start();
+    }
+#endif
 
     threads_.reserve(num_threads_);
     for (size_t i = 0; i < num_threads_; ++i) {
         threads_.emplace_back([this] { ioc_.run(); });
     }
+
+    start_background_tasks();
+}
+
+void http_server::start_background_tasks() {
+    if (scrubber_) {
+        scrubber_->start();
+    }
+    if (resharder_) {
+        resharder_->resume();
+    }
+    if (replica_) {
+        replica_->start();
+    }
 }
 
 void http_server::stop() {
@@ -62,6 +371,18 @@ void http_server::stop() {
 
     beast::error_code ec;
     acceptor_.close(ec);
+    binary_acceptor_.close(ec);
+    for (auto& a : core_acceptors_) {
+        a.acceptor.close(ec);
+    }
+    if (cores_) {
+        cores_->stop();
+    }
+#ifdef __linux__
+    if (uring_) {
+        uring_->stop();
+    }
+#endif
     ioc_.stop();
 }
 
@@ -73,61 +394,455 @@ void http_server::wait() {
     }
     threads_.clear();
 
+    if (cores_) {
+        cores_->wait();
+    }
+
+#ifdef __linux__
+    if (uring_) {
+        uring_->wait();
+    }
+#endif
+
+    if (scrubber_) {
+        scrubber_->stop();
+        scrubber_.reset();
+    }
+
+    if (replica_) {
+        replica_->stop();
+        replica_.reset();
+    }
+
+    // the manifest keeps an unfinished move for the next start
+    if (resharder_) {
+        resharder_->stop();
+        resharder_.reset();
+    }
+
     db_.close();
 }
 
-void http_server::do_accept() {
-    acceptor_.async_accept(
-        net::make_strand(ioc_),
-        [this](beast::error_code ec, tcp::socket socket) {
-            if (!ec && running_) {
-                // Launch session in a detached coroutine-like manner
-                net::post(
-                    socket.get_executor(),
-                    [this, s = std::move(socket)]() mutable {
-                        handle_session(std::move(s));
-                    });
+size_t http_server::owning_core(const http::request<http::string_body>& req) const {
+    if (!cores_) {
+        return core_group::current();
+    }
+
+    auto target = std::string(req.target());
+    auto path = target.substr(0, target.find('?'));
+    auto key = extract_query_param(target, "key");
+    if ((path != "/get" && path != "/set" && path != "/delete") || key.empty()) {
+        return core_group::current();
+    }
+    return owning_core(base64url_decode(url_decode(key)));
+}
+
+size_t http_server::owning_core(const binary_protocol::frame& frame) const {
+    using namespace binary_protocol;
+
+    if (!cores_) {
+        return core_group::current();
+    }
+
+    switch (frame.code) {
+    case OP_GET:
+    case OP_DELETE:
+        return owning_core(frame.body);
+    case OP_SET:
+        if (frame.body.size() >= 4 && get_u32(frame.body.data()) <= frame.body.size() - 4) {
+            return owning_core(frame.body.substr(4, get_u32(frame.body.data())));
+        }
+        break;
+    }
+    // MGET spans shards, malformed requests are answered where they arrived
+    return core_group::current();
+}
+
+size_t http_server::owning_core(std::string_view key) const {
+    return db_.shard_index(key) % cores_->size();
+}
+
+bool http_server::uses_io_uring() const {
+#ifdef __linux__
+    return uring_ != nullptr;
+#else
+    return false;
+#endif
+}
+
+net::awaitable<void> http_server::do_accept(tcp::acceptor& acceptor, bool binary) {
+    while (running_) {
+        beast::error_code ec;
+        // a core's io_context has one thread and needs no strands
+        net::any_io_executor executor = cores_ ? acceptor.get_executor()
+                                               : net::any_io_executor(net::make_strand(ioc_));
+        tcp::socket socket = co_await acceptor.async_accept(
+            executor, net::redirect_error(net::use_awaitable, ec));
+
+        if (ec) {
+            // closed by stop(), other errors are specific to one connection
+            if (!running_) {
+                break;
             }
-            if (running_) {
-                do_accept();
+            continue;
+        }
+
+        // every session runs on the strand of its socket, or on the core that accepted it
+        beast::tcp_stream stream(std::move(socket));
+
+        if (connections_.fetch_add(1, std::memory_order_relaxed) >= max_connections_) {
+            rejected_connections_.fetch_add(1, std::memory_order_relaxed);
+            // binary clients cannot parse a 503, closing is all they get
+            if (!binary) {
+                net::co_spawn(executor, reject_session(std::move(stream)), net::detached);
+            } else {
+                connections_.fetch_sub(1, std::memory_order_relaxed);
             }
-        });
+        } else if (binary) {
+            net::co_spawn(executor, handle_binary_session(std::move(stream)), net::detached);
+        } else {
+            net::co_spawn(executor, handle_session(std::move(stream)), net::detached);
+        }
+    }
 }
 
-void http_server::handle_session(tcp::socket socket) {
+net::awaitable<void> http_server::handle_session(beast::tcp_stream stream) {
+    connection_guard guard{connections_};
     beast::error_code ec;
     beast::flat_buffer buffer;
 
+    // for direct responses, asynchronous operations are unaffected
+    stream.socket().non_blocking(true, ec);
+
     while (running_) {
         http::request<http::string_body> req;
-        http::read(socket, buffer, req, ec);
+
+        // a keep-alive connection that sends nothing is closed when this expires
+        stream.expires_after(idle_timeout_);
+        co_await http::async_read(stream, buffer, req, net::redirect_error(net::use_awaitable, ec));
 
         if (ec == http::error::end_of_stream) {
             break;
         }
         if (ec) {
-            return;
+            co_return;
         }
 
-        auto res = handle_request(req);
-        res.set(http::field::server, "diskhash-server/1.0");
-        res.prepare_payload();
+        auto start = clock_type::now();
+        server_metrics::request_timing timing;
+
+        http::response<http::string_body> res;
+        direct_response direct(stream.socket());
+        try {
+            // with thread_per_core, on the core that owns the key's shard
+            co_await run_on(owning_core(req), [&] { res = handle_request(req, timing, direct); });
+        } catch (const std::exception& e) {
+            // e.g. checksum_error from a corrupted bucket
+            res = http::response<http::string_body>{
+                http::status::internal_server_error, req.version()};
+            res.set(http::field::content_type, "text/plain");
+            res.body() = e.what();
+        }
+        auto handled = clock_type::now();
+
+        stream.expires_after(idle_timeout_);
+        if (direct.stream_keys) {
+            co_await stream_keys(stream, ec);
+        } else if (direct.sent) {
+            if (!direct.unsent.empty()) {
+                co_await net::async_write(stream, net::buffer(direct.unsent),
+                                          net::redirect_error(net::use_awaitable, ec));
+            }
+        } else {
+            res.set(http::field::server, "diskhash-server/1.0");
+            res.prepare_payload();
+            co_await http::async_write(stream, res, net::redirect_error(net::use_awaitable, ec));
+        }
+
+        auto written = clock_type::now();
+        // a direct response was partly written while the request was handled
+        uint64_t direct_ns = direct.sent ? timing.ns[server_metrics::SERIALIZATION] : 0;
+        timing.ns[server_metrics::SERIALIZATION] = direct_ns + nanoseconds_between(handled, written);
+        timing.ns[server_metrics::TOTAL] = nanoseconds_between(start, written);
+        metrics_.record(timing, res.result_int());
+
+        if (ec) {
+            co_return;
+        }
+
+        // direct and streamed responses leave res without a Content-Length, which would make
+        // it ask for the connection to be closed
+        bool eof = direct.sent || direct.stream_keys ? !req.keep_alive() : res.need_eof();
+        if (eof) {
+            break;
+        }
+    }
+
+    stream.socket().shutdown(tcp::socket::shutdown_send, ec);
+}
+
+net::awaitable<void> http_server::stream_keys(beast::tcp_stream& stream, beast::error_code& ec) {
+    http::response<http::empty_body> res{http::status::ok, 11};
+    res.set(http::field::server, "diskhash-server/1.0");
+    res.set(http::field::content_type, "text/plain");
+    res.chunked(true);
+
+    http::response_serializer<http::empty_body> serializer{res};
+    co_await http::async_write_header(stream, serializer,
+                                      net::redirect_error(net::use_awaitable, ec));
+
+    sharded_hash_map::scan_cursor cursor;
+    std::vector<std::string> keys;
+    std::string chunk;
+    bool more = true;
+
+    while (!ec && more) {
+        keys.clear();
+        more = db_.scan_keys(cursor, KEYS_PAGE_SIZE, keys);
+
+        chunk.clear();
+        for (const auto& key : keys) {
+            chunk += base64url_encode(key);
+            chunk += '\n';
+        }
+        if (chunk.empty()) {
+            continue;
+        }
+
+        stream.expires_after(idle_timeout_);
+        co_await net::async_write(stream, http::make_chunk(net::buffer(chunk)),
+                                  net::redirect_error(net::use_awaitable, ec));
+    }
+
+    if (!ec) {
+        stream.expires_after(idle_timeout_);
+        co_await net::async_write(stream, http::make_chunk_last(),
+                                  net::redirect_error(net::use_awaitable, ec));
+    }
+}
+
+net::awaitable<void> http_server::reject_session(beast::tcp_stream stream) {
+    connection_guard guard{connections_};
+    beast::error_code ec;
+    beast::flat_buffer buffer;
+
+    // read the request first, closing with unread data would reset the connection before
+    // the client sees the response
+    http::request<http::string_body> req;
+    stream.expires_after(idle_timeout_);
+    co_await http::async_read(stream, buffer, req, net::redirect_error(net::use_awaitable, ec));
+    if (ec) {
+        co_return;
+    }
+
+    http::response<http::string_body> res{http::status::service_unavailable, req.version()};
+    res.set(http::field::server, "diskhash-server/1.0");
+    res.set(http::field::content_type, "text/plain");
+    res.keep_alive(false);
+    res.body() = "Too many connections";
+    res.prepare_payload();
+
+    co_await http::async_write(stream, res, net::redirect_error(net::use_awaitable, ec));
+    stream.socket().shutdown(tcp::socket::shutdown_send, ec);
+}
+
+net::awaitable<void> http_server::handle_binary_session(beast::tcp_stream stream) {
+    connection_guard guard{connections_};
+    beast::error_code ec;
+    beast::flat_buffer buffer;
+    std::string out;
+    std::vector<binary_protocol::frame> frames;
+
+    // for large GET values, asynchronous operations are unaffected
+    stream.socket().non_blocking(true, ec);
 
-        http::write(socket, res, ec);
+    while (running_) {
+        stream.expires_after(idle_timeout_);
+        size_t bytes = co_await stream.async_read_some(
+            buffer.prepare(BINARY_READ_SIZE), net::redirect_error(net::use_awaitable, ec));
         if (ec) {
-            return;
+            co_return;
+        }
+        buffer.commit(bytes);
+
+        // answer every complete frame received so far with one write. with thread_per_core,
+        // consecutive frames for the same core are handed to it together
+        std::string_view data(static_cast<const char*>(buffer.data().data()), buffer.size());
+        size_t used = 0;
+        size_t run_core = 0;
+        std::optional<std::string> malformed;
+        frames.clear();
+
+        for (;;) {
+            binary_protocol::frame frame;
+            size_t frame_size;
+            try {
+                frame_size = binary_protocol::parse_frame(data.substr(used), frame);
+            } catch (const std::exception& e) {
+                // the frames before it are still handled and answered
+                malformed = e.what();
+                frame_size = 0;
+            }
+
+            size_t core = frame_size != 0 ? owning_core(frame) : 0;
+            if (!frames.empty() && (frame_size == 0 || core != run_core)) {
+                co_await run_on(run_core, [&] {
+                    for (const auto& f : frames) {
+                        handle_binary_request(f, out, &stream.socket());
+                    }
+                });
+                frames.clear();
+            }
+            if (frame_size == 0) {
+                break;
+            }
+
+            run_core = core;
+            frames.push_back(frame);
+            used += frame_size;
+        }
+        buffer.consume(used);
+        if (malformed) {
+            binary_protocol::append_frame(out, binary_protocol::STATUS_ERROR, *malformed);
+        }
+
+        if (!out.empty()) {
+            stream.expires_after(idle_timeout_);
+            co_await net::async_write(stream, net::buffer(out),
+                                      net::redirect_error(net::use_awaitable, ec));
+            out.clear();
+            if (ec) {
+                co_return;
+            }
+        }
+
+        if (malformed) {
+            // drop what the client still sends until it closes, closing with unread data
+            // would reset the connection before the client reads the responses
+            stream.socket().shutdown(tcp::socket::shutdown_send, ec);
+            while (!ec) {
+                stream.expires_after(idle_timeout_);
+                co_await stream.async_read_some(buffer.prepare(BINARY_READ_SIZE),
+                                                net::redirect_error(net::use_awaitable, ec));
+            }
+            co_return;
+        }
+    }
+}
+
+void http_server::handle_binary_request(const binary_protocol::frame& frame, std::string& out,
+                                        tcp::socket* socket)
+{
+    using namespace binary_protocol;
+
+    auto start = clock_type::now();
+    server_metrics::request_timing timing;
+    // the HTTP status of the equivalent request, for /metrics
+    unsigned status_code = 200;
+
+    auto error = [&](unsigned code, std::string_view message) {
+        append_frame(out, STATUS_ERROR, message);
+        status_code = code;
+    };
+
+    try {
+        switch (frame.code) {
+        case OP_GET: {
+            timing.ep = server_metrics::ENDPOINT_GET;
+            bool sent = false;
+            auto value = lookup(std::string(frame.body), timing, [&](std::string_view value) {
+                if (!socket) {
+                    append_frame(out, STATUS_OK, value);
+                    return;
+                }
+
+                // after the responses before it, which are still in out
+                std::string header;
+                begin_frame(header, STATUS_OK, value.size());
+                std::array<net::const_buffer, 3> buffers{
+                    net::buffer(out), net::buffer(header), net::buffer(value)};
+                std::string unsent;
+                write_or_copy(*socket, buffers, unsent);
+                out = std::move(unsent);
+            }, sent);
+
+            if (value) {
+                append_frame(out, STATUS_OK, *value);
+            } else if (!sent) {
+                append_frame(out, STATUS_NOT_FOUND, {});
+                status_code = 404;
+            }
+            break;
+        }
+
+        case OP_SET: {
+            timing.ep = server_metrics::ENDPOINT_SET;
+            if (frame.body.size() < 4 || get_u32(frame.body.data()) > frame.body.size() - 4) {
+                error(400, "Malformed SET");
+            } else if (read_only()) {
+                error(405, read_only_reason());
+            } else {
+                size_t key_size = get_u32(frame.body.data());
+                std::string key(frame.body.substr(4, key_size));
+                std::string value(frame.body.substr(4 + key_size));
+                if (insert(key, value, timing)) {
+                    append_frame(out, STATUS_OK, {});
+                } else {
+                    append_frame(out, STATUS_EXISTS, {});
+                    status_code = 409;
+                }
+            }
+            break;
+        }
+
+        case OP_DELETE: {
+            timing.ep = server_metrics::ENDPOINT_DELETE;
+            if (read_only()) {
+                error(405, read_only_reason());
+            } else if (erase(std::string(frame.body), timing)) {
+                append_frame(out, STATUS_OK, {});
+            } else {
+                append_frame(out, STATUS_NOT_FOUND, {});
+                status_code = 404;
+            }
+            break;
+        }
+
+        case OP_MGET: {
+            timing.ep = server_metrics::ENDPOINT_MGET;
+            std::vector<std::string_view> fields;
+            if (!split_fields(frame.body, fields)) {
+                error(400, "Malformed MGET");
+                break;
+            }
+
+            std::vector<std::string> keys(fields.begin(), fields.end());
+            std::string body;
+            if (!append_values(body, lookup_many(keys, timing))) {
+                error(413, "MGET response too large");
+                break;
+            }
+            append_frame(out, STATUS_OK, body);
+            break;
         }
 
-        if (res.need_eof()) {
+        default:
+            error(400, "Unknown opcode");
             break;
         }
+    } catch (const std::exception& e) {
+        // e.g. checksum_error from a corrupted bucket
+        error(500, e.what());
     }
 
-    socket.shutdown(tcp::socket::shutdown_send, ec);
+    timing.ns[server_metrics::TOTAL] = nanoseconds_between(start, clock_type::now());
+    metrics_.record(timing, status_code);
 }
 
 http::response<http::string_body> http_server::handle_request(
-    const http::request<http::string_body>& req)
+    const http::request<http::string_body>& req,
+    server_metrics::request_timing& timing,
+    direct_response& direct)
 {
     auto target = std::string(req.target());
 
@@ -137,14 +852,81 @@ http::response<http::string_body> http_server::handle_request(
                            ? target.substr(0, query_pos)
                            : target;
 
+    if (path == "/get") {
+        timing.ep = server_metrics::ENDPOINT_GET;
+    } else if (path == "/set") {
+        timing.ep = server_metrics::ENDPOINT_SET;
+    } else if (path == "/delete") {
+        timing.ep = server_metrics::ENDPOINT_DELETE;
+    } else if (path == "/mget") {
+        timing.ep = server_metrics::ENDPOINT_MGET;
+    } else if (path == "/mset") {
+        timing.ep = server_metrics::ENDPOINT_MSET;
+    } else if (path == "/keys") {
+        timing.ep = server_metrics::ENDPOINT_KEYS;
+    } else if (path == "/health" || path == "/scrub" || path == "/cache" ||
+               path == "/filters" || path == "/stats" || path == "/structure" || path == "/metrics" ||
+               path == "/reshard" || path == "/replication" || path == "/snapshot") {
+        timing.ep = server_metrics::ENDPOINT_ADMIN;
+    }
+
     // Health check
     if (path == "/health") {
         return handle_health();
     }
 
-    // Keys listing
+    // Keys listing, streamed or a page from a cursor
     if (path == "/keys" && req.method() == http::verb::get) {
-        return handle_keys();
+        if (extract_query_param(target, "cursor").empty()) {
+            direct.stream_keys = true;
+            return http::response<http::string_body>{http::status::ok, 11};
+        }
+        return handle_keys(target);
+    }
+
+    // Prometheus text format
+    if (path == "/metrics" && req.method() == http::verb::get) {
+        return handle_metrics();
+    }
+
+    // Scrubber progress and findings
+    if (path == "/scrub" && req.method() == http::verb::get) {
+        return handle_scrub();
+    }
+
+    // Operations for replicas
+    if (path == "/replication" && req.method() == http::verb::get) {
+        return handle_replication(target);
+    }
+
+    // Start resharding, or its progress
+    if (path == "/reshard") {
+        return handle_reshard(req, target);
+    }
+
+    // Copy the database for a backup
+    if (path == "/snapshot") {
+        return handle_snapshot(req, target);
+    }
+
+    // Record count and live bytes, with filter and cache counters
+    if (path == "/stats" && req.method() == http::verb::get) {
+        return handle_stats();
+    }
+
+    // Chain lengths, bucket fill and split statistics, walks every shard
+    if (path == "/structure" && req.method() == http::verb::get) {
+        return handle_structure();
+    }
+
+    // Cache hit ratio and evictions
+    if (path == "/cache" && req.method() == http::verb::get) {
+        return handle_cache();
+    }
+
+    // Bucket filter effectiveness
+    if (path == "/filters" && req.method() == http::verb::get) {
+        return handle_filters();
     }
 
     // GET /get?key=...
@@ -157,7 +939,7 @@ http::response<http::string_body> http_server::handle_request(
             res.body() = "Missing 'key' parameter";
             return res;
         }
-        return handle_get(base64url_decode(url_decode(key)));
+        return handle_get(base64url_decode(url_decode(key)), timing, direct);
     }
 
     // PUT/POST /set?key=...
@@ -171,7 +953,7 @@ http::response<http::string_body> http_server::handle_request(
             res.body() = "Missing 'key' parameter";
             return res;
         }
-        return handle_set(base64url_decode(url_decode(key)), req.body());
+        return handle_set(base64url_decode(url_decode(key)), req.body(), timing);
     }
 
     // DELETE /delete?key=...
@@ -184,7 +966,17 @@ http::response<http::string_body> http_server::handle_request(
             res.body() = "Missing 'key' parameter";
             return res;
         }
-        return handle_delete(base64url_decode(url_decode(key)));
+        return handle_delete(base64url_decode(url_decode(key)), timing);
+    }
+
+    // POST /mget, length-prefixed keys
+    if (path == "/mget" && req.method() == http::verb::post) {
+        return handle_mget(req.body(), timing);
+    }
+
+    // POST /mset, length-prefixed keys and values
+    if (path == "/mset" && req.method() == http::verb::post) {
+        return handle_mset(req.body(), timing);
     }
 
     // Not found
@@ -194,10 +986,201 @@ http::response<http::string_body> http_server::handle_request(
     return res;
 }
 
-http::response<http::string_body> http_server::handle_get(const std::string& key) {
-    auto result = db_.get(key);
-    if (result) {
-        http::response<http::string_body> res{http::status::ok, 11};
+std::optional<std::string> http_server::lookup(const std::string& key,
+                                               server_metrics::request_timing& timing,
+                                               const std::function<void(std::string_view)>& send,
+                                               bool& sent)
+{
+    auto start = clock_type::now();
+    uint64_t send_ns = 0;
+
+    std::optional<std::string> result;
+    uint64_t token = 0;
+    sent = false;
+
+    if (!cache_ || !cache_->find(cache_segment(key), key, result, token)) {
+        db_.with_value(key, [&](std::string_view value) {
+            if (value.size() < DIRECT_VALUE_SIZE) {
+                result.emplace(value);
+                return;
+            }
+
+            auto send_start = clock_type::now();
+            send(value);
+            send_ns = nanoseconds_between(send_start, clock_type::now());
+            sent = true;
+        });
+
+        if (cache_ && !sent) {
+            cache_->insert(cache_segment(key), key, result, token);
+        }
+    }
+
+    timing.shard = db_.shard_index(key);
+    timing.ns[server_metrics::LOOKUP] = nanoseconds_between(start, clock_type::now()) - send_ns;
+    if (sent) {
+        timing.ns[server_metrics::SERIALIZATION] = send_ns;
+    }
+    return result;
+}
+
+bool http_server::insert(const std::string& key, const std::string& value,
+                         server_metrics::request_timing& timing)
+{
+    auto start = clock_type::now();
+    std::chrono::nanoseconds lock_wait{0};
+
+    // logged in the order the writes of the key took effect
+    std::unique_lock<std::mutex> logged;
+    if (log_) {
+        logged = std::unique_lock(log_->key_mutex(key));
+    }
+
+    bool inserted = db_.set(key, value, &lock_wait);
+    if (inserted && log_) {
+        log_->append(replication_log::OP_SET, key, value);
+    }
+
+    timing.shard = db_.shard_index(key);
+    timing.ns[server_metrics::LOCK_WAIT] = lock_wait.count();
+    timing.ns[server_metrics::LOOKUP] =
+        nanoseconds_between(start, clock_type::now()) - lock_wait.count();
+
+    // after the map, see record_cache
+    if (inserted && cache_) {
+        cache_->invalidate(cache_segment(key), key);
+    }
+    return inserted;
+}
+
+bool http_server::erase(const std::string& key, server_metrics::request_timing& timing) {
+    auto start = clock_type::now();
+    std::chrono::nanoseconds lock_wait{0};
+
+    std::unique_lock<std::mutex> logged;
+    if (log_) {
+        logged = std::unique_lock(log_->key_mutex(key));
+    }
+
+    bool removed = db_.remove(key, &lock_wait);
+    if (removed && log_) {
+        log_->append(replication_log::OP_DELETE, key, {});
+    }
+
+    timing.shard = db_.shard_index(key);
+    timing.ns[server_metrics::LOCK_WAIT] = lock_wait.count();
+    timing.ns[server_metrics::LOOKUP] =
+        nanoseconds_between(start, clock_type::now()) - lock_wait.count();
+
+    if (removed && cache_) {
+        cache_->invalidate(cache_segment(key), key);
+    }
+    return removed;
+}
+
+std::vector<std::optional<std::string>> http_server::lookup_many(
+    const std::vector<std::string>& keys, server_metrics::request_timing& timing)
+{
+    auto start = clock_type::now();
+
+    std::vector<std::optional<std::string>> results(keys.size());
+    std::vector<uint64_t> tokens(keys.size());
+    std::vector<size_t> misses;
+
+    for (size_t i = 0; i < keys.size(); ++i) {
+        if (!cache_ || !cache_->find(cache_segment(keys[i]), keys[i], results[i], tokens[i])) {
+            misses.push_back(i);
+        }
+    }
+
+    if (misses.size() == keys.size()) {
+        results = db_.get_many(keys);
+    } else if (!misses.empty()) {
+        std::vector<std::string> miss_keys;
+        for (size_t i : misses) {
+            miss_keys.push_back(keys[i]);
+        }
+
+        auto found = db_.get_many(miss_keys);
+        for (size_t j = 0; j < misses.size(); ++j) {
+            results[misses[j]] = std::move(found[j]);
+        }
+    }
+
+    if (cache_) {
+        for (size_t i : misses) {
+            cache_->insert(cache_segment(keys[i]), keys[i], results[i], tokens[i]);
+        }
+    }
+
+    // keys fall into different shards, so only the whole batch is timed
+    timing.ns[server_metrics::LOOKUP] = nanoseconds_between(start, clock_type::now());
+    return results;
+}
+
+std::vector<bool> http_server::insert_many(
+    const std::vector<std::pair<std::string, std::string>>& records,
+    server_metrics::request_timing& timing)
+{
+    auto start = clock_type::now();
+    std::chrono::nanoseconds lock_wait{0};
+
+    std::vector<std::unique_lock<std::mutex>> logged;
+    if (log_) {
+        std::vector<std::string_view> keys;
+        for (const auto& record : records) {
+            keys.push_back(record.first);
+        }
+        logged = log_->lock_keys(keys);
+    }
+
+    auto inserted = db_.set_many(records, &lock_wait);
+    if (log_) {
+        for (size_t i = 0; i < records.size(); ++i) {
+            if (inserted[i]) {
+                log_->append(replication_log::OP_SET, records[i].first, records[i].second);
+            }
+        }
+    }
+
+    timing.ns[server_metrics::LOCK_WAIT] = lock_wait.count();
+    timing.ns[server_metrics::LOOKUP] =
+        nanoseconds_between(start, clock_type::now()) - lock_wait.count();
+
+    if (cache_) {
+        for (size_t i = 0; i < records.size(); ++i) {
+            if (inserted[i]) {
+                cache_->invalidate(cache_segment(records[i].first), records[i].first);
+            }
+        }
+    }
+    return inserted;
+}
+
+http::response<http::string_body> http_server::handle_get(
+    const std::string& key, server_metrics::request_timing& timing, direct_response& direct)
+{
+    auto result = lookup(key, timing, [&](std::string_view value) {
+        http::response<http::empty_body> res{http::status::ok, 11};
+        res.set(http::field::server, "diskhash-server/1.0");
+        res.set(http::field::content_type, "application/octet-stream");
+        res.content_length(value.size());
+
+        std::ostringstream header;
+        header << res;
+        std::string head = header.str();
+
+        std::array<net::const_buffer, 2> buffers{net::buffer(head), net::buffer(value)};
+        write_or_copy(direct.socket, buffers, direct.unsent);
+    }, direct.sent);
+
+    // the status is all that is left of a direct response, for /metrics
+    if (direct.sent) {
+        return http::response<http::string_body>{http::status::ok, 11};
+    }
+
+    if (result) {
+        http::response<http::string_body> res{http::status::ok, 11};
         res.set(http::field::content_type, "application/octet-stream");
         res.body() = std::move(*result);
         return res;
@@ -210,9 +1193,14 @@ http::response<http::string_body> http_server::handle_get(const std::string& key
 }
 
 http::response<http::string_body> http_server::handle_set(
-    const std::string& key, const std::string& value)
+    const std::string& key, const std::string& value,
+    server_metrics::request_timing& timing)
 {
-    if (db_.set(key, value)) {
+    if (read_only()) {
+        return read_only_response();
+    }
+
+    if (insert(key, value, timing)) {
         http::response<http::string_body> res{http::status::ok, 11};
         res.set(http::field::content_type, "text/plain");
         res.body() = "OK";
@@ -225,8 +1213,14 @@ http::response<http::string_body> http_server::handle_set(
     return res;
 }
 
-http::response<http::string_body> http_server::handle_delete(const std::string& key) {
-    if (db_.remove(key)) {
+http::response<http::string_body> http_server::handle_delete(
+    const std::string& key, server_metrics::request_timing& timing)
+{
+    if (read_only()) {
+        return read_only_response();
+    }
+
+    if (erase(key, timing)) {
         http::response<http::string_body> res{http::status::ok, 11};
         res.set(http::field::content_type, "text/plain");
         res.body() = "OK";
@@ -239,17 +1233,89 @@ http::response<http::string_body> http_server::handle_delete(const std::string&
     return res;
 }
 
-http::response<http::string_body> http_server::handle_keys() {
-    auto all_keys = db_.keys();
+http::response<http::string_body> http_server::handle_mget(
+    const std::string& body, server_metrics::request_timing& timing)
+{
+    std::vector<std::string_view> fields;
+    if (!binary_protocol::split_fields(body, fields)) {
+        http::response<http::string_body> res{http::status::bad_request, 11};
+        res.set(http::field::content_type, "text/plain");
+        res.body() = "Malformed key list";
+        return res;
+    }
+
+    std::vector<std::string> keys(fields.begin(), fields.end());
 
-    std::ostringstream oss;
-    for (const auto& key : all_keys) {
-        oss << base64url_encode(key) << "\n";
+    http::response<http::string_body> res{http::status::ok, 11};
+    res.set(http::field::content_type, "application/octet-stream");
+    if (!append_values(res.body(), lookup_many(keys, timing))) {
+        res.result(http::status::payload_too_large);
+        res.set(http::field::content_type, "text/plain");
+        res.body() = "MGET response too large";
+    }
+    return res;
+}
+
+http::response<http::string_body> http_server::handle_mset(
+    const std::string& body, server_metrics::request_timing& timing)
+{
+    if (read_only()) {
+        return read_only_response();
+    }
+
+    std::vector<std::string_view> fields;
+    if (!binary_protocol::split_fields(body, fields) || fields.size() % 2 != 0) {
+        http::response<http::string_body> res{http::status::bad_request, 11};
+        res.set(http::field::content_type, "text/plain");
+        res.body() = "Malformed key and value list";
+        return res;
+    }
+
+    std::vector<std::pair<std::string, std::string>> records;
+    records.reserve(fields.size() / 2);
+    for (size_t i = 0; i < fields.size(); i += 2) {
+        records.emplace_back(fields[i], fields[i + 1]);
+    }
+
+    auto inserted = insert_many(records, timing);
+
+    // one byte per pair: 1 if it was set, 0 if the key already existed
+    http::response<http::string_body> res{http::status::ok, 11};
+    res.set(http::field::content_type, "application/octet-stream");
+    for (bool i : inserted) {
+        res.body().push_back(i ? 1 : 0);
+    }
+    return res;
+}
+
+http::response<http::string_body> http_server::handle_keys(const std::string& target) {
+    sharded_hash_map::scan_cursor cursor;
+    size_t count = KEYS_PAGE_SIZE;
+    bool valid = parse_cursor(extract_query_param(target, "cursor"), cursor) &&
+                 cursor.shard <= db_.num_shards();
+
+    valid = valid && parse_count(extract_query_param(target, "count"), count);
+
+    if (!valid) {
+        http::response<http::string_body> res{http::status::bad_request, 11};
+        res.set(http::field::content_type, "text/plain");
+        res.body() = "Invalid cursor or count";
+        return res;
+    }
+
+    std::vector<std::string> keys;
+    bool more = db_.scan_keys(cursor, std::min(count, MAX_KEYS_PAGE_SIZE), keys);
+
+    std::string body;
+    for (const auto& key : keys) {
+        body += base64url_encode(key);
+        body += '\n';
     }
 
     http::response<http::string_body> res{http::status::ok, 11};
     res.set(http::field::content_type, "text/plain");
-    res.body() = oss.str();
+    res.set("X-Cursor", format_cursor(cursor, more));
+    res.body() = std::move(body);
     return res;
 }
 
@@ -260,6 +1326,444 @@ http::response<http::string_body> http_server::handle_health() {
     return res;
 }
 
+http::response<http::string_body> http_server::handle_scrub() {
+    if (!scrubber_) {
+        http::response<http::string_body> res{http::status::not_found, 11};
+        res.set(http::field::content_type, "text/plain");
+        res.body() = "Scrubber is disabled";
+        return res;
+    }
+
+    std::ostringstream oss;
+    oss << "buckets_scrubbed " << scrubber_->buckets_scrubbed() << "\n";
+    oss << "passes_completed " << scrubber_->passes_completed() << "\n";
+    for (const auto& [shard_idx, bucket_id] : scrubber_->corrupted_buckets()) {
+        oss << "corrupted " << shard_idx << " " << bucket_id << "\n";
+    }
+
+    http::response<http::string_body> res{http::status::ok, 11};
+    res.set(http::field::content_type, "text/plain");
+    res.body() = oss.str();
+    return res;
+}
+
+http::response<http::string_body> http_server::handle_reshard(
+    const http::request<http::string_body>& req, const std::string& target)
+{
+    if (!resharder_) {
+        return frozen_response();
+    }
+
+    if (req.method() == http::verb::get) {
+        std::ostringstream oss;
+        oss << "shards " << db_.num_shards() << "\n";
+        oss << "target " << db_.reshard_target() << "\n";
+        oss << "running " << (resharder_->running() ? 1 : 0) << "\n";
+        oss << "keys_moved " << resharder_->keys_moved() << "\n";
+
+        http::response<http::string_body> res{http::status::ok, 11};
+        res.set(http::field::content_type, "text/plain");
+        res.body() = oss.str();
+        return res;
+    }
+
+    http::response<http::string_body> res{http::status::accepted, 11};
+    res.set(http::field::content_type, "text/plain");
+
+    auto shards = extract_query_param(target, "shards");
+    if (req.method() != http::verb::post || shards.empty() || shards.size() > 9 ||
+        shards.find_first_not_of("0123456789") != std::string::npos) {
+        res.result(http::status::bad_request);
+        res.body() = "Expected POST /reshard?shards=N";
+        return res;
+    }
+
+    try {
+        resharder_->start(std::stoul(shards));
+        res.body() = "Resharding to " + shards + " shards";
+    } catch (const std::invalid_argument& e) {
+        res.result(http::status::bad_request);
+        res.body() = e.what();
+    } catch (const std::logic_error& e) {
+        res.result(http::status::conflict);
+        res.body() = e.what();
+    }
+    return res;
+}
+
+http::response<http::string_body> http_server::handle_snapshot(
+    const http::request<http::string_body>& req, const std::string& target)
+{
+    http::response<http::string_body> res{http::status::ok, 11};
+    res.set(http::field::content_type, "text/plain");
+
+    if (snapshot_dir_.empty()) {
+        res.result(http::status::not_found);
+        res.body() = "Snapshots are disabled, see --snapshot-dir";
+        return res;
+    }
+    if (db_.frozen()) {
+        return frozen_response();
+    }
+
+    auto name = extract_query_param(target, "name");
+    if (name.empty()) {
+        name = snapshot_timestamp();
+    }
+    if (req.method() != http::verb::post || !valid_snapshot_name(name)) {
+        res.result(http::status::bad_request);
+        res.body() = "Expected POST /snapshot?name=NAME of letters, digits, '_', '.' and '-'";
+        return res;
+    }
+
+    // the files keep the name of the database, so the copy is served with
+    // --db <snapshot_dir>/<name>/<database name>
+    std::filesystem::path dir = std::filesystem::path(snapshot_dir_) / name;
+    std::string base = (dir / std::filesystem::path(db_path_).filename()).string();
+
+    std::error_code ec;
+    std::filesystem::create_directories(snapshot_dir_, ec);
+    if (!std::filesystem::create_directory(dir, ec)) {
+        res.result(ec ? http::status::internal_server_error : http::status::conflict);
+        res.body() = ec ? "Cannot create " + dir.string() + ": " + ec.message()
+                        : "Snapshot " + name + " exists";
+        return res;
+    }
+
+    auto start = clock_type::now();
+    size_t shards;
+    try {
+        shards = db_.snapshot(base);
+    } catch (const std::logic_error& e) {
+        std::filesystem::remove_all(dir, ec);
+        res.result(http::status::conflict);
+        res.body() = e.what();
+        return res;
+    } catch (const std::exception& e) {
+        std::filesystem::remove_all(dir, ec);
+        res.result(http::status::internal_server_error);
+        res.body() = std::string("Snapshot failed: ") + e.what();
+        return res;
+    }
+    auto elapsed = clock_type::now() - start;
+
+    uintmax_t bytes = 0;
+    for (const auto& entry : std::filesystem::directory_iterator(dir, ec)) {
+        bytes += entry.file_size(ec);
+    }
+
+    std::ostringstream oss;
+    oss << "path " << base << "\n";
+    oss << "shards " << shards << "\n";
+    oss << "bytes " << bytes << "\n";
+    oss << "milliseconds "
+        << std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count() << "\n";
+    res.body() = oss.str();
+    return res;
+}
+
+http::response<http::string_body> http_server::handle_replication(const std::string& target) {
+    http::response<http::string_body> res{http::status::ok, 11};
+    res.set(http::field::content_type, "application/octet-stream");
+
+    // a page of length-prefixed keys and values, skipping those deleted in between
+    auto snapshot = extract_query_param(target, "snapshot");
+    if (!snapshot.empty()) {
+        sharded_hash_map::scan_cursor cursor;
+        size_t count = KEYS_PAGE_SIZE;
+        if (!parse_cursor(snapshot, cursor) || cursor.shard > db_.num_shards() ||
+            !parse_count(extract_query_param(target, "count"), count)) {
+            res.result(http::status::bad_request);
+            res.set(http::field::content_type, "text/plain");
+            res.body() = "Invalid cursor or count";
+            return res;
+        }
+
+        std::vector<std::string> keys;
+        bool more = db_.scan_keys(cursor, std::min(count, MAX_KEYS_PAGE_SIZE), keys);
+        auto values = db_.get_many(keys);
+        for (size_t i = 0; i < keys.size(); ++i) {
+            if (values[i]) {
+                binary_protocol::append_field(res.body(), keys[i]);
+                binary_protocol::append_field(res.body(), *values[i]);
+            }
+        }
+        res.set("X-Cursor", format_cursor(cursor, more));
+        return res;
+    }
+
+    if (!log_) {
+        res.result(http::status::not_found);
+        res.set(http::field::content_type, "text/plain");
+        res.body() = "Replication log is disabled";
+        return res;
+    }
+
+    // a replica that never synced asks for log 0 and gets the heads to copy from
+    auto log_param = extract_query_param(target, "log");
+    std::vector<uint64_t> log_id;
+    std::vector<uint64_t> from;
+    auto from_param = extract_query_param(target, "from");
+    if (!parse_sequence_list(log_param, log_id) || log_id.size() != 1 ||
+        (!from_param.empty() && !parse_sequence_list(from_param, from))) {
+        res.result(http::status::bad_request);
+        res.set(http::field::content_type, "text/plain");
+        res.body() = "Expected /replication?log=<id>&from=<seq>,<seq>,...";
+        return res;
+    }
+
+    size_t streams = log_->streams();
+    bool resume = log_id[0] == log_->id() && from.size() == streams;
+    size_t stream_bytes = std::max<size_t>(REPLICATION_BATCH_BYTES / streams, 64 * 1024);
+
+    std::string& body = res.body();
+    binary_protocol::put_u64(body, log_->id());
+    binary_protocol::put_u32(body, uint32_t(streams));
+
+    std::string ops;
+    for (size_t i = 0; i < streams; ++i) {
+        ops.clear();
+        uint32_t count = 0;
+        bool kept = resume && log_->read(i, from[i], stream_bytes, ops, count);
+
+        body.push_back(kept ? 0 : 1);
+        binary_protocol::put_u64(body, log_->head(i));
+        binary_protocol::put_u32(body, count);
+        binary_protocol::put_u32(body, uint32_t(ops.size()));
+        body += ops;
+    }
+    return res;
+}
+
+http::response<http::string_body> http_server::handle_cache() {
+    if (!cache_) {
+        http::response<http::string_body> res{http::status::not_found, 11};
+        res.set(http::field::content_type, "text/plain");
+        res.body() = "Cache is disabled";
+        return res;
+    }
+
+    auto stats = cache_->get_stats();
+
+    std::ostringstream oss;
+    oss << "hits " << stats.hits << "\n";
+    oss << "negative_hits " << stats.negative_hits << "\n";
+    oss << "misses " << stats.misses << "\n";
+    oss << "hit_ratio " << stats.hit_ratio() << "\n";
+    oss << "evictions " << stats.evictions << "\n";
+    oss << "entries " << stats.entries << "\n";
+    oss << "bytes " << stats.bytes << "\n";
+    oss << "capacity_bytes " << cache_->capacity_bytes() << "\n";
+
+    http::response<http::string_body> res{http::status::ok, 11};
+    res.set(http::field::content_type, "text/plain");
+    res.body() = oss.str();
+    return res;
+}
+
+http::response<http::string_body> http_server::handle_filters() {
+    auto stats = db_.filter_stats();
+    if (!stats) {
+        http::response<http::string_body> res{http::status::not_found, 11};
+        res.set(http::field::content_type, "text/plain");
+        res.body() = "Filters are disabled";
+        return res;
+    }
+
+    std::ostringstream oss;
+    oss << "lookups " << stats->lookups << "\n";
+    oss << "negatives " << stats->negatives << "\n";
+    oss << "false_positives " << stats->false_positives << "\n";
+    oss << "false_positive_rate " << stats->false_positive_rate() << "\n";
+
+    http::response<http::string_body> res{http::status::ok, 11};
+    res.set(http::field::content_type, "text/plain");
+    res.body() = oss.str();
+    return res;
+}
+
+http::response<http::string_body> http_server::handle_stats() {
+    auto usage = db_.usage();
+
+    std::ostringstream oss;
+    oss << "records " << usage.records << "\n";
+    oss << "key_bytes " << usage.key_bytes << "\n";
+    oss << "value_bytes " << usage.value_bytes << "\n";
+    oss << "free_buckets " << usage.free_buckets << "\n";
+    oss << "shards " << db_.num_shards() << "\n";
+
+    if (auto filters = db_.filter_stats()) {
+        oss << "filter_lookups " << filters->lookups << "\n";
+        oss << "filter_negatives " << filters->negatives << "\n";
+        oss << "filter_false_positives " << filters->false_positives << "\n";
+    }
+
+    if (cache_) {
+        auto cache = cache_->get_stats();
+        oss << "cache_hits " << cache.hits << "\n";
+        oss << "cache_misses " << cache.misses << "\n";
+        oss << "cache_evictions " << cache.evictions << "\n";
+        oss << "cache_bytes " << cache.bytes << "\n";
+    }
+
+    http::response<http::string_body> res{http::status::ok, 11};
+    res.set(http::field::content_type, "text/plain");
+    res.body() = oss.str();
+    return res;
+}
+
+http::response<http::string_body> http_server::handle_structure() {
+    auto structure = db_.structure();
+
+    std::ostringstream oss;
+    oss << "buckets " << structure.buckets << "\n";
+    oss << "chains " << structure.chains << "\n";
+    oss << "bytes_used " << structure.bytes_used << "\n";
+    for (size_t length = 1; length < structure.chain_lengths.size(); ++length) {
+        oss << "chain_length_" << length << " " << structure.chain_lengths[length] << "\n";
+    }
+    for (size_t bin = 0; bin < structure.FILL_BINS; ++bin) {
+        oss << "bucket_fill_" << (bin + 1) * 100 / structure.FILL_BINS << " "
+            << structure.bucket_fill[bin] << "\n";
+    }
+    oss << "global_depth " << structure.global_depth << "\n";
+    oss << "median_local_depth " << structure.median_local_depth() << "\n";
+    oss << "splits " << structure.splits << "\n";
+    oss << "catalogue_doublings " << structure.catalogue_doublings << "\n";
+    oss << "file_resizes " << structure.file_resizes << "\n";
+    oss << "bytes_moved " << structure.bytes_moved << "\n";
+
+    http::response<http::string_body> res{http::status::ok, 11};
+    res.set(http::field::content_type, "text/plain");
+    res.body() = oss.str();
+    return res;
+}
+
+http::response<http::string_body> http_server::handle_metrics() {
+    auto snapshot = metrics_.read();
+
+    std::ostringstream oss;
+
+    oss << "# HELP diskhash_requests_total Requests handled, by endpoint and status class\n";
+    oss << "# TYPE diskhash_requests_total counter\n";
+    for (size_t ep = 0; ep < server_metrics::ENDPOINTS; ++ep) {
+        for (size_t c = 0; c < snapshot.requests[ep].size(); ++c) {
+            if (snapshot.requests[ep][c] == 0) {
+                continue;
+            }
+            oss << "diskhash_requests_total{endpoint=\""
+                << server_metrics::endpoint_name(server_metrics::endpoint(ep))
+                << "\",code=\"" << c << "xx\"} " << snapshot.requests[ep][c] << "\n";
+        }
+    }
+
+    oss << "# HELP diskhash_request_duration_seconds Time requests spent in each phase\n";
+    oss << "# TYPE diskhash_request_duration_seconds histogram\n";
+    for (size_t ep = 0; ep < server_metrics::ENDPOINTS; ++ep) {
+        for (size_t p = 0; p < server_metrics::PHASES; ++p) {
+            const auto& histogram = snapshot.endpoints[ep][p];
+            if (histogram.count() == 0) {
+                continue;
+            }
+            std::string labels = std::string("endpoint=\"") +
+                server_metrics::endpoint_name(server_metrics::endpoint(ep)) + "\",phase=\"" +
+                server_metrics::phase_name(server_metrics::phase(p)) + "\"";
+            write_histogram(oss, "diskhash_request_duration_seconds", labels, histogram);
+        }
+    }
+
+    oss << "# HELP diskhash_shard_duration_seconds Time key requests spent in each phase, by shard\n";
+    oss << "# TYPE diskhash_shard_duration_seconds histogram\n";
+    for (size_t shard = 0; shard < snapshot.shards.size(); ++shard) {
+        for (size_t p = 0; p < server_metrics::PHASES; ++p) {
+            const auto& histogram = snapshot.shards[shard][p];
+            if (histogram.count() == 0) {
+                continue;
+            }
+            std::string labels = "shard=\"" + std::to_string(shard) + "\",phase=\"" +
+                server_metrics::phase_name(server_metrics::phase(p)) + "\"";
+            write_histogram(oss, "diskhash_shard_duration_seconds", labels, histogram);
+        }
+    }
+
+    oss << "# HELP diskhash_shard_bytes_allocated Size of the shard's files\n";
+    oss << "# TYPE diskhash_shard_bytes_allocated gauge\n";
+    for (size_t shard = 0; shard < db_.num_shards(); ++shard) {
+        oss << "diskhash_shard_bytes_allocated{shard=\"" << shard << "\"} "
+            << db_.bytes_allocated(shard) << "\n";
+    }
+
+    oss << "# HELP diskhash_shard_records Records stored in the shard\n";
+    oss << "# TYPE diskhash_shard_records gauge\n";
+    for (size_t shard = 0; shard < db_.num_shards(); ++shard) {
+        oss << "diskhash_shard_records{shard=\"" << shard << "\"} "
+            << db_.shard_usage(shard).records << "\n";
+    }
+
+    if (log_) {
+        oss << "# HELP diskhash_replication_log_bytes Memory held by operations kept for replicas\n";
+        oss << "# TYPE diskhash_replication_log_bytes gauge\n";
+        oss << "diskhash_replication_log_bytes " << log_->bytes() << "\n";
+    }
+
+    if (replica_) {
+        oss << "# HELP diskhash_replication_connected Whether the last request to the primary succeeded\n";
+        oss << "# TYPE diskhash_replication_connected gauge\n";
+        oss << "diskhash_replication_connected " << (replica_->connected() ? 1 : 0) << "\n";
+
+        oss << "# HELP diskhash_replication_lag_operations Operations of the primary not applied yet, at the last poll\n";
+        oss << "# TYPE diskhash_replication_lag_operations gauge\n";
+        oss << "diskhash_replication_lag_operations " << replica_->lag_operations() << "\n";
+
+        oss << "# HELP diskhash_replication_lag_seconds Time since the replica last had every operation of the primary\n";
+        oss << "# TYPE diskhash_replication_lag_seconds gauge\n";
+        oss << "diskhash_replication_lag_seconds " << replica_->lag_seconds() << "\n";
+
+        oss << "# HELP diskhash_replication_operations_total Operations of the primary applied\n";
+        oss << "# TYPE diskhash_replication_operations_total counter\n";
+        oss << "diskhash_replication_operations_total " << replica_->operations_applied() << "\n";
+
+        oss << "# HELP diskhash_replication_full_syncs_total Copies of all of the primary's records\n";
+        oss << "# TYPE diskhash_replication_full_syncs_total counter\n";
+        oss << "diskhash_replication_full_syncs_total " << replica_->full_syncs() << "\n";
+    }
+
+    oss << "# HELP diskhash_connections Open client connections\n";
+    oss << "# TYPE diskhash_connections gauge\n";
+    oss << "diskhash_connections " << connections_.load(std::memory_order_relaxed) << "\n";
+
+    oss << "# HELP diskhash_connections_rejected_total Connections refused with a 503 at the connection limit\n";
+    oss << "# TYPE diskhash_connections_rejected_total counter\n";
+    oss << "diskhash_connections_rejected_total "
+        << rejected_connections_.load(std::memory_order_relaxed) << "\n";
+
+    http::response<http::string_body> res{http::status::ok, 11};
+    res.set(http::field::content_type, "text/plain; version=0.0.4");
+    res.body() = oss.str();
+    return res;
+}
+
+std::string http_server::read_only_reason() const {
+    if (replica_) {
+        return "Database is a replica of " + replica_->primary();
+    }
+    return "Database is frozen";
+}
+
+http::response<http::string_body> http_server::read_only_response() {
+    http::response<http::string_body> res{http::status::method_not_allowed, 11};
+    res.set(http::field::content_type, "text/plain");
+    res.body() = read_only_reason();
+    return res;
+}
+
+http::response<http::string_body> http_server::frozen_response() {
+    http::response<http::string_body> res{http::status::method_not_allowed, 11};
+    res.set(http::field::content_type, "text/plain");
+    res.body() = "Database is frozen";
+    return res;
+}
+
 std::string http_server::url_decode(const std::string& str) {
     std::string result;
     result.reserve(str.size());
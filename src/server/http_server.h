@@ -1,17 +1,34 @@
 #pragma once
 
 #include <atomic>
+#include <chrono>
 #include <cstdint>
+#include <functional>
 #include <memory>
+#include <optional>
 #include <string>
+#include <string_view>
 #include <thread>
+#include <utility>
 #include <vector>
 
 #include <boost/asio.hpp>
 #include <boost/beast.hpp>
 
+#include "binary_protocol.h"
+#include "core_group.h"
+#include "record_cache.h"
+#include "replica.h"
+#include "replication_log.h"
+#include "resharder.h"
+#include "scrubber.h"
+#include "server_metrics.h"
 #include "sharded_hash_map.h"
 
+#ifdef __linux__
+#include "uring_listener.h"
+#endif
+
 namespace diskhash {
 
 namespace beast = boost::beast;
@@ -19,11 +36,61 @@ namespace http = beast::http;
 namespace net = boost::asio;
 using tcp = net::ip::tcp;
 
+struct server_config {
+    std::string address = "0.0.0.0";
+    uint16_t port = 8080;
+    std::string db_path;
+    // shards of a new database, an existing one keeps the count in its manifest
+    size_t num_shards = 4;
+    size_t num_threads = 1;
+
+    // CRC32C per bucket, only applies to shards created by this run
+    bool checksums = false;
+
+    // buckets verified per second by the background scrubber, 0 disables it
+    size_t scrub_rate = 0;
+
+    // serve the read-only copies written by diskhash_freeze, modifications are rejected
+    bool frozen = false;
+
+    // keep a Bloom filter per bucket chain so that lookups of missing keys skip the buckets
+    bool filters = false;
+
+    // bytes of recent lookups, including misses, cached in memory, 0 disables the cache
+    size_t cache_bytes = 0;
+
+    // seconds a connection may take to send a request or receive a response before it is closed
+    size_t idle_timeout = 60;
+
+    // open connections, further ones get a 503 and are closed
+    size_t max_connections = 10000;
+
+    // port of the binary_protocol listener, 0 disables it
+    uint16_t binary_port = 0;
+
+    // serve the binary listener from io_uring rings, one per thread, where the kernel has them
+    bool io_uring = false;
+
+    // every thread runs its own io_context with its own listening sockets and executes the
+    // requests for its shards, see core_group. the binary listener then uses epoll
+    bool thread_per_core = false;
+
+    // bind each thread of thread_per_core to a CPU
+    bool pin_threads = false;
+
+    // bytes of recent sets and deletes kept for replicas to tail, 0 disables the log
+    size_t replication_log_bytes = 64 << 20;
+
+    // host:port of a primary to follow, clients may then only read
+    std::string replica_of;
+
+    // directory that POST /snapshot writes copies of the database into, empty disables it
+    std::string snapshot_dir;
+};
+
 class http_server {
 public:
-    http_server(const std::string& address, uint16_t port,
-                const std::string& db_path, size_t num_shards,
-                size_t num_threads);
+    explicit http_server(const server_config& config);
 
     ~http_server();
 
@@ -31,26 +98,173 @@ public:
     void stop();
     void wait();
 
+    // whether io_uring serves the binary listener, false if it was not asked for or the kernel
+    // does not provide it and Asio's reactor does instead
+    bool uses_io_uring() const;
+
+    // of the database, both layouts' while resharding
+    size_t num_shards() const {
+        return db_.num_shards();
+    }
+
 private:
+    // declared before ioc_: sessions still suspended when the server is destroyed decrement it
+    // as ioc_ destroys them
+    std::atomic<size_t> connections_{0};
+    std::atomic<uint64_t> rejected_connections_{0};
+
     net::io_context ioc_;
+    // thread_per_core: every core accepts on its own listening sockets, on its io_context
+    std::unique_ptr<core_group> cores_;
+    struct core_acceptor {
+        tcp::acceptor acceptor;
+        size_t core;
+        bool binary;
+    };
+    std::vector<core_acceptor> core_acceptors_;
     tcp::acceptor acceptor_;
+    tcp::acceptor binary_acceptor_;
     sharded_hash_map db_;
+    std::unique_ptr<scrubber> scrubber_;
+    std::unique_ptr<resharder> resharder_;
+    std::unique_ptr<replication_log> log_;
+    std::unique_ptr<replica> replica_;
+    std::unique_ptr<record_cache> cache_;
+    server_metrics metrics_;
     std::vector<std::thread> threads_;
+#ifdef __linux__
+    std::unique_ptr<uring_listener> uring_;
+#endif
     std::atomic<bool> running_{false};
     size_t num_threads_;
+    std::chrono::seconds idle_timeout_;
+    size_t max_connections_;
+    std::string db_path_;
+    std::string snapshot_dir_;
+
+    // bytes read from a binary connection at a time
+    static constexpr size_t BINARY_READ_SIZE = 64 * 1024;
+
+    // GET values of at least this size are written to the socket from the mapping instead of
+    // being copied into the response, smaller ones are not worth holding off writers for
+    static constexpr size_t DIRECT_VALUE_SIZE = 1024;
+
+    // keys per page of /keys, by default and at most
+    static constexpr size_t KEYS_PAGE_SIZE = 1000;
+    static constexpr size_t MAX_KEYS_PAGE_SIZE = 100000;
+
+    // bytes of operations per response of /replication, shared by the streams
+    static constexpr size_t REPLICATION_BATCH_BYTES = 1 << 20;
+
+    // a response that handle_request() wrote directly to the socket of its session, or left to
+    // the session to stream
+    struct direct_response {
+        explicit direct_response(tcp::socket& s) : socket(s) {}
+
+        tcp::socket& socket;
+        bool sent = false;
+        // the part the socket did not take without blocking, still to be written
+        std::string unsent;
+        // all keys, with chunked encoding, see stream_keys()
+        bool stream_keys = false;
+    };
 
-    void do_accept();
-    void handle_session(tcp::socket socket);
+    net::awaitable<void> do_accept(tcp::acceptor& acceptor, bool binary);
+    net::awaitable<void> handle_session(beast::tcp_stream stream);
+    net::awaitable<void> reject_session(beast::tcp_stream stream);
+    net::awaitable<void> handle_binary_session(beast::tcp_stream stream);
+
+    // GET /keys without a cursor: every key, a page at a time, so neither the keys nor a shard's
+    // writers are held for longer than one page
+    net::awaitable<void> stream_keys(beast::tcp_stream& stream, beast::error_code& ec);
+
+    // the background threads that share db_ with the sessions
+    void start_background_tasks();
+
+    // thread_per_core: the core that owns the shard of a single-key request, the calling one for
+    // other requests and without cores. shard i belongs to core i modulo the number of cores
+    size_t owning_core(const http::request<http::string_body>& req) const;
+    size_t owning_core(const binary_protocol::frame& frame) const;
+    size_t owning_core(std::string_view key) const;
+
+    // the record_cache segment of key, which unlike its shard does not change with resharding
+    size_t cache_segment(std::string_view key) const {
+        return fnv1a(key) % cache_->segments();
+    }
+
+    // f() on core with thread_per_core, in place otherwise
+    template<class F>
+    net::awaitable<void> run_on(size_t core, F f) {
+        if (cores_) {
+            co_await cores_->run_on(core, std::move(f));
+        } else {
+            f();
+        }
+    }
+
+    // append the response to one binary_protocol request to out. a large GET value is written
+    // to socket right away, preceded by out, which then holds what the socket did not take;
+    // without a socket it is copied to out from the mapping
+    void handle_binary_request(const binary_protocol::frame& frame, std::string& out,
+                               tcp::socket* socket);
+
+    // key operations shared by both protocols, with the record cache kept up to date
+    // values of at least DIRECT_VALUE_SIZE are passed to send where they are mapped instead
+    // of being copied and returned, see sharded_hash_map::with_value. sent tells whether one
+    // was, such values are not cached
+    std::optional<std::string> lookup(const std::string& key,
+                                      server_metrics::request_timing& timing,
+                                      const std::function<void(std::string_view)>& send,
+                                      bool& sent);
+    bool insert(const std::string& key, const std::string& value,
+                server_metrics::request_timing& timing);
+    bool erase(const std::string& key, server_metrics::request_timing& timing);
+    std::vector<std::optional<std::string>> lookup_many(const std::vector<std::string>& keys,
+                                                        server_metrics::request_timing& timing);
+    std::vector<bool> insert_many(const std::vector<std::pair<std::string, std::string>>& records,
+                                  server_metrics::request_timing& timing);
     http::response<http::string_body> handle_request(
-        const http::request<http::string_body>& req);
+        const http::request<http::string_body>& req,
+        server_metrics::request_timing& timing,
+        direct_response& direct);
 
     // Request handlers
-    http::response<http::string_body> handle_get(const std::string& key);
+    http::response<http::string_body> handle_get(const std::string& key,
+                                                  server_metrics::request_timing& timing,
+                                                  direct_response& direct);
     http::response<http::string_body> handle_set(const std::string& key,
-                                                  const std::string& value);
-    http::response<http::string_body> handle_delete(const std::string& key);
-    http::response<http::string_body> handle_keys();
+                                                  const std::string& value,
+                                                  server_metrics::request_timing& timing);
+    http::response<http::string_body> handle_delete(const std::string& key,
+                                                     server_metrics::request_timing& timing);
+    http::response<http::string_body> handle_mget(const std::string& body,
+                                                   server_metrics::request_timing& timing);
+    http::response<http::string_body> handle_mset(const std::string& body,
+                                                   server_metrics::request_timing& timing);
+    // one page of keys from a cursor
+    http::response<http::string_body> handle_keys(const std::string& target);
     http::response<http::string_body> handle_health();
+    http::response<http::string_body> handle_scrub();
+    http::response<http::string_body> handle_reshard(const http::request<http::string_body>& req,
+                                                     const std::string& target);
+    // copy of the database into a directory of config.snapshot_dir
+    http::response<http::string_body> handle_snapshot(const http::request<http::string_body>& req,
+                                                      const std::string& target);
+    // operations of the replication log, or a page of records to copy, see replica
+    http::response<http::string_body> handle_replication(const std::string& target);
+    http::response<http::string_body> handle_filters();
+    http::response<http::string_body> handle_cache();
+    http::response<http::string_body> handle_stats();
+    http::response<http::string_body> handle_structure();
+    http::response<http::string_body> handle_metrics();
+    http::response<http::string_body> frozen_response();
+
+    // frozen databases and replicas reject modifications
+    bool read_only() const {
+        return db_.frozen() || replica_;
+    }
+    std::string read_only_reason() const;
+    http::response<http::string_body> read_only_response();
 
     // URL utilities
     static std::string url_decode(const std::string& str);
@@ -0,0 +1,164 @@
+#include "io_ring.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <system_error>
+
+namespace diskhash {
+
+namespace {
+
+int io_uring_setup(unsigned entries, io_uring_params* params) {
+    return int(syscall(__NR_io_uring_setup, entries, params));
+}
+
+int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return int(syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0));
+}
+
+int io_uring_register(int fd, unsigned opcode, const void* arg, unsigned nr_args) {
+    return int(syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+void* map_ring(int fd, size_t size, off_t offset) {
+    void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+    if (p == MAP_FAILED) {
+        throw std::system_error(errno, std::system_category(), "io_uring mmap");
+    }
+    return p;
+}
+
+template<class T>
+T* at(void* base, unsigned offset) {
+    return reinterpret_cast<T*>(static_cast<char*>(base) + offset);
+}
+
+}  // namespace
+
+io_ring::io_ring(unsigned entries) {
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+
+    fd_ = io_uring_setup(entries, &params);
+    if (fd_ < 0) {
+        throw std::system_error(errno, std::system_category(), "io_uring_setup");
+    }
+
+    // fast poll came with the socket operations: accept, send and recv
+    if (!(params.features & IORING_FEAT_FAST_POLL) || !(params.features & IORING_FEAT_NODROP)) {
+        release();
+        throw std::system_error(ENOSYS, std::system_category(), "io_uring too old");
+    }
+
+    try {
+        sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+        }
+
+        sq_ring_ = map_ring(fd_, sq_ring_size_, IORING_OFF_SQ_RING);
+        cq_ring_ = (params.features & IORING_FEAT_SINGLE_MMAP)
+                       ? sq_ring_
+                       : map_ring(fd_, cq_ring_size_, IORING_OFF_CQ_RING);
+
+        sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+        sqes_ = static_cast<io_uring_sqe*>(map_ring(fd_, sqes_size_, IORING_OFF_SQES));
+    } catch (...) {
+        release();
+        throw;
+    }
+
+    sq_head_ = at<unsigned>(sq_ring_, params.sq_off.head);
+    sq_tail_ = at<unsigned>(sq_ring_, params.sq_off.tail);
+    sq_array_ = at<unsigned>(sq_ring_, params.sq_off.array);
+    sq_mask_ = *at<unsigned>(sq_ring_, params.sq_off.ring_mask);
+    sq_entries_ = params.sq_entries;
+    sq_tail_local_ = *sq_tail_;
+
+    cq_head_ = at<unsigned>(cq_ring_, params.cq_off.head);
+    cq_tail_ = at<unsigned>(cq_ring_, params.cq_off.tail);
+    cqes_ = at<io_uring_cqe>(cq_ring_, params.cq_off.cqes);
+    cq_mask_ = *at<unsigned>(cq_ring_, params.cq_off.ring_mask);
+}
+
+io_ring::~io_ring() {
+    release();
+}
+
+bool io_ring::available() {
+    try {
+        io_ring ring(2);
+        return true;
+    } catch (const std::system_error&) {
+        return false;
+    }
+}
+
+io_uring_sqe* io_ring::get_sqe() {
+    unsigned head = std::atomic_ref<unsigned>(*sq_head_).load(std::memory_order_acquire);
+
+    // without SQPOLL, io_uring_enter() consumes every entry it is given
+    if (sq_tail_local_ - head == sq_entries_) {
+        submit_and_wait(0);
+        head = std::atomic_ref<unsigned>(*sq_head_).load(std::memory_order_acquire);
+
+        // the kernel refused them until completions are consumed
+        if (sq_tail_local_ - head == sq_entries_) {
+            throw std::system_error(EBUSY, std::system_category(), "io_uring submission queue full");
+        }
+    }
+
+    unsigned index = sq_tail_local_ & sq_mask_;
+    sq_array_[index] = index;
+    sq_tail_local_++;
+
+    io_uring_sqe* sqe = &sqes_[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+void io_ring::submit_and_wait(unsigned wait_nr) {
+    std::atomic_ref<unsigned>(*sq_tail_).store(sq_tail_local_, std::memory_order_release);
+
+    unsigned head = std::atomic_ref<unsigned>(*sq_head_).load(std::memory_order_acquire);
+    unsigned to_submit = sq_tail_local_ - head;
+
+    if (io_uring_enter(fd_, to_submit, wait_nr, wait_nr != 0 ? IORING_ENTER_GETEVENTS : 0) < 0) {
+        // EBUSY: completions must be consumed before more can be submitted
+        if (errno != EINTR && errno != EBUSY && errno != EAGAIN) {
+            throw std::system_error(errno, std::system_category(), "io_uring_enter");
+        }
+    }
+}
+
+bool io_ring::register_buffers(const iovec* buffers, unsigned count) {
+    return io_uring_register(fd_, IORING_REGISTER_BUFFERS, buffers, count) == 0;
+}
+
+void io_ring::release() {
+    if (sqes_) {
+        munmap(sqes_, sqes_size_);
+    }
+    if (cq_ring_ && cq_ring_ != sq_ring_) {
+        munmap(cq_ring_, cq_ring_size_);
+    }
+    if (sq_ring_) {
+        munmap(sq_ring_, sq_ring_size_);
+    }
+    if (fd_ >= 0) {
+        close(fd_);
+    }
+
+    sqes_ = nullptr;
+    cq_ring_ = sq_ring_ = nullptr;
+    fd_ = -1;
+}
+
+}  // namespace diskhash
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <linux/io_uring.h>
+#include <sys/uio.h>
+
+#include <atomic>
+#include <cstddef>
+
+namespace diskhash {
+
+// A minimal io_uring made with the raw system calls, so liburing is not needed.
+//
+// Entries queued with get_sqe() are handed to the kernel together by one io_uring_enter() in
+// submit_and_wait(), and completions are consumed with for_each_completion(). A ring is not
+// thread-safe, every thread needs its own.
+class io_ring {
+public:
+    // throws std::system_error if the kernel has no io_uring, it is disabled, or it lacks the
+    // operations on sockets that the server needs (Linux 5.7)
+    explicit io_ring(unsigned entries);
+    ~io_ring();
+
+    io_ring(const io_ring&) = delete;
+    io_ring& operator=(const io_ring&) = delete;
+
+    // whether a ring can be set up at all, for choosing a fallback up front
+    static bool available();
+
+    // a zeroed submission queue entry, submitting the queued ones first if the queue is full
+    io_uring_sqe* get_sqe();
+
+    // submit the queued entries and wait until at least wait_nr completions are available.
+    // returns early if a signal interrupts the wait
+    void submit_and_wait(unsigned wait_nr);
+
+    // call f(const io_uring_cqe&) for each available completion and consume them, returns how
+    // many there were. f may queue new entries
+    template<class F>
+    unsigned for_each_completion(F&& f) {
+        unsigned head = *cq_head_;
+        unsigned tail = std::atomic_ref<unsigned>(*cq_tail_).load(std::memory_order_acquire);
+        unsigned count = tail - head;
+
+        for (; head != tail; ++head) {
+            f(static_cast<const io_uring_cqe&>(cqes_[head & cq_mask_]));
+        }
+
+        // the kernel may reuse the entries from here on
+        std::atomic_ref<unsigned>(*cq_head_).store(head, std::memory_order_release);
+        return count;
+    }
+
+    // register buffers for IORING_OP_READ_FIXED and IORING_OP_WRITE_FIXED, false if the kernel
+    // refuses them, e.g. beyond RLIMIT_MEMLOCK
+    bool register_buffers(const iovec* buffers, unsigned count);
+
+private:
+    int fd_ = -1;
+
+    void* sq_ring_ = nullptr;
+    size_t sq_ring_size_ = 0;
+    // the same mapping as sq_ring_ with IORING_FEAT_SINGLE_MMAP
+    void* cq_ring_ = nullptr;
+    size_t cq_ring_size_ = 0;
+    io_uring_sqe* sqes_ = nullptr;
+    size_t sqes_size_ = 0;
+
+    unsigned* sq_head_;
+    unsigned* sq_tail_;
+    unsigned* sq_array_;
+    unsigned sq_mask_;
+    unsigned sq_entries_;
+
+    unsigned* cq_head_;
+    unsigned* cq_tail_;
+    io_uring_cqe* cqes_;
+    unsigned cq_mask_;
+
+    // entries handed out by get_sqe(), published to the kernel by submit_and_wait()
+    unsigned sq_tail_local_ = 0;
+
+    void release();
+};
+
+}  // namespace diskhash
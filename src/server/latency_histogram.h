@@ -0,0 +1,148 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+
+namespace diskhash {
+
+// HDR-style histogram of durations in nanoseconds: every power of two is split into
+// SUB_BUCKETS linear buckets, so a recorded value is reported to within 1/SUB_BUCKETS of
+// itself. Values up to 2^MAX_EXPONENT ns (about 18 minutes) are kept, longer ones are counted
+// in the last bucket.
+//
+// record() is two relaxed loads and stores: it must only be called by one thread at a time,
+// while any thread may read. Histograms of several threads are combined with add().
+class latency_histogram {
+public:
+    static constexpr unsigned SUB_BUCKET_BITS = 4;
+    static constexpr uint64_t SUB_BUCKETS = uint64_t(1) << SUB_BUCKET_BITS;
+    static constexpr unsigned MAX_EXPONENT = 40;
+    static constexpr size_t BUCKETS = (MAX_EXPONENT - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+    latency_histogram() = default;
+
+    latency_histogram(const latency_histogram& other) {
+        add(other);
+    }
+
+    latency_histogram& operator=(const latency_histogram& other) {
+        if (this != &other) {
+            clear();
+            add(other);
+        }
+        return *this;
+    }
+
+    void record(uint64_t ns) {
+        increment(counts_[bucket_index(ns)], 1);
+        increment(count_, 1);
+        increment(sum_, ns);
+    }
+
+    // add the counts of other, not safe against concurrent record() calls on this histogram
+    void add(const latency_histogram& other) {
+        for (size_t i = 0; i < BUCKETS; ++i) {
+            increment(counts_[i], other.counts_[i].load(std::memory_order_relaxed));
+        }
+        increment(count_, other.count_.load(std::memory_order_relaxed));
+        increment(sum_, other.sum_.load(std::memory_order_relaxed));
+    }
+
+    void clear() {
+        for (auto& c : counts_) {
+            c.store(0, std::memory_order_relaxed);
+        }
+        count_.store(0, std::memory_order_relaxed);
+        sum_.store(0, std::memory_order_relaxed);
+    }
+
+    uint64_t count() const {
+        return count_.load(std::memory_order_relaxed);
+    }
+
+    // total of all recorded values
+    uint64_t sum() const {
+        return sum_.load(std::memory_order_relaxed);
+    }
+
+    uint64_t bucket_count(size_t index) const {
+        return counts_[index].load(std::memory_order_relaxed);
+    }
+
+    // number of recorded values no larger than ns, rounded to bucket boundaries
+    uint64_t count_at_most(uint64_t ns) const {
+        uint64_t result = 0;
+        for (size_t i = 0; i < BUCKETS && bucket_upper(i) <= ns; ++i) {
+            result += bucket_count(i);
+        }
+        return result;
+    }
+
+    // smallest value that at least fraction q of the recorded values do not exceed, as the
+    // upper bound of its bucket. 0 if nothing was recorded
+    uint64_t percentile(double q) const {
+        uint64_t total = count();
+        if (total == 0) {
+            return 0;
+        }
+
+        uint64_t target = std::max<uint64_t>(1, uint64_t(q * double(total) + 0.5));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < BUCKETS; ++i) {
+            seen += bucket_count(i);
+            if (seen >= target) {
+                return bucket_upper(i);
+            }
+        }
+        return bucket_upper(BUCKETS - 1);
+    }
+
+    uint64_t max() const {
+        for (size_t i = BUCKETS; i-- > 0;) {
+            if (bucket_count(i) != 0) {
+                return bucket_upper(i);
+            }
+        }
+        return 0;
+    }
+
+    static size_t bucket_index(uint64_t ns) {
+        if (ns < SUB_BUCKETS) {
+            return size_t(ns);
+        }
+
+        unsigned exponent = std::min<unsigned>(std::bit_width(ns) - 1, MAX_EXPONENT);
+        if (exponent == MAX_EXPONENT) {
+            return BUCKETS - 1;
+        }
+
+        uint64_t mantissa = ns >> (exponent - SUB_BUCKET_BITS);
+        return size_t((exponent - SUB_BUCKET_BITS + 1) * SUB_BUCKETS + mantissa - SUB_BUCKETS);
+    }
+
+    // largest value counted in bucket index
+    static uint64_t bucket_upper(size_t index) {
+        if (index < SUB_BUCKETS) {
+            return index;
+        }
+
+        unsigned exponent = unsigned(index / SUB_BUCKETS) + SUB_BUCKET_BITS - 1;
+        uint64_t mantissa = index % SUB_BUCKETS + SUB_BUCKETS;
+        return ((mantissa + 1) << (exponent - SUB_BUCKET_BITS)) - 1;
+    }
+
+private:
+    std::array<std::atomic<uint64_t>, BUCKETS> counts_{};
+    std::atomic<uint64_t> count_{0};
+    std::atomic<uint64_t> sum_{0};
+
+    static void increment(std::atomic<uint64_t>& counter, uint64_t delta) {
+        counter.store(counter.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+    }
+};
+
+}  // namespace diskhash
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <csignal>
 #include <iostream>
 #include <thread>
@@ -25,13 +26,36 @@ int main(int argc, char* argv[]) {
                 "Port to listen on")
             ("address,a", po::value<std::string>()->default_value("0.0.0.0"),
                 "Address to bind to")
+            ("binary-port", po::value<uint16_t>()->default_value(0),
+                "Port of the binary protocol listener (0 = off)")
+            ("io-uring", "Serve the binary protocol from io_uring rings where the kernel has them")
             ("db,d", po::value<std::string>()->required(),
                 "Path to database files (required)")
             ("shards,s", po::value<size_t>()->default_value(4),
-                "Number of shards")
+                "Number of shards of a new database, existing ones keep theirs until POST /reshard")
             ("threads,t", po::value<size_t>()->default_value(
                 std::thread::hardware_concurrency()),
-                "Number of worker threads");
+                "Number of worker threads")
+            ("checksums", "Keep CRC32C checksums in newly created shards")
+            ("scrub-rate", po::value<size_t>()->default_value(0),
+                "Buckets per second verified by the background scrubber (0 = off)")
+            ("frozen", "Serve the read-only copies written by diskhash_freeze")
+            ("filters", "Keep a Bloom filter per bucket chain to skip lookups of missing keys")
+            ("cache-bytes", po::value<size_t>()->default_value(0),
+                "Bytes of recent lookups, including misses, cached in memory (0 = off)")
+            ("idle-timeout", po::value<size_t>()->default_value(60),
+                "Seconds before a connection that sends no request is closed")
+            ("thread-per-core",
+                "Run an event loop per thread that owns a subset of the shards")
+            ("pin-threads", "Bind each thread of --thread-per-core to a CPU")
+            ("max-connections", po::value<size_t>()->default_value(10000),
+                "Open connections, further ones are refused with 503")
+            ("replication-log-bytes", po::value<size_t>()->default_value(64 << 20),
+                "Bytes of recent sets and deletes kept for replicas (0 = off)")
+            ("replica-of", po::value<std::string>(),
+                "host:port of a primary to follow, writes are then rejected")
+            ("snapshot-dir", po::value<std::string>(),
+                "Directory that POST /snapshot copies the database into (default: off)");
 
         po::variables_map vm;
         po::store(po::parse_command_line(argc, argv, desc), vm);
@@ -43,27 +67,60 @@ int main(int argc, char* argv[]) {
 
         po::notify(vm);
 
-        auto address = vm["address"].as<std::string>();
-        auto port = vm["port"].as<uint16_t>();
-        auto db_path = vm["db"].as<std::string>();
-        auto num_shards = vm["shards"].as<size_t>();
-        auto num_threads = vm["threads"].as<size_t>();
-
-        if (num_threads == 0) {
-            num_threads = 1;
+        diskhash::server_config config;
+        config.address = vm["address"].as<std::string>();
+        config.port = vm["port"].as<uint16_t>();
+        config.binary_port = vm["binary-port"].as<uint16_t>();
+        config.io_uring = vm.count("io-uring") > 0;
+        config.thread_per_core = vm.count("thread-per-core") > 0;
+        config.pin_threads = vm.count("pin-threads") > 0;
+        config.db_path = vm["db"].as<std::string>();
+        config.num_shards = vm["shards"].as<size_t>();
+        config.num_threads = vm["threads"].as<size_t>();
+        config.checksums = vm.count("checksums") > 0;
+        config.scrub_rate = vm["scrub-rate"].as<size_t>();
+        config.frozen = vm.count("frozen") > 0;
+        config.filters = vm.count("filters") > 0;
+        config.cache_bytes = vm["cache-bytes"].as<size_t>();
+        config.idle_timeout = std::max<size_t>(vm["idle-timeout"].as<size_t>(), 1);
+        config.max_connections = std::max<size_t>(vm["max-connections"].as<size_t>(), 1);
+        config.replication_log_bytes = vm["replication-log-bytes"].as<size_t>();
+        if (vm.count("replica-of")) {
+            config.replica_of = vm["replica-of"].as<std::string>();
+        }
+        if (vm.count("snapshot-dir")) {
+            config.snapshot_dir = vm["snapshot-dir"].as<std::string>();
         }
 
-        std::cout << "Starting diskhash_server on " << address << ":" << port
-                  << " with " << num_shards << " shards and "
-                  << num_threads << " threads\n";
-        std::cout << "Database path: " << db_path << "\n";
+        if (config.num_threads == 0) {
+            config.num_threads = 1;
+        }
 
         // Set up signal handlers
         std::signal(SIGINT, signal_handler);
         std::signal(SIGTERM, signal_handler);
 
-        g_server = std::make_unique<diskhash::http_server>(
-            address, port, db_path, num_shards, num_threads);
+        g_server = std::make_unique<diskhash::http_server>(config);
+
+        // the manifest of an existing database decides the shard count
+        std::cout << "Starting diskhash_server on " << config.address << ":"
+                  << config.port << " with " << g_server->num_shards()
+                  << " shards and " << config.num_threads << " threads"
+                  << (config.thread_per_core ? ", one event loop per thread" : "") << "\n";
+        std::cout << "Database path: " << config.db_path << "\n";
+        if (!config.replica_of.empty()) {
+            std::cout << "Replica of " << config.replica_of << "\n";
+        }
+
+        if (config.binary_port != 0) {
+            std::cout << "Binary protocol on port " << config.binary_port
+                      << (g_server->uses_io_uring() ? " with io_uring" : "") << "\n";
+            if (config.io_uring && config.thread_per_core) {
+                std::cout << "io_uring is not used with --thread-per-core, using epoll\n";
+            } else if (config.io_uring && !g_server->uses_io_uring()) {
+                std::cout << "io_uring is not available, using epoll\n";
+            }
+        }
 
         g_server->run();
 
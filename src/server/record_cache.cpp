@@ -0,0 +1,145 @@
+#include "record_cache.h"
+
+#include <algorithm>
+#include <mutex>
+
+namespace diskhash {
+
+record_cache::record_cache(size_t segments, size_t capacity_bytes)
+    : segments_(new segment[std::max<size_t>(segments, 1)])
+    , segments_count_(std::max<size_t>(segments, 1))
+    , capacity_bytes_(capacity_bytes)
+    , segment_capacity_(capacity_bytes / segments_count_)
+{
+}
+
+bool record_cache::find(size_t segment_idx, std::string_view key,
+                        std::optional<std::string>& value, uint64_t& token) {
+    segment& seg = segments_[segment_idx];
+    std::shared_lock lock(seg.mutex);
+
+    auto it = seg.index.find(key);
+    if (it == seg.index.end()) {
+        token = seg.versions[version_stripe(key)].load(std::memory_order_relaxed);
+        seg.misses.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    slot& s = seg.slots[it->second];
+
+    // hot entries are already referenced, don't write their cache line again
+    if (!s.referenced.load(std::memory_order_relaxed)) {
+        s.referenced.store(true, std::memory_order_relaxed);
+    }
+
+    value = s.value;
+
+    seg.hits.fetch_add(1, std::memory_order_relaxed);
+    if (!value) {
+        seg.negative_hits.fetch_add(1, std::memory_order_relaxed);
+    }
+    return true;
+}
+
+void record_cache::insert(size_t segment_idx, std::string_view key,
+                          const std::optional<std::string>& value, uint64_t token) {
+    size_t charge = key.size() + (value ? value->size() : 0) + ENTRY_OVERHEAD;
+    if (charge > segment_capacity_) {
+        return;
+    }
+
+    segment& seg = segments_[segment_idx];
+    std::unique_lock lock(seg.mutex);
+
+    // a writer may have changed the record after the lookup read it
+    if (seg.versions[version_stripe(key)].load(std::memory_order_relaxed) != token ||
+        seg.index.count(key)) {
+        return;
+    }
+
+    while (seg.bytes + charge > segment_capacity_) {
+        evict(seg);
+    }
+
+    size_t slot_id;
+    if (!seg.free_slots.empty()) {
+        slot_id = seg.free_slots.back();
+        seg.free_slots.pop_back();
+    } else {
+        slot_id = seg.slots.size();
+        seg.slots.emplace_back();
+    }
+
+    slot& s = seg.slots[slot_id];
+    s.key = key;
+    s.value = value;
+    s.referenced.store(false, std::memory_order_relaxed);
+    s.charge = charge;
+
+    seg.index.emplace(s.key, slot_id);
+    seg.bytes += charge;
+}
+
+void record_cache::invalidate(size_t segment_idx, std::string_view key) {
+    segment& seg = segments_[segment_idx];
+    std::unique_lock lock(seg.mutex);
+
+    seg.versions[version_stripe(key)].fetch_add(1, std::memory_order_relaxed);
+
+    auto it = seg.index.find(key);
+    if (it != seg.index.end()) {
+        erase(seg, it->second);
+    }
+}
+
+void record_cache::erase(segment& seg, size_t slot_id) {
+    slot& s = seg.slots[slot_id];
+
+    seg.index.erase(s.key);
+    seg.bytes -= s.charge;
+
+    s.key.clear();
+    s.value.reset();
+    s.charge = 0;
+    seg.free_slots.push_back(slot_id);
+}
+
+void record_cache::evict(segment& seg) {
+    for (;;) {
+        seg.hand = (seg.hand + 1) % seg.slots.size();
+        slot& s = seg.slots[seg.hand];
+
+        if (s.charge == 0) {
+            continue;
+        }
+
+        if (s.referenced.load(std::memory_order_relaxed)) {
+            s.referenced.store(false, std::memory_order_relaxed);
+            continue;
+        }
+
+        erase(seg, seg.hand);
+        seg.evictions.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+}
+
+record_cache::stats record_cache::get_stats() const {
+    stats result;
+
+    for (size_t i = 0; i < segments_count_; ++i) {
+        const segment& seg = segments_[i];
+        result.hits += seg.hits.load(std::memory_order_relaxed);
+        result.negative_hits += seg.negative_hits.load(std::memory_order_relaxed);
+        result.misses += seg.misses.load(std::memory_order_relaxed);
+        result.evictions += seg.evictions.load(std::memory_order_relaxed);
+
+        std::shared_lock lock(seg.mutex);
+        result.entries += seg.index.size();
+        result.bytes += seg.bytes;
+    }
+
+    return result;
+}
+
+}  // namespace diskhash
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace diskhash {
+
+// Byte-bounded cache of recent lookups in front of a sharded_hash_map, in segments chosen by
+// the caller.
+// Misses are cached too, as entries without a value. Eviction is CLOCK: hits only set a
+// reference bit under a shared lock, the clock hand clears it and evicts entries found
+// without it.
+//
+// Writers must modify the map first and then call invalidate(). A lookup that missed the cache
+// gets a token from find() and passes it to insert() after reading the map, insert() drops the
+// entry if its key was invalidated in between, so it never brings back a stale value. Versions
+// are kept per stripe of keys, so writes of other keys rarely cost a miss its insert.
+class record_cache {
+public:
+    record_cache(size_t segments, size_t capacity_bytes);
+
+    // true if key is cached, value is then the cached value or nullopt for a cached miss.
+    // otherwise token is set for insert()
+    bool find(size_t segment, std::string_view key, std::optional<std::string>& value,
+              uint64_t& token);
+
+    // cache the result of a lookup that started with find() returning token
+    void insert(size_t segment, std::string_view key, const std::optional<std::string>& value,
+                uint64_t token);
+
+    void invalidate(size_t segment, std::string_view key);
+
+    struct stats {
+        uint64_t hits = 0;
+        // hits on cached misses, also counted in hits
+        uint64_t negative_hits = 0;
+        uint64_t misses = 0;
+        uint64_t evictions = 0;
+        size_t entries = 0;
+        size_t bytes = 0;
+
+        double hit_ratio() const {
+            return hits + misses == 0 ? 0.0 : double(hits) / double(hits + misses);
+        }
+    };
+
+    stats get_stats() const;
+
+    size_t capacity_bytes() const {
+        return capacity_bytes_;
+    }
+
+    size_t segments() const {
+        return segments_count_;
+    }
+
+private:
+    // bookkeeping charged to every entry on top of key and value
+    static constexpr size_t ENTRY_OVERHEAD = 96;
+
+    // version stripes of a segment, a power of two
+    static constexpr size_t VERSION_STRIPES = 64;
+
+    struct slot {
+        std::string key;
+        std::optional<std::string> value;
+        std::atomic<bool> referenced{false};
+        // 0 if the slot is free
+        size_t charge = 0;
+    };
+
+    struct alignas(64) segment {
+        mutable std::shared_mutex mutex;
+
+        // views into slot keys, slots never move
+        std::unordered_map<std::string_view, size_t> index;
+        std::deque<slot> slots;
+        std::vector<size_t> free_slots;
+        size_t hand = 0;
+        size_t bytes = 0;
+
+        // bumped by invalidate() of a key in the stripe, see version_stripe()
+        std::atomic<uint64_t> versions[VERSION_STRIPES] = {};
+
+        std::atomic<uint64_t> hits{0}, negative_hits{0}, misses{0}, evictions{0};
+    };
+
+    std::unique_ptr<segment[]> segments_;
+    size_t segments_count_;
+    size_t capacity_bytes_;
+    size_t segment_capacity_;
+
+    static size_t version_stripe(std::string_view key) {
+        return std::hash<std::string_view>{}(key) & (VERSION_STRIPES - 1);
+    }
+
+    void erase(segment& seg, size_t slot_id);
+
+    // free the first entry the clock hand finds without its reference bit
+    void evict(segment& seg);
+};
+
+}  // namespace diskhash
@@ -0,0 +1,395 @@
+#include "replica.h"
+
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+#include <boost/asio.hpp>
+#include <boost/beast.hpp>
+
+#include "binary_protocol.h"
+#include "replication_log.h"
+
+namespace diskhash {
+
+namespace beast = boost::beast;
+namespace http = beast::http;
+namespace net = boost::asio;
+using tcp = net::ip::tcp;
+
+namespace {
+
+// a request to the primary that takes longer fails and is retried on a new connection
+constexpr auto REQUEST_TIMEOUT = std::chrono::seconds(10);
+
+// wait after a poll that found nothing new
+constexpr auto POLL_INTERVAL = std::chrono::milliseconds(20);
+
+// wait after a failed request
+constexpr auto RETRY_INTERVAL = std::chrono::seconds(1);
+
+// how often the position is written to the state file
+constexpr auto SAVE_INTERVAL = std::chrono::seconds(1);
+
+// records per page when copying
+constexpr size_t COPY_PAGE = 1000;
+
+std::runtime_error malformed() {
+    return std::runtime_error("malformed response to /replication");
+}
+
+}  // namespace
+
+// one keep-alive connection to the primary. Asio only times out asynchronous operations, so
+// requests run them on an io_context of their own
+class replica::connection {
+public:
+    connection(const std::string& host, const std::string& port)
+        : host_(host)
+        , stream_(ioc_)
+    {
+        tcp::resolver resolver(ioc_);
+        auto endpoints = resolver.resolve(host, port);
+
+        stream_.expires_after(REQUEST_TIMEOUT);
+        run([&](auto handler) { stream_.async_connect(endpoints, handler); });
+    }
+
+    // the body of a 200 response to GET target, throws for anything else
+    http::response<http::string_body> get(const std::string& target) {
+        http::request<http::empty_body> req{http::verb::get, target, 11};
+        req.set(http::field::host, host_);
+        req.keep_alive(true);
+
+        http::response_parser<http::string_body> parser;
+        parser.body_limit(boost::none);
+
+        stream_.expires_after(REQUEST_TIMEOUT);
+        run([&](auto handler) { http::async_write(stream_, req, handler); });
+        run([&](auto handler) { http::async_read(stream_, buffer_, parser, handler); });
+
+        auto res = parser.release();
+        if (res.result() != http::status::ok) {
+            throw std::runtime_error(target + " returned " + std::to_string(res.result_int()) +
+                                     " " + res.body());
+        }
+        return res;
+    }
+
+private:
+    std::string host_;
+    net::io_context ioc_;
+    beast::tcp_stream stream_;
+    beast::flat_buffer buffer_;
+
+    template<class Initiate>
+    void run(Initiate initiate) {
+        beast::error_code result;
+        initiate([&](beast::error_code ec, auto&&...) { result = ec; });
+        ioc_.restart();
+        ioc_.run();
+        if (result) {
+            throw beast::system_error(result);
+        }
+    }
+};
+
+replica::replica(const std::string& primary, const std::string& state_path,
+                 sharded_hash_map& db, std::function<void(std::string_view)> invalidate)
+    : primary_(primary)
+    , state_path_(state_path)
+    , db_(db)
+    , invalidate_(std::move(invalidate))
+    , saved_(clock::now())
+    , caught_up_(clock::now().time_since_epoch().count())
+{
+    auto colon = primary.rfind(':');
+    if (colon == std::string::npos || colon == 0 || colon + 1 == primary.size()) {
+        throw std::invalid_argument("expected host:port of the primary, got " + primary);
+    }
+    host_ = primary.substr(0, colon);
+    port_ = primary.substr(colon + 1);
+
+    load_state();
+}
+
+replica::~replica() {
+    stop();
+}
+
+void replica::start() {
+    thread_ = std::thread([this] { run(); });
+}
+
+void replica::stop() {
+    {
+        std::lock_guard lock(mutex_);
+        stopping_ = true;
+    }
+    cv_.notify_all();
+
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+}
+
+double replica::lag_seconds() const {
+    auto caught_up = clock::time_point(clock::duration(caught_up_.load(std::memory_order_relaxed)));
+    return std::chrono::duration<double>(clock::now() - caught_up).count();
+}
+
+void replica::run() {
+    std::unique_ptr<connection> c;
+    bool failed = false;
+
+    for (;;) {
+        bool applied = false;
+        try {
+            if (!c) {
+                c = std::make_unique<connection>(host_, port_);
+            }
+            if (log_id_ == 0 || !poll(*c, applied)) {
+                full_sync(*c);
+                applied = true;
+            }
+
+            connected_.store(true, std::memory_order_relaxed);
+            if (failed) {
+                std::cerr << "diskhash: replicating from " << primary_ << " again\n";
+                failed = false;
+            }
+        } catch (const std::exception& e) {
+            c.reset();
+            connected_.store(false, std::memory_order_relaxed);
+            if (!failed) {
+                std::cerr << "diskhash: replication from " << primary_ << " failed: " << e.what()
+                          << "\n";
+                failed = true;
+            }
+        }
+
+        if (clock::now() - saved_ >= SAVE_INTERVAL) {
+            save_state();
+        }
+
+        auto wait = failed ? clock::duration(RETRY_INTERVAL)
+                           : applied ? clock::duration::zero() : clock::duration(POLL_INTERVAL);
+        if (wait_for_stop(wait)) {
+            break;
+        }
+    }
+
+    save_state();
+}
+
+// GET /replication?log=<id>&from=<seq>,<seq>,... answers the log id, the stream count and per
+// stream a status (0, or 1 if from is no longer kept), the head, the operation count and size,
+// and the operations, see replication_log::read()
+bool replica::poll(connection& c, bool& applied) {
+    std::string target = "/replication?log=" + std::to_string(log_id_) + "&from=";
+    for (size_t i = 0; i < from_.size(); ++i) {
+        target += (i == 0 ? "" : ",") + std::to_string(from_[i]);
+    }
+
+    auto res = c.get(target);
+    std::string_view body = res.body();
+    if (body.size() < 12) {
+        throw malformed();
+    }
+    if (binary_protocol::get_u64(body.data()) != log_id_ ||
+        binary_protocol::get_u32(body.data() + 8) != from_.size()) {
+        return false;
+    }
+    body.remove_prefix(12);
+
+    uint64_t lag = 0;
+    for (size_t i = 0; i < from_.size(); ++i) {
+        if (body.size() < 17) {
+            throw malformed();
+        }
+        bool kept = body[0] == 0;
+        uint64_t head = binary_protocol::get_u64(body.data() + 1);
+        uint32_t count = binary_protocol::get_u32(body.data() + 9);
+        uint32_t size = binary_protocol::get_u32(body.data() + 13);
+        body.remove_prefix(17);
+
+        if (!kept) {
+            return false;
+        }
+        if (body.size() < size) {
+            throw malformed();
+        }
+
+        std::string_view ops = body.substr(0, size);
+        body.remove_prefix(size);
+        for (uint32_t j = 0; j < count; ++j) {
+            replication_log::op o;
+            size_t op_size = replication_log::parse(ops, o);
+            if (op_size == 0 || o.seq != from_[i]) {
+                throw malformed();
+            }
+            ops.remove_prefix(op_size);
+
+            if (o.code == replication_log::OP_SET) {
+                put(o.key, o.value);
+            } else {
+                erase(o.key);
+            }
+            ++from_[i];
+            operations_applied_.fetch_add(1, std::memory_order_relaxed);
+            applied = true;
+        }
+        lag += head > from_[i] ? head - from_[i] : 0;
+    }
+
+    lag_operations_.store(lag, std::memory_order_relaxed);
+    if (lag == 0) {
+        caught_up_.store(clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+    }
+    return true;
+}
+
+// GET /replication?snapshot=<cursor>&count=<n> answers a page of length-prefixed keys and
+// values, with the next cursor in X-Cursor as for /keys
+void replica::full_sync(connection& c) {
+    // the heads before the copy, whatever changes during it is logged after them
+    auto res = c.get("/replication?log=0");
+    std::string_view body = res.body();
+    if (body.size() < 12) {
+        throw malformed();
+    }
+    uint64_t log_id = binary_protocol::get_u64(body.data());
+    std::vector<uint64_t> heads(binary_protocol::get_u32(body.data() + 8));
+    body.remove_prefix(12);
+    for (auto& head : heads) {
+        if (body.size() < 17) {
+            throw malformed();
+        }
+        head = binary_protocol::get_u64(body.data() + 1);
+        body.remove_prefix(17 + binary_protocol::get_u32(body.data() + 13));
+    }
+
+    std::cerr << "diskhash: copying the records of " << primary_ << "\n";
+
+    // the primary may have deleted any of the local records
+    sharded_hash_map::scan_cursor cursor;
+    std::vector<std::string> keys;
+    bool more = true;
+    while (more) {
+        keys.clear();
+        more = db_.scan_keys(cursor, COPY_PAGE, keys);
+        for (const auto& key : keys) {
+            erase(key);
+        }
+    }
+
+    std::string snapshot = "0";
+    std::vector<std::string_view> fields;
+    do {
+        if (wait_for_stop(clock::duration::zero())) {
+            return;
+        }
+
+        auto page = c.get("/replication?snapshot=" + snapshot + "&count=" +
+                          std::to_string(COPY_PAGE));
+        if (!binary_protocol::split_fields(page.body(), fields) || fields.size() % 2 != 0) {
+            throw malformed();
+        }
+        for (size_t i = 0; i < fields.size(); i += 2) {
+            put(fields[i], fields[i + 1]);
+        }
+        snapshot = std::string(page["X-Cursor"]);
+    } while (snapshot != "0" && !snapshot.empty());
+
+    log_id_ = log_id;
+    from_ = std::move(heads);
+    full_syncs_.fetch_add(1, std::memory_order_relaxed);
+    save_state();
+}
+
+void replica::put(std::string_view key, std::string_view value) {
+    std::string k(key);
+    auto current = db_.get(k);
+    if (current && *current == value) {
+        return;
+    }
+
+    // readers see the key missing for a moment
+    if (current) {
+        db_.remove(k);
+    }
+    db_.set(k, std::string(value));
+    invalidate_(k);
+}
+
+void replica::erase(std::string_view key) {
+    std::string k(key);
+    if (db_.remove(k)) {
+        invalidate_(k);
+    }
+}
+
+bool replica::wait_for_stop(clock::duration timeout) {
+    std::unique_lock lock(mutex_);
+    return cv_.wait_for(lock, timeout, [this] { return stopping_; });
+}
+
+// "primary <host:port>", "log <id>" and "from <seq>,<seq>,..." lines
+void replica::load_state() {
+    std::ifstream in(state_path_);
+    std::string name;
+    std::string value;
+    std::string primary;
+    uint64_t log_id = 0;
+    std::vector<uint64_t> from;
+
+    while (in >> name >> value) {
+        if (name == "primary") {
+            primary = value;
+        } else if (name == "log") {
+            log_id = std::stoull(value);
+        } else if (name == "from") {
+            std::istringstream list(value);
+            std::string seq;
+            while (std::getline(list, seq, ',')) {
+                from.push_back(std::stoull(seq));
+            }
+        }
+    }
+
+    // following another primary starts over
+    if (primary == primary_) {
+        log_id_ = log_id;
+        from_ = std::move(from);
+    }
+}
+
+void replica::save_state() {
+    saved_ = clock::now();
+    if (log_id_ == 0) {
+        return;
+    }
+
+    std::string tmp = state_path_ + ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::trunc);
+        out << "primary " << primary_ << "\n";
+        out << "log " << log_id_ << "\n";
+        out << "from ";
+        for (size_t i = 0; i < from_.size(); ++i) {
+            out << (i == 0 ? "" : ",") << from_[i];
+        }
+        out << "\n";
+        if (!out.flush()) {
+            std::cerr << "diskhash: cannot write " << tmp << "\n";
+            return;
+        }
+    }
+
+    std::error_code ec;
+    std::filesystem::rename(tmp, state_path_, ec);
+}
+
+}  // namespace diskhash
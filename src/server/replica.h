@@ -0,0 +1,107 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "sharded_hash_map.h"
+
+namespace diskhash {
+
+// Background thread that follows a primary diskhash_server through its GET /replication
+// endpoint and applies the primary's sets and deletes to the local database.
+//
+// The position in each of the primary's log streams is kept in state_path, so a restarted
+// replica carries on where it stopped. When the primary no longer has the operations it needs,
+// because the replica fell too far behind or the primary restarted, the replica deletes its
+// records and copies the primary's, then tails the log from where the copy began. Replaying
+// operations that the copy already saw is harmless: the last set or delete of a key wins.
+class replica {
+public:
+    // primary is the host:port of the primary's HTTP listener. invalidate is called with
+    // every key the replica modified, after modifying it
+    replica(const std::string& primary, const std::string& state_path, sharded_hash_map& db,
+            std::function<void(std::string_view)> invalidate);
+    ~replica();
+
+    void start();
+    void stop();
+
+    const std::string& primary() const {
+        return primary_;
+    }
+
+    // the last request to the primary succeeded
+    bool connected() const {
+        return connected_.load(std::memory_order_relaxed);
+    }
+
+    // operations the primary had logged and the replica had not applied, at the last poll
+    uint64_t lag_operations() const {
+        return lag_operations_.load(std::memory_order_relaxed);
+    }
+
+    // time since the replica last had every operation of the primary
+    double lag_seconds() const;
+
+    uint64_t operations_applied() const {
+        return operations_applied_.load(std::memory_order_relaxed);
+    }
+
+    uint64_t full_syncs() const {
+        return full_syncs_.load(std::memory_order_relaxed);
+    }
+
+private:
+    using clock = std::chrono::steady_clock;
+
+    class connection;
+
+    std::string primary_;
+    std::string host_;
+    std::string port_;
+    std::string state_path_;
+    sharded_hash_map& db_;
+    std::function<void(std::string_view)> invalidate_;
+
+    std::thread thread_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool stopping_ = false;
+
+    // where the replica is in the primary's log, log_id_ 0 if it never synced
+    uint64_t log_id_ = 0;
+    std::vector<uint64_t> from_;
+    clock::time_point saved_;
+
+    std::atomic<bool> connected_{false};
+    std::atomic<uint64_t> lag_operations_{0};
+    std::atomic<clock::rep> caught_up_;
+    std::atomic<uint64_t> operations_applied_{0};
+    std::atomic<uint64_t> full_syncs_{0};
+
+    void run();
+
+    // applies one response of the primary's log, false if the replica has to copy everything
+    // again. applied is set to whether any operation was
+    bool poll(connection& c, bool& applied);
+    void full_sync(connection& c);
+
+    void put(std::string_view key, std::string_view value);
+    void erase(std::string_view key);
+
+    // waits for stop() up to timeout, true if it was called
+    bool wait_for_stop(clock::duration timeout);
+
+    void load_state();
+    void save_state();
+};
+
+}  // namespace diskhash
@@ -0,0 +1,119 @@
+#include "replication_log.h"
+
+#include <algorithm>
+#include <random>
+
+namespace diskhash {
+
+replication_log::replication_log(size_t streams, size_t capacity_bytes)
+    : streams_count_(std::max<size_t>(streams, 1))
+    , stream_capacity_(capacity_bytes / streams_count_)
+    , streams_(new stream[streams_count_])
+    , key_mutexes_(new std::mutex[KEY_STRIPES])
+{
+    // 0 is what a replica that never synced asks for
+    std::random_device random;
+    do {
+        id_ = uint64_t(random()) << 32 | random();
+    } while (id_ == 0);
+}
+
+std::vector<std::unique_lock<std::mutex>> replication_log::lock_keys(
+    const std::vector<std::string_view>& keys)
+{
+    std::vector<size_t> stripes;
+    stripes.reserve(keys.size());
+    for (auto key : keys) {
+        stripes.push_back(fnv1a(key) % KEY_STRIPES);
+    }
+    std::sort(stripes.begin(), stripes.end());
+    stripes.erase(std::unique(stripes.begin(), stripes.end()), stripes.end());
+
+    std::vector<std::unique_lock<std::mutex>> locks;
+    locks.reserve(stripes.size());
+    for (size_t stripe : stripes) {
+        locks.emplace_back(key_mutexes_[stripe]);
+    }
+    return locks;
+}
+
+void replication_log::append(op_code code, std::string_view key, std::string_view value) {
+    stream& s = streams_[stream_of(key)];
+    if (code == OP_DELETE) {
+        value = {};
+    }
+    size_t charge = key.size() + value.size() + ENTRY_OVERHEAD;
+
+    std::lock_guard lock(s.mutex);
+    s.entries.push_back({code, std::string(key), std::string(value)});
+    s.bytes += charge;
+
+    // the newest operation is kept even if it alone is over the capacity
+    while (s.bytes > stream_capacity_ && s.entries.size() > 1) {
+        const entry& oldest = s.entries.front();
+        s.bytes -= oldest.key.size() + oldest.value.size() + ENTRY_OVERHEAD;
+        s.entries.pop_front();
+        ++s.first;
+    }
+}
+
+uint64_t replication_log::head(size_t stream_idx) const {
+    const stream& s = streams_[stream_idx];
+    std::lock_guard lock(s.mutex);
+    return s.first + s.entries.size();
+}
+
+bool replication_log::read(size_t stream_idx, uint64_t from, size_t max_bytes, std::string& out,
+                           uint32_t& count) const
+{
+    const stream& s = streams_[stream_idx];
+    std::lock_guard lock(s.mutex);
+
+    if (from < s.first || from > s.first + s.entries.size()) {
+        return false;
+    }
+
+    size_t start = out.size();
+    for (size_t i = from - s.first; i < s.entries.size() && out.size() - start < max_bytes; ++i) {
+        const entry& e = s.entries[i];
+        binary_protocol::put_u64(out, s.first + i);
+        out.push_back(char(e.code));
+        binary_protocol::put_u32(out, uint32_t(e.key.size()));
+        out.append(e.key);
+        binary_protocol::put_u32(out, uint32_t(e.value.size()));
+        out.append(e.value);
+        ++count;
+    }
+    return true;
+}
+
+// seq (8 bytes), code, key length, key, value length, value
+size_t replication_log::parse(std::string_view data, op& result) {
+    if (data.size() < 13) {
+        return 0;
+    }
+    result.seq = binary_protocol::get_u64(data.data());
+    result.code = op_code(data[8]);
+    size_t key_size = binary_protocol::get_u32(data.data() + 9);
+    if (data.size() - 13 < key_size + 4) {
+        return 0;
+    }
+    result.key = data.substr(13, key_size);
+    size_t value_size = binary_protocol::get_u32(data.data() + 13 + key_size);
+    if (data.size() - 17 - key_size < value_size) {
+        return 0;
+    }
+    result.value = data.substr(17 + key_size, value_size);
+    return 17 + key_size + value_size;
+}
+
+size_t replication_log::bytes() const {
+    size_t total = 0;
+    for (size_t i = 0; i < streams_count_; ++i) {
+        std::lock_guard lock(streams_[i].mutex);
+        total += streams_[i].bytes;
+    }
+    return total;
+}
+
+}  // namespace diskhash
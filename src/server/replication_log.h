@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "binary_protocol.h"
+#include "fnv.h"
+
+namespace diskhash {
+
+// The sets and deletes a primary applied, for replicas to tail through GET /replication.
+//
+// Operations are split into streams by key hash, independent of the shard layout, so that
+// resharding never moves a key to another stream. Each stream numbers its operations from 1
+// and keeps the latest ones within its share of capacity_bytes; a replica that falls further
+// behind, or that followed an earlier run of the primary, copies everything again. Every run
+// draws a new id for that purpose.
+//
+// Writers hold key_mutex() of the key, or lock_keys() of a batch, across modifying the map and
+// append(), so that the operations on one key are logged in the order they took effect.
+class replication_log {
+public:
+    enum op_code : uint8_t { OP_SET = 1, OP_DELETE = 2 };
+
+    // an operation as read from the wire format of read()
+    struct op {
+        uint64_t seq = 0;
+        op_code code = OP_SET;
+        std::string_view key;
+        std::string_view value;
+    };
+
+    replication_log(size_t streams, size_t capacity_bytes);
+
+    uint64_t id() const {
+        return id_;
+    }
+
+    size_t streams() const {
+        return streams_count_;
+    }
+
+    size_t stream_of(std::string_view key) const {
+        return fnv1a(key) % streams_count_;
+    }
+
+    std::mutex& key_mutex(std::string_view key) {
+        return key_mutexes_[fnv1a(key) % KEY_STRIPES];
+    }
+
+    // the key mutexes of every key, locked in a fixed order
+    std::vector<std::unique_lock<std::mutex>> lock_keys(const std::vector<std::string_view>& keys);
+
+    // value is ignored for OP_DELETE
+    void append(op_code code, std::string_view key, std::string_view value);
+
+    // sequence number the next operation of stream gets
+    uint64_t head(size_t stream) const;
+
+    // appends the operations of stream from sequence number from on, stopping after the one
+    // that reaches max_bytes, and adds their count to count. false if from is no longer kept
+    // or was never reached
+    bool read(size_t stream, uint64_t from, size_t max_bytes, std::string& out,
+              uint32_t& count) const;
+
+    // the operation at the start of data, its size or 0 if data is malformed
+    static size_t parse(std::string_view data, op& result);
+
+    size_t bytes() const;
+
+private:
+    static constexpr size_t KEY_STRIPES = 1024;
+
+    // bookkeeping charged to every operation on top of key and value
+    static constexpr size_t ENTRY_OVERHEAD = 64;
+
+    struct entry {
+        op_code code;
+        std::string key;
+        std::string value;
+    };
+
+    struct alignas(64) stream {
+        mutable std::mutex mutex;
+        std::deque<entry> entries;
+        // sequence number of entries.front()
+        uint64_t first = 1;
+        size_t bytes = 0;
+    };
+
+    uint64_t id_;
+    size_t streams_count_;
+    size_t stream_capacity_;
+    std::unique_ptr<stream[]> streams_;
+    std::unique_ptr<std::mutex[]> key_mutexes_;
+};
+
+}  // namespace diskhash
@@ -0,0 +1,75 @@
+#include "resharder.h"
+
+#include <iostream>
+
+namespace diskhash {
+
+// keys looked at per reshard_step(), the shard being read is locked for each
+static constexpr size_t RESHARD_PAGE = 1000;
+
+resharder::resharder(sharded_hash_map& db)
+    : db_(db)
+{
+}
+
+resharder::~resharder() {
+    stop();
+}
+
+void resharder::start(size_t shards) {
+    std::lock_guard lock(mutex_);
+
+    db_.begin_reshard(shards);
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+    keys_moved_.store(0, std::memory_order_relaxed);
+    running_.store(true, std::memory_order_relaxed);
+    thread_ = std::thread([this] { run(); });
+}
+
+void resharder::resume() {
+    std::lock_guard lock(mutex_);
+
+    if (thread_.joinable() || db_.reshard_target() == 0) {
+        return;
+    }
+    running_.store(true, std::memory_order_relaxed);
+    thread_ = std::thread([this] { run(); });
+}
+
+void resharder::stop() {
+    std::lock_guard lock(mutex_);
+
+    stopping_.store(true, std::memory_order_relaxed);
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+}
+
+void resharder::run() {
+    size_t target = db_.reshard_target();
+    sharded_hash_map::scan_cursor cursor;
+    uint64_t moved = 0;
+
+    try {
+        while (!stopping_.load(std::memory_order_relaxed) &&
+               db_.reshard_step(cursor, RESHARD_PAGE, moved)) {
+            keys_moved_.store(moved, std::memory_order_relaxed);
+        }
+        keys_moved_.store(moved, std::memory_order_relaxed);
+
+        if (db_.reshard_target() == 0) {
+            std::cerr << "diskhash: resharded to " << target << " shards, " << moved
+                      << " keys moved\n";
+        }
+    } catch (const std::exception& e) {
+        // the manifest still names the target, a restart tries again
+        std::cerr << "diskhash: resharding to " << target << " shards failed: " << e.what()
+                  << "\n";
+    }
+
+    running_.store(false, std::memory_order_relaxed);
+}
+
+}  // namespace diskhash
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+#include "sharded_hash_map.h"
+
+namespace diskhash {
+
+// Background thread that moves records to a new shard count with
+// sharded_hash_map::reshard_step(), a page of keys at a time, while the map stays in use.
+// An unfinished move is resumed from the manifest after a restart.
+class resharder {
+public:
+    explicit resharder(sharded_hash_map& db);
+    ~resharder();
+
+    // begin moving to shards shards, throws what sharded_hash_map::begin_reshard() throws
+    void start(size_t shards);
+
+    // carry on with the move a previous run left unfinished
+    void resume();
+
+    void stop();
+
+    bool running() const {
+        return running_.load(std::memory_order_relaxed);
+    }
+
+    uint64_t keys_moved() const {
+        return keys_moved_.load(std::memory_order_relaxed);
+    }
+
+private:
+    sharded_hash_map& db_;
+
+    std::mutex mutex_;
+    std::thread thread_;
+    std::atomic<bool> stopping_{false};
+    std::atomic<bool> running_{false};
+    std::atomic<uint64_t> keys_moved_{0};
+
+    void run();
+};
+
+}  // namespace diskhash
@@ -0,0 +1,97 @@
+#include "scrubber.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+
+namespace diskhash {
+
+// buckets verified between two checks of the rate limit
+static constexpr size_t SCRUB_BATCH = 64;
+
+scrubber::scrubber(sharded_hash_map& db, size_t buckets_per_second)
+    : db_(db)
+    , buckets_per_second_(std::max<size_t>(buckets_per_second, 1))
+{
+}
+
+scrubber::~scrubber() {
+    stop();
+}
+
+void scrubber::start() {
+    thread_ = std::thread([this] { run(); });
+}
+
+void scrubber::stop() {
+    {
+        std::lock_guard lock(mutex_);
+        stopping_ = true;
+    }
+    cv_.notify_all();
+
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+}
+
+std::vector<std::pair<size_t, size_t>> scrubber::corrupted_buckets() const {
+    std::lock_guard lock(mutex_);
+    return corrupted_;
+}
+
+void scrubber::run() {
+    using clock = std::chrono::steady_clock;
+
+    auto batch_interval = std::chrono::duration_cast<clock::duration>(
+        std::chrono::duration<double>(double(SCRUB_BATCH) / buckets_per_second_));
+    auto deadline = clock::now();
+
+    for (;;) {
+        for (size_t shard_idx = 0; shard_idx < db_.num_shards(); ++shard_idx) {
+            // buckets created during the pass are picked up by the next one
+            size_t buckets_count = db_.buckets_count(shard_idx);
+
+            for (size_t bucket_id = 0; bucket_id < buckets_count; ++bucket_id) {
+                if (!db_.verify_bucket(shard_idx, bucket_id)) {
+                    report(shard_idx, bucket_id);
+                }
+                buckets_scrubbed_.fetch_add(1, std::memory_order_relaxed);
+
+                if ((bucket_id + 1) % SCRUB_BATCH == 0) {
+                    deadline += batch_interval;
+                    std::unique_lock lock(mutex_);
+                    if (cv_.wait_until(lock, deadline, [this] { return stopping_; })) {
+                        return;
+                    }
+                }
+            }
+        }
+
+        passes_completed_.fetch_add(1, std::memory_order_relaxed);
+
+        // also throttles passes over nearly empty maps
+        deadline += batch_interval;
+        std::unique_lock lock(mutex_);
+        if (cv_.wait_until(lock, std::max(deadline, clock::now() + std::chrono::seconds(1)),
+                           [this] { return stopping_; })) {
+            return;
+        }
+        deadline = clock::now();
+    }
+}
+
+void scrubber::report(size_t shard_idx, size_t bucket_id) {
+    std::lock_guard lock(mutex_);
+
+    auto entry = std::make_pair(shard_idx, bucket_id);
+    if (std::find(corrupted_.begin(), corrupted_.end(), entry) != corrupted_.end()) {
+        return;
+    }
+
+    corrupted_.push_back(entry);
+    std::cerr << "diskhash: scrubber found corrupted bucket " << bucket_id
+              << " in shard " << shard_idx << "\n";
+}
+
+}  // namespace diskhash
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "sharded_hash_map.h"
+
+namespace diskhash {
+
+// Background thread that walks every bucket of every shard, verifying header fields, record
+// framing and checksums, at no more than buckets_per_second. Corrupted buckets are logged
+// to stderr once and kept in a list; passes repeat until stop().
+class scrubber {
+public:
+    scrubber(sharded_hash_map& db, size_t buckets_per_second);
+    ~scrubber();
+
+    void start();
+    void stop();
+
+    uint64_t buckets_scrubbed() const {
+        return buckets_scrubbed_.load(std::memory_order_relaxed);
+    }
+
+    uint64_t passes_completed() const {
+        return passes_completed_.load(std::memory_order_relaxed);
+    }
+
+    // (shard, bucket_id) pairs found corrupted so far
+    std::vector<std::pair<size_t, size_t>> corrupted_buckets() const;
+
+private:
+    sharded_hash_map& db_;
+    size_t buckets_per_second_;
+
+    std::thread thread_;
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    bool stopping_ = false;
+
+    std::vector<std::pair<size_t, size_t>> corrupted_;
+    std::atomic<uint64_t> buckets_scrubbed_{0};
+    std::atomic<uint64_t> passes_completed_{0};
+
+    void run();
+    void report(size_t shard_idx, size_t bucket_id);
+};
+
+}  // namespace diskhash
@@ -0,0 +1,97 @@
+#include "server_metrics.h"
+
+#include <algorithm>
+#include <utility>
+
+namespace diskhash {
+
+namespace {
+
+std::atomic<uint64_t> next_metrics_id{1};
+
+}  // namespace
+
+server_metrics::server_metrics(size_t num_shards)
+    : num_shards_(num_shards)
+    , id_(next_metrics_id.fetch_add(1, std::memory_order_relaxed))
+{
+}
+
+void server_metrics::record(const request_timing& timing, unsigned status) {
+    slot& s = local_slot();
+
+    auto& requests = s.requests[timing.ep][std::min<size_t>(status / 100, STATUS_CLASSES - 1)];
+    requests.store(requests.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
+    for (size_t p = 0; p < PHASES; ++p) {
+        if (timing.ns[p] == NOT_MEASURED) {
+            continue;
+        }
+
+        s.endpoints[timing.ep][p].record(timing.ns[p]);
+
+        if (timing.shard < num_shards_ && p != TOTAL) {
+            s.shards[timing.shard * PHASES + p].record(timing.ns[p]);
+        }
+    }
+}
+
+server_metrics::snapshot server_metrics::read() const {
+    snapshot result;
+    result.requests.assign(ENDPOINTS, std::vector<uint64_t>(STATUS_CLASSES));
+    result.endpoints.assign(ENDPOINTS, std::vector<latency_histogram>(PHASES));
+    result.shards.assign(num_shards_, std::vector<latency_histogram>(PHASES));
+
+    std::lock_guard lock(slots_mutex_);
+
+    for (const auto& s : slots_) {
+        for (size_t ep = 0; ep < ENDPOINTS; ++ep) {
+            for (size_t c = 0; c < STATUS_CLASSES; ++c) {
+                result.requests[ep][c] += s->requests[ep][c].load(std::memory_order_relaxed);
+            }
+            for (size_t p = 0; p < PHASES; ++p) {
+                result.endpoints[ep][p].add(s->endpoints[ep][p]);
+            }
+        }
+
+        for (size_t shard = 0; shard < num_shards_; ++shard) {
+            for (size_t p = 0; p < PHASES; ++p) {
+                result.shards[shard][p].add(s->shards[shard * PHASES + p]);
+            }
+        }
+    }
+
+    return result;
+}
+
+const char* server_metrics::endpoint_name(endpoint ep) {
+    static const char* const names[ENDPOINTS] = {"get", "set", "delete", "mget", "mset", "keys", "admin", "other"};
+    return names[ep];
+}
+
+const char* server_metrics::phase_name(phase p) {
+    static const char* const names[PHASES] = {"total", "lock_wait", "lookup", "serialization"};
+    return names[p];
+}
+
+server_metrics::slot& server_metrics::local_slot() {
+    // one entry per instance this thread has recorded into, ids are never reused
+    thread_local std::vector<std::pair<uint64_t, slot*>> cache;
+
+    for (auto& [id, s] : cache) {
+        if (id == id_) {
+            return *s;
+        }
+    }
+
+    std::lock_guard lock(slots_mutex_);
+
+    auto s = std::make_unique<slot>();
+    s->shards = std::make_unique<latency_histogram[]>(num_shards_ * PHASES);
+    slots_.push_back(std::move(s));
+
+    cache.emplace_back(id_, slots_.back().get());
+    return *slots_.back();
+}
+
+}  // namespace diskhash
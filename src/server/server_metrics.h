@@ -0,0 +1,87 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "latency_histogram.h"
+
+namespace diskhash {
+
+// Request counts and latency histograms of http_server, by endpoint and by shard.
+//
+// Every thread that records gets its own slot, found through a thread_local cache, so
+// recording never contends with other threads: histograms are only written by their owner
+// and merged when the metrics are read.
+class server_metrics {
+public:
+    // DELETE alone is a macro on Windows
+    enum endpoint {
+        ENDPOINT_GET, ENDPOINT_SET, ENDPOINT_DELETE, ENDPOINT_MGET, ENDPOINT_MSET, ENDPOINT_KEYS,
+        ENDPOINT_ADMIN, ENDPOINT_OTHER, ENDPOINTS
+    };
+
+    // where the time of a request went. lookups take no locks, so only writes wait for them
+    enum phase { TOTAL, LOCK_WAIT, LOOKUP, SERIALIZATION, PHASES };
+
+    static constexpr size_t NO_SHARD = size_t(-1);
+    static constexpr uint64_t NOT_MEASURED = uint64_t(-1);
+
+    // what one request spent in each phase, filled in while it is handled. phases a request
+    // did not go through stay NOT_MEASURED and are left out of the histograms
+    struct request_timing {
+        endpoint ep = ENDPOINT_OTHER;
+        // shard the key belongs to, NO_SHARD for requests without a key
+        size_t shard = NO_SHARD;
+        uint64_t ns[PHASES] = {NOT_MEASURED, NOT_MEASURED, NOT_MEASURED, NOT_MEASURED};
+    };
+
+    explicit server_metrics(size_t num_shards);
+
+    // count a finished request with its HTTP status code
+    void record(const request_timing& timing, unsigned status);
+
+    struct snapshot {
+        // requests[endpoint][status / 100]
+        std::vector<std::vector<uint64_t>> requests;
+        // by endpoint, then by phase
+        std::vector<std::vector<latency_histogram>> endpoints;
+        // by shard, then by phase
+        std::vector<std::vector<latency_histogram>> shards;
+    };
+
+    // merge the slots of all threads
+    snapshot read() const;
+
+    size_t num_shards() const {
+        return num_shards_;
+    }
+
+    static const char* endpoint_name(endpoint ep);
+    static const char* phase_name(phase p);
+
+private:
+    static constexpr size_t STATUS_CLASSES = 6;
+
+    struct slot {
+        std::atomic<uint64_t> requests[ENDPOINTS][STATUS_CLASSES] = {};
+        latency_histogram endpoints[ENDPOINTS][PHASES];
+        std::unique_ptr<latency_histogram[]> shards;
+    };
+
+    size_t num_shards_;
+
+    // distinguishes instances in the thread_local cache, an address could be reused
+    uint64_t id_;
+
+    mutable std::mutex slots_mutex_;
+    std::deque<std::unique_ptr<slot>> slots_;
+
+    slot& local_slot();
+};
+
+}  // namespace diskhash
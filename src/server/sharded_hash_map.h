@@ -1,102 +1,717 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
 #include <memory>
+#include <mutex>
 #include <optional>
-#include <shared_mutex>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <utility>
 #include <vector>
 
-#include "hash_map.h"
+#include "concurrent_hash_map.h"
+#include "epoch.h"
+#include "frozen_hash_map.h"
 #include "fnv.h"
 
 namespace diskhash {
 
+// Readers never lock: each shard is a concurrent_hash_map, where lookups are validated
+// with seqlocks and writers of different bucket chains run in parallel.
+//
+// A frozen database serves the frozen_hash_map copies written by diskhash_freeze
+// and rejects modifications.
+//
+// The shard count and the way hashes pick shards are kept in the manifest, <base_path>_manifest,
+// and can be changed while the map is in use, see begin_reshard(). While records move, keys
+// are looked up in the shard of the old layout and then in that of the new one, and written to
+// the new one.
 class sharded_hash_map {
 public:
-    sharded_hash_map(const std::string& base_path, size_t num_shards)
-        : num_shards_(num_shards)
+    // Slots for this many shards are allocated up front, so that readers never see them move
+    static constexpr size_t MAX_SHARDS = 4096;
+
+    // How a key's hash picks its shard. Databases created before manifests existed use
+    // HASH_MODULO; new and resharded ones use HASH_JUMP, Lamping and Veach's jump consistent
+    // hash, so that going from n to m shards only moves the keys of added or removed shards
+    enum hash_scheme { HASH_MODULO, HASH_JUMP };
+
+    // num_shards only applies to a database without a manifest
+    sharded_hash_map(const std::string& base_path, size_t num_shards,
+                     bool checksums = false, bool frozen = false,
+                     bool filters = false)
+        : base_path_(base_path)
+        , checksums_(checksums)
+        , frozen_(frozen)
+        , filters_(filters)
+        , shards_(new std::unique_ptr<shard>[MAX_SHARDS])
+        , move_mutexes_(new std::mutex[MOVE_STRIPES])
     {
-        shards_.reserve(num_shards);
-        for (size_t i = 0; i < num_shards; ++i) {
-            std::string shard_path = base_path + "_shard" + std::to_string(i);
-            shards_.push_back(std::make_unique<shard>(shard_path.c_str()));
+        layout current = read_manifest(num_shards);
+        if (frozen && current.target != 0) {
+            throw std::runtime_error("resharding of " + base_path + " is unfinished");
+        }
+
+        open_shards(std::max(current.shards, current.target));
+        if (!frozen) {
+            // Databases from before manifests get one
+            write_manifest(current);
         }
+        topology_.store(pack(current));
     }
 
     std::optional<std::string> get(const std::string& key) {
-        size_t idx = shard_index(key);
-        std::shared_lock lock(shards_[idx]->mutex);
-
         hash_t h = hash_key(key);
-        auto result = shards_[idx]->map.find(h, key);
-        if (result) {
-            return std::string(*result);
+        if (frozen_) {
+            if (auto r = shards_[shard_index(key)]->frozen->find(h, key)) {
+                return std::string(*r);
+            }
+            return std::nullopt;
+        }
+
+        epoch::guard guard;
+        layout l = load();
+        size_t to = home(h, l);
+        size_t from = previous(h, l);
+
+        std::string value;
+        // A moving key is inserted into its new shard before it is removed from the old one
+        if (from != to && shards_[from]->map->find(h, key, value)) {
+            return value;
+        }
+        if (shards_[to]->map->find(h, key, value)) {
+            return value;
         }
         return std::nullopt;
     }
 
-    bool set(const std::string& key, const std::string& value) {
-        size_t idx = shard_index(key);
-        std::unique_lock lock(shards_[idx]->mutex);
-
+    // Calls f(std::string_view) with the value of key where it is mapped instead of copying
+    // it, false if key is missing. Writers of the key's bucket chain wait until f returns, see
+    // concurrent_hash_map::with_value, so f must not block. Frozen shards are never modified
+    template<class F>
+    bool with_value(const std::string& key, F&& f) {
         hash_t h = hash_key(key);
-        // Check if key already exists
-        if (shards_[idx]->map.find(h, key)) {
-            return false;  // Key exists
+        if (frozen_) {
+            if (auto r = shards_[shard_index(key)]->frozen->find(h, key)) {
+                f(*r);
+                return true;
+            }
+            return false;
         }
 
-        // Insert the new key-value pair
-        shards_[idx]->map.get(h, key, value);
-        return true;
+        epoch::guard guard;
+        layout l = load();
+        size_t to = home(h, l);
+        size_t from = previous(h, l);
+
+        if (from != to && shards_[from]->map->with_value(h, key, f)) {
+            return true;
+        }
+        return shards_[to]->map->with_value(h, key, f);
     }
 
-    bool remove(const std::string& key) {
-        size_t idx = shard_index(key);
-        std::unique_lock lock(shards_[idx]->mutex);
+    // Time spent blocked on shard locks is added to lock_wait if given
+    bool set(const std::string& key, const std::string& value,
+             std::chrono::nanoseconds* lock_wait = nullptr) {
+        check_writable();
+        hash_t h = hash_key(key);
+
+        epoch::guard guard;
+        layout l = load();
+        size_t to = home(h, l);
+        size_t from = previous(h, l);
+
+        if (from == to) {
+            // Fails if the key already exists
+            return shards_[to]->map->insert(h, key, value, lock_wait);
+        }
+
+        // Not while the key is being moved, and not if it has yet to be
+        std::lock_guard lock(move_mutex(h));
+        std::string existing;
+        if (shards_[from]->map->find(h, key, existing)) {
+            return false;
+        }
+        return shards_[to]->map->insert(h, key, value, lock_wait);
+    }
 
+    bool remove(const std::string& key, std::chrono::nanoseconds* lock_wait = nullptr) {
+        check_writable();
         hash_t h = hash_key(key);
-        return shards_[idx]->map.remove(h, key);
+
+        epoch::guard guard;
+        layout l = load();
+        size_t to = home(h, l);
+        size_t from = previous(h, l);
+
+        if (from == to) {
+            return shards_[to]->map->remove(h, key, lock_wait);
+        }
+
+        std::lock_guard lock(move_mutex(h));
+        bool removed = shards_[from]->map->remove(h, key, lock_wait);
+        return shards_[to]->map->remove(h, key, lock_wait) || removed;
     }
 
-    std::vector<std::string> keys() {
-        std::vector<std::string> result;
+    // Values of keys in request order, nullopt for missing keys. Keys are grouped by shard and
+    // each shard is searched once, under one epoch pin
+    std::vector<std::optional<std::string>> get_many(const std::vector<std::string>& keys) {
+        std::vector<std::optional<std::string>> result(keys.size());
 
-        for (auto& shard : shards_) {
-            std::shared_lock lock(shard->mutex);
-            for (auto it = shard->map.begin(); it != shard->map.end(); ++it) {
-                auto [k, v] = *it;
-                result.emplace_back(k);
+        epoch::guard guard;
+        layout l = load();
+        if (l.target != 0) {
+            for (size_t i = 0; i < keys.size(); ++i) {
+                result[i] = get(keys[i]);
             }
+            return result;
         }
 
+        auto by_shard = group_by_shard(l, keys.size(), [&](size_t i) -> const std::string& {
+            return keys[i];
+        });
+
+        std::vector<record_view> requests;
+        std::vector<std::string> values;
+        std::vector<bool> found;
+
+        for (size_t idx = 0; idx < by_shard.size(); ++idx) {
+            const auto& indices = by_shard[idx];
+
+            if (frozen_) {
+                for (size_t i : indices) {
+                    if (auto r = shards_[idx]->frozen->find(hash_key(keys[i]), keys[i])) {
+                        result[i] = std::string(*r);
+                    }
+                }
+                continue;
+            }
+
+            if (indices.empty()) {
+                continue;
+            }
+
+            requests.clear();
+            for (size_t i : indices) {
+                requests.push_back(record_view{hash_key(keys[i]), keys[i], {}});
+            }
+
+            shards_[idx]->map->find_many(requests, values, found);
+
+            for (size_t j = 0; j < indices.size(); ++j) {
+                if (found[j]) {
+                    result[indices[j]] = std::move(values[j]);
+                }
+            }
+        }
         return result;
     }
 
+    // set for every (key, value) pair, true where it was inserted. Pairs are grouped by shard
+    // and each shard's directory lock is taken once for the batch unless a split intervenes;
+    // of pairs with the same key only the first is inserted
+    std::vector<bool> set_many(const std::vector<std::pair<std::string, std::string>>& records,
+                               std::chrono::nanoseconds* lock_wait = nullptr) {
+        check_writable();
+
+        std::vector<bool> result(records.size());
+
+        epoch::guard guard;
+        layout l = load();
+        if (l.target != 0) {
+            for (size_t i = 0; i < records.size(); ++i) {
+                result[i] = set(records[i].first, records[i].second, lock_wait);
+            }
+            return result;
+        }
+
+        auto by_shard = group_by_shard(l, records.size(), [&](size_t i) -> const std::string& {
+            return records[i].first;
+        });
+
+        std::vector<record_view> batch;
+        std::vector<bool> inserted;
+
+        for (size_t idx = 0; idx < by_shard.size(); ++idx) {
+            const auto& indices = by_shard[idx];
+            if (indices.empty()) {
+                continue;
+            }
+
+            batch.clear();
+            for (size_t i : indices) {
+                batch.push_back(record_view{hash_key(records[i].first), records[i].first,
+                                            records[i].second});
+            }
+
+            shards_[idx]->map->insert_many(batch, inserted, lock_wait);
+
+            for (size_t j = 0; j < indices.size(); ++j) {
+                result[indices[j]] = inserted[j];
+            }
+        }
+        return result;
+    }
+
+    // Where a resumable key scan goes on: the keys of earlier shards, and those of the shard's
+    // bucket chains below the hash prefix position, have been returned. For frozen shards
+    // position is a record number
+    struct scan_cursor {
+        size_t shard = 0;
+        uint64_t position = 0;
+    };
+
+    // Appends the keys of whole bucket chains from cursor on until at least count were appended
+    // or all shards are done, advances cursor and returns false once it is past the last shard.
+    // Each shard's writers are excluded only while its part of one call is read. Keys present
+    // throughout a scan are returned exactly once: splits only divide the chains a position
+    // lies between, see hash_map::cursor::position. Keys moved by resharding during a scan may
+    // be missed or returned twice
+    bool scan_keys(scan_cursor& cursor, size_t count, std::vector<std::string>& keys) {
+        size_t appended = 0;
+
+        while (cursor.shard < num_shards() && appended < count) {
+            size_t before = keys.size();
+            bool shard_done = scan_shard(cursor.shard, cursor.position, count - appended, keys);
+            appended += keys.size() - before;
+
+            if (shard_done) {
+                ++cursor.shard;
+                cursor.position = 0;
+            }
+        }
+
+        return cursor.shard < num_shards();
+    }
+
+    // Starts moving records to a layout of target shards with HASH_JUMP, which reshard_step()
+    // carries out. The layout is written to the manifest first, so that a restart resumes the
+    // move. Waits for the operations that began under the old layout, so it must not be
+    // called under an epoch::guard. Throws std::logic_error if frozen or already resharding
+    // and std::invalid_argument if target is out of range or already the layout
+    void begin_reshard(size_t target) {
+        check_writable();
+        std::lock_guard lock(reshard_mutex_);
+
+        if (target == 0 || target > MAX_SHARDS) {
+            throw std::invalid_argument("shard count must be between 1 and " +
+                                        std::to_string(MAX_SHARDS));
+        }
+        layout l = load();
+        if (l.target != 0) {
+            throw std::logic_error("already resharding to " + std::to_string(l.target) + " shards");
+        }
+        if (target == l.shards && l.scheme == HASH_JUMP) {
+            throw std::invalid_argument("already " + std::to_string(target) + " shards");
+        }
+
+        open_shards(target);
+        l.target = target;
+        write_manifest(l);
+        topology_.store(pack(l), std::memory_order_release);
+
+        // Writers that chose a shard under the old layout could otherwise add records behind
+        // reshard_step()'s back
+        epoch::retire([] {});
+        epoch::synchronize();
+    }
+
+    // Moves the records of whole bucket chains of the old layout, from cursor on, whose shard
+    // changes, until at least count records were looked at, and adds the number moved to
+    // moved. Returns false once all records are in place and the new layout is the only one
+    bool reshard_step(scan_cursor& cursor, size_t count, uint64_t& moved) {
+        std::lock_guard lock(reshard_mutex_);
+
+        layout l = load();
+        if (l.target == 0) {
+            return false;
+        }
+
+        if (cursor.shard < l.shards) {
+            std::vector<std::string> keys;
+            bool shard_done = scan_shard(cursor.shard, cursor.position, count, keys);
+
+            for (const auto& key : keys) {
+                hash_t h = hash_key(key);
+                size_t to = jump_hash(h, l.target);
+                if (to != cursor.shard &&
+                    move(h, key, *shards_[cursor.shard]->map, *shards_[to]->map)) {
+                    ++moved;
+                }
+            }
+
+            if (shard_done) {
+                ++cursor.shard;
+                cursor.position = 0;
+            }
+            return true;
+        }
+
+        layout next{l.target, HASH_JUMP};
+        write_manifest(next);
+        topology_.store(pack(next), std::memory_order_release);
+        return false;
+    }
+
+    // Copies every shard to <base_path>_shard<i> and writes the manifest next to them, so that
+    // a server started with --db base_path serves the copy. Each shard is copied with its
+    // writers held off, readers keep going; shards are copied one after the other, which is
+    // consistent per key because no operation spans shards. Returns the number of shards.
+    // Throws std::logic_error if frozen or resharding, because a key being moved could be
+    // caught in both shards or in neither
+    size_t snapshot(const std::string& base_path) {
+        check_writable();
+        std::lock_guard lock(reshard_mutex_);
+
+        layout l = load();
+        if (l.target != 0) {
+            throw std::logic_error("resharding to " + std::to_string(l.target) + " shards");
+        }
+        for (size_t idx = 0; idx < l.shards; ++idx) {
+            shards_[idx]->map->snapshot(shard_path(base_path, idx).c_str());
+        }
+        write_manifest(base_path + "_manifest", l);
+        return l.shards;
+    }
+
+    // The shard count being moved to, 0 if not resharding
+    size_t reshard_target() const {
+        return load().target;
+    }
+
+    // Shards that hold records: those of both layouts while resharding
+    size_t num_shards() const {
+        layout l = load();
+        return std::max(l.shards, l.target);
+    }
+
+    // The shard that key is written to
+    size_t shard_index(std::string_view key) const {
+        return home(hash_key(key), load());
+    }
+
+    bool frozen() const {
+        return frozen_;
+    }
+
+    // Frozen shards have no buckets
+    size_t buckets_count(size_t shard_idx) {
+        if (frozen_) {
+            return 0;
+        }
+        return shards_[shard_idx]->map->exclusive(
+            [](const hash_map<>& map) { return map.buckets_count(); });
+    }
+
+    // Record counts and sizes summed over all shards without locking. Frozen shards only
+    // count records
+    usage_stats usage() const {
+        usage_stats total;
+        for (size_t idx = 0; idx < num_shards(); ++idx) {
+            auto usage = shard_usage(idx);
+            total.records += usage.records;
+            total.key_bytes += usage.key_bytes;
+            total.value_bytes += usage.value_bytes;
+            total.free_buckets += usage.free_buckets;
+        }
+        return total;
+    }
+
+    usage_stats shard_usage(size_t shard_idx) const {
+        if (frozen_) {
+            usage_stats usage;
+            usage.records = shards_[shard_idx]->frozen->size();
+            return usage;
+        }
+        return shards_[shard_idx]->map->usage();
+    }
+
+    // Size of the shard's files without locking
+    size_t bytes_allocated(size_t shard_idx) const {
+        if (frozen_) {
+            return shards_[shard_idx]->frozen->bytes_allocated();
+        }
+        return shards_[shard_idx]->map->bytes_allocated();
+    }
+
+    // Merged over all shards, each walked with its writers excluded. Frozen shards have no
+    // buckets and are skipped
+    structure_stats structure() {
+        structure_stats total;
+        if (frozen_) {
+            return total;
+        }
+        for (size_t idx = 0; idx < num_shards(); ++idx) {
+            total.merge(shards_[idx]->map->exclusive(
+                [](const hash_map<>& map) { return map.structure_stats(); }));
+        }
+        return total;
+    }
+
+    // Bucket filter counters summed over all shards, nullopt without filters
+    std::optional<diskhash::filter_stats> filter_stats() const {
+        std::optional<diskhash::filter_stats> total;
+        for (size_t idx = 0; idx < num_shards(); ++idx) {
+            if (!shards_[idx]->map) {
+                continue;
+            }
+            if (auto stats = shards_[idx]->map->filter_stats()) {
+                if (!total) {
+                    total.emplace();
+                }
+                total->lookups += stats->lookups;
+                total->negatives += stats->negatives;
+                total->false_positives += stats->false_positives;
+            }
+        }
+        return total;
+    }
+
+    // Writers of the shard keep going unless the bucket looks corrupted, see
+    // concurrent_hash_map::verify_bucket
+    bool verify_bucket(size_t shard_idx, size_t bucket_id) {
+        if (frozen_) {
+            return true;
+        }
+        return shards_[shard_idx]->map->verify_bucket(bucket_id);
+    }
+
     void close() {
-        for (auto& shard : shards_) {
-            std::unique_lock lock(shard->mutex);
-            shard->map.close();
+        for (size_t idx = 0; idx < opened_.load(); ++idx) {
+            if (frozen_) {
+                shards_[idx]->frozen->close();
+            } else {
+                shards_[idx]->map->close();
+            }
         }
     }
 
 private:
     struct shard {
-        hash_map<> map;
-        mutable std::shared_mutex mutex;
+        std::unique_ptr<concurrent_hash_map<>> map;
+        std::unique_ptr<frozen_hash_map> frozen;
 
-        explicit shard(const char* path) : map(path) {}
+        shard(const char* path, bool checksums, bool frozen_only, bool filters) {
+            if (frozen_only) {
+                frozen = std::make_unique<frozen_hash_map>(path);
+            } else {
+                map = std::make_unique<concurrent_hash_map<>>(path, false, false, checksums, filters);
+            }
+        }
     };
 
-    std::vector<std::unique_ptr<shard>> shards_;
-    size_t num_shards_;
-
-    size_t shard_index(const std::string& key) const {
-        return fnv1a(key) % num_shards_;
+    void check_writable() const {
+        if (frozen_) {
+            throw std::logic_error("database is frozen");
+        }
     }
 
-    static hash_t hash_key(const std::string& key) {
+    // A shard count and scheme, with the shard count being moved to while resharding
+    struct layout {
+        size_t shards;
+        hash_scheme scheme;
+        size_t target = 0;
+    };
+
+    // Moves serialize with the writers of the same key through these
+    static constexpr size_t MOVE_STRIPES = 1024;
+
+    std::string base_path_;
+    bool checksums_;
+    bool frozen_;
+    bool filters_;
+
+    std::unique_ptr<std::unique_ptr<shard>[]> shards_;
+    // Slots of shards_ filled so far. Shards dropped by resharding stay open, and their emptied
+    // files in place, in case the count grows again
+    std::atomic<size_t> opened_{0};
+
+    // The layout, packed by pack(), read once by every operation
+    std::atomic<uint64_t> topology_{0};
+    std::mutex reshard_mutex_;
+    std::unique_ptr<std::mutex[]> move_mutexes_;
+
+    static hash_t hash_key(std::string_view key) {
         return fnv1a(key);
     }
+
+    // John Lamping and Eric Veach, A Fast, Minimal Memory, Consistent Hash Algorithm
+    static size_t jump_hash(uint64_t key, size_t buckets) {
+        int64_t b = -1;
+        int64_t j = 0;
+        while (j < int64_t(buckets)) {
+            b = j;
+            key = key * 2862933555777941757ULL + 1;
+            j = int64_t(double(b + 1) * (double(int64_t(1) << 31) / double((key >> 33) + 1)));
+        }
+        return size_t(b);
+    }
+
+    static size_t route(hash_t h, size_t shards, hash_scheme scheme) {
+        return scheme == HASH_MODULO ? h % shards : jump_hash(h, shards);
+    }
+
+    // Where a key is written
+    static size_t home(hash_t h, const layout& l) {
+        return l.target != 0 ? jump_hash(h, l.target) : route(h, l.shards, l.scheme);
+    }
+
+    // Where a key was before resharding
+    static size_t previous(hash_t h, const layout& l) {
+        return route(h, l.shards, l.scheme);
+    }
+
+    static uint64_t pack(const layout& l) {
+        return uint64_t(l.shards) | uint64_t(l.target) << 20 | uint64_t(l.scheme) << 40;
+    }
+
+    layout load() const {
+        uint64_t t = topology_.load(std::memory_order_acquire);
+        return layout{size_t(t & 0xfffff), hash_scheme(t >> 40), size_t(t >> 20 & 0xfffff)};
+    }
+
+    std::mutex& move_mutex(hash_t h) {
+        return move_mutexes_[h % MOVE_STRIPES];
+    }
+
+    // Copies key from one shard to the other and removes it from the first, false if it was
+    // removed in the meantime. A copy already in to, left by an interrupted move, is kept
+    bool move(hash_t h, const std::string& key, concurrent_hash_map<>& from,
+              concurrent_hash_map<>& to) {
+        std::lock_guard lock(move_mutex(h));
+
+        std::string value;
+        if (!from.find(h, key, value)) {
+            return false;
+        }
+        to.insert(h, key, value);
+        from.remove(h, key);
+        return true;
+    }
+
+    std::string shard_path(size_t shard_idx) const {
+        return shard_path(base_path_, shard_idx);
+    }
+
+    static std::string shard_path(const std::string& base_path, size_t shard_idx) {
+        return base_path + "_shard" + std::to_string(shard_idx);
+    }
+
+    void open_shards(size_t count) {
+        for (size_t idx = opened_.load(); idx < count; ++idx) {
+            shards_[idx] = std::make_unique<shard>(shard_path(idx).c_str(), checksums_, frozen_,
+                                                   filters_);
+            opened_.store(idx + 1);
+        }
+    }
+
+    // Keys of whole bucket chains of one shard from position on until at least count were
+    // appended, true once the shard is done. See scan_keys
+    bool scan_shard(size_t shard_idx, uint64_t& position, size_t count,
+                    std::vector<std::string>& keys) {
+        size_t appended = 0;
+
+        if (frozen_) {
+            const frozen_hash_map& map = *shards_[shard_idx]->frozen;
+            for (; position < map.size() && appended < count; ++position, ++appended) {
+                keys.emplace_back((*frozen_hash_map::const_iterator(&map, position)).first);
+            }
+            return position >= map.size();
+        }
+
+        return shards_[shard_idx]->map->exclusive([&](const hash_map<>& map) {
+            auto c = map.scan_from(std::min(position, uint64_t(1) << HASH_BITS));
+            std::vector<record_view> batch;
+
+            while (c.next(batch)) {
+                for (const auto& rv : batch) {
+                    keys.emplace_back(rv.key);
+                }
+                appended += batch.size();
+
+                if (appended >= count && c.at_chain_end()) {
+                    break;
+                }
+            }
+
+            position = c.position();
+            return position >= (uint64_t(1) << HASH_BITS);
+        });
+    }
+
+    std::string manifest_path() const {
+        return base_path_ + "_manifest";
+    }
+
+    // Lines of "<name> <value>": shards, hash (modulo or jump) and, while resharding, target.
+    // Without a manifest, a database whose first shard exists is from before manifests
+    layout read_manifest(size_t num_shards) const {
+        std::ifstream in(manifest_path());
+        if (!in) {
+            std::error_code ec;
+            bool existing = std::filesystem::exists(shard_path(0) + "dat", ec) ||
+                            frozen_hash_map::exists(shard_path(0).c_str());
+            return layout{std::clamp<size_t>(num_shards, 1, MAX_SHARDS),
+                          existing ? HASH_MODULO : HASH_JUMP};
+        }
+
+        layout l{0, HASH_JUMP};
+        std::string name;
+        std::string value;
+        while (in >> name >> value) {
+            if (name == "shards") {
+                l.shards = std::stoul(value);
+            } else if (name == "target") {
+                l.target = std::stoul(value);
+            } else if (name == "hash") {
+                l.scheme = value == "modulo" ? HASH_MODULO : HASH_JUMP;
+            }
+        }
+
+        if (l.shards == 0 || l.shards > MAX_SHARDS || l.target > MAX_SHARDS) {
+            throw std::runtime_error("invalid manifest " + manifest_path());
+        }
+        return l;
+    }
+
+    void write_manifest(const layout& l) const {
+        write_manifest(manifest_path(), l);
+    }
+
+    // Replaces the manifest at path in one rename
+    static void write_manifest(const std::string& path, const layout& l) {
+        std::string tmp = path + ".tmp";
+        {
+            std::ofstream out(tmp, std::ios::trunc);
+            out << "shards " << l.shards << "\n";
+            out << "hash " << (l.scheme == HASH_MODULO ? "modulo" : "jump") << "\n";
+            if (l.target != 0) {
+                out << "target " << l.target << "\n";
+            }
+            if (!out.flush()) {
+                throw std::runtime_error("cannot write " + tmp);
+            }
+        }
+        std::filesystem::rename(tmp, path);
+    }
+
+    // indices 0..count-1 by the shard of key_of(index) under a layout that is not resharding,
+    // in order within each shard
+    template<class KeyOf>
+    std::vector<std::vector<size_t>> group_by_shard(const layout& l, size_t count,
+                                                    KeyOf&& key_of) const {
+        std::vector<std::vector<size_t>> result(l.shards);
+        for (size_t i = 0; i < count; ++i) {
+            result[home(hash_key(key_of(i)), l)].push_back(i);
+        }
+        return result;
+    }
 };
 
 }  // namespace diskhash
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <utility>
+
+namespace diskhash {
+
+// Bounded lock-free queue between exactly one producer thread and one consumer thread.
+//
+// The producer and the consumer each keep a copy of the other's index and only reload it when
+// the queue looks full or empty, so while both keep up the index cache lines are not shared.
+template<class T>
+class spsc_queue {
+public:
+    // capacity is rounded up to a power of two
+    explicit spsc_queue(size_t capacity)
+        : mask_(round_up(capacity) - 1)
+        , slots_(new T[mask_ + 1])
+    {
+    }
+
+    spsc_queue(const spsc_queue&) = delete;
+    spsc_queue& operator=(const spsc_queue&) = delete;
+
+    // producer only, false if the queue is full
+    bool push(T value) {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - producer_head_ > mask_) {
+            producer_head_ = head_.load(std::memory_order_acquire);
+            if (tail - producer_head_ > mask_) {
+                return false;
+            }
+        }
+
+        slots_[tail & mask_] = std::move(value);
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // consumer only, false if the queue is empty
+    bool pop(T& value) {
+        size_t head = head_.load(std::memory_order_relaxed);
+        if (head == consumer_tail_) {
+            consumer_tail_ = tail_.load(std::memory_order_acquire);
+            if (head == consumer_tail_) {
+                return false;
+            }
+        }
+
+        value = std::move(slots_[head & mask_]);
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    static size_t round_up(size_t capacity) {
+        size_t result = 1;
+        while (result < capacity) {
+            result <<= 1;
+        }
+        return result;
+    }
+
+    const size_t mask_;
+    std::unique_ptr<T[]> slots_;
+
+    // written by the consumer
+    alignas(64) std::atomic<size_t> head_{0};
+    size_t consumer_tail_ = 0;
+
+    // written by the producer
+    alignas(64) std::atomic<size_t> tail_{0};
+    size_t producer_head_ = 0;
+};
+
+}  // namespace diskhash
@@ -0,0 +1,481 @@
+#include "uring_listener.h"
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <system_error>
+#include <unordered_map>
+
+#include "io_ring.h"
+
+namespace diskhash {
+
+namespace {
+
+using clock_type = std::chrono::steady_clock;
+
+constexpr unsigned RING_ENTRIES = 1024;
+
+// bytes read from a connection at a time, frames that do not fit are gathered in a string
+constexpr size_t READ_BUFFER_SIZE = 64 * 1024;
+
+// read buffers registered with each ring, connections beyond these get their own
+constexpr size_t REGISTERED_BUFFERS = 256;
+
+// a connection is not read from while this many response bytes wait for it
+constexpr size_t MAX_PENDING_OUTPUT = 1 << 20;
+
+// completions carry their operation in the low bits of user_data and their connection, if
+// any, in the others
+enum operation : uint64_t {
+    OP_ACCEPT = 1,
+    OP_READ = 2,
+    OP_SEND = 3,
+    OP_WAKE = 4,
+    OP_TICK = 5,
+    OP_CANCEL = 6,
+};
+
+constexpr uint64_t OPERATION_MASK = 7;
+
+}  // namespace
+
+class uring_listener::worker {
+public:
+    worker(int listen_fd, handler handle, std::chrono::seconds idle_timeout,
+           size_t max_connections, std::atomic<size_t>& connections,
+           std::atomic<uint64_t>& rejected)
+        : listen_fd_(listen_fd)
+        , handle_(std::move(handle))
+        , idle_timeout_(idle_timeout)
+        , max_connections_(max_connections)
+        , connections_(connections)
+        , rejected_(rejected)
+        , buffers_(new char[REGISTERED_BUFFERS * READ_BUFFER_SIZE])
+        , ring_(std::make_unique<io_ring>(RING_ENTRIES))
+    {
+        wake_fd_ = eventfd(0, EFD_CLOEXEC);
+        if (wake_fd_ < 0) {
+            throw std::system_error(errno, std::system_category(), "eventfd");
+        }
+
+        std::vector<iovec> iovecs(REGISTERED_BUFFERS);
+        for (size_t i = 0; i < REGISTERED_BUFFERS; ++i) {
+            iovecs[i].iov_base = buffers_.get() + i * READ_BUFFER_SIZE;
+            iovecs[i].iov_len = READ_BUFFER_SIZE;
+        }
+
+        // without them, connections read into their own buffers
+        if (ring_->register_buffers(iovecs.data(), unsigned(iovecs.size()))) {
+            for (size_t i = REGISTERED_BUFFERS; i > 0; --i) {
+                free_buffers_.push_back(int(i - 1));
+            }
+        } else {
+            buffers_.reset();
+        }
+    }
+
+    ~worker() {
+        // the kernel may write to the buffers until the ring is gone
+        ring_.reset();
+
+        for (auto& [c, owned] : open_) {
+            ::close(c->fd);
+            connections_.fetch_sub(1, std::memory_order_relaxed);
+        }
+        ::close(listen_fd_);
+        ::close(wake_fd_);
+    }
+
+    void run() {
+        if (stopping_.load()) {
+            return;
+        }
+
+        arm_accept();
+        arm_wake();
+        arm_tick();
+
+        while (!stopping_.load(std::memory_order_relaxed)) {
+            step();
+        }
+
+        // end every operation, so that nothing refers to a connection once it is gone
+        ::shutdown(listen_fd_, SHUT_RDWR);
+        std::vector<connection*> open;
+        for (auto& [c, owned] : open_) {
+            open.push_back(c);
+        }
+        for (connection* c : open) {
+            close_connection(c);
+        }
+        io_uring_sqe* sqe = ring_->get_sqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = OP_TICK;
+        sqe->user_data = OP_CANCEL;
+        ++in_flight_;
+
+        while (in_flight_ > 0) {
+            step();
+        }
+    }
+
+    void stop() {
+        stopping_.store(true);
+        uint64_t one = 1;
+        [[maybe_unused]] ssize_t written = ::write(wake_fd_, &one, sizeof(one));
+    }
+
+private:
+    struct connection {
+        int fd;
+        // index of a registered buffer, -1 for own_buffer
+        int buffer_index = -1;
+        char* buffer;
+        std::unique_ptr<char[]> own_buffer;
+        size_t filled = 0;
+        // a frame larger than the buffer, and whatever follows it, until it is complete
+        std::string large;
+
+        // responses queued while sending is in flight
+        std::string out;
+        std::string sending;
+        size_t sent = 0;
+
+        bool reading = false;
+        bool writing = false;
+        bool closing = false;
+        // after a malformed frame: once the responses so far and an error are sent, the
+        // sending side is shut down and what the client still sends is dropped until it
+        // closes, so that closing does not reset the connection under the responses
+        bool draining = false;
+        clock_type::time_point last_active;
+    };
+
+    int listen_fd_;
+    int wake_fd_ = -1;
+    handler handle_;
+    std::chrono::seconds idle_timeout_;
+    size_t max_connections_;
+    std::atomic<size_t>& connections_;
+    std::atomic<uint64_t>& rejected_;
+    std::atomic<bool> stopping_{false};
+
+    std::unique_ptr<char[]> buffers_;
+    std::vector<int> free_buffers_;
+    std::unordered_map<connection*, std::unique_ptr<connection>> open_;
+
+    // reset first: the kernel refers to the buffers and connections while operations are queued
+    std::unique_ptr<io_ring> ring_;
+    size_t in_flight_ = 0;
+    __kernel_timespec tick_{1, 0};
+
+    // submit everything queued since the last step with one system call, then handle completions
+    void step() {
+        ring_->submit_and_wait(1);
+        ring_->for_each_completion([this](const io_uring_cqe& cqe) {
+            --in_flight_;
+            auto* c = reinterpret_cast<connection*>(cqe.user_data & ~OPERATION_MASK);
+
+            switch (cqe.user_data & OPERATION_MASK) {
+            case OP_ACCEPT:
+                accepted(cqe.res);
+                break;
+            case OP_READ:
+                received(c, cqe.res);
+                break;
+            case OP_SEND:
+                sent(c, cqe.res);
+                break;
+            case OP_TICK:
+                close_idle();
+                break;
+            default:
+                // OP_WAKE only ends the wait, OP_CANCEL races the tick it cancels
+                break;
+            }
+        });
+    }
+
+    io_uring_sqe* queue(uint8_t opcode, int fd, connection* c, operation op) {
+        io_uring_sqe* sqe = ring_->get_sqe();
+        sqe->opcode = opcode;
+        sqe->fd = fd;
+        sqe->user_data = reinterpret_cast<uint64_t>(c) | op;
+        ++in_flight_;
+        return sqe;
+    }
+
+    void arm_accept() {
+        queue(IORING_OP_ACCEPT, listen_fd_, nullptr, OP_ACCEPT)->accept_flags = SOCK_CLOEXEC;
+    }
+
+    void arm_wake() {
+        queue(IORING_OP_POLL_ADD, wake_fd_, nullptr, OP_WAKE)->poll32_events = POLLIN;
+    }
+
+    void arm_tick() {
+        io_uring_sqe* sqe = queue(IORING_OP_TIMEOUT, -1, nullptr, OP_TICK);
+        sqe->addr = reinterpret_cast<uint64_t>(&tick_);
+        sqe->len = 1;
+    }
+
+    void arm_read(connection* c) {
+        io_uring_sqe* sqe;
+        if (c->buffer_index >= 0) {
+            sqe = queue(IORING_OP_READ_FIXED, c->fd, c, OP_READ);
+            sqe->buf_index = uint16_t(c->buffer_index);
+            // sockets have no file position
+            sqe->off = uint64_t(-1);
+        } else {
+            sqe = queue(IORING_OP_RECV, c->fd, c, OP_READ);
+        }
+        sqe->addr = reinterpret_cast<uint64_t>(c->buffer + c->filled);
+        sqe->len = unsigned(READ_BUFFER_SIZE - c->filled);
+        c->reading = true;
+    }
+
+    void arm_send(connection* c) {
+        io_uring_sqe* sqe = queue(IORING_OP_SEND, c->fd, c, OP_SEND);
+        sqe->addr = reinterpret_cast<uint64_t>(c->sending.data() + c->sent);
+        sqe->len = unsigned(c->sending.size() - c->sent);
+        sqe->msg_flags = MSG_NOSIGNAL;
+        c->writing = true;
+    }
+
+    void accepted(int fd) {
+        if (stopping_.load(std::memory_order_relaxed)) {
+            if (fd >= 0) {
+                ::close(fd);
+            }
+            return;
+        }
+
+        if (fd >= 0) {
+            if (connections_.fetch_add(1, std::memory_order_relaxed) >= max_connections_) {
+                // binary clients cannot parse a 503, closing is all they get
+                rejected_.fetch_add(1, std::memory_order_relaxed);
+                connections_.fetch_sub(1, std::memory_order_relaxed);
+                ::close(fd);
+            } else {
+                open(fd);
+            }
+        }
+        // other errors are specific to one connection
+        arm_accept();
+    }
+
+    void open(int fd) {
+        auto owned = std::make_unique<connection>();
+        connection* c = owned.get();
+        c->fd = fd;
+        c->last_active = clock_type::now();
+
+        if (!free_buffers_.empty()) {
+            c->buffer_index = free_buffers_.back();
+            free_buffers_.pop_back();
+            c->buffer = buffers_.get() + size_t(c->buffer_index) * READ_BUFFER_SIZE;
+        } else {
+            c->own_buffer.reset(new char[READ_BUFFER_SIZE]);
+            c->buffer = c->own_buffer.get();
+        }
+
+        open_.emplace(c, std::move(owned));
+        arm_read(c);
+    }
+
+    void received(connection* c, int bytes) {
+        c->reading = false;
+        if (bytes <= 0 || c->closing || stopping_.load(std::memory_order_relaxed)) {
+            close_connection(c);
+            return;
+        }
+        c->last_active = clock_type::now();
+        if (c->draining) {
+            arm_read(c);
+            return;
+        }
+        c->filled += size_t(bytes);
+
+        // answer every complete frame received so far with one send
+        try {
+            handle_frames(c);
+        } catch (const std::exception& e) {
+            // the frames before it were handled, their responses go out first
+            binary_protocol::append_frame(c->out, binary_protocol::STATUS_ERROR, e.what());
+            c->draining = true;
+            c->filled = 0;
+            c->large.clear();
+        }
+        flush(c);
+
+        if (c->out.size() + c->sending.size() - c->sent < MAX_PENDING_OUTPUT) {
+            arm_read(c);
+        }
+    }
+
+    // throws std::runtime_error for frames over binary_protocol::MAX_FRAME_SIZE
+    void handle_frames(connection* c) {
+        if (!c->large.empty()) {
+            c->large.append(c->buffer, c->filled);
+            c->filled = 0;
+            c->large.erase(0, handle_complete(c->large, c->out));
+            return;
+        }
+
+        size_t used = handle_complete(std::string_view(c->buffer, c->filled), c->out);
+        size_t rest = c->filled - used;
+        if (rest == READ_BUFFER_SIZE) {
+            c->large.assign(c->buffer, rest);
+            rest = 0;
+        } else if (used != 0) {
+            std::memmove(c->buffer, c->buffer + used, rest);
+        }
+        c->filled = rest;
+    }
+
+    // bytes of the complete frames at the start of data, which are handled
+    size_t handle_complete(std::string_view data, std::string& out) {
+        size_t used = 0;
+        for (;;) {
+            binary_protocol::frame frame;
+            size_t frame_size = binary_protocol::parse_frame(data.substr(used), frame);
+            if (frame_size == 0) {
+                return used;
+            }
+            handle_(frame, out);
+            used += frame_size;
+        }
+    }
+
+    void flush(connection* c) {
+        if (c->writing || c->out.empty()) {
+            return;
+        }
+        std::swap(c->sending, c->out);
+        c->out.clear();
+        c->sent = 0;
+        arm_send(c);
+    }
+
+    void sent(connection* c, int bytes) {
+        c->writing = false;
+        if (bytes < 0 || stopping_.load(std::memory_order_relaxed)) {
+            c->out.clear();
+            close_connection(c);
+            return;
+        }
+        c->last_active = clock_type::now();
+
+        c->sent += size_t(bytes);
+        if (c->sent < c->sending.size()) {
+            arm_send(c);
+            return;
+        }
+        c->sending.clear();
+        flush(c);
+
+        if (c->draining && !c->writing) {
+            ::shutdown(c->fd, SHUT_WR);
+        }
+
+        if (c->closing) {
+            // after the responses to everything the client sent before it closed
+            close_connection(c);
+        } else if (!c->reading && c->out.size() < MAX_PENDING_OUTPUT) {
+            arm_read(c);
+        }
+    }
+
+    // the connection is closed once its operations are done, its pending responses are sent
+    // unless stopping
+    void close_connection(connection* c) {
+        c->closing = true;
+        if (c->reading) {
+            // completes the read
+            ::shutdown(c->fd, SHUT_RD);
+            return;
+        }
+        if (c->writing) {
+            if (stopping_.load(std::memory_order_relaxed)) {
+                ::shutdown(c->fd, SHUT_RDWR);
+            }
+            return;
+        }
+
+        ::close(c->fd);
+        if (c->buffer_index >= 0) {
+            free_buffers_.push_back(c->buffer_index);
+        }
+        connections_.fetch_sub(1, std::memory_order_relaxed);
+        open_.erase(c);
+    }
+
+    // like the expiring streams of http_server: a connection has idle_timeout for every read
+    // or send
+    void close_idle() {
+        if (stopping_.load(std::memory_order_relaxed)) {
+            return;
+        }
+
+        auto now = clock_type::now();
+        for (auto& [c, owned] : open_) {
+            if (!c->closing && now - c->last_active > idle_timeout_) {
+                c->closing = true;
+                c->out.clear();
+                ::shutdown(c->fd, SHUT_RDWR);
+            }
+        }
+        arm_tick();
+    }
+};
+
+uring_listener::uring_listener(std::vector<int> listen_fds, handler handle,
+                               std::chrono::seconds idle_timeout, size_t max_connections,
+                               std::atomic<size_t>& connections, std::atomic<uint64_t>& rejected)
+{
+    for (size_t i = 0; i < listen_fds.size(); ++i) {
+        try {
+            workers_.push_back(std::make_unique<worker>(listen_fds[i], handle, idle_timeout,
+                                                        max_connections, connections, rejected));
+        } catch (...) {
+            // the workers made so far closed theirs
+            for (size_t j = i; j < listen_fds.size(); ++j) {
+                ::close(listen_fds[j]);
+            }
+            throw;
+        }
+    }
+}
+
+uring_listener::~uring_listener() {
+    stop();
+    wait();
+}
+
+void uring_listener::start() {
+    for (auto& w : workers_) {
+        threads_.emplace_back([&w] { w->run(); });
+    }
+}
+
+void uring_listener::stop() {
+    for (auto& w : workers_) {
+        w->stop();
+    }
+}
+
+void uring_listener::wait() {
+    for (auto& t : threads_) {
+        if (t.joinable()) {
+            t.join();
+        }
+    }
+    threads_.clear();
+}
+
+}  // namespace diskhash
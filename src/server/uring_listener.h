@@ -0,0 +1,50 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "binary_protocol.h"
+
+namespace diskhash {
+
+// Serves binary_protocol connections from io_uring rings instead of Asio's epoll reactor.
+//
+// Every worker thread owns a ring and one of the listening sockets, which share the port with
+// SO_REUSEPORT so that the kernel spreads connections over the workers. A worker queues the
+// accepts, reads and sends of all its connections and hands them to the kernel with one
+// io_uring_enter() per round, which also waits for the next completions. Reads go to buffers
+// registered with the ring while there are free ones. Responses are ordered and batched like
+// those of http_server::handle_binary_session.
+class uring_listener {
+public:
+    // appends the response to one frame to out
+    using handler = std::function<void(const binary_protocol::frame& frame, std::string& out)>;
+
+    // listen_fds are listening sockets, one per worker, closed by the listener. connections
+    // counts open connections across protocols, those beyond max_connections are closed at once
+    // and counted in rejected. throws std::system_error if a ring cannot be set up
+    uring_listener(std::vector<int> listen_fds, handler handle, std::chrono::seconds idle_timeout,
+                   size_t max_connections, std::atomic<size_t>& connections,
+                   std::atomic<uint64_t>& rejected);
+    ~uring_listener();
+
+    void start();
+
+    // async-signal-safe, wait() joins the workers
+    void stop();
+    void wait();
+
+private:
+    class worker;
+
+    std::vector<std::unique_ptr<worker>> workers_;
+    std::vector<std::thread> threads_;
+};
+
+}  // namespace diskhash
@@ -0,0 +1,407 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/program_options.hpp>
+
+#include "concurrent_hash_map.h"
+#include "fnv.h"
+#include "server/latency_histogram.h"
+#include "zipfian.h"
+
+namespace po = boost::program_options;
+
+namespace {
+
+using clock_type = std::chrono::steady_clock;
+
+enum operation { READ, UPDATE, INSERT, SCAN, READ_MODIFY_WRITE, OPERATIONS };
+
+const char* const operation_names[OPERATIONS] = {"read", "update", "insert", "scan", "read_modify_write"};
+
+// YCSB core workloads, as fractions of operations
+struct workload {
+    char name;
+    double read, update, insert, scan, read_modify_write;
+    // D reads the records inserted last whatever the distribution option says
+    bool latest;
+};
+
+const workload workloads[] = {
+    {'a', 0.50, 0.50, 0.00, 0.00, 0.00, false},
+    {'b', 0.95, 0.05, 0.00, 0.00, 0.00, false},
+    {'c', 1.00, 0.00, 0.00, 0.00, 0.00, false},
+    {'d', 0.95, 0.00, 0.05, 0.00, 0.00, true},
+    {'e', 0.00, 0.00, 0.05, 0.95, 0.00, false},
+    {'f', 0.50, 0.00, 0.00, 0.00, 0.50, false},
+};
+
+enum distribution { UNIFORM, ZIPFIAN, LATEST };
+
+struct bench_config {
+    std::string db_path;
+    std::string workloads;
+    distribution dist = ZIPFIAN;
+    uint64_t records = 0;
+    uint64_t operations = 0;
+    size_t key_size = 0;
+    size_t value_size = 0;
+    size_t threads = 1;
+    size_t scan_length = 0;
+    bool filters = false;
+    bool checksums = false;
+    bool reuse = false;
+};
+
+// "user" and the record number, zero-padded to key_size
+std::string make_key(uint64_t number, size_t key_size) {
+    std::string digits = std::to_string(number);
+    std::string key = "user";
+    if (key.size() + digits.size() < key_size) {
+        key.append(key_size - key.size() - digits.size(), '0');
+    }
+    return key + digits;
+}
+
+struct thread_result {
+    diskhash::latency_histogram latencies[OPERATIONS];
+    uint64_t not_found = 0;
+};
+
+class bench {
+public:
+    bench(const bench_config& config, diskhash::concurrent_hash_map<>& map, uint64_t records)
+        : config_(config), map_(map), inserted_(records), zipfian_(std::max<uint64_t>(records, 2))
+    {
+    }
+
+    // insert records [first, last)
+    void load(uint64_t first, uint64_t last, thread_result& result) {
+        std::string value(config_.value_size, 'v');
+        for (uint64_t i = first; i < last; ++i) {
+            std::string key = make_key(i, config_.key_size);
+            fill_value(value, i);
+
+            auto start = clock_type::now();
+            map_.insert(diskhash::fnv1a(key), key, value);
+            result.latencies[INSERT].record(since(start));
+        }
+    }
+
+    void run(const workload& w, uint64_t operations, uint64_t seed, thread_result& result) {
+        std::mt19937_64 rng(seed);
+        std::uniform_real_distribution<double> choice(0.0, 1.0);
+        std::string value(config_.value_size, 'v');
+        std::string found;
+        std::vector<diskhash::record_view> batch;
+
+        for (uint64_t n = 0; n < operations; ++n) {
+            double c = choice(rng);
+            operation op = c < w.read ? READ
+                : (c -= w.read) < w.update ? UPDATE
+                : (c -= w.update) < w.insert ? INSERT
+                : (c -= w.insert) < w.scan ? SCAN
+                : READ_MODIFY_WRITE;
+
+            uint64_t number = op == INSERT ? inserted_.fetch_add(1, std::memory_order_relaxed)
+                : choose(w, rng);
+            std::string key = make_key(number, config_.key_size);
+            diskhash::hash_t hash = diskhash::fnv1a(key);
+
+            auto start = clock_type::now();
+
+            switch (op) {
+            case READ:
+                if (!map_.find(hash, key, found)) {
+                    result.not_found++;
+                }
+                break;
+            case UPDATE:
+                // records are not updated in place, see README
+                fill_value(value, rng());
+                map_.remove(hash, key);
+                map_.insert(hash, key, value);
+                break;
+            case INSERT:
+                fill_value(value, number);
+                map_.insert(hash, key, value);
+                break;
+            case SCAN:
+                scan(hash, batch);
+                break;
+            case READ_MODIFY_WRITE:
+                if (!map_.find(hash, key, found)) {
+                    result.not_found++;
+                }
+                fill_value(value, rng());
+                map_.remove(hash, key);
+                map_.insert(hash, key, value);
+                break;
+            default:
+                break;
+            }
+
+            result.latencies[op].record(since(start));
+        }
+    }
+
+private:
+    const bench_config& config_;
+    diskhash::concurrent_hash_map<>& map_;
+    std::atomic<uint64_t> inserted_;
+    diskhash::zipfian_generator zipfian_;
+
+    template<class Rng>
+    uint64_t choose(const workload& w, Rng& rng) {
+        uint64_t count = inserted_.load(std::memory_order_relaxed);
+        distribution dist = w.latest ? LATEST : config_.dist;
+
+        switch (dist) {
+        case UNIFORM:
+            return std::uniform_int_distribution<uint64_t>(0, count - 1)(rng);
+        case LATEST:
+            return count - 1 - std::min(zipfian_.next(rng), count - 1);
+        default:
+            // scrambled, so that popular records are spread over the map
+            return diskhash::splitmix64(zipfian_.next(rng)) % count;
+        }
+    }
+
+    // hash maps have no key order, so a scan reads scan_length records in map order from the
+    // bucket chain of the start key on
+    void scan(diskhash::hash_t hash, std::vector<diskhash::record_view>& batch) {
+        map_.exclusive([&](const diskhash::hash_map<>& map) {
+            // the catalogue is indexed by the top bits of the hash and has a power of two slots
+            size_t first_slot = size_t((uint64_t(hash) * map.catalogue_size()) >> diskhash::HASH_BITS);
+            auto cursor = map.scan(first_slot);
+
+            for (size_t seen = 0; seen < config_.scan_length && cursor.next(batch);) {
+                seen += batch.size();
+            }
+        });
+    }
+
+    void fill_value(std::string& value, uint64_t seed) {
+        uint64_t x = diskhash::splitmix64(seed);
+        for (size_t i = 0; i < value.size(); i += sizeof(x)) {
+            std::copy_n(reinterpret_cast<const char*>(&x), std::min(sizeof(x), value.size() - i), &value[i]);
+            x = diskhash::splitmix64(x);
+        }
+    }
+
+    static uint64_t since(clock_type::time_point start) {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(clock_type::now() - start).count();
+    }
+};
+
+// run f(thread, result) on config.threads threads, return the merged results and the seconds
+// it took
+template<class F>
+std::pair<thread_result, double> run_threads(size_t threads, F&& f) {
+    std::vector<thread_result> results(threads);
+    std::vector<std::thread> workers;
+
+    auto start = clock_type::now();
+    for (size_t t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t] { f(t, results[t]); });
+    }
+    for (auto& w : workers) {
+        w.join();
+    }
+    double seconds = std::chrono::duration<double>(clock_type::now() - start).count();
+
+    thread_result total;
+    for (auto& r : results) {
+        for (size_t op = 0; op < OPERATIONS; ++op) {
+            total.latencies[op].add(r.latencies[op]);
+        }
+        total.not_found += r.not_found;
+    }
+    return {std::move(total), seconds};
+}
+
+void write_phase(std::ostream& out, const thread_result& result, double seconds) {
+    uint64_t operations = 0;
+    for (const auto& h : result.latencies) {
+        operations += h.count();
+    }
+
+    out << "{\"seconds\": " << seconds
+        << ", \"operations\": " << operations
+        << ", \"throughput\": " << (seconds > 0 ? double(operations) / seconds : 0.0)
+        << ", \"not_found\": " << result.not_found
+        << ", \"latency_us\": {";
+
+    bool first = true;
+    for (size_t op = 0; op < OPERATIONS; ++op) {
+        const auto& h = result.latencies[op];
+        if (h.count() == 0) {
+            continue;
+        }
+        out << (first ? "" : ", ") << "\"" << operation_names[op] << "\": {"
+            << "\"count\": " << h.count()
+            << ", \"mean\": " << double(h.sum()) / double(h.count()) / 1e3
+            << ", \"p50\": " << double(h.percentile(0.5)) / 1e3
+            << ", \"p99\": " << double(h.percentile(0.99)) / 1e3
+            << ", \"p999\": " << double(h.percentile(0.999)) / 1e3
+            << ", \"max\": " << double(h.max()) / 1e3 << "}";
+        first = false;
+    }
+    out << "}}";
+}
+
+void remove_map_files(const std::string& path) {
+    for (const char* suffix : {"cat", "dat", "jnl", "flt"}) {
+        std::filesystem::remove(path + suffix);
+    }
+}
+
+}  // namespace
+
+// exit codes: 0 - done, 1 - error
+int main(int argc, char* argv[]) {
+    try {
+        po::options_description desc("diskhash_bench options");
+        desc.add_options()
+            ("help,h", "Show help message")
+            ("db,d", po::value<std::string>()->required(),
+                "Path to database files (required), without the cat/dat suffix")
+            ("workloads,w", po::value<std::string>()->default_value("abcdef"),
+                "YCSB workloads to run in order, letters a to f")
+            ("distribution", po::value<std::string>()->default_value("zipfian"),
+                "Key distribution: uniform, zipfian or latest")
+            ("records,r", po::value<uint64_t>()->default_value(1000000),
+                "Records loaded before the workloads run, may exceed RAM")
+            ("operations,n", po::value<uint64_t>()->default_value(1000000),
+                "Operations per workload")
+            ("key-size", po::value<size_t>()->default_value(16), "Key size in bytes")
+            ("value-size", po::value<size_t>()->default_value(100), "Value size in bytes")
+            ("threads,t", po::value<size_t>()->default_value(1), "Client threads")
+            ("scan-length", po::value<size_t>()->default_value(100),
+                "Records read by a workload E scan")
+            ("filters", "Keep Bloom filters per bucket chain")
+            ("checksums", "Keep CRC32C checksums per bucket")
+            ("reuse", "Keep an existing database instead of loading a new one");
+
+        po::variables_map vm;
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+
+        if (vm.count("help")) {
+            std::cout << "Usage: diskhash_bench [options]\n\n"
+                      << "Runs YCSB workloads against a concurrent_hash_map and prints a JSON report.\n\n"
+                      << desc << "\n";
+            return 0;
+        }
+
+        po::notify(vm);
+
+        bench_config config;
+        config.db_path = vm["db"].as<std::string>();
+        config.workloads = vm["workloads"].as<std::string>();
+        config.records = vm["records"].as<uint64_t>();
+        config.operations = vm["operations"].as<uint64_t>();
+        config.key_size = vm["key-size"].as<size_t>();
+        config.value_size = vm["value-size"].as<size_t>();
+        config.threads = std::max<size_t>(vm["threads"].as<size_t>(), 1);
+        config.scan_length = vm["scan-length"].as<size_t>();
+        config.filters = vm.count("filters") > 0;
+        config.checksums = vm.count("checksums") > 0;
+        config.reuse = vm.count("reuse") > 0;
+
+        auto dist = vm["distribution"].as<std::string>();
+        if (dist == "uniform") {
+            config.dist = UNIFORM;
+        } else if (dist == "zipfian") {
+            config.dist = ZIPFIAN;
+        } else if (dist == "latest") {
+            config.dist = LATEST;
+        } else {
+            throw po::error("unknown distribution " + dist);
+        }
+
+        for (char w : config.workloads) {
+            if (w < 'a' || w > 'f') {
+                throw po::error(std::string("unknown workload ") + w);
+            }
+        }
+
+        // a record must fit into one bucket, with room for the hash and two length prefixes
+        if (config.key_size + config.value_size + 32 > diskhash::DEFAULT_BUCKET_SIZE) {
+            throw po::error("records larger than a bucket are not supported");
+        }
+
+        if (config.records == 0) {
+            throw po::error("at least one record is needed");
+        }
+
+        if (!config.reuse) {
+            remove_map_files(config.db_path);
+        }
+
+        diskhash::concurrent_hash_map<> map(config.db_path.c_str(), false, false,
+                                            config.checksums, config.filters);
+
+        uint64_t existing = map.size();
+        bool load = existing == 0;
+        uint64_t records = load ? config.records : existing;
+
+        bench b(config, map, records);
+
+        std::ostringstream out;
+        out << std::fixed << std::setprecision(3);
+        out << "{\"config\": {\"records\": " << records
+            << ", \"operations\": " << config.operations
+            << ", \"key_size\": " << config.key_size
+            << ", \"value_size\": " << config.value_size
+            << ", \"threads\": " << config.threads
+            << ", \"distribution\": \"" << dist << "\""
+            << ", \"filters\": " << (config.filters ? "true" : "false")
+            << ", \"checksums\": " << (config.checksums ? "true" : "false") << "}";
+
+        if (load) {
+            auto [result, seconds] = run_threads(config.threads, [&](size_t t, thread_result& r) {
+                b.load(records * t / config.threads, records * (t + 1) / config.threads, r);
+            });
+            out << ",\n \"load\": ";
+            write_phase(out, result, seconds);
+        }
+
+        out << ",\n \"workloads\": {";
+        for (size_t i = 0; i < config.workloads.size(); ++i) {
+            const workload& w = workloads[config.workloads[i] - 'a'];
+
+            auto [result, seconds] = run_threads(config.threads, [&](size_t t, thread_result& r) {
+                uint64_t operations = config.operations * (t + 1) / config.threads
+                    - config.operations * t / config.threads;
+                b.run(w, operations, diskhash::splitmix64(i * config.threads + t), r);
+            });
+
+            out << (i == 0 ? "" : ",") << "\n  \"" << w.name << "\": ";
+            write_phase(out, result, seconds);
+        }
+        out << "},\n \"bytes_allocated\": " << map.bytes_allocated() << "}\n";
+
+        map.close();
+
+        std::cout << out.str();
+        return 0;
+
+    } catch (const po::error& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        std::cerr << "Use --help for usage information.\n";
+        return 1;
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        return 1;
+    }
+}
@@ -0,0 +1,72 @@
+#include <filesystem>
+#include <iostream>
+#include <string>
+
+#include <boost/program_options.hpp>
+
+#include "frozen_hash_map.h"
+
+namespace po = boost::program_options;
+
+namespace {
+
+void freeze_map(const std::string& path) {
+    if (!std::filesystem::exists(path + "dat")) {
+        throw std::runtime_error(path + "dat does not exist");
+    }
+
+    // opened for writing only to hold the writer lock, so nothing changes while we copy
+    diskhash::hash_map<> map(path.c_str());
+    diskhash::freeze(map, path.c_str());
+    map.close();
+
+    diskhash::frozen_hash_map frozen(path.c_str());
+    std::cout << path << "frz: " << frozen.size() << " records, "
+              << frozen.bytes_allocated() << " bytes\n";
+    frozen.close();
+}
+
+}  // namespace
+
+// exit codes: 0 - frozen, 1 - error
+int main(int argc, char* argv[]) {
+    try {
+        po::options_description desc("diskhash_freeze options");
+        desc.add_options()
+            ("help,h", "Show help message")
+            ("db,d", po::value<std::string>()->required(),
+                "Path to database files (required), without the cat/dat suffix")
+            ("shards,s", po::value<size_t>(),
+                "Freeze the shards of a diskhash_server database with this many shards");
+
+        po::variables_map vm;
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+
+        if (vm.count("help")) {
+            std::cout << "Usage: diskhash_freeze [options]\n\n" << desc << "\n";
+            return 0;
+        }
+
+        po::notify(vm);
+
+        auto db_path = vm["db"].as<std::string>();
+
+        if (vm.count("shards")) {
+            for (size_t i = 0; i < vm["shards"].as<size_t>(); ++i) {
+                freeze_map(db_path + "_shard" + std::to_string(i));
+            }
+        } else {
+            freeze_map(db_path);
+        }
+
+        return 0;
+
+    } catch (const po::error& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        std::cerr << "Use --help for usage information.\n";
+        return 1;
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        return 1;
+    }
+}
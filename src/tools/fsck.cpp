@@ -0,0 +1,122 @@
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <string>
+
+#include <boost/program_options.hpp>
+
+#include "fsck.h"
+
+namespace po = boost::program_options;
+
+// exit codes: 0 - map is consistent, 1 - problems found, 2 - map could not be checked
+int main(int argc, char* argv[]) {
+    try {
+        po::options_description desc("diskhash_fsck options");
+        desc.add_options()
+            ("help,h", "Show help message")
+            ("db,d", po::value<std::string>()->required(),
+                "Path to database files (required), without the cat/dat suffix")
+            ("rebuild-catalogue", "Rebuild the .cat file from bucket contents")
+            ("upgrade", "Convert a map written by diskhash 1.0 to the current format")
+            ("checksums", "With --upgrade, keep CRC32C checksums in the converted map");
+
+        po::variables_map vm;
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+
+        if (vm.count("help")) {
+            std::cout << "Usage: diskhash_fsck [options]\n\n" << desc << "\n";
+            return 0;
+        }
+
+        po::notify(vm);
+
+        auto db_path = vm["db"].as<std::string>();
+        auto cat_path = db_path + "cat";
+        auto dat_path = db_path + "dat";
+        bool rebuild = vm.count("rebuild-catalogue") > 0;
+
+        if (vm.count("upgrade")) {
+            // the old files are replaced, so keep writers in other processes out
+            diskhash::file_lock lock(dat_path.c_str());
+            size_t records = diskhash::upgrade_legacy(db_path, vm.count("checksums") > 0);
+            std::cout << "upgraded, " << records << " records\n";
+            return 0;
+        }
+
+        // rebuilding writes to the map, so keep writers in other processes out
+        std::unique_ptr<diskhash::file_lock> lock;
+        if (rebuild) {
+            lock = std::make_unique<diskhash::file_lock>(dat_path.c_str());
+        }
+
+        diskhash::container<> cont(dat_path.c_str(), !rebuild);
+
+        std::cout << "buckets: " << cont.buckets_count() << "\n";
+        std::cout << "format: " << (cont.legacy() ? "1.0" : "current") << "\n";
+        std::cout << "checksums: " << (cont.checksums() ? "on" : "off") << "\n";
+
+        if (rebuild) {
+            diskhash::fsck_report report;
+            for (size_t id = 0; id < cont.buckets_count(); ++id) {
+                if (!cont.verify_bucket(id)) {
+                    report.corrupted_buckets.push_back(id);
+                }
+            }
+
+            if (!report.corrupted_buckets.empty()) {
+                for (size_t id : report.corrupted_buckets) {
+                    std::cout << "corrupted bucket: " << id << "\n";
+                }
+                std::cerr << "Error: refusing to rebuild catalogue over corrupted buckets\n";
+                cont.close();
+                return 1;
+            }
+
+            size_t created = diskhash::rebuild_catalogue(cont, cat_path.c_str());
+            cont.recount();
+            cont.sync();
+            cont.close();
+
+            // bucket filters are keyed by chain head, let the next writer rebuild them
+            std::filesystem::remove(db_path + "flt");
+
+            std::cout << "catalogue rebuilt, " << created << " empty buckets created\n";
+            return 0;
+        }
+
+        diskhash::catalogue cat(cat_path.c_str(), 1, true);
+        auto report = diskhash::check(cat, cont);
+
+        std::cout << "free buckets: " << report.free_buckets << "\n";
+        std::cout << "records: " << report.records << "\n";
+
+        for (size_t id : report.corrupted_buckets) {
+            std::cout << "corrupted bucket: " << id << "\n";
+        }
+        for (size_t id : report.misplaced_buckets) {
+            std::cout << "misplaced bucket: " << id << "\n";
+        }
+        if (report.bad_catalogue_entries != 0) {
+            std::cout << "bad catalogue entries: " << report.bad_catalogue_entries << "\n";
+        }
+        if (report.bad_usage_counters) {
+            std::cout << "usage counters out of date, fixed by --rebuild-catalogue\n";
+        }
+
+        std::cout << (report.ok() ? "OK" : "CORRUPTED") << "\n";
+
+        cat.close();
+        cont.close();
+
+        return report.ok() ? 0 : 1;
+
+    } catch (const po::error& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        std::cerr << "Use --help for usage information.\n";
+        return 2;
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        return 2;
+    }
+}
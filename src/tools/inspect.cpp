@@ -0,0 +1,132 @@
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+#include <boost/program_options.hpp>
+
+#include "hash_map.h"
+
+namespace po = boost::program_options;
+
+namespace {
+
+// read-only, so it may run while a server or another writer has the map open
+diskhash::structure_stats inspect_map(const std::string& path, diskhash::usage_stats& usage) {
+    if (!std::filesystem::exists(path + "dat")) {
+        throw std::runtime_error(path + "dat does not exist");
+    }
+
+    diskhash::hash_map<> map(path.c_str(), true);
+    auto stats = map.structure_stats();
+
+    auto map_usage = map.usage();
+    usage.records += map_usage.records;
+    usage.key_bytes += map_usage.key_bytes;
+    usage.value_bytes += map_usage.value_bytes;
+
+    map.close();
+    return stats;
+}
+
+void print_histogram(const char* title, const std::vector<size_t>& counts, size_t total,
+                     const std::vector<std::string>& labels) {
+    std::cout << title << ":\n";
+    for (size_t i = 0; i < counts.size(); ++i) {
+        if (counts[i] == 0) {
+            continue;
+        }
+        double percent = total == 0 ? 0.0 : 100.0 * double(counts[i]) / double(total);
+        std::cout << "  " << std::setw(8) << labels[i] << "  " << std::setw(10) << counts[i]
+                  << "  " << std::fixed << std::setprecision(1) << std::setw(5) << percent << "%\n";
+    }
+}
+
+void print(const diskhash::structure_stats& stats, const diskhash::usage_stats& usage) {
+    std::cout << "records: " << usage.records << "\n";
+    std::cout << "key bytes: " << usage.key_bytes << "\n";
+    std::cout << "value bytes: " << usage.value_bytes << "\n";
+    std::cout << "buckets: " << stats.buckets << "\n";
+    std::cout << "free buckets: " << stats.free_buckets << "\n";
+    std::cout << "chains: " << stats.chains << "\n";
+
+    size_t buckets_in_chains = stats.buckets - stats.free_buckets;
+    double fill = buckets_in_chains == 0 ? 0.0
+        : double(stats.bytes_used) / double(buckets_in_chains * diskhash::DEFAULT_BUCKET_SIZE);
+    std::cout << "fill factor: " << std::fixed << std::setprecision(3) << fill << "\n";
+
+    std::cout << "global depth: " << stats.global_depth << "\n";
+    std::cout << "median local depth: " << stats.median_local_depth() << "\n";
+    std::cout << "splits: " << stats.splits << "\n";
+    std::cout << "catalogue doublings: " << stats.catalogue_doublings << "\n";
+    std::cout << "file resizes: " << stats.file_resizes << "\n";
+    std::cout << "bytes moved by splits: " << stats.bytes_moved << "\n";
+
+    std::vector<std::string> labels;
+
+    for (size_t length = 0; length < stats.chain_lengths.size(); ++length) {
+        labels.push_back(std::to_string(length));
+    }
+    print_histogram("chain length", stats.chain_lengths, stats.chains, labels);
+
+    labels.clear();
+    for (size_t bin = 0; bin < stats.FILL_BINS; ++bin) {
+        const char* bound = bin + 1 == stats.FILL_BINS ? "<=" : "<";
+        labels.push_back(bound + std::to_string((bin + 1) * 100 / stats.FILL_BINS) + "%");
+    }
+    print_histogram("bucket fill", stats.bucket_fill, buckets_in_chains, labels);
+
+    labels.clear();
+    for (size_t depth = 0; depth < stats.local_depths.size(); ++depth) {
+        labels.push_back(std::to_string(depth));
+    }
+    print_histogram("local depth", stats.local_depths, stats.chains, labels);
+}
+
+}  // namespace
+
+// exit codes: 0 - inspected, 1 - error
+int main(int argc, char* argv[]) {
+    try {
+        po::options_description desc("diskhash_inspect options");
+        desc.add_options()
+            ("help,h", "Show help message")
+            ("db,d", po::value<std::string>()->required(),
+                "Path to database files (required), without the cat/dat suffix")
+            ("shards,s", po::value<size_t>(),
+                "Inspect the shards of a diskhash_server database with this many shards");
+
+        po::variables_map vm;
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+
+        if (vm.count("help")) {
+            std::cout << "Usage: diskhash_inspect [options]\n\n" << desc << "\n";
+            return 0;
+        }
+
+        po::notify(vm);
+
+        auto db_path = vm["db"].as<std::string>();
+        diskhash::structure_stats stats;
+        diskhash::usage_stats usage;
+
+        if (vm.count("shards")) {
+            for (size_t i = 0; i < vm["shards"].as<size_t>(); ++i) {
+                stats.merge(inspect_map(db_path + "_shard" + std::to_string(i), usage));
+            }
+        } else {
+            stats = inspect_map(db_path, usage);
+        }
+
+        print(stats, usage);
+        return 0;
+
+    } catch (const po::error& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        std::cerr << "Use --help for usage information.\n";
+        return 1;
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        return 1;
+    }
+}
@@ -0,0 +1,643 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/beast.hpp>
+#include <boost/program_options.hpp>
+
+#include "server/binary_protocol.h"
+#include "server/latency_histogram.h"
+#include "zipfian.h"
+
+namespace po = boost::program_options;
+namespace beast = boost::beast;
+namespace http = beast::http;
+namespace net = boost::asio;
+namespace binary_protocol = diskhash::binary_protocol;
+using tcp = net::ip::tcp;
+
+namespace {
+
+using clock_type = std::chrono::steady_clock;
+
+// DELETE alone is a macro on Windows
+enum operation { OP_GET, OP_SET, OP_DELETE, OPERATIONS };
+
+const char* const operation_names[OPERATIONS] = {"get", "set", "delete"};
+
+struct loadgen_config {
+    std::string host;
+    std::string port;
+    size_t connections = 1;
+    size_t threads = 1;
+    size_t pipeline = 1;
+    double duration = 0;
+    // requests per second over all connections, 0 for a closed loop
+    double rate = 0;
+    // percentages of GET and SET, the rest are DELETE
+    unsigned get_percent = 0;
+    unsigned set_percent = 0;
+    uint64_t keys = 0;
+    bool zipfian = false;
+    size_t value_size = 0;
+    // binary_protocol frames instead of HTTP requests
+    bool binary = false;
+};
+
+struct connection_stats {
+    // from the time a request was due to its response, so that requests queued behind a slow
+    // one are charged for the wait (coordinated omission)
+    diskhash::latency_histogram corrected[OPERATIONS];
+    // from the time a request was written to its response
+    diskhash::latency_histogram uncorrected[OPERATIONS];
+    uint64_t status_classes[6] = {};
+    uint64_t errors = 0;
+    // requests that were due before the end but never written, open loop only
+    uint64_t unsent = 0;
+
+    void add(const connection_stats& other) {
+        for (size_t op = 0; op < OPERATIONS; ++op) {
+            corrected[op].add(other.corrected[op]);
+            uncorrected[op].add(other.uncorrected[op]);
+        }
+        for (size_t c = 0; c < 6; ++c) {
+            status_classes[c] += other.status_classes[c];
+        }
+        errors += other.errors;
+        unsent += other.unsent;
+    }
+};
+
+// the bytes "key<n>" in base64url without padding, as DiskHashClient sends keys
+std::string encode_key(const std::string& key) {
+    static const char alphabet[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+    std::string result;
+    unsigned val = 0;
+    int bits = 0;
+    for (unsigned char c : key) {
+        val = (val << 8) | c;
+        bits += 8;
+        while (bits >= 6) {
+            bits -= 6;
+            result += alphabet[(val >> bits) & 0x3f];
+        }
+    }
+    if (bits > 0) {
+        result += alphabet[(val << (6 - bits)) & 0x3f];
+    }
+    return result;
+}
+
+// one keep-alive connection with up to pipeline requests in flight, run on its own strand.
+//
+// in a closed loop a request is due as soon as the response to an earlier one arrives. in an
+// open loop requests are due at a fixed rate whatever the server does, and wait in pending_
+// while the pipeline is full
+class connection : public std::enable_shared_from_this<connection> {
+public:
+    // with preload, SET every key once in order instead of following the mix
+    connection(net::io_context& ioc, const loadgen_config& config,
+               const diskhash::zipfian_generator& zipfian, std::atomic<uint64_t>* preload,
+               uint64_t seed, connection_stats& stats)
+        : config_(config)
+        , zipfian_(zipfian)
+        , preload_(preload)
+        , stream_(net::make_strand(ioc))
+        , timer_(stream_.get_executor())
+        , rng_(seed)
+        , value_(config.value_size, 'v')
+        , stats_(stats)
+    {
+    }
+
+    void start(const tcp::resolver::results_type& endpoints, clock_type::time_point first_due,
+               clock_type::time_point deadline) {
+        deadline_ = deadline;
+        next_due_ = first_due;
+
+        stream_.async_connect(endpoints,
+            [self = shared_from_this()](beast::error_code ec, const tcp::endpoint&) {
+                if (ec) {
+                    return self->fail();
+                }
+                self->stream_.socket().set_option(tcp::no_delay(true));
+
+                if (self->open_loop()) {
+                    self->schedule();
+                } else {
+                    for (size_t i = 0; i < self->config_.pipeline; ++i) {
+                        self->pending_.push_back(clock_type::now());
+                    }
+                    self->write();
+                }
+            });
+    }
+
+private:
+    struct request_state {
+        clock_type::time_point due;
+        clock_type::time_point sent;
+        operation op;
+    };
+
+    const loadgen_config& config_;
+    const diskhash::zipfian_generator& zipfian_;
+    std::atomic<uint64_t>* preload_;
+
+    beast::tcp_stream stream_;
+    net::steady_timer timer_;
+    beast::flat_buffer buffer_;
+    http::request<http::string_body> request_;
+    http::response<http::string_body> response_;
+    std::string frame_;
+    std::mt19937_64 rng_;
+    std::string value_;
+
+    std::deque<clock_type::time_point> pending_;
+    std::deque<request_state> in_flight_;
+    bool writing_ = false;
+    bool reading_ = false;
+    bool failed_ = false;
+
+    clock_type::time_point next_due_;
+    clock_type::time_point deadline_;
+
+    connection_stats& stats_;
+
+    bool open_loop() const {
+        return config_.rate > 0 && !preload_;
+    }
+
+    void schedule() {
+        timer_.expires_at(next_due_);
+        timer_.async_wait([self = shared_from_this()](beast::error_code ec) {
+            if (ec || self->failed_) {
+                return;
+            }
+
+            // a late timer makes up for every request that fell due meanwhile
+            auto interval = std::chrono::duration_cast<clock_type::duration>(
+                std::chrono::duration<double>(double(self->config_.connections) / self->config_.rate));
+            auto now = clock_type::now();
+            for (; self->next_due_ <= now && self->next_due_ < self->deadline_; self->next_due_ += interval) {
+                self->pending_.push_back(self->next_due_);
+            }
+
+            self->write();
+
+            if (self->next_due_ < self->deadline_) {
+                self->schedule();
+            } else {
+                self->finish_if_idle();
+            }
+        });
+    }
+
+    // choose the next request, false when a preload has run out of keys
+    bool prepare(operation& op) {
+        uint64_t key;
+        if (preload_) {
+            key = preload_->fetch_add(1, std::memory_order_relaxed);
+            if (key >= config_.keys) {
+                return false;
+            }
+            op = OP_SET;
+        } else {
+            unsigned percent = std::uniform_int_distribution<unsigned>(0, 99)(rng_);
+            op = percent < config_.get_percent ? OP_GET
+                : percent < config_.get_percent + config_.set_percent ? OP_SET
+                : OP_DELETE;
+            key = config_.zipfian ? zipfian_.next_scrambled(rng_)
+                : std::uniform_int_distribution<uint64_t>(0, config_.keys - 1)(rng_);
+        }
+
+        std::string key_bytes = "key" + std::to_string(key);
+        if (op == OP_SET) {
+            auto x = diskhash::splitmix64(rng_());
+            std::copy_n(reinterpret_cast<const char*>(&x), std::min(sizeof(x), value_.size()), value_.data());
+        }
+
+        if (config_.binary) {
+            static const uint8_t opcodes[OPERATIONS] = {
+                binary_protocol::OP_GET, binary_protocol::OP_SET, binary_protocol::OP_DELETE};
+
+            frame_.clear();
+            if (op == OP_SET) {
+                binary_protocol::append_set(frame_, key_bytes, value_);
+            } else {
+                binary_protocol::append_frame(frame_, opcodes[op], key_bytes);
+            }
+            return true;
+        }
+
+        static const http::verb verbs[OPERATIONS] = {http::verb::get, http::verb::put, http::verb::delete_};
+        static const char* const paths[OPERATIONS] = {"/get?key=", "/set?key=", "/delete?key="};
+
+        request_ = {};
+        request_.version(11);
+        request_.method(verbs[op]);
+        request_.target(paths[op] + encode_key(key_bytes));
+        request_.set(http::field::host, config_.host);
+        if (op == OP_SET) {
+            request_.body() = value_;
+        }
+        request_.prepare_payload();
+        return true;
+    }
+
+    void write() {
+        if (writing_ || failed_ || pending_.empty() || in_flight_.size() >= config_.pipeline) {
+            return;
+        }
+
+        operation op;
+        if (!prepare(op)) {
+            pending_.clear();
+            return finish_if_idle();
+        }
+
+        in_flight_.push_back({pending_.front(), clock_type::now(), op});
+        pending_.pop_front();
+        writing_ = true;
+
+        auto written = [self = shared_from_this()](beast::error_code ec, size_t) {
+            self->writing_ = false;
+            if (ec) {
+                return self->fail();
+            }
+            self->read();
+            self->write();
+        };
+
+        if (config_.binary) {
+            net::async_write(stream_, net::buffer(frame_), std::move(written));
+        } else {
+            http::async_write(stream_, request_, std::move(written));
+        }
+    }
+
+    void read() {
+        if (reading_ || failed_ || in_flight_.empty()) {
+            return;
+        }
+
+        reading_ = true;
+
+        if (config_.binary) {
+            return read_frame();
+        }
+
+        response_ = {};
+        http::async_read(stream_, buffer_, response_,
+            [self = shared_from_this()](beast::error_code ec, size_t) {
+                self->reading_ = false;
+                if (ec) {
+                    return self->fail();
+                }
+                self->complete(self->response_.result_int());
+            });
+    }
+
+    // complete the next response once a whole frame is buffered
+    void read_frame() {
+        binary_protocol::frame frame;
+        size_t frame_size = 0;
+        try {
+            frame_size = binary_protocol::parse_frame(
+                {static_cast<const char*>(buffer_.data().data()), buffer_.size()}, frame);
+        } catch (const std::exception&) {
+            reading_ = false;
+            return fail();
+        }
+
+        if (frame_size != 0) {
+            // the HTTP status of the same request, so that both protocols report alike
+            static const unsigned status_codes[] = {200, 404, 409, 500};
+            unsigned status = status_codes[std::min<unsigned>(frame.code, 3)];
+            buffer_.consume(frame_size);
+            reading_ = false;
+            return complete(status);
+        }
+
+        stream_.async_read_some(buffer_.prepare(64 * 1024),
+            [self = shared_from_this()](beast::error_code ec, size_t bytes) {
+                if (ec) {
+                    self->reading_ = false;
+                    return self->fail();
+                }
+                self->buffer_.commit(bytes);
+                self->read_frame();
+            });
+    }
+
+    void complete(unsigned status) {
+        auto now = clock_type::now();
+        const request_state& request = in_flight_.front();
+
+        stats_.corrected[request.op].record(nanoseconds(request.due, now));
+        stats_.uncorrected[request.op].record(nanoseconds(request.sent, now));
+        stats_.status_classes[std::min<unsigned>(status / 100, 5)]++;
+        in_flight_.pop_front();
+
+        if (!open_loop() && now < deadline_) {
+            pending_.push_back(now);
+        }
+
+        write();
+        read();
+        finish_if_idle();
+    }
+
+    // close once nothing is in flight and nothing more will be sent
+    void finish_if_idle() {
+        bool more = open_loop() ? next_due_ < deadline_
+            : !pending_.empty() && clock_type::now() < deadline_;
+        if (failed_ || !in_flight_.empty() || writing_ || more) {
+            return;
+        }
+
+        stats_.unsent += pending_.size();
+        pending_.clear();
+        timer_.cancel();
+
+        beast::error_code ec;
+        stream_.socket().shutdown(tcp::socket::shutdown_both, ec);
+        stream_.close();
+    }
+
+    void fail() {
+        if (!failed_) {
+            failed_ = true;
+            // a failed connect or a lost connection counts once even with nothing in flight
+            stats_.errors += std::max<size_t>(in_flight_.size(), 1);
+            timer_.cancel();
+            stream_.close();
+        }
+    }
+
+    static uint64_t nanoseconds(clock_type::time_point start, clock_type::time_point end) {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+    }
+};
+
+// run one phase on config.connections connections, return the merged statistics and the
+// seconds it took
+std::pair<connection_stats, double> run_phase(const loadgen_config& config,
+                                              const tcp::resolver::results_type& endpoints,
+                                              const diskhash::zipfian_generator& zipfian,
+                                              bool preload, uint64_t seed) {
+    net::io_context ioc;
+    std::vector<connection_stats> stats(config.connections);
+    std::atomic<uint64_t> next_key{0};
+
+    auto start = clock_type::now();
+    auto deadline = preload ? clock_type::time_point::max()
+        : start + std::chrono::duration_cast<clock_type::duration>(std::chrono::duration<double>(config.duration));
+
+    for (size_t i = 0; i < config.connections; ++i) {
+        auto c = std::make_shared<connection>(ioc, config, zipfian, preload ? &next_key : nullptr,
+                                              diskhash::splitmix64(seed + i), stats[i]);
+
+        // stagger open-loop connections evenly over one interval
+        auto offset = config.rate > 0
+            ? std::chrono::duration_cast<clock_type::duration>(std::chrono::duration<double>(double(i) / config.rate))
+            : clock_type::duration::zero();
+        c->start(endpoints, start + offset, deadline);
+    }
+
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < config.threads; ++t) {
+        threads.emplace_back([&ioc] { ioc.run(); });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    double seconds = std::chrono::duration<double>(clock_type::now() - start).count();
+
+    connection_stats total;
+    for (const auto& s : stats) {
+        total.add(s);
+    }
+    return {std::move(total), seconds};
+}
+
+void write_histogram(std::ostream& out, const diskhash::latency_histogram& h) {
+    out << "{\"mean\": " << (h.count() == 0 ? 0.0 : double(h.sum()) / double(h.count()) / 1e3)
+        << ", \"p50\": " << double(h.percentile(0.5)) / 1e3
+        << ", \"p99\": " << double(h.percentile(0.99)) / 1e3
+        << ", \"p999\": " << double(h.percentile(0.999)) / 1e3
+        << ", \"max\": " << double(h.max()) / 1e3 << "}";
+}
+
+void write_phase(std::ostream& out, const connection_stats& stats, double seconds) {
+    uint64_t requests = 0;
+    for (const auto& h : stats.corrected) {
+        requests += h.count();
+    }
+
+    out << "{\"seconds\": " << seconds
+        << ", \"requests\": " << requests
+        << ", \"throughput\": " << (seconds > 0 ? double(requests) / seconds : 0.0)
+        << ", \"status\": {\"2xx\": " << stats.status_classes[2]
+        << ", \"3xx\": " << stats.status_classes[3]
+        << ", \"4xx\": " << stats.status_classes[4]
+        << ", \"5xx\": " << stats.status_classes[5] << "}"
+        << ", \"errors\": " << stats.errors
+        << ", \"unsent\": " << stats.unsent
+        << ", \"latency_us\": {";
+
+    bool first = true;
+    for (size_t op = 0; op < OPERATIONS; ++op) {
+        if (stats.corrected[op].count() == 0) {
+            continue;
+        }
+        out << (first ? "" : ", ") << "\"" << operation_names[op] << "\": {"
+            << "\"count\": " << stats.corrected[op].count() << ", \"corrected\": ";
+        write_histogram(out, stats.corrected[op]);
+        out << ", \"uncorrected\": ";
+        write_histogram(out, stats.uncorrected[op]);
+        out << "}";
+        first = false;
+    }
+    out << "}}";
+}
+
+// retry connecting until the server accepts or seconds have passed
+void wait_ready(const tcp::resolver::results_type& endpoints, double seconds) {
+    auto deadline = clock_type::now() + std::chrono::duration_cast<clock_type::duration>(
+        std::chrono::duration<double>(seconds));
+
+    net::io_context ioc;
+    for (;;) {
+        tcp::socket socket(ioc);
+        beast::error_code ec;
+        net::connect(socket, endpoints, ec);
+        if (!ec) {
+            return;
+        }
+        if (clock_type::now() >= deadline) {
+            throw std::runtime_error("server not reachable: " + ec.message());
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+}
+
+}  // namespace
+
+// exit codes: 0 - done, 1 - error, 2 - requests failed or got 5xx responses
+int main(int argc, char* argv[]) {
+    try {
+        po::options_description desc("diskhash_loadgen options");
+        desc.add_options()
+            ("help,h", "Show help message")
+            ("host", po::value<std::string>()->default_value("127.0.0.1"), "Server address")
+            ("port,p", po::value<uint16_t>()->default_value(8080),
+                "Server port, the --binary-port of the server with --protocol binary")
+            ("protocol", po::value<std::string>()->default_value("http"),
+                "Protocol: http or binary")
+            ("connections,c", po::value<size_t>()->default_value(16), "Keep-alive connections")
+            ("threads,t", po::value<size_t>()->default_value(1), "Client threads")
+            ("pipeline", po::value<size_t>()->default_value(1),
+                "Requests in flight per connection")
+            ("duration", po::value<double>()->default_value(10), "Seconds to run")
+            ("rate,r", po::value<double>()->default_value(0),
+                "Requests per second over all connections (open loop), 0 for a closed loop")
+            ("mix", po::value<std::string>()->default_value("90:10:0"),
+                "Percentages of GET:SET:DELETE requests")
+            ("keys,k", po::value<uint64_t>()->default_value(100000), "Number of distinct keys")
+            ("distribution", po::value<std::string>()->default_value("uniform"),
+                "Key distribution: uniform or zipfian")
+            ("value-size", po::value<size_t>()->default_value(100), "Value size in bytes")
+            ("preload", "SET every key once before the measured run")
+            ("wait", po::value<double>()->default_value(0),
+                "Seconds to wait for the server to accept connections")
+            ("output,o", po::value<std::string>(), "Write the JSON report to this file");
+
+        po::variables_map vm;
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+
+        if (vm.count("help")) {
+            std::cout << "Usage: diskhash_loadgen [options]\n\n"
+                      << "Sends requests to a diskhash_server and prints a JSON report.\n\n"
+                      << desc << "\n";
+            return 0;
+        }
+
+        po::notify(vm);
+
+        loadgen_config config;
+        config.host = vm["host"].as<std::string>();
+        config.port = std::to_string(vm["port"].as<uint16_t>());
+        config.connections = std::max<size_t>(vm["connections"].as<size_t>(), 1);
+        config.threads = std::max<size_t>(vm["threads"].as<size_t>(), 1);
+        config.pipeline = std::max<size_t>(vm["pipeline"].as<size_t>(), 1);
+        config.duration = vm["duration"].as<double>();
+        config.rate = vm["rate"].as<double>();
+        config.keys = vm["keys"].as<uint64_t>();
+        config.value_size = vm["value-size"].as<size_t>();
+
+        auto mix = vm["mix"].as<std::string>();
+        unsigned delete_percent = 0;
+        char colon1 = 0, colon2 = 0;
+        std::istringstream mix_stream(mix);
+        if (!(mix_stream >> config.get_percent >> colon1 >> config.set_percent >> colon2 >> delete_percent)
+            || colon1 != ':' || colon2 != ':'
+            || config.get_percent + config.set_percent + delete_percent != 100) {
+            throw po::error("--mix must be three percentages adding up to 100, e.g. 80:15:5");
+        }
+
+        auto protocol = vm["protocol"].as<std::string>();
+        if (protocol == "binary") {
+            config.binary = true;
+        } else if (protocol != "http") {
+            throw po::error("unknown protocol " + protocol);
+        }
+
+        auto dist = vm["distribution"].as<std::string>();
+        if (dist == "zipfian") {
+            config.zipfian = true;
+        } else if (dist != "uniform") {
+            throw po::error("unknown distribution " + dist);
+        }
+
+        if (config.keys == 0) {
+            throw po::error("at least one key is needed");
+        }
+
+        if (config.rate < 0) {
+            throw po::error("--rate must not be negative");
+        }
+
+        net::io_context resolver_ioc;
+        tcp::resolver resolver(resolver_ioc);
+        auto endpoints = resolver.resolve(config.host, config.port);
+
+        if (vm["wait"].as<double>() > 0) {
+            wait_ready(endpoints, vm["wait"].as<double>());
+        }
+
+        diskhash::zipfian_generator zipfian(std::max<uint64_t>(config.keys, 2));
+
+        std::ostringstream out;
+        out << std::fixed << std::setprecision(3);
+        out << "{\"config\": {\"connections\": " << config.connections
+            << ", \"threads\": " << config.threads
+            << ", \"pipeline\": " << config.pipeline
+            << ", \"duration\": " << config.duration
+            << ", \"rate\": " << config.rate
+            << ", \"protocol\": \"" << protocol << "\""
+            << ", \"mode\": \"" << (config.rate > 0 ? "open" : "closed") << "\""
+            << ", \"mix\": \"" << mix << "\""
+            << ", \"keys\": " << config.keys
+            << ", \"distribution\": \"" << dist << "\""
+            << ", \"value_size\": " << config.value_size << "}";
+
+        uint64_t failures = 0;
+
+        if (vm.count("preload")) {
+            auto [stats, seconds] = run_phase(config, endpoints, zipfian, true, 0);
+            out << ",\n \"preload\": ";
+            write_phase(out, stats, seconds);
+            failures += stats.errors + stats.status_classes[5];
+        }
+
+        auto [stats, seconds] = run_phase(config, endpoints, zipfian, false, config.connections);
+        out << ",\n \"run\": ";
+        write_phase(out, stats, seconds);
+        out << "}\n";
+        failures += stats.errors + stats.status_classes[5];
+
+        if (vm.count("output")) {
+            std::ofstream file(vm["output"].as<std::string>());
+            file << out.str();
+            if (!file) {
+                throw std::runtime_error("cannot write " + vm["output"].as<std::string>());
+            }
+        }
+        std::cout << out.str();
+
+        return failures == 0 ? 0 : 2;
+
+    } catch (const po::error& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        std::cerr << "Use --help for usage information.\n";
+        return 1;
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        return 1;
+    }
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <random>
+
+namespace diskhash {
+
+// bijective 64-bit mixer, used to scatter popular Zipfian ranks over the key space
+inline uint64_t splitmix64(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ull;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+// Zipfian ranks in [0, n) with YCSB's constant 0.99, after Gray et al., "Quickly Generating
+// Billion-Record Synthetic Databases". Rank 0 is the most popular
+class zipfian_generator {
+public:
+    explicit zipfian_generator(uint64_t n, double theta = 0.99)
+        : n_(n), theta_(theta), alpha_(1.0 / (1.0 - theta))
+    {
+        for (uint64_t i = 1; i <= n; ++i) {
+            zetan_ += 1.0 / std::pow(double(i), theta);
+        }
+        double zeta2 = 1.0 + 1.0 / std::pow(2.0, theta);
+        eta_ = (1.0 - std::pow(2.0 / double(n), 1.0 - theta)) / (1.0 - zeta2 / zetan_);
+    }
+
+    template<class Rng>
+    uint64_t next(Rng& rng) const {
+        double u = std::uniform_real_distribution<double>(0.0, 1.0)(rng);
+        double uz = u * zetan_;
+        if (uz < 1.0) {
+            return 0;
+        }
+        if (uz < 1.0 + std::pow(0.5, theta_)) {
+            return 1;
+        }
+        return std::min<uint64_t>(n_ - 1, uint64_t(double(n_) * std::pow(eta_ * u - eta_ + 1.0, alpha_)));
+    }
+
+    // a rank scrambled over [0, n), so that popular keys are not neighbours
+    template<class Rng>
+    uint64_t next_scrambled(Rng& rng) const {
+        return splitmix64(next(rng)) % n_;
+    }
+
+private:
+    uint64_t n_;
+    double theta_;
+    double alpha_;
+    double zetan_ = 0;
+    double eta_ = 0;
+};
+
+}  // namespace diskhash
@@ -43,6 +43,31 @@ unsigned char *read(unsigned char *ptr, T &val)
 	return ptr;
 }
 
+// same as read, but does not look at bytes at or after end,
+// returns nullptr if the number is truncated or too long for T
+template<class T>
+const unsigned char *read(const unsigned char *ptr, const unsigned char *end, T &val)
+{
+	size_t offset = 0;
+	val = 0;
+
+	while(ptr != end && (*ptr & MARK_MASK))
+	{
+		if(offset >= sizeof(T) * CHAR_BIT)
+			return nullptr;
+
+		val |= T(*ptr++ & DATA_MASK) << offset;
+		offset += MARK_OFFSET;
+	}
+
+	if(ptr == end || offset >= sizeof(T) * CHAR_BIT)
+		return nullptr;
+
+	val |= T(*ptr++) << offset;
+
+	return ptr;
+}
+
 template<class T>
 size_t length(T const &val)
 {
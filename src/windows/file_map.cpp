@@ -1,13 +1,17 @@
 #include "file_map.h"
+#include <algorithm>
 #include <iostream>
+#include <stdexcept>
+#include <string>
 
 diskhash::file_map::file_map(char const *file_name, bool read_only, size_t length):
 	read_only_(read_only),
 	mapping_handle_(INVALID_HANDLE_VALUE),
 	start_(0)
 {
-	file_handle_ = CreateFile(file_name, read_only ? GENERIC_READ : GENERIC_READ | GENERIC_WRITE, 0,
-		0, OPEN_EXISTING, 0, 0);
+	// other processes may map the same file, see file_lock
+	file_handle_ = CreateFile(file_name, read_only ? GENERIC_READ : GENERIC_READ | GENERIC_WRITE,
+		FILE_SHARE_READ | FILE_SHARE_WRITE, 0, OPEN_EXISTING, 0, 0);
 
 	if(file_handle_ == INVALID_HANDLE_VALUE)
 	{
@@ -16,7 +20,8 @@ diskhash::file_map::file_map(char const *file_name, bool read_only, size_t lengt
 			throw system_error();
 		}
 
-		file_handle_ = CreateFile(file_name, GENERIC_READ | GENERIC_WRITE, 0, 0, CREATE_NEW, 0, 0);
+		file_handle_ = CreateFile(file_name, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+			0, CREATE_NEW, 0, 0);
 
 		if(file_handle_ == INVALID_HANDLE_VALUE)
 		{
@@ -24,6 +29,19 @@ diskhash::file_map::file_map(char const *file_name, bool read_only, size_t lengt
 		}
 	}
 
+	LARGE_INTEGER file_size;
+	if(!GetFileSizeEx(file_handle_, &file_size))
+	{
+		system_error last_error;
+		CloseHandle(file_handle_);
+		throw last_error;
+	}
+
+	if(length < size_t(file_size.QuadPart))
+	{
+		length = size_t(file_size.QuadPart);
+	}
+
 	try
 	{
 		resize(length);
@@ -77,7 +95,15 @@ void diskhash::file_map::resize(size_t new_length)
 
 	if(start_)
 	{
-		UnmapViewOfFile(start_);
+		// the view keeps the old mapping object alive after its handle is closed
+		if(retire_)
+		{
+			retire_(start_, length_);
+		}
+		else
+		{
+			UnmapViewOfFile(start_);
+		}
 	}
 
 	if(mapping_handle_)
@@ -88,7 +114,86 @@ void diskhash::file_map::resize(size_t new_length)
 	mapping_handle_ = mapping_handle;
 
 	start_ = start;
-	length_ = new_length;
+	std::atomic_ref<size_t>(length_).store(new_length, std::memory_order_relaxed);
+}
+
+bool diskhash::file_map::refresh()
+{
+	LARGE_INTEGER file_size;
+	if(!GetFileSizeEx(file_handle_, &file_size))
+	{
+		throw system_error();
+	}
+
+	if(size_t(file_size.QuadPart) <= length_)
+	{
+		return false;
+	}
+
+	resize(size_t(file_size.QuadPart));
+	return true;
+}
+
+void diskhash::file_map::sync()
+{
+	if(!FlushViewOfFile(start_, length_))
+	{
+		throw system_error();
+	}
+
+	if(!FlushFileBuffers(file_handle_))
+	{
+		throw system_error();
+	}
+}
+
+void diskhash::file_map::copy_to(char const *file_name) const
+{
+	HANDLE file_handle = CreateFile(file_name, GENERIC_WRITE, 0, 0, CREATE_ALWAYS, 0, 0);
+	if(file_handle == INVALID_HANDLE_VALUE)
+	{
+		throw system_error();
+	}
+
+	size_t offset = 0;
+	while(offset < length_)
+	{
+		DWORD written;
+		DWORD chunk = DWORD((std::min)(length_ - offset, size_t(1) << 30));
+		if(!WriteFile(file_handle, (char const *) start_ + offset, chunk, &written, 0))
+		{
+			system_error last_error;
+			CloseHandle(file_handle);
+			throw last_error;
+		}
+		offset += written;
+	}
+
+	if(!FlushFileBuffers(file_handle))
+	{
+		system_error last_error;
+		CloseHandle(file_handle);
+		throw last_error;
+	}
+
+	if(!CloseHandle(file_handle))
+	{
+		throw system_error();
+	}
+}
+
+void diskhash::file_map::will_need(size_t offset, size_t length) const
+{
+	WIN32_MEMORY_RANGE_ENTRY range;
+	range.VirtualAddress = (char *) start_ + offset;
+	range.NumberOfBytes = (std::min)(length, length_ - (std::min)(offset, length_));
+
+	PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+}
+
+void diskhash::file_map::unmap(void *start, size_t)
+{
+	UnmapViewOfFile(start);
 }
 
 void diskhash::file_map::close()
@@ -122,4 +227,38 @@ void diskhash::file_map::close()
 
 		file_handle_ = INVALID_HANDLE_VALUE;
 	}
-}
\ No newline at end of file
+}
+diskhash::file_lock::file_lock(char const *file_name)
+{
+	file_handle_ = CreateFile(file_name, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+		0, OPEN_ALWAYS, 0, 0);
+
+	if(file_handle_ == INVALID_HANDLE_VALUE)
+	{
+		throw system_error();
+	}
+
+	// lock a byte far past the end of the file, so that the lock never gets in the way of I/O
+	OVERLAPPED overlapped = {};
+	overlapped.OffsetHigh = 0x7fffffff;
+
+	if(!LockFileEx(file_handle_, LOCKFILE_EXCLUSIVE_LOCK | LOCKFILE_FAIL_IMMEDIATELY, 0, 1, 0, &overlapped))
+	{
+		bool held = GetLastError() == ERROR_LOCK_VIOLATION;
+		system_error last_error;
+		CloseHandle(file_handle_);
+
+		if(held)
+		{
+			throw std::runtime_error(std::string("diskhash: ") + file_name + " is open for writing in another process");
+		}
+
+		throw last_error;
+	}
+}
+
+diskhash::file_lock::~file_lock()
+{
+	// closing the handle releases the lock
+	CloseHandle(file_handle_);
+}
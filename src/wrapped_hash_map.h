@@ -45,6 +45,11 @@ public:
 		return hash_map_.remove(hash, wrap(key));
 	}
 
+	size_t size() const
+	{
+		return hash_map_.size();
+	}
+
 	size_t bytes_allocated() const
 	{
 		return hash_map_.bytes_allocated();
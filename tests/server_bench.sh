@@ -0,0 +1,43 @@
+#!/bin/sh
+# Starts diskhash_server on a temporary directory, runs diskhash_loadgen against it in closed
+# and open loop over HTTP and in closed loop over the binary protocol, and writes the reports
+# to server_bench_closed.json, server_bench_open.json and server_bench_binary.json in the
+# working directory. A second server with --io-uring repeats the binary run for
+# server_bench_binary_uring.json, on epoll if the kernel has no io_uring.
+#
+# usage: server_bench.sh <diskhash_server> <diskhash_loadgen>
+# the ports are DISKHASH_BENCH_PORT, 18571 by default, and the three after it
+set -e
+
+server=$1
+loadgen=$2
+port=${DISKHASH_BENCH_PORT:-18571}
+binary_port=$((port + 1))
+dir=$(mktemp -d)
+
+"$server" --db "$dir/db" --address 127.0.0.1 --port "$port" --binary-port "$binary_port" \
+    --shards 4 --threads 2 > "$dir/server.log" 2>&1 &
+pid=$!
+uring_pid=
+# KILL, a TERM that arrives before the server installs its handler would be lost
+trap 'kill -KILL $pid $uring_pid 2>/dev/null; wait $pid $uring_pid 2>/dev/null || true; rm -rf "$dir"' EXIT
+
+"$loadgen" --port "$port" --wait 10 --preload --keys 20000 --duration 2 \
+    --connections 16 --pipeline 4 --mix 80:15:5 --distribution zipfian \
+    --output server_bench_closed.json
+
+"$loadgen" --port "$port" --keys 20000 --duration 2 --rate 5000 \
+    --connections 16 --pipeline 2 --mix 90:10:0 \
+    --output server_bench_open.json
+
+"$loadgen" --port "$binary_port" --protocol binary --keys 20000 --duration 2 \
+    --connections 16 --pipeline 4 --mix 80:15:5 --distribution zipfian \
+    --output server_bench_binary.json
+
+"$server" --db "$dir/uring_db" --address 127.0.0.1 --port $((port + 2)) \
+    --binary-port $((port + 3)) --io-uring --shards 4 --threads 2 > "$dir/uring_server.log" 2>&1 &
+uring_pid=$!
+
+"$loadgen" --port $((port + 3)) --protocol binary --wait 10 --preload --keys 20000 --duration 2 \
+    --connections 16 --pipeline 4 --mix 80:15:5 --distribution zipfian \
+    --output server_bench_binary_uring.json
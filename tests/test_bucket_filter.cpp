@@ -0,0 +1,229 @@
+
+#include <boost/test/unit_test.hpp>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+#include "bucket_filter.h"
+#include "hash_map.h"
+#include "fnv.h"
+
+using namespace diskhash;
+
+namespace {
+
+void cleanup_hash_map_files(const char *base)
+{
+	std::string cat = std::string(base) + "cat";
+	std::string dat = std::string(base) + "dat";
+	std::string flt = std::string(base) + "flt";
+	unlink(cat.c_str());
+	unlink(dat.c_str());
+	unlink(flt.c_str());
+}
+
+struct filter_fixture {
+	filter_fixture() { cleanup_hash_map_files("test_flt"); unlink("test_bucket_filter"); }
+	~filter_fixture() { cleanup_hash_map_files("test_flt"); unlink("test_bucket_filter"); }
+};
+
+std::vector<std::string> make_keys(const char *prefix, size_t n)
+{
+	std::vector<std::string> keys;
+
+	for(size_t i = 0; i < n; i++)
+	{
+		keys.push_back(prefix + std::to_string(i));
+	}
+
+	return keys;
+}
+
+}
+
+BOOST_AUTO_TEST_SUITE(bucket_filter_suite)
+
+BOOST_FIXTURE_TEST_CASE(add_clear_fill, filter_fixture)
+{
+	bucket_filter filter("test_bucket_filter", false);
+	filter.reserve(4);
+
+	BOOST_CHECK(!filter.may_contain(1, 42));
+
+	filter.add(1, 42);
+	BOOST_CHECK(filter.may_contain(1, 42));
+	BOOST_CHECK(!filter.may_contain(2, 42));
+
+	filter.clear(1);
+	BOOST_CHECK(!filter.may_contain(1, 42));
+
+	filter.fill(2);
+	BOOST_CHECK(filter.may_contain(2, 42));
+
+	// chains without a filter yet let everything through
+	BOOST_CHECK(filter.may_contain(filter.capacity(), 42));
+
+	filter.close();
+}
+
+BOOST_FIXTURE_TEST_CASE(stale_hashes, filter_fixture)
+{
+	bucket_filter filter("test_bucket_filter", false);
+	filter.reserve(4);
+
+	for(size_t i = 1; i < bucket_filter::STALE_HASHES; i++)
+	{
+		BOOST_CHECK(!filter.remove(1));
+	}
+
+	BOOST_CHECK(filter.remove(1));
+	BOOST_CHECK(!filter.remove(2));
+
+	// refilling the filter restarts the count
+	filter.clear(1);
+	BOOST_CHECK(!filter.remove(1));
+
+	filter.close();
+}
+
+BOOST_FIXTURE_TEST_CASE(removed_keys, filter_fixture)
+{
+	std::vector<std::string> keys = make_keys("key", 0x2000);
+
+	hash_map<> map("test_flt", false, false, false, true);
+
+	for(auto const &k : keys)
+	{
+		map.get(fnv1a(k), k, k);
+	}
+
+	for(auto const &k : keys)
+	{
+		BOOST_REQUIRE(map.remove(fnv1a(k), k));
+	}
+
+	// filters keep fewer than STALE_HASHES hashes of removed records
+	auto before = map.filter_stats();
+	BOOST_REQUIRE(before);
+
+	for(auto const &k : keys)
+	{
+		BOOST_CHECK(!map.find(fnv1a(k), k));
+	}
+
+	auto after = map.filter_stats();
+	uint64_t negatives = after->negatives - before->negatives;
+
+	BOOST_CHECK_GT(negatives, keys.size() * 9 / 10);
+
+	map.close();
+}
+
+BOOST_FIXTURE_TEST_CASE(no_false_negatives, filter_fixture)
+{
+	std::vector<std::string> keys = make_keys("key", 0x4000);
+	std::vector<std::string> missing = make_keys("missing", 0x4000);
+
+	hash_map<> map("test_flt", false, false, false, true);
+
+	for(auto const &k : keys)
+	{
+		map.get(fnv1a(k), k, k);
+	}
+
+	for(size_t i = 0; i < keys.size(); i += 3)
+	{
+		BOOST_REQUIRE(map.remove(fnv1a(keys[i]), keys[i]));
+	}
+
+	for(size_t i = 0; i < keys.size(); i++)
+	{
+		auto r = map.find(fnv1a(keys[i]), keys[i]);
+		BOOST_REQUIRE_EQUAL(bool(r), i % 3 != 0);
+	}
+
+	auto before = map.filter_stats();
+	BOOST_REQUIRE(before);
+
+	for(auto const &k : missing)
+	{
+		BOOST_CHECK(!map.find(fnv1a(k), k));
+	}
+
+	auto after = map.filter_stats();
+	uint64_t negatives = after->negatives - before->negatives;
+	uint64_t false_positives = after->false_positives - before->false_positives;
+
+	BOOST_CHECK_EQUAL(negatives + false_positives, missing.size());
+	BOOST_CHECK_LT(after->false_positive_rate(), 0.1);
+
+	map.close();
+}
+
+BOOST_FIXTURE_TEST_CASE(reopen_and_rebuild, filter_fixture)
+{
+	std::vector<std::string> keys = make_keys("key", 0x2000);
+	std::vector<std::string> more_keys = make_keys("more", 0x2000);
+
+	{
+		hash_map<> map("test_flt", false, false, false, true);
+
+		for(auto const &k : keys)
+		{
+			map.get(fnv1a(k), k, k);
+		}
+
+		map.close();
+	}
+
+	{
+		// a clean close leaves the filter usable by readers
+		hash_map<> map("test_flt", true, false, false, true);
+		BOOST_REQUIRE(map.filter_stats());
+
+		for(auto const &k : keys)
+		{
+			BOOST_REQUIRE(map.find(fnv1a(k), k));
+		}
+
+		BOOST_CHECK(!map.find(fnv1a(more_keys[0]), more_keys[0]));
+		BOOST_CHECK_EQUAL(map.filter_stats()->lookups, keys.size() + 1);
+
+		map.close();
+	}
+
+	{
+		// a writer without filters leaves the filter behind
+		hash_map<> map("test_flt");
+
+		for(auto const &k : more_keys)
+		{
+			map.get(fnv1a(k), k, k);
+		}
+
+		map.close();
+	}
+
+	{
+		hash_map<> map("test_flt", true, false, false, true);
+		BOOST_CHECK(!map.filter_stats());
+		map.close();
+	}
+
+	hash_map<> map("test_flt", false, false, false, true);
+
+	for(auto const &k : keys)
+	{
+		BOOST_REQUIRE(map.find(fnv1a(k), k));
+	}
+
+	for(auto const &k : more_keys)
+	{
+		BOOST_REQUIRE(map.find(fnv1a(k), k));
+	}
+
+	map.close();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,593 @@
+
+#include <boost/test/unit_test.hpp>
+#include <stdlib.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "concurrent_hash_map.h"
+#include "fnv.h"
+
+using namespace diskhash;
+
+namespace {
+
+void cleanup_hash_map_files(const char *base)
+{
+	std::string cat = std::string(base) + "cat";
+	std::string dat = std::string(base) + "dat";
+	unlink(cat.c_str());
+	unlink(dat.c_str());
+}
+
+struct concurrent_fixture {
+	concurrent_fixture() { cleanup_hash_map_files("test_conc"); }
+	~concurrent_fixture() { cleanup_hash_map_files("test_conc"); }
+};
+
+std::string key_of(size_t i)
+{
+	return "key" + std::to_string(i);
+}
+
+std::string value_of(size_t i)
+{
+	return std::string(i % 50, 'x') + std::to_string(i);
+}
+
+// the data file has an 88 byte header, the bucket count at offset 4, and buckets of a 24 byte
+// header and the records
+const long BUCKETS_OFFSET = 88;
+const long BUCKET_BYTES = 4096;
+
+size_t read_size(FILE *f, long offset)
+{
+	size_t value = 0;
+	fseek(f, offset, SEEK_SET);
+	BOOST_REQUIRE_EQUAL(fread(&value, sizeof(value), 1, f), 1u);
+	return value;
+}
+
+void write_size(FILE *f, long offset, size_t value)
+{
+	fseek(f, offset, SEEK_SET);
+	BOOST_REQUIRE_EQUAL(fwrite(&value, sizeof(value), 1, f), 1u);
+}
+
+const size_t READERS = 3;
+const size_t WRITERS = 4;
+
+}
+
+BOOST_AUTO_TEST_SUITE(concurrent_hash_map_suite)
+
+BOOST_AUTO_TEST_CASE(epoch_retire)
+{
+	std::atomic<bool> released(false);
+
+	{
+		epoch::guard guard;
+		epoch::retire([&released]() { released = true; });
+		epoch::reclaim();
+		BOOST_CHECK(!released);
+	}
+
+	epoch::synchronize();
+	BOOST_CHECK(released);
+}
+
+BOOST_FIXTURE_TEST_CASE(readers_during_inserts, concurrent_fixture)
+{
+	const size_t N = 0x8000;
+
+	concurrent_hash_map<> map("test_conc");
+
+	std::atomic<size_t> inserted(0);
+	std::atomic<bool> done(false);
+	std::atomic<size_t> errors(0), lookups(0);
+
+	std::vector<std::thread> readers;
+	for(size_t r = 0; r < READERS; r++)
+	{
+		readers.emplace_back([&, r]() {
+			unsigned seed = unsigned(r + 1);
+			std::string value;
+
+			while(!done)
+			{
+				size_t n = inserted.load(std::memory_order_acquire);
+
+				if(n != 0)
+				{
+					size_t i = rand_r(&seed) % n;
+					std::string k = key_of(i);
+
+					if(!map.find(fnv1a(k), k, value) || value != value_of(i))
+					{
+						errors++;
+					}
+				}
+
+				std::string missing = key_of(N + rand_r(&seed) % N);
+				if(map.find(fnv1a(missing), missing, value))
+				{
+					errors++;
+				}
+
+				lookups++;
+			}
+		});
+	}
+
+	// the files only grow while inserting, and their size is read without locks
+	std::atomic<size_t> shrinks(0);
+	readers.emplace_back([&]() {
+		size_t last = 0;
+
+		while(!done)
+		{
+			size_t bytes = map.bytes_allocated();
+
+			if(bytes < last)
+			{
+				shrinks++;
+			}
+
+			last = bytes;
+		}
+	});
+
+	for(size_t i = 0; i < N; i++)
+	{
+		std::string k = key_of(i);
+		BOOST_REQUIRE(map.insert(fnv1a(k), k, value_of(i)));
+		inserted.store(i + 1, std::memory_order_release);
+	}
+
+	done = true;
+	for(auto &t : readers)
+	{
+		t.join();
+	}
+
+	BOOST_CHECK_EQUAL(errors.load(), 0u);
+	BOOST_CHECK(lookups.load() > 0);
+	BOOST_CHECK_EQUAL(shrinks.load(), 0u);
+	BOOST_CHECK_EQUAL(map.bytes_allocated(), map.exclusive([](hash_map<> const &m) { return m.bytes_allocated(); }));
+
+	std::string k = key_of(0);
+	BOOST_CHECK(!map.insert(fnv1a(k), k, "again"));
+
+	map.close();
+}
+
+BOOST_FIXTURE_TEST_CASE(readers_during_removes, concurrent_fixture)
+{
+	const size_t N = 0x4000;
+
+	concurrent_hash_map<> map("test_conc");
+
+	for(size_t i = 0; i < N; i++)
+	{
+		std::string k = key_of(i);
+		map.insert(fnv1a(k), k, value_of(i));
+	}
+
+	std::atomic<bool> done(false);
+	std::atomic<size_t> errors(0);
+
+	std::vector<std::thread> readers;
+	for(size_t r = 0; r < READERS; r++)
+	{
+		readers.emplace_back([&, r]() {
+			unsigned seed = unsigned(r + 1);
+			std::string value;
+
+			while(!done)
+			{
+				// odd keys are never removed
+				size_t i = (rand_r(&seed) % (N / 2)) * 2 + 1;
+				std::string k = key_of(i);
+
+				if(!map.find(fnv1a(k), k, value) || value != value_of(i))
+				{
+					errors++;
+				}
+			}
+		});
+	}
+
+	for(size_t i = 0; i < N; i += 2)
+	{
+		std::string k = key_of(i);
+		BOOST_REQUIRE(map.remove(fnv1a(k), k));
+	}
+
+	done = true;
+	for(auto &t : readers)
+	{
+		t.join();
+	}
+
+	BOOST_CHECK_EQUAL(errors.load(), 0u);
+
+	size_t count = map.exclusive([](hash_map<> const &m) {
+		size_t n = 0;
+		for(auto it = m.begin(); it != m.end(); ++it)
+		{
+			n++;
+		}
+		return n;
+	});
+	BOOST_CHECK_EQUAL(count, N / 2);
+
+	map.close();
+}
+
+BOOST_FIXTURE_TEST_CASE(concurrent_writers, concurrent_fixture)
+{
+	const size_t N = 0x8000;
+
+	concurrent_hash_map<> map("test_conc", false, false, true);
+
+	std::atomic<bool> done(false);
+	std::atomic<size_t> errors(0);
+
+	// keys below N / 2 are inserted before writers start and never touched again
+	for(size_t i = 0; i < N / 2; i++)
+	{
+		std::string k = key_of(i);
+		map.insert(fnv1a(k), k, value_of(i));
+	}
+
+	std::thread reader([&]() {
+		unsigned seed = 1;
+		std::string value;
+
+		while(!done)
+		{
+			size_t i = rand_r(&seed) % (N / 2);
+			std::string k = key_of(i);
+
+			if(!map.find(fnv1a(k), k, value) || value != value_of(i))
+			{
+				errors++;
+			}
+		}
+	});
+
+	// every writer inserts its own slice of keys and removes every third of them again
+	std::vector<std::thread> writers;
+	for(size_t w = 0; w < WRITERS; w++)
+	{
+		writers.emplace_back([&, w]() {
+			for(size_t i = N / 2 + w; i < 2 * N; i += WRITERS)
+			{
+				std::string k = key_of(i);
+
+				if(!map.insert(fnv1a(k), k, value_of(i)))
+				{
+					errors++;
+				}
+
+				if(i % 3 == 0 && !map.remove(fnv1a(k), k))
+				{
+					errors++;
+				}
+			}
+		});
+	}
+
+	for(auto &t : writers)
+	{
+		t.join();
+	}
+
+	done = true;
+	reader.join();
+
+	BOOST_CHECK_EQUAL(errors.load(), 0u);
+
+	std::string value;
+	size_t expected = N / 2;
+
+	for(size_t i = N / 2; i < 2 * N; i++)
+	{
+		std::string k = key_of(i);
+		bool found = map.find(fnv1a(k), k, value);
+
+		BOOST_CHECK_EQUAL(found, i % 3 != 0);
+		expected += i % 3 != 0;
+
+		if(found)
+		{
+			BOOST_CHECK_EQUAL(value, value_of(i));
+		}
+	}
+
+	size_t count = map.exclusive([](hash_map<> const &m) {
+		size_t n = 0;
+		for(size_t bucket_id = 0; bucket_id < m.buckets_count(); bucket_id++)
+		{
+			BOOST_CHECK(m.verify_bucket(bucket_id));
+		}
+		for(auto it = m.begin(); it != m.end(); ++it)
+		{
+			n++;
+		}
+		return n;
+	});
+	BOOST_CHECK_EQUAL(count, expected);
+
+	map.close();
+}
+
+BOOST_FIXTURE_TEST_CASE(batches, concurrent_fixture)
+{
+	const size_t N = 0x4000;
+	const size_t BATCH = 100;
+
+	concurrent_hash_map<> map("test_conc", false, false, true);
+
+	// batches from several writers, large enough to need splits and file growth in between
+	std::atomic<size_t> errors(0);
+	std::vector<std::thread> writers;
+	for(size_t w = 0; w < WRITERS; w++)
+	{
+		writers.emplace_back([&, w]() {
+			std::vector<std::string> keys, values;
+			std::vector<record_view> records;
+			std::vector<bool> inserted;
+
+			for(size_t first = w * BATCH; first < N; first += WRITERS * BATCH)
+			{
+				keys.clear();
+				values.clear();
+				for(size_t i = first; i < std::min(first + BATCH, N); i++)
+				{
+					keys.push_back(key_of(i));
+					values.push_back(value_of(i));
+				}
+
+				// the duplicate of the first key must not replace it
+				keys.push_back(keys.front());
+				values.push_back("duplicate");
+
+				records.clear();
+				for(size_t i = 0; i < keys.size(); i++)
+				{
+					records.push_back(record_view{fnv1a(keys[i]), keys[i], values[i]});
+				}
+
+				map.insert_many(records, inserted);
+
+				for(size_t i = 0; i + 1 < inserted.size(); i++)
+				{
+					errors += !inserted[i];
+				}
+				errors += inserted.back();
+			}
+		});
+	}
+
+	for(auto &t : writers)
+	{
+		t.join();
+	}
+
+	BOOST_CHECK_EQUAL(errors.load(), 0u);
+	BOOST_CHECK_EQUAL(map.size(), N);
+
+	std::vector<std::string> keys;
+	std::vector<record_view> requests;
+	for(size_t i = 0; i < N + 10; i++)
+	{
+		keys.push_back(key_of(i));
+	}
+	for(auto const &k : keys)
+	{
+		requests.push_back(record_view{fnv1a(k), k, {}});
+	}
+
+	std::vector<std::string> values;
+	std::vector<bool> found;
+	map.find_many(requests, values, found);
+
+	BOOST_REQUIRE_EQUAL(found.size(), N + 10);
+	for(size_t i = 0; i < N + 10; i++)
+	{
+		BOOST_CHECK_EQUAL(found[i], i < N);
+		BOOST_CHECK_EQUAL(values[i], i < N ? value_of(i) : std::string());
+	}
+
+	map.close();
+}
+
+BOOST_FIXTURE_TEST_CASE(values_in_place, concurrent_fixture)
+{
+	const size_t N = 0x4000;
+
+	concurrent_hash_map<> map("test_conc");
+
+	for(size_t i = 0; i < N; i++)
+	{
+		std::string k = key_of(i);
+		map.insert(fnv1a(k), k, value_of(i));
+	}
+
+	BOOST_CHECK(!map.with_value(fnv1a(key_of(N)), key_of(N), [](std::string_view) {
+		BOOST_ERROR("called for a missing key");
+	}));
+
+	// removing even keys compacts the buckets of odd ones, which must not move under a reader
+	std::atomic<bool> done(false);
+	std::atomic<size_t> errors(0);
+
+	std::vector<std::thread> readers;
+	for(size_t r = 0; r < READERS; r++)
+	{
+		readers.emplace_back([&, r]() {
+			unsigned seed = unsigned(r + 1);
+
+			while(!done)
+			{
+				size_t i = (rand_r(&seed) % (N / 2)) * 2 + 1;
+				std::string k = key_of(i);
+
+				bool found = map.with_value(fnv1a(k), k, [&](std::string_view value) {
+					std::string before(value);
+					std::this_thread::yield();
+					errors += before != value_of(i) || value != before;
+				});
+				errors += !found;
+			}
+		});
+	}
+
+	// and splits, which rewrite chains into new buckets and take no shared directory lock
+	std::thread inserter([&]() {
+		for(size_t i = N; i < 4 * N; i++)
+		{
+			std::string k = key_of(i);
+			errors += !map.insert(fnv1a(k), k, value_of(i));
+		}
+	});
+
+	for(size_t i = 0; i < N; i += 2)
+	{
+		std::string k = key_of(i);
+		BOOST_REQUIRE(map.remove(fnv1a(k), k));
+	}
+
+	inserter.join();
+	done = true;
+	for(auto &t : readers)
+	{
+		t.join();
+	}
+
+	BOOST_CHECK_EQUAL(errors.load(), 0u);
+
+	map.close();
+}
+
+BOOST_FIXTURE_TEST_CASE(with_value_holds_one_chain, concurrent_fixture)
+{
+	const size_t N = 0x1000;
+
+	concurrent_hash_map<> map("test_conc");
+
+	for(size_t i = 0; i < N; i++)
+	{
+		std::string k = key_of(i);
+		map.insert(fnv1a(k), k, value_of(i));
+	}
+
+	// keys outside the chain of key 0. while there are fewer buckets than chain mutexes, no
+	// other chain shares its mutex
+	std::string held = key_of(0);
+	std::vector<std::string> others;
+	map.exclusive([&](hash_map<> const &m) {
+		size_t held_bucket = m.find_bucket(fnv1a(held));
+		for(size_t i = N; others.size() < N; i++)
+		{
+			std::string k = key_of(i);
+			if(m.find_bucket(fnv1a(k)) != held_bucket)
+			{
+				others.push_back(k);
+			}
+		}
+	});
+
+	std::atomic<size_t> inserted(0);
+	std::atomic<bool> excluded(false);
+	std::thread writer;
+
+	bool found = map.with_value(fnv1a(held), held, [&](std::string_view value) {
+		// other chains split and the file grows while the chain of held is locked, and
+		// exclusive() does not wait for it
+		writer = std::thread([&]() {
+			for(auto const &k : others)
+			{
+				map.insert(fnv1a(k), k, k);
+				inserted++;
+			}
+			map.exclusive([&](hash_map<> const &) { excluded = true; });
+		});
+
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+		while(!excluded && std::chrono::steady_clock::now() < deadline)
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+
+		BOOST_CHECK_EQUAL(inserted.load(), others.size());
+		BOOST_CHECK(excluded.load());
+		BOOST_CHECK_EQUAL(value, value_of(0));
+	});
+
+	writer.join();
+	BOOST_CHECK(found);
+	BOOST_CHECK_LT(map.exclusive([](hash_map<> const &m) { return m.buckets_count(); }), size_t(1024));
+
+	map.close();
+}
+
+BOOST_FIXTURE_TEST_CASE(corrupted_buckets, concurrent_fixture)
+{
+	std::string value;
+
+	{
+		concurrent_hash_map<> map("test_conc", false, false, true);
+		BOOST_REQUIRE(map.insert(fnv1a("hello"), "hello", "world"));
+		map.close();
+	}
+
+	// a flipped record byte fails the checksum on first access, even where it leaves the
+	// records parseable
+	{
+		FILE *f = fopen("test_concdat", "r+b");
+		BOOST_REQUIRE(f);
+		size_t buckets_count = read_size(f, 4);
+		for(size_t id = 0; id < buckets_count; id++)
+		{
+			long bucket = BUCKETS_OFFSET + long(id) * BUCKET_BYTES;
+			if(read_size(f, bucket + 8) != 0)
+			{
+				fseek(f, bucket + 24, SEEK_SET);
+				int c = fgetc(f);
+				fseek(f, bucket + 24, SEEK_SET);
+				fputc(c ^ 0x40, f);
+			}
+		}
+		fclose(f);
+	}
+
+	{
+		concurrent_hash_map<> map("test_conc", true, false, true);
+		BOOST_CHECK_THROW(map.find(fnv1a("hello"), "hello", value), checksum_error);
+		map.close();
+	}
+
+	// bucket sizes past the end of the bucket make every lookup retry. with no writer to
+	// blame that is corruption too, and the reader must not spin with its epoch pinned
+	{
+		FILE *f = fopen("test_concdat", "r+b");
+		BOOST_REQUIRE(f);
+		write_size(f, BUCKETS_OFFSET + 8, 1 << 20);
+		write_size(f, BUCKETS_OFFSET + BUCKET_BYTES + 8, 1 << 20);
+		fclose(f);
+	}
+
+	concurrent_hash_map<> map("test_conc", true, false, true);
+	BOOST_CHECK_THROW(map.find(fnv1a("hello"), "hello", value), checksum_error);
+	BOOST_CHECK_THROW(map.find(fnv1a("missing"), "missing", value), checksum_error);
+
+	// close() waits for readers to leave their epochs
+	map.close();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
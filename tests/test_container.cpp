@@ -1,6 +1,7 @@
 
 #include <boost/test/unit_test.hpp>
 #include <limits.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <map>
 #include <string_view>
@@ -27,6 +28,16 @@ struct remove_operations_fixture {
 	~remove_operations_fixture() { cleanup_files("test_map_rm"); }
 };
 
+struct usage_fixture {
+	usage_fixture() { cleanup_files("test_map_usage"); }
+	~usage_fixture() { cleanup_files("test_map_usage"); }
+};
+
+struct checksum_fixture {
+	checksum_fixture() { cleanup_files("test_map_crc"); }
+	~checksum_fixture() { cleanup_files("test_map_crc"); }
+};
+
 }
 
 BOOST_AUTO_TEST_SUITE(container_suite)
@@ -131,4 +142,103 @@ BOOST_FIXTURE_TEST_CASE(remove_operations, remove_operations_fixture)
 	cont.close();
 }
 
+BOOST_FIXTURE_TEST_CASE(checksums, checksum_fixture)
+{
+	typedef container<> container_type;
+
+	size_t bucket_id, new_bucket_id;
+
+	{
+		container_type cont("test_map_crc", false, true);
+		BOOST_CHECK(cont.checksums());
+
+		bucket_id = cont.create_bucket(0);
+
+		for(unsigned key = 0; key < 1000; key++)
+		{
+			cont.create_record(bucket_id, key * 2654435761u, wrap(key), wrap(key));
+		}
+
+		BOOST_CHECK(cont.remove_record(bucket_id, 7 * 2654435761u, wrap(7u)));
+
+		new_bucket_id = cont.split(bucket_id);
+
+		for(size_t id = 0; id < cont.buckets_count(); id++)
+		{
+			BOOST_CHECK(cont.verify_bucket(id));
+		}
+
+		cont.close();
+	}
+
+	// flip one byte inside the records of the first bucket, which follows the 88 byte file
+	// header and its own 28 byte header
+	{
+		FILE *f = fopen("test_map_crc", "r+b");
+		BOOST_REQUIRE(f);
+		fseek(f, 88 + 28 + 10, SEEK_SET);
+		int c = fgetc(f);
+		fseek(f, 88 + 28 + 10, SEEK_SET);
+		fputc(c ^ 0x40, f);
+		fclose(f);
+	}
+
+	container_type cont("test_map_crc", true);
+
+	BOOST_CHECK(!cont.verify_bucket(bucket_id));
+	BOOST_CHECK(cont.verify_bucket(new_bucket_id));
+	BOOST_CHECK_THROW(cont.find_record(bucket_id, 0, wrap(0u)), checksum_error);
+	BOOST_CHECK(!cont.find_record(new_bucket_id, 0, wrap(0u)));
+
+	cont.close();
+}
+
+BOOST_FIXTURE_TEST_CASE(usage, usage_fixture)
+{
+	typedef container<> container_type;
+
+	container_type cont("test_map_usage");
+
+	size_t bucket_id = cont.create_bucket(0);
+
+	for(unsigned key = 0; key < 1000; key++)
+	{
+		cont.create_record(bucket_id, key * 2654435761u, wrap(key), wrap(uint64_t(key)));
+	}
+
+	BOOST_CHECK(cont.remove_record(bucket_id, 7 * 2654435761u, wrap(7u)));
+	BOOST_CHECK(!cont.remove_record(bucket_id, 7 * 2654435761u, wrap(7u)));
+
+	usage_stats usage = cont.usage();
+	BOOST_CHECK_EQUAL(usage.records, 999);
+	BOOST_CHECK_EQUAL(usage.key_bytes, 999 * sizeof(unsigned));
+	BOOST_CHECK_EQUAL(usage.value_bytes, 999 * sizeof(uint64_t));
+	BOOST_CHECK_EQUAL(usage.free_buckets, 0);
+
+	// the chain is longer than both halves need, the rest goes to the free list
+	size_t chain_length = cont.chain_length(bucket_id);
+	size_t new_bucket_id = cont.split(bucket_id);
+	size_t free_buckets = cont.buckets_count() - cont.chain_length(bucket_id) - cont.chain_length(new_bucket_id);
+
+	BOOST_CHECK_EQUAL(cont.usage().records, 999);
+	BOOST_CHECK_EQUAL(cont.usage().free_buckets, free_buckets);
+	BOOST_CHECK_GT(cont.buckets_count(), chain_length);
+
+	if(free_buckets != 0)
+	{
+		cont.create_bucket(0);
+		BOOST_CHECK_EQUAL(cont.usage().free_buckets, free_buckets - 1);
+	}
+
+	usage = cont.usage();
+	cont.recount();
+
+	BOOST_CHECK_EQUAL(cont.usage().records, usage.records);
+	BOOST_CHECK_EQUAL(cont.usage().key_bytes, usage.key_bytes);
+	BOOST_CHECK_EQUAL(cont.usage().value_bytes, usage.value_bytes);
+	BOOST_CHECK_EQUAL(cont.usage().free_buckets, usage.free_buckets);
+
+	cont.close();
+}
+
 BOOST_AUTO_TEST_SUITE_END()
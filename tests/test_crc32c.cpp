@@ -0,0 +1,37 @@
+
+#include <boost/test/unit_test.hpp>
+#include <stdlib.h>
+#include <string>
+
+#include "crc32c.h"
+
+using namespace diskhash;
+
+BOOST_AUTO_TEST_SUITE(crc32c_suite)
+
+BOOST_AUTO_TEST_CASE(check_value)
+{
+	std::string s = "123456789";
+	BOOST_CHECK_EQUAL(crc32c(0, s.data(), s.size()), 0xe3069283u);
+	BOOST_CHECK_EQUAL(crc32c(0, s.data(), 0), 0u);
+}
+
+BOOST_AUTO_TEST_CASE(incremental)
+{
+	std::string s;
+
+	for(int i = 0; i < 1000; i++)
+	{
+		s += char(rand());
+	}
+
+	uint32_t whole = crc32c(0, s.data(), s.size());
+
+	for(size_t split = 0; split <= s.size(); split += 37)
+	{
+		uint32_t head = crc32c(0, s.data(), split);
+		BOOST_CHECK_EQUAL(crc32c(head, s.data() + split, s.size() - split), whole);
+	}
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,121 @@
+
+#include <boost/test/unit_test.hpp>
+#include <algorithm>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "frozen_hash_map.h"
+#include "fnv.h"
+
+using namespace diskhash;
+
+namespace {
+
+void cleanup_hash_map_files(const char *base)
+{
+	std::string cat = std::string(base) + "cat";
+	std::string dat = std::string(base) + "dat";
+	std::string frz = std::string(base) + "frz";
+	unlink(cat.c_str());
+	unlink(dat.c_str());
+	unlink(frz.c_str());
+}
+
+struct frozen_fixture {
+	frozen_fixture() { cleanup_hash_map_files("test_frz"); }
+	~frozen_fixture() { cleanup_hash_map_files("test_frz"); }
+};
+
+std::string value_of(size_t i)
+{
+	// some records take most of a page
+	return std::string(i % 97 == 0 ? 3000 : i % 50, 'v') + std::to_string(i);
+}
+
+}
+
+BOOST_AUTO_TEST_SUITE(frozen_hash_map_suite)
+
+BOOST_FIXTURE_TEST_CASE(freeze_and_find, frozen_fixture)
+{
+	const size_t N = 0x8000;
+
+	uint64_t generation;
+
+	{
+		hash_map<> map("test_frz");
+
+		for(size_t i = 0; i < N; i++)
+		{
+			std::string k = "key" + std::to_string(i);
+			map.get(fnv1a(k), k, value_of(i));
+		}
+
+		freeze(map, "test_frz");
+		generation = map.write_generation();
+		map.close();
+	}
+
+	BOOST_REQUIRE(frozen_hash_map::exists("test_frz"));
+
+	frozen_hash_map frozen("test_frz");
+	BOOST_CHECK_EQUAL(frozen.size(), N);
+	BOOST_CHECK_EQUAL(frozen.source_generation(), generation);
+
+	for(size_t i = 0; i < N; i++)
+	{
+		std::string k = "key" + std::to_string(i);
+		auto r = frozen.find(fnv1a(k), k);
+		BOOST_REQUIRE(r);
+		BOOST_CHECK_EQUAL(*r, value_of(i));
+	}
+
+	for(size_t i = N; i < 2 * N; i++)
+	{
+		std::string k = "key" + std::to_string(i);
+		BOOST_CHECK(!frozen.find(fnv1a(k), k));
+	}
+
+	size_t count = 0;
+	for(auto it = frozen.begin(); it != frozen.end(); ++it)
+	{
+		auto [k, v] = *it;
+		BOOST_CHECK_EQUAL(v, value_of(std::stoul(std::string(k.substr(3)))));
+		count++;
+	}
+	BOOST_CHECK_EQUAL(count, N);
+
+	std::vector<size_t> seen(N, 0);
+	std::mutex seen_mutex;
+
+	frozen.parallel_scan(3, [&](size_t, std::vector<record_view> const &batch) {
+		std::lock_guard lock(seen_mutex);
+
+		for(auto const &rv : batch)
+		{
+			seen[std::stoul(std::string(rv.key.substr(3)))]++;
+		}
+	});
+
+	BOOST_CHECK(std::all_of(seen.begin(), seen.end(), [](size_t n) { return n == 1; }));
+
+	frozen.close();
+}
+
+BOOST_FIXTURE_TEST_CASE(empty, frozen_fixture)
+{
+	{
+		hash_map<> map("test_frz");
+		freeze(map, "test_frz");
+		map.close();
+	}
+
+	frozen_hash_map frozen("test_frz");
+	BOOST_CHECK_EQUAL(frozen.size(), 0u);
+	BOOST_CHECK(!frozen.find(fnv1a("a"), "a"));
+	BOOST_CHECK(frozen.begin() == frozen.end());
+	frozen.close();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,270 @@
+
+#include <boost/test/unit_test.hpp>
+#include <stdio.h>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "hash_map.h"
+#include "fsck.h"
+#include "fnv.h"
+
+using namespace diskhash;
+
+namespace {
+
+void cleanup_hash_map_files(const char *base)
+{
+	std::string cat = std::string(base) + "cat";
+	std::string dat = std::string(base) + "dat";
+	unlink(cat.c_str());
+	unlink(dat.c_str());
+}
+
+struct fsck_fixture {
+	fsck_fixture() { cleanup_hash_map_files("test_fsck"); }
+	~fsck_fixture() { cleanup_hash_map_files("test_fsck"); }
+};
+
+// write a diskhash 1.0 data file: the signature, the bucket count and the free list head, then
+// buckets of 4096 bytes holding prefix bits, bytes used, the next bucket and the records.
+// bucket i holds a record of every key in buckets[i], with the key three times as its value
+void write_legacy(const char *filename, std::vector<std::vector<std::string>> const &buckets, size_t first_free_bucket_id)
+{
+	const size_t header_size = sizeof(unsigned) + 2 * sizeof(size_t);
+	std::vector<unsigned char> file(header_size + buckets.size() * 4096, 0);
+
+	auto put = [&](size_t offset, size_t value) { std::memcpy(&file[offset], &value, sizeof(value)); };
+	unsigned signature = container<>::LEGACY_SIGNATURE;
+	std::memcpy(&file[0], &signature, sizeof(signature));
+	put(sizeof(unsigned), buckets.size());
+	put(sizeof(unsigned) + sizeof(size_t), first_free_bucket_id);
+
+	for(size_t bucket_id = 0; bucket_id < buckets.size(); bucket_id++)
+	{
+		size_t bucket = header_size + bucket_id * 4096;
+		unsigned char *cursor = &file[bucket + 3 * sizeof(size_t)];
+
+		for(std::string const &k: buckets[bucket_id])
+		{
+			hash_t hash = fnv1a(k);
+			std::memcpy(cursor, &hash, sizeof(hash));
+			cursor = vbe::write(cursor + sizeof(hash), k.size());
+			cursor = vbe::write(cursor, k.size() * 3);
+			for(int copy = 0; copy < 4; copy++)
+			{
+				cursor = std::copy(k.begin(), k.end(), cursor);
+			}
+		}
+
+		put(bucket, 1);
+		put(bucket + sizeof(size_t), cursor - &file[bucket + 3 * sizeof(size_t)]);
+		put(bucket + 2 * sizeof(size_t), size_t(-1));
+	}
+
+	FILE *f = fopen(filename, "wb");
+	BOOST_REQUIRE(f);
+	BOOST_REQUIRE_EQUAL(fwrite(file.data(), 1, file.size(), f), file.size());
+	fclose(f);
+}
+
+unsigned read_signature(const char *filename)
+{
+	unsigned signature = 0;
+	FILE *f = fopen(filename, "rb");
+	BOOST_REQUIRE(f);
+	BOOST_REQUIRE_EQUAL(fread(&signature, sizeof(signature), 1, f), 1u);
+	fclose(f);
+	return signature;
+}
+
+}
+
+BOOST_AUTO_TEST_SUITE(fsck_suite)
+
+BOOST_FIXTURE_TEST_CASE(rebuild, fsck_fixture)
+{
+	std::vector<std::string> keys;
+
+	{
+		hash_map<> map("test_fsck", false, false, true);
+
+		for(int i = 0; i < 0x4000; i++)
+		{
+			std::string k = "key" + std::to_string(i);
+			map.get(fnv1a(k), k, k);
+			keys.push_back(k);
+		}
+
+		for(int i = 0; i < 0x4000; i += 3)
+		{
+			map.remove(fnv1a(keys[i]), keys[i]);
+		}
+
+		BOOST_CHECK_EQUAL(map.size(), 0x4000 - (0x4000 + 2) / 3);
+		map.close();
+	}
+
+	{
+		catalogue cat("test_fsckcat", 1, true);
+		container<> cont("test_fsckdat", true);
+
+		fsck_report report = check(cat, cont);
+		BOOST_CHECK(report.ok());
+		BOOST_CHECK_EQUAL(report.buckets_count, cont.buckets_count());
+		BOOST_CHECK_EQUAL(report.records, cont.usage().records);
+
+		cat.close();
+		cont.close();
+	}
+
+	unlink("test_fsckcat");
+
+	{
+		container<> cont("test_fsckdat");
+		rebuild_catalogue(cont, "test_fsckcat");
+
+		catalogue cat("test_fsckcat", 1, true);
+		BOOST_CHECK(check(cat, cont).ok());
+
+		cat.close();
+		cont.close();
+	}
+
+	hash_map<> map("test_fsck", true);
+
+	for(int i = 0; i < 0x4000; i++)
+	{
+		auto r = map.find(fnv1a(keys[i]), keys[i]);
+		BOOST_CHECK_EQUAL(bool(r), i % 3 != 0);
+	}
+
+	map.close();
+}
+
+BOOST_FIXTURE_TEST_CASE(upgrade, fsck_fixture)
+{
+	// bucket 2 is free and its stale records must not come back
+	std::vector<std::vector<std::string>> buckets(3);
+	std::vector<std::string> keys;
+
+	for(size_t bucket_id = 0; bucket_id < 3; bucket_id++)
+	{
+		for(int i = 0; i < 20; i++)
+		{
+			buckets[bucket_id].push_back("key" + std::to_string(bucket_id) + "_" + std::to_string(i));
+			keys.push_back(buckets[bucket_id].back());
+		}
+	}
+
+	write_legacy("test_fsckdat", buckets, 2);
+
+	BOOST_CHECK_EQUAL(upgrade_legacy("test_fsck", true), 40u);
+
+	{
+		catalogue cat("test_fsckcat", 1, true);
+		container<> cont("test_fsckdat", true);
+		BOOST_CHECK(cont.checksums());
+		BOOST_CHECK(check(cat, cont).ok());
+		cat.close();
+		cont.close();
+	}
+
+	hash_map<> map("test_fsck", true);
+	BOOST_CHECK_EQUAL(map.size(), 40u);
+
+	for(size_t i = 0; i < keys.size(); i++)
+	{
+		auto r = map.find(fnv1a(keys[i]), keys[i]);
+		BOOST_CHECK_EQUAL(bool(r), i < 40);
+		if(r)
+		{
+			BOOST_CHECK_EQUAL(*r, keys[i] + keys[i] + keys[i]);
+		}
+	}
+
+	map.close();
+
+	// nothing left to upgrade
+	BOOST_CHECK_THROW(upgrade_legacy("test_fsck", false), std::runtime_error);
+}
+
+BOOST_FIXTURE_TEST_CASE(legacy_in_place, fsck_fixture)
+{
+	// two chains split on the top hash bit, the way diskhash 1.0 starts a map
+	std::vector<std::vector<std::string>> buckets(2);
+	std::vector<std::string> keys;
+
+	for(int i = 0; i < 40; i++)
+	{
+		std::string k = "key" + std::to_string(i);
+		buckets[fnv1a(k) >> (HASH_BITS - 1)].push_back(k);
+		keys.push_back(k);
+	}
+
+	write_legacy("test_fsckdat", buckets, size_t(-1));
+
+	{
+		container<> cont("test_fsckdat");
+		BOOST_CHECK(cont.legacy());
+		BOOST_CHECK(!cont.checksums());
+		BOOST_CHECK_EQUAL(cont.usage().records, 40u);
+		BOOST_CHECK_EQUAL(rebuild_catalogue(cont, "test_fsckcat"), 0u);
+		cont.close();
+	}
+
+	{
+		hash_map<> map("test_fsck");
+		BOOST_CHECK_EQUAL(map.size(), 40u);
+
+		for(size_t i = 0; i < keys.size(); i++)
+		{
+			auto r = map.find(fnv1a(keys[i]), keys[i]);
+			BOOST_REQUIRE(r);
+			BOOST_CHECK_EQUAL(*r, keys[i] + keys[i] + keys[i]);
+		}
+
+		// enough to split buckets and grow the file
+		for(int i = 40; i < 0x4000; i++)
+		{
+			std::string k = "key" + std::to_string(i);
+			map.get(fnv1a(k), k, k + k + k);
+			keys.push_back(k);
+		}
+
+		for(size_t i = 0; i < keys.size(); i += 3)
+		{
+			BOOST_CHECK(map.remove(fnv1a(keys[i]), keys[i]));
+		}
+
+		map.close();
+	}
+
+	// still a 1.0 file, which diskhash 1.0 could go on using
+	BOOST_CHECK_EQUAL(read_signature("test_fsckdat"), unsigned(container<>::LEGACY_SIGNATURE));
+
+	{
+		catalogue cat("test_fsckcat", 1, true);
+		container<> cont("test_fsckdat", true);
+		BOOST_CHECK(cont.legacy());
+		BOOST_CHECK(check(cat, cont).ok());
+		cat.close();
+		cont.close();
+	}
+
+	hash_map<> map("test_fsck", true);
+	BOOST_CHECK_EQUAL(map.size(), keys.size() - (keys.size() + 2) / 3);
+
+	for(size_t i = 0; i < keys.size(); i++)
+	{
+		auto r = map.find(fnv1a(keys[i]), keys[i]);
+		BOOST_CHECK_EQUAL(bool(r), i % 3 != 0);
+	}
+
+	map.close();
+
+	BOOST_CHECK_EQUAL(upgrade_legacy("test_fsck", false), keys.size() - (keys.size() + 2) / 3);
+	BOOST_CHECK(read_signature("test_fsckdat") != container<>::LEGACY_SIGNATURE);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
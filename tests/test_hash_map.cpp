@@ -4,10 +4,15 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <algorithm>
 #include <map>
+#include <numeric>
 #include <vector>
 
 #include "wrapped_hash_map.h"
+#include "fnv.h"
 
 using namespace diskhash;
 
@@ -36,6 +41,11 @@ struct iterate_fixture {
 	~iterate_fixture() { cleanup_hash_map_files("test_iter"); }
 };
 
+struct shared_fixture {
+	shared_fixture() { cleanup_hash_map_files("test_shared"); }
+	~shared_fixture() { cleanup_hash_map_files("test_shared"); }
+};
+
 struct perf_fixture {
 	perf_fixture() { cleanup_hash_map_files("test"); }
 	~perf_fixture() { cleanup_hash_map_files("test"); }
@@ -127,12 +137,16 @@ BOOST_FIXTURE_TEST_CASE(remove, remove_fixture)
 		keep = !keep;
 	}
 
+	BOOST_CHECK_EQUAL(map1.size(), map2.size());
+
 	for(std::map<std::string, unsigned>::const_iterator it = to_remove.begin(); it != to_remove.end(); it++)
 	{
 		BOOST_CHECK(map1.remove(it->first));
 		map2.erase(it->first);
 	}
 
+	BOOST_CHECK_EQUAL(map1.size(), map2.size());
+
 	for(std::map<std::string, unsigned>::const_iterator it = map2.begin(); it != map2.end(); it++)
 	{
 		BOOST_CHECK_EQUAL(map1[it->first], it->second);
@@ -309,6 +323,521 @@ BOOST_FIXTURE_TEST_CASE(iterate_with_mixed_mutations, iterate_fixture)
 	map1.close();
 }
 
+BOOST_FIXTURE_TEST_CASE(scan, iterate_fixture)
+{
+	hash_map<> map("test_iter");
+	std::map<std::string, std::string> expected;
+
+	hash_map<>::cursor empty = map.scan();
+	std::vector<record_view> batch;
+	BOOST_CHECK(!empty.next(batch));
+
+	for(int i = 0; i < 0x4000; i++)
+	{
+		std::string k = "key" + std::to_string(i);
+		map.get(fnv1a(k), k, std::to_string(i));
+		expected[k] = std::to_string(i);
+	}
+
+	for(int i = 0; i < 0x4000; i += 2)
+	{
+		std::string k = "key" + std::to_string(i);
+		map.remove(fnv1a(k), k);
+		expected.erase(k);
+	}
+
+	std::map<std::string, std::string> collected;
+	size_t batches = 0;
+
+	map.scan([&](std::vector<record_view> const &records) {
+		BOOST_REQUIRE(!records.empty());
+		batches++;
+
+		for(auto const &rv : records)
+		{
+			BOOST_CHECK_EQUAL(rv.hash, fnv1a(std::string(rv.key)));
+			BOOST_CHECK(collected.emplace(rv.key, rv.value).second);
+		}
+	});
+
+	BOOST_CHECK(collected == expected);
+	BOOST_CHECK_LE(batches, map.buckets_count());
+
+	// the iterator visits the same records in the same order
+	auto it = map.begin();
+	hash_map<>::cursor c = map.scan();
+
+	while(c.next(batch))
+	{
+		for(auto const &rv : batch)
+		{
+			BOOST_REQUIRE(it != map.end());
+			BOOST_CHECK((*it).first == rv.key);
+			BOOST_CHECK_EQUAL(it.hash(), rv.hash);
+			++it;
+		}
+	}
+
+	BOOST_CHECK(it == map.end());
+
+	map.close();
+}
+
+BOOST_FIXTURE_TEST_CASE(resumed_scan, iterate_fixture)
+{
+	const int N = 0x4000;
+
+	hash_map<> map("test_iter");
+
+	for(int i = 0; i < N; i++)
+	{
+		std::string k = "key" + std::to_string(i);
+		map.get(fnv1a(k), k, k);
+	}
+
+	// pages of whole chains, with enough inserts between them to split buckets and the
+	// catalogue: every key present throughout is seen exactly once
+	std::map<std::string, int> seen;
+	std::vector<record_view> batch;
+	uint64_t position = 0;
+	int inserted = N;
+	size_t catalogue_size = map.catalogue_size();
+
+	while(position < (uint64_t(1) << HASH_BITS))
+	{
+		hash_map<>::cursor c = map.scan_from(position);
+		size_t page = 0;
+
+		while(c.next(batch))
+		{
+			for(auto const &rv : batch)
+			{
+				seen[std::string(rv.key)]++;
+			}
+			page += batch.size();
+
+			if(page >= 100 && c.at_chain_end())
+			{
+				break;
+			}
+		}
+
+		BOOST_REQUIRE(c.at_chain_end());
+		uint64_t next = c.position();
+		BOOST_REQUIRE(next > position);
+		position = next;
+
+		for(int i = 0; i < 200; i++, inserted++)
+		{
+			std::string k = "key" + std::to_string(inserted);
+			map.get(fnv1a(k), k, k);
+		}
+	}
+
+	BOOST_CHECK_GT(map.catalogue_size(), catalogue_size);
+	for(int i = 0; i < N; i++)
+	{
+		BOOST_CHECK_EQUAL(seen["key" + std::to_string(i)], 1);
+	}
+	for(auto const &[k, count] : seen)
+	{
+		BOOST_CHECK_EQUAL(count, 1);
+	}
+
+	map.close();
+}
+
+BOOST_FIXTURE_TEST_CASE(parallel_scan, iterate_fixture)
+{
+	const size_t N = 0x4000;
+
+	hash_map<> map("test_iter");
+
+	for(size_t i = 0; i < N; i++)
+	{
+		std::string k = std::to_string(i);
+		map.get(fnv1a(k), k, k);
+	}
+
+	// more ranges than catalogue slots leaves some of them empty
+	for(size_t threads : {size_t(1), size_t(4), size_t(7), map.catalogue_size() + 3})
+	{
+		std::vector<std::vector<size_t>> ranges(threads);
+
+		map.parallel_scan(threads, [&](size_t range, std::vector<record_view> const &batch) {
+			for(auto const &rv : batch)
+			{
+				ranges[range].push_back(std::stoul(std::string(rv.key)));
+			}
+		});
+
+		std::vector<size_t> seen(N, 0);
+
+		for(auto const &range : ranges)
+		{
+			for(size_t i : range)
+			{
+				seen[i]++;
+			}
+		}
+
+		BOOST_CHECK(std::all_of(seen.begin(), seen.end(), [](size_t n) { return n == 1; }));
+	}
+
+	BOOST_CHECK_THROW(map.parallel_scan(4, [](size_t, std::vector<record_view> const &) {
+		throw std::runtime_error("visitor failed");
+	}), std::runtime_error);
+
+	map.close();
+}
+
+BOOST_FIXTURE_TEST_CASE(structure, iterate_fixture)
+{
+	const size_t N = 0x4000;
+
+	hash_map<> map("test_iter");
+
+	for(size_t i = 0; i < N; i++)
+	{
+		std::string k = "key" + std::to_string(i);
+		map.get(fnv1a(k), k, k);
+	}
+
+	for(size_t i = 0; i < N; i += 2)
+	{
+		std::string k = "key" + std::to_string(i);
+		map.remove(fnv1a(k), k);
+	}
+
+	structure_stats stats = map.structure_stats();
+	size_t buckets_in_chains = stats.buckets - stats.free_buckets;
+
+	size_t chained = 0;
+	for(size_t length = 0; length < stats.chain_lengths.size(); length++)
+	{
+		chained += length * stats.chain_lengths[length];
+	}
+
+	// keys and values are short enough for one byte length prefixes
+	size_t bytes_used = 0;
+	map.scan([&bytes_used](std::vector<record_view> const &records) {
+		for(auto const &rv : records)
+		{
+			bytes_used += sizeof(hash_t) + 2 + rv.key.size() + rv.value.size();
+		}
+	});
+
+	BOOST_CHECK_EQUAL(stats.buckets, map.buckets_count());
+	BOOST_CHECK_EQUAL(chained, buckets_in_chains);
+	BOOST_CHECK_EQUAL(std::accumulate(stats.bucket_fill.begin(), stats.bucket_fill.end(), size_t(0)), buckets_in_chains);
+	BOOST_CHECK_EQUAL(std::accumulate(stats.local_depths.begin(), stats.local_depths.end(), size_t(0)), stats.chains);
+	BOOST_CHECK_EQUAL(stats.bytes_used, bytes_used);
+	BOOST_CHECK_LE(stats.median_local_depth(), stats.global_depth);
+
+	BOOST_CHECK_GT(stats.splits, 0);
+	BOOST_CHECK_GT(stats.bytes_moved, 0);
+	BOOST_CHECK_GT(stats.file_resizes, 0);
+	BOOST_CHECK_EQUAL(stats.catalogue_doublings, stats.global_depth - 1);
+
+	structure_stats twice = stats;
+	twice.merge(stats);
+
+	BOOST_CHECK_EQUAL(twice.chains, 2 * stats.chains);
+	BOOST_CHECK_EQUAL(twice.global_depth, stats.global_depth);
+	BOOST_CHECK_EQUAL(twice.median_local_depth(), stats.median_local_depth());
+
+	map.close();
+}
+
+BOOST_FIXTURE_TEST_CASE(single_writer, shared_fixture)
+{
+	hash_map<> writer("test_shared");
+	writer.get(fnv1a("a"), "a", "1");
+
+	BOOST_CHECK_THROW(hash_map<>("test_shared"), std::runtime_error);
+
+	// readers do not take the lock and see records added after they opened the map
+	hash_map<> reader("test_shared", true);
+	BOOST_CHECK(reader.find(fnv1a("a"), "a") == std::string_view("1"));
+
+	for(int i = 0; i < 0x4000; i++)
+	{
+		std::string k = std::to_string(i);
+		writer.get(fnv1a(k), k, k);
+	}
+
+	for(int i = 0; i < 0x4000; i++)
+	{
+		std::string k = std::to_string(i);
+		BOOST_CHECK(reader.find(fnv1a(k), k) == std::string_view(k));
+	}
+
+	reader.close();
+	writer.close();
+
+	// the lock goes away with the writer
+	hash_map<> writer2("test_shared");
+	writer2.close();
+}
+
+BOOST_FIXTURE_TEST_CASE(reader_process, shared_fixture)
+{
+	const int N = 0x10000;
+
+	{
+		hash_map<> map("test_shared");
+		map.close();
+	}
+
+	int pipe_fds[2];
+	BOOST_REQUIRE(pipe(pipe_fds) == 0);
+
+	pid_t pid = fork();
+	BOOST_REQUIRE(pid >= 0);
+
+	if(pid == 0)
+	{
+		// writer process, reports every inserted key through the pipe in batches
+		close(pipe_fds[0]);
+
+		hash_map<> map("test_shared");
+
+		for(int i = 0; i < N; i++)
+		{
+			std::string k = std::to_string(i);
+			map.get(fnv1a(k), k, k);
+
+			if(i % 256 == 255 && write(pipe_fds[1], &i, sizeof(i)) != sizeof(i))
+			{
+				_exit(1);
+			}
+		}
+
+		map.close();
+		_exit(0);
+	}
+
+	close(pipe_fds[1]);
+
+	hash_map<> map("test_shared", true);
+
+	int inserted = -1;
+	size_t errors = 0;
+
+	for(int last; read(pipe_fds[0], &last, sizeof(last)) == sizeof(last); )
+	{
+		inserted = last;
+
+		// everything reported must be there, anything else may or may not be
+		for(int i = 0; i <= inserted; i += 7)
+		{
+			std::string k = std::to_string(i);
+			auto r = map.find(fnv1a(k), k);
+
+			if(!r || *r != k)
+			{
+				errors++;
+			}
+		}
+	}
+
+	close(pipe_fds[0]);
+
+	int status;
+	BOOST_REQUIRE(waitpid(pid, &status, 0) == pid);
+	BOOST_CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	BOOST_CHECK_EQUAL(inserted, N - 1);
+	BOOST_CHECK_EQUAL(errors, 0u);
+
+	for(int i = 0; i < N; i++)
+	{
+		std::string k = std::to_string(i);
+		BOOST_CHECK(map.find(fnv1a(k), k) == std::string_view(k));
+	}
+
+	map.close();
+}
+
+BOOST_FIXTURE_TEST_CASE(reader_process_scan, shared_fixture)
+{
+	const size_t BASE = 0x1000, N = 0x20000;
+
+	{
+		hash_map<> map("test_shared");
+
+		for(size_t i = 0; i < BASE; i++)
+		{
+			std::string k = std::to_string(i);
+			map.get(fnv1a(k), k, k);
+		}
+
+		map.close();
+	}
+
+	pid_t pid = fork();
+	BOOST_REQUIRE(pid >= 0);
+
+	if(pid == 0)
+	{
+		// writer process, grows the files and splits the catalogue under the scans
+		hash_map<> map("test_shared");
+
+		for(size_t i = BASE; i < N; i++)
+		{
+			std::string k = std::to_string(i);
+			map.get(fnv1a(k), k, k);
+		}
+
+		map.close();
+		_exit(0);
+	}
+
+	hash_map<> map("test_shared", true);
+
+	// records the writer has not moved are seen at least once, those it moves may be seen
+	// twice, and no record is ever seen torn
+	auto check = [&](std::vector<size_t> const &seen, size_t &errors, bool done) {
+		for(size_t i = 0; i < N; i++)
+		{
+			if(done ? seen[i] != 1 : i < BASE && seen[i] == 0)
+			{
+				errors++;
+			}
+		}
+	};
+
+	auto count = [&](std::vector<size_t> &seen, size_t &errors, record_view const &rv) {
+		size_t i = 0;
+
+		for(char c : rv.key)
+		{
+			i = c >= '0' && c <= '9' ? 10 * i + (c - '0') : N;
+		}
+
+		if(rv.key.empty() || i >= N || rv.value != rv.key)
+		{
+			errors++;
+			return;
+		}
+
+		seen[i]++;
+	};
+
+	size_t scan_errors = 0, parallel_errors = 0, iterator_errors = 0, modified = 0;
+
+	for(bool done = false; !done; )
+	{
+		int status;
+		pid_t exited = waitpid(pid, &status, WNOHANG);
+		BOOST_REQUIRE(exited >= 0);
+
+		if(exited == pid)
+		{
+			BOOST_CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+			done = true;
+		}
+
+		std::vector<size_t> seen(N, 0);
+		map.scan([&](std::vector<record_view> const &batch) {
+			for(auto const &rv : batch)
+			{
+				count(seen, scan_errors, rv);
+			}
+		});
+		check(seen, scan_errors, done);
+
+		std::vector<std::vector<size_t>> ranges(4, std::vector<size_t>(N, 0));
+		map.parallel_scan(4, [&](size_t range, std::vector<record_view> const &batch) {
+			for(auto const &rv : batch)
+			{
+				size_t errors = 0;
+				count(ranges[range], errors, rv);
+
+				if(errors)
+				{
+					ranges[range][0] = N;
+				}
+			}
+		});
+
+		seen.assign(N, 0);
+		for(auto const &range : ranges)
+		{
+			for(size_t i = 0; i < N; i++)
+			{
+				seen[i] += range[i];
+			}
+		}
+		check(seen, parallel_errors, done);
+
+		// iterators yield views into the mapping and throw once the writer has changed it, so
+		// only an iteration that completes is checked
+		try
+		{
+			size_t errors = 0;
+
+			seen.assign(N, 0);
+			for(auto it = map.begin(); it != map.end(); ++it)
+			{
+				count(seen, errors, record_view{it.hash(), (*it).first, (*it).second});
+			}
+
+			check(seen, errors, done);
+			iterator_errors += errors;
+		}
+		catch(std::runtime_error const &)
+		{
+			BOOST_REQUIRE(!done);
+			modified++;
+		}
+	}
+
+	BOOST_CHECK_EQUAL(scan_errors, 0u);
+	BOOST_CHECK_EQUAL(parallel_errors, 0u);
+	BOOST_CHECK_EQUAL(iterator_errors, 0u);
+	BOOST_TEST_MESSAGE("iterations interrupted by the writer: " << modified);
+
+	map.close();
+}
+
+BOOST_FIXTURE_TEST_CASE(corrupted_chain, shared_fixture)
+{
+	size_t buckets_count;
+
+	{
+		hash_map<> map("test_shared");
+		map.get(fnv1a("a"), "a", "1");
+		buckets_count = map.buckets_count();
+		map.close();
+	}
+
+	// every bucket links to a bucket past the end of the file
+	FILE *f = fopen("test_shareddat", "r+b");
+	BOOST_REQUIRE(f);
+
+	for(size_t id = 0; id < buckets_count; id++)
+	{
+		size_t next_bucket_id = 1 << 20;
+		BOOST_REQUIRE(fseek(f, 88 + id * 4096 + 2 * sizeof(size_t), SEEK_SET) == 0);
+		BOOST_REQUIRE(fwrite(&next_bucket_id, sizeof(next_bucket_id), 1, f) == 1);
+	}
+
+	fclose(f);
+
+	for(bool read_only : {false, true})
+	{
+		hash_map<> map("test_shared", read_only);
+		std::vector<record_view> batch;
+
+		BOOST_CHECK_THROW({ auto c = map.scan(); while(c.next(batch)); }, checksum_error);
+		BOOST_CHECK_THROW(map.parallel_scan(2, [](size_t, std::vector<record_view> const &) {}), checksum_error);
+		BOOST_CHECK_THROW({ for(auto it = map.begin(); it != map.end(); ++it); }, checksum_error);
+
+		map.close();
+	}
+}
+
 BOOST_AUTO_TEST_SUITE_END()
 
 // Performance test in separate suite, disabled by default
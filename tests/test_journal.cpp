@@ -0,0 +1,164 @@
+
+#include <boost/test/unit_test.hpp>
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "hash_map.h"
+#include "fnv.h"
+
+using namespace diskhash;
+
+namespace {
+
+void cleanup_hash_map_files(const char *base)
+{
+	std::string cat = std::string(base) + "cat";
+	std::string dat = std::string(base) + "dat";
+	std::string jnl = std::string(base) + "jnl";
+	unlink(cat.c_str());
+	unlink(dat.c_str());
+	unlink(jnl.c_str());
+}
+
+struct journal_fixture {
+	journal_fixture() { cleanup_hash_map_files("test_jnl"); }
+	~journal_fixture() { cleanup_hash_map_files("test_jnl"); }
+};
+
+std::vector<std::string> make_keys(size_t n)
+{
+	std::vector<std::string> keys;
+
+	for(size_t i = 0; i < n; i++)
+	{
+		keys.push_back("key" + std::to_string(i));
+	}
+
+	return keys;
+}
+
+}
+
+BOOST_AUTO_TEST_SUITE(journal_suite)
+
+BOOST_FIXTURE_TEST_CASE(durable_inserts, journal_fixture)
+{
+	std::vector<std::string> keys = make_keys(0x4000);
+
+	{
+		hash_map<> map("test_jnl", false, true);
+
+		for(auto const &k : keys)
+		{
+			map.get(fnv1a(k), k, k);
+		}
+
+		map.close();
+	}
+
+	// every split has been committed, nothing is left to replay
+	BOOST_CHECK(!journal::recover("test_jnljnl", {"test_jnlcat", "test_jnldat"}));
+
+	hash_map<> map("test_jnl", true);
+
+	for(auto const &k : keys)
+	{
+		auto r = map.find(fnv1a(k), k);
+		BOOST_REQUIRE(r);
+		BOOST_CHECK_EQUAL(*r, k);
+	}
+
+	map.close();
+}
+
+BOOST_FIXTURE_TEST_CASE(interrupted_split, journal_fixture)
+{
+	std::vector<std::string> keys = make_keys(0x1000);
+
+	{
+		hash_map<> map("test_jnl", false, true);
+
+		for(auto const &k : keys)
+		{
+			map.get(fnv1a(k), k, k);
+		}
+
+		map.close();
+	}
+
+	// replay what a durable split does up to the point where records have been moved
+	// but the catalogue does not point at the new bucket yet, then "crash"
+	{
+		catalogue cat("test_jnlcat", 1);
+		container<> cont("test_jnldat");
+		journal j("test_jnljnl");
+
+		size_t bucket_id = cat.find(fnv1a(keys[0]));
+
+		cont.journal_split(j, 1, bucket_id);
+		j.commit();
+
+		size_t new_bucket_id = cont.split(bucket_id);
+		BOOST_CHECK(cont.bucket_bytes_used(new_bucket_id) > 0);
+
+		j.close();
+		cont.close();
+		cat.close();
+	}
+
+	hash_map<> map("test_jnl");
+
+	for(auto const &k : keys)
+	{
+		auto r = map.find(fnv1a(k), k);
+		BOOST_REQUIRE(r);
+		BOOST_CHECK_EQUAL(*r, k);
+	}
+
+	map.close();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+// compares insert throughput of durable and non-durable maps, disabled by default
+BOOST_AUTO_TEST_SUITE(journal_perf, * boost::unit_test::disabled())
+
+namespace {
+
+double insert_seconds(std::vector<std::string> const &keys, bool durable)
+{
+	cleanup_hash_map_files("test_jnl");
+
+	auto start = std::chrono::steady_clock::now();
+
+	hash_map<> map("test_jnl", false, durable);
+
+	for(auto const &k : keys)
+	{
+		map.get(fnv1a(k), k, k);
+	}
+
+	map.close();
+
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+}
+
+BOOST_FIXTURE_TEST_CASE(performance, journal_fixture)
+{
+	for(size_t n = 4096; n <= 1024 * 1024; n <<= 2)
+	{
+		std::vector<std::string> keys = make_keys(n);
+
+		double plain = insert_seconds(keys, false);
+		double durable = insert_seconds(keys, true);
+
+		printf("%lu\t%.4f\t%.4f\t%.2f\n", n, plain, durable, durable / plain);
+	}
+}
+
+BOOST_AUTO_TEST_SUITE_END()
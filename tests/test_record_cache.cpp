@@ -0,0 +1,164 @@
+
+#include <boost/test/unit_test.hpp>
+#include <optional>
+#include <string>
+
+#include "server/record_cache.h"
+
+using namespace diskhash;
+
+namespace {
+
+// result of a lookup through the cache, the way http_server does one against a map that
+// holds stored
+std::optional<std::string> lookup(record_cache &cache, std::string const &key, std::optional<std::string> const &stored)
+{
+	std::optional<std::string> value;
+	uint64_t token;
+
+	if(cache.find(0, key, value, token))
+	{
+		return value;
+	}
+
+	cache.insert(0, key, stored, token);
+	return stored;
+}
+
+}
+
+BOOST_AUTO_TEST_SUITE(record_cache_suite)
+
+BOOST_AUTO_TEST_CASE(hits_and_misses)
+{
+	record_cache cache(1, 1 << 20);
+
+	BOOST_CHECK_EQUAL(*lookup(cache, "key", std::string("value")), "value");
+	BOOST_CHECK_EQUAL(*lookup(cache, "key", std::nullopt), "value");
+
+	// a miss of the map is cached as an entry without a value
+	BOOST_CHECK(!lookup(cache, "missing", std::nullopt));
+	BOOST_CHECK(!lookup(cache, "missing", std::string("value")));
+
+	auto stats = cache.get_stats();
+	BOOST_CHECK_EQUAL(stats.misses, 2u);
+	BOOST_CHECK_EQUAL(stats.hits, 2u);
+	BOOST_CHECK_EQUAL(stats.negative_hits, 1u);
+	BOOST_CHECK_EQUAL(stats.entries, 2u);
+}
+
+BOOST_AUTO_TEST_CASE(invalidate)
+{
+	record_cache cache(1, 1 << 20);
+
+	lookup(cache, "key", std::string("old"));
+	lookup(cache, "missing", std::nullopt);
+
+	cache.invalidate(0, "key");
+	cache.invalidate(0, "missing");
+
+	BOOST_CHECK_EQUAL(*lookup(cache, "key", std::string("new")), "new");
+	BOOST_CHECK_EQUAL(*lookup(cache, "key", std::nullopt), "new");
+	BOOST_CHECK_EQUAL(*lookup(cache, "missing", std::string("set")), "set");
+}
+
+BOOST_AUTO_TEST_CASE(set_after_get)
+{
+	record_cache cache(1, 1 << 20);
+	std::optional<std::string> value;
+	uint64_t token;
+
+	// a GET reads the old value from the map, then a SET replaces it and invalidates the key
+	// before the GET caches what it read
+	BOOST_REQUIRE(!cache.find(0, "key", value, token));
+	cache.invalidate(0, "key");
+	cache.insert(0, "key", std::string("old"), token);
+
+	BOOST_CHECK_EQUAL(*lookup(cache, "key", std::string("new")), "new");
+
+	// the same for a GET that found nothing
+	BOOST_REQUIRE(!cache.find(0, "created", value, token));
+	cache.invalidate(0, "created");
+	cache.insert(0, "created", std::nullopt, token);
+
+	BOOST_CHECK_EQUAL(*lookup(cache, "created", std::string("new")), "new");
+}
+
+BOOST_AUTO_TEST_CASE(writes_of_other_keys)
+{
+	record_cache cache(1, 1 << 20);
+	size_t cached = 0;
+
+	// versions are striped, so a write of another key drops a concurrent insert only if both
+	// keys share a stripe
+	for(size_t i = 0; i < 100; i++)
+	{
+		std::string key = "key" + std::to_string(i);
+		std::optional<std::string> value;
+		uint64_t token;
+
+		BOOST_REQUIRE(!cache.find(0, key, value, token));
+		cache.invalidate(0, "other" + std::to_string(i));
+		cache.insert(0, key, std::string("value"), token);
+
+		if(cache.find(0, key, value, token))
+		{
+			BOOST_CHECK_EQUAL(*value, "value");
+			cached++;
+		}
+	}
+
+	BOOST_CHECK_GE(cached, 90u);
+}
+
+BOOST_AUTO_TEST_CASE(byte_budget)
+{
+	const size_t capacity = 64 * 1024;
+	record_cache cache(4, capacity);
+
+	for(size_t i = 0; i < 10000; i++)
+	{
+		std::string key = "key" + std::to_string(i);
+		std::optional<std::string> value;
+		uint64_t token;
+
+		if(!cache.find(i % 4, key, value, token))
+		{
+			cache.insert(i % 4, key, std::string(100, 'x'), token);
+		}
+
+		BOOST_REQUIRE_LE(cache.get_stats().bytes, capacity);
+	}
+
+	auto stats = cache.get_stats();
+	BOOST_CHECK_GT(stats.evictions, 0u);
+	BOOST_CHECK_GT(stats.entries, 0u);
+	BOOST_CHECK_EQUAL(stats.entries + stats.evictions, 10000u);
+
+	// entries larger than a segment are not cached
+	std::optional<std::string> value;
+	uint64_t token;
+	BOOST_REQUIRE(!cache.find(0, "large", value, token));
+	cache.insert(0, "large", std::string(capacity, 'x'), token);
+	BOOST_CHECK(!cache.find(0, "large", value, token));
+}
+
+BOOST_AUTO_TEST_CASE(clock_keeps_referenced_entries)
+{
+	// room for a few entries only
+	record_cache cache(1, 4 * (96 + 16));
+
+	lookup(cache, "hot", std::string("value"));
+
+	for(size_t i = 0; i < 100; i++)
+	{
+		// a hit sets the reference bit, which saves the entry from the next pass of the hand
+		BOOST_CHECK_EQUAL(*lookup(cache, "hot", std::nullopt), "value");
+		lookup(cache, "cold" + std::to_string(i), std::string("value"));
+	}
+
+	BOOST_CHECK_EQUAL(*lookup(cache, "hot", std::nullopt), "value");
+	BOOST_CHECK_GT(cache.get_stats().evictions, 90u);
+}
+
+BOOST_AUTO_TEST_SUITE_END()